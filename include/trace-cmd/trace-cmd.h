@@ -14,6 +14,9 @@ struct tracecmd_input;
 enum tracecmd_open_flags {
 	TRACECMD_FL_LOAD_NO_PLUGINS		= 1 << 0, /* Do not load plugins */
 	TRACECMD_FL_LOAD_NO_SYSTEM_PLUGINS	= 1 << 1, /* Do not load system plugins */
+	TRACECMD_FL_SEQUENTIAL_SCAN		= 1 << 2, /* Data is read once, in order */
+	TRACECMD_FL_RANDOM_ACCESS		= 1 << 3, /* Data is read by seeking around */
+	TRACECMD_FL_IO_URING			= 1 << 4, /* Read data with io_uring, not mmap */
 };
 struct tracecmd_input *tracecmd_open_head(const char *file, int flags);
 struct tracecmd_input *tracecmd_open(const char *file, int flags);
@@ -43,6 +43,7 @@ void tracecmd_set_debug(bool set_debug);
 bool tracecmd_get_debug(void);
 
 struct tracecmd_output;
+struct tracecmd_option;
 struct tracecmd_recorder;
 struct hook_list;
 
@@ -128,6 +129,7 @@ enum {
 	TRACECMD_OPTION_TIME_SHIFT,
 	TRACECMD_OPTION_GUEST,
 	TRACECMD_OPTION_TSC2NSEC,
+	TRACECMD_OPTION_RECORDER_STATS,
 };
 
 enum {
@@ -135,6 +137,7 @@ enum {
 	TRACECMD_FL_BUFFER_INSTANCE	= (1 << 1),
 	TRACECMD_FL_IN_USECS		= (1 << 2),
 	TRACECMD_FL_RAW_TS		= (1 << 3),
+	TRACECMD_FL_LINEAR_MERGE	= (1 << 4),	/* Do not use the CPU heap */
 };
 
 struct tracecmd_ftrace {
@@ -167,6 +170,10 @@ int tracecmd_cpus(struct tracecmd_input *handle);
 int tracecmd_copy_headers(struct tracecmd_input *handle, int fd,
 			  enum tracecmd_file_states start_state,
 			  enum tracecmd_file_states end_state);
+int tracecmd_copy_options(struct tracecmd_input *handle,
+			  struct tracecmd_output *ohandle,
+			  struct tracecmd_option **buffer_options);
+const char *tracecmd_get_trace_clock(struct tracecmd_input *handle);
 void tracecmd_set_flag(struct tracecmd_input *handle, int flag);
 void tracecmd_clear_flag(struct tracecmd_input *handle, int flag);
 unsigned long tracecmd_get_flags(struct tracecmd_input *handle);
@@ -193,6 +200,19 @@ void tracecmd_print_version(struct tracecmd_input *handle);
 struct tep_record *
 tracecmd_peek_data(struct tracecmd_input *handle, int cpu);
 
+struct tracecmd_record_stats {
+	unsigned long long	allocated;	/* records handed out */
+	unsigned long long	reused;		/* of those, taken from the free list */
+	unsigned long long	freed;
+	unsigned long long	in_use;
+	unsigned long long	max_in_use;
+	unsigned long long	slabs;		/* slab allocations backing the records */
+};
+
+void tracecmd_get_record_stats(struct tracecmd_input *handle,
+			       struct tracecmd_record_stats *stats);
+void tracecmd_set_page_map_cache(struct tracecmd_input *handle, int nr_maps);
+
 static inline struct tep_record *
 tracecmd_peek_data_ref(struct tracecmd_input *handle, int cpu)
 {
@@ -211,6 +231,12 @@ tracecmd_read_next_data(struct tracecmd_input *handle, int *rec_cpu);
 struct tep_record *
 tracecmd_peek_next_data(struct tracecmd_input *handle, int *rec_cpu);
 
+typedef int (*tracecmd_iterate_func)(struct tracecmd_input *handle,
+				     struct tep_record *record,
+				     int cpu, void *data);
+int tracecmd_iterate_events(struct tracecmd_input *handle, int cpu,
+			    tracecmd_iterate_func callback, void *callback_data);
+
 struct tep_record *
 tracecmd_translate_data(struct tracecmd_input *handle,
 			void *ptr, int size);
@@ -232,6 +258,8 @@ tracecmd_get_cursor(struct tracecmd_input *handle, int cpu);
 
 int tracecmd_ftrace_overrides(struct tracecmd_input *handle, struct tracecmd_ftrace *finfo);
 bool tracecmd_get_use_trace_clock(struct tracecmd_input *handle);
+const char *tracecmd_get_compression(struct tracecmd_input *handle);
+int tracecmd_refresh(struct tracecmd_input *handle);
 tracecmd_show_data_func
 tracecmd_get_show_data_func(struct tracecmd_input *handle);
 void tracecmd_set_show_data_func(struct tracecmd_input *handle,
@@ -259,7 +287,6 @@ struct tracecmd_event_list {
 	const char			*glob;
 };
 
-struct tracecmd_option;
 struct tracecmd_msg_handle;
 
 struct tracecmd_output *tracecmd_create_file_latency(const char *output_file, int cpus);
@@ -303,6 +330,9 @@ void tracecmd_output_close(struct tracecmd_output *handle);
 void tracecmd_output_free(struct tracecmd_output *handle);
 struct tracecmd_output *tracecmd_copy(struct tracecmd_input *ihandle,
 				      const char *file);
+int tracecmd_output_set_compression(struct tracecmd_output *handle,
+				    const char *name);
+int tracecmd_compress_id(const char *name);
 
 int tracecmd_write_cpu_data(struct tracecmd_output *handle,
 			    int cpus, char * const *cpu_data_files);
@@ -311,6 +341,15 @@ int tracecmd_append_cpu_data(struct tracecmd_output *handle,
 int tracecmd_append_buffer_cpu_data(struct tracecmd_output *handle,
 				    struct tracecmd_option *option,
 				    int cpus, char * const *cpu_data_files);
+int tracecmd_reserve_cpu_data(struct tracecmd_output *handle, int cpus,
+			      unsigned long long size,
+			      unsigned long long header_room,
+			      unsigned long long *offsets);
+int tracecmd_append_reserved_cpu_data(struct tracecmd_output *handle, int cpus,
+				      unsigned long long *sizes);
+struct tracecmd_extents;
+struct tracecmd_extents *tracecmd_get_cpu_extents(struct tracecmd_output *handle);
+int tracecmd_sync_reserved_cpu_data(struct tracecmd_output *handle);
 
 struct tracecmd_output *tracecmd_get_output_handle_fd(int fd);
 
@@ -321,6 +360,8 @@ enum {
 	TRACECMD_RECORD_SNAPSHOT	= (1 << 1),	/* Extract from snapshot */
 	TRACECMD_RECORD_BLOCK		= (1 << 2),	/* Block on splice write */
 	TRACECMD_RECORD_NOBRASS		= (1 << 3),	/* Splice directly without a brass pipe */
+	TRACECMD_RECORD_POLL		= (1 << 4),	/* Never block, the caller polls the trace fd */
+	TRACECMD_RECORD_WAKEUP		= (1 << 5),	/* Wait to be woken up by the kernel, not sleep */
 };
 
 void tracecmd_free_recorder(struct tracecmd_recorder *recorder);
@@ -331,6 +372,50 @@ struct tracecmd_recorder *tracecmd_create_recorder_maxkb(const char *file, int c
 struct tracecmd_recorder *tracecmd_create_buffer_recorder_fd(int fd, int cpu, unsigned flags, const char *buffer);
 struct tracecmd_recorder *tracecmd_create_buffer_recorder(const char *file, int cpu, unsigned flags, const char *buffer);
 struct tracecmd_recorder *tracecmd_create_buffer_recorder_maxkb(const char *file, int cpu, unsigned flags, const char *buffer, int maxkb);
+struct tracecmd_recorder *tracecmd_create_recorder_ring(const char *file, int cpu, unsigned flags,
+							int segments, int segment_kb);
+struct tracecmd_recorder *tracecmd_create_buffer_recorder_ring(const char *file, int cpu, unsigned flags,
+							       const char *buffer, int segments,
+							       int segment_kb);
+int tracecmd_recorder_set_compression(struct tracecmd_recorder *recorder, const char *name);
+int tracecmd_recorder_set_limit(struct tracecmd_recorder *recorder, unsigned long long size);
+int tracecmd_recorder_set_extents(struct tracecmd_recorder *recorder,
+				  struct tracecmd_extents *extents);
+int tracecmd_recorder_get_trace_fd(struct tracecmd_recorder *recorder);
+long tracecmd_recorder_read_data(struct tracecmd_recorder *recorder);
+
+/* Bucket i of the histograms counts the calls that took less than 2^i usecs */
+#define TRACECMD_RECORDER_HIST_SIZE	20
+
+struct tracecmd_recorder_stats {
+	unsigned long long	bytes;		/* read from the ring buffer */
+	unsigned long long	written;	/* before compression */
+	unsigned long long	dropped;	/* past the limit */
+	unsigned long long	reads;		/* splice() or read() calls that got data */
+	unsigned long long	read_ns;
+	unsigned long long	writes;		/* calls to write the data out */
+	unsigned long long	write_ns;
+	unsigned long long	sleep_ns;	/* waiting for data */
+	unsigned long long	polls;		/* passes over the buffer */
+	unsigned long long	empty_polls;	/* passes that found no data */
+	unsigned long long	max_backlog;	/* most bytes waiting in the pipe */
+	unsigned long long	read_hist[TRACECMD_RECORDER_HIST_SIZE];
+	unsigned long long	write_hist[TRACECMD_RECORDER_HIST_SIZE];
+};
+void tracecmd_recorder_get_stats(struct tracecmd_recorder *recorder,
+				 struct tracecmd_recorder_stats *stats);
+void tracecmd_recorder_print_stats(struct trace_seq *s, int cpu,
+				   struct tracecmd_recorder_stats *stats);
+
+struct tracecmd_recorder_compress_stats {
+	const char		*compression;
+	unsigned long long	bytes_in;	/* raw ring buffer data */
+	unsigned long long	bytes_out;	/* written to the file */
+	unsigned long long	compress_ns;	/* time spent compressing */
+	unsigned long long	record_ns;	/* time spent recording */
+};
+int tracecmd_recorder_compress_stats(const char *file,
+				     struct tracecmd_recorder_compress_stats *stats);
 
 int tracecmd_start_recording(struct tracecmd_recorder *recorder, unsigned long sleep);
 void tracecmd_stop_recording(struct tracecmd_recorder *recorder);
@@ -504,6 +589,37 @@ int tracecmd_set_logfile(char *logfile);
 unsigned long long tracecmd_generate_traceid(void);
 int tracecmd_count_cpus(void);
 
+/* --- Arena allocator --- */
+struct tracecmd_arena;
+
+struct tracecmd_arena *tracecmd_arena_alloc(void);
+void tracecmd_arena_free(struct tracecmd_arena *arena);
+void *tracecmd_arena_get(struct tracecmd_arena *arena, size_t size);
+void tracecmd_arena_put(struct tracecmd_arena *arena, void *ptr, size_t size);
+char *tracecmd_arena_strdup(struct tracecmd_arena *arena, const char *str);
+void tracecmd_arena_join(struct tracecmd_arena *arena,
+			 struct tracecmd_arena *from);
+size_t tracecmd_arena_size(struct tracecmd_arena *arena);
+
+/* --- Latency histograms --- */
+#define TRACECMD_HISTOGRAM_SUB_BITS	3
+#define TRACECMD_HISTOGRAM_MAX_BITS	40
+#define TRACECMD_HISTOGRAM_BUCKETS	\
+	((TRACECMD_HISTOGRAM_MAX_BITS - TRACECMD_HISTOGRAM_SUB_BITS + 1) << \
+	 TRACECMD_HISTOGRAM_SUB_BITS)
+
+struct tracecmd_histogram {
+	unsigned int	counts[TRACECMD_HISTOGRAM_BUCKETS];
+};
+
+void tracecmd_histogram_add(struct tracecmd_histogram *hist,
+			    unsigned long long val);
+void tracecmd_histogram_merge(struct tracecmd_histogram *hist,
+			      struct tracecmd_histogram *from);
+void tracecmd_histogram_scale(struct tracecmd_histogram *hist, int percent);
+unsigned long long tracecmd_histogram_percentile(struct tracecmd_histogram *hist,
+						 double percent);
+
 /* --- Hack! --- */
 int tracecmd_blk_hack(struct tracecmd_input *handle);
 
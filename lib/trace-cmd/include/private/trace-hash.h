@@ -12,10 +12,17 @@ struct trace_hash_item {
 	unsigned long long	key;
 };
 
+/*
+ * Open addressing, that grows as items are added. A bucket holds the
+ * items of one key, newest first: trace_hash_find() returns the last
+ * one added that matches.
+ */
 struct trace_hash {
 	struct trace_hash_item	**buckets;
+	unsigned char		*tags;
 	int			nr_buckets;
-	int			power;
+	int			bits;
+	int			nr_used;	/* buckets with a tag */
 };
 
 int trace_hash_init(struct trace_hash *hash, int buckets);
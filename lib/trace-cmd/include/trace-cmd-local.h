@@ -20,6 +20,117 @@ void tracecmd_fatal(const char *fmt, ...);
 #define STR(x)	_STR(x)
 #define FILE_VERSION_STRING STR(FILE_VERSION)
 
+/*
+ * Optional per CPU page index, written right after the (page aligned)
+ * end of the flyrecord CPU data. See trace-cmd.dat(5).
+ */
+#define PAGE_INDEX_MAGIC	"pageindex"
+#define PAGE_INDEX_MAGIC_SIZE	10
+/* page offset (8), first timestamp (8), last timestamp (8), events (4) */
+#define PAGE_INDEX_ENTRY_SIZE	28
+
+/*
+ * Compressed CPU data, in a "flychunks" section instead of "flyrecord".
+ * The data of each CPU is split in chunks of CHUNK_PAGES pages, that
+ * are compressed independently. See trace-cmd.dat(5).
+ */
+#define FLYCHUNKS_MAGIC		"flychunks"
+#define CHUNK_PAGES		16
+/* file offset (8), compressed size (4), timestamp of its first page (8) */
+#define CHUNK_INDEX_ENTRY_SIZE	20
+
+/* Stored in the file, do not reorder */
+enum tracecmd_compress_id {
+	TRACECMD_COMPRESS_NONE,
+	TRACECMD_COMPRESS_ZLIB,
+};
+
+const char *tracecmd_compress_name(int id);
+bool tracecmd_compress_supported(int id);
+unsigned int tracecmd_compress_bound(int id, unsigned int size);
+int tracecmd_compress_buffer(int id, const char *in, unsigned int in_size,
+			     char *out, unsigned int *out_size);
+int tracecmd_uncompress_buffer(int id, const char *in, unsigned int in_size,
+			       char *out, unsigned int out_size);
+
+/*
+ * The per CPU files written by a recorder that compresses the data
+ * (see tracecmd_recorder_set_compression()). They are local temp
+ * files, so everything is in host endian:
+ *  "recchunks\0"
+ *  4 bytes: the compression algorithm
+ *  4 bytes: the size of a chunk, before compression
+ *  32 bytes: bytes in, bytes out, compression time and recording time
+ *  For each chunk:
+ *   4 bytes: size before compression
+ *   4 bytes: compressed size
+ *   The compressed data
+ */
+#define RECORD_CHUNKS_MAGIC		"recchunks"
+#define RECORD_CHUNKS_MAGIC_SIZE	10
+#define RECORD_CHUNKS_STATS_OFFSET	(RECORD_CHUNKS_MAGIC_SIZE + 8)
+#define RECORD_CHUNKS_HEADER_SIZE	(RECORD_CHUNKS_STATS_OFFSET + 32)
+#define RECORD_CHUNK_HEADER_SIZE	8
+
+int read_record_chunks_header(int fd, int *codec, unsigned int *chunk_size,
+			      struct tracecmd_recorder_compress_stats *stats);
+
+long long copy_file_data(int dst, int src, long long offset,
+			 unsigned long long size);
+
+/*
+ * The room for the CPU data in the output file, handed out in extents
+ * of the same size (see tracecmd_reserve_cpu_data()). It is shared
+ * (MAP_SHARED) with the recorders, that may run in other processes.
+ * The first extent of each CPU is the one of its number, the others
+ * are taken as the recorders fill them.
+ */
+struct tracecmd_extent {
+	int			owner;		/* CPU + 1, 0 if not in use */
+	unsigned int		used;		/* the bytes written in it */
+};
+
+struct tracecmd_extents {
+	unsigned long long	start;		/* file offset of extent 0 */
+	unsigned long long	size;		/* of each extent */
+	int			fd;		/* to allocate the extents */
+	unsigned int		max;		/* the extents that can be used */
+	unsigned int		next;		/* the next free extent (atomic) */
+	struct tracecmd_extent	extent[];
+};
+
+int tracecmd_extents_next(struct tracecmd_extents *extents, int cpu);
+
+/*
+ * A file that can be read while it is recorded has a generation count
+ * right before its CPU data, after this magic. The count is odd while
+ * its headers are written again (see tracecmd_sync_reserved_cpu_data()).
+ */
+#define LIVE_GEN_MAGIC		"livegen"
+#define LIVE_GEN_SIZE		16
+
+struct tracecmd_uring;
+
+#ifdef IO_URING
+struct tracecmd_uring *tracecmd_uring_alloc(int fd, int cpus, int page_size,
+					    int depth);
+void *tracecmd_uring_read_page(struct tracecmd_uring *ring, int cpu,
+			       off64_t offset, off64_t end);
+void tracecmd_uring_free(struct tracecmd_uring *ring);
+#else
+static inline struct tracecmd_uring *
+tracecmd_uring_alloc(int fd, int cpus, int page_size, int depth)
+{
+	return NULL;
+}
+static inline void *tracecmd_uring_read_page(struct tracecmd_uring *ring, int cpu,
+					     off64_t offset, off64_t end)
+{
+	return NULL;
+}
+static inline void tracecmd_uring_free(struct tracecmd_uring *ring) { }
+#endif
+
 #ifndef htonll
 # if __BYTE_ORDER == __LITTLE_ENDIAN
 #define htonll(x) __bswap_64(x)
@@ -8,6 +8,9 @@
 
 /* Local for trace-input.c, trace-output.c and trace-msg.c */
 
+#include <errno.h>
+#include <sys/uio.h>
+
 static inline ssize_t __do_write(int fd, const void *data, size_t size)
 {
 	ssize_t tot = 0;
@@ -40,4 +43,35 @@ __do_write_check(int fd, const void *data, size_t size)
 	return 0;
 }
 
+/*
+ * Write all of @iov, that is modified if the write is cut short.
+ * Returns 0 on success and -1 on error.
+ */
+static inline int __do_writev_check(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t w;
+
+	while (cnt) {
+		w = writev(fd, iov, cnt);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (!w)
+			return -1;
+		while (cnt && w >= (ssize_t)iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base += w;
+			iov->iov_len -= w;
+		}
+	}
+
+	return 0;
+}
+
 #endif /* _TRACE_WRITE_LOCAL_H */
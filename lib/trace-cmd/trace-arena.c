@@ -0,0 +1,211 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * An arena for the state that the trace-cmd analyzers (profile, hist,
+ * mem) build up while reading a trace: the objects are cut out of big
+ * chunks, and they all go away at once with tracecmd_arena_free().
+ *
+ * Objects given back with tracecmd_arena_put() go on a free list for
+ * their size, and are handed out again by tracecmd_arena_get(). The
+ * arena is not locked, it is meant to be used by one thread.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace-cmd-local.h"
+
+#define ARENA_CHUNK_SIZE	(256 * 1024)
+#define ARENA_ALIGN		16
+#define ARENA_NR_SIZES		64	/* free lists for objects up to 1K */
+
+#define arena_align(size)	(((size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/* The objects of a chunk start ARENA_ALIGN bytes into it */
+struct arena_chunk {
+	struct arena_chunk	*next;
+};
+
+struct tracecmd_arena {
+	struct arena_chunk	*chunks;
+	char			*next;	/* free space of the last chunk */
+	char			*end;
+	void			*free_lists[ARENA_NR_SIZES];
+	size_t			size;	/* of all the chunks */
+};
+
+/**
+ * tracecmd_arena_alloc - allocate an empty arena
+ *
+ * Returns the arena, or NULL on error. It must be freed with
+ * tracecmd_arena_free().
+ */
+struct tracecmd_arena *tracecmd_arena_alloc(void)
+{
+	return calloc(1, sizeof(struct tracecmd_arena));
+}
+
+/**
+ * tracecmd_arena_free - free an arena and all that was allocated from it
+ * @arena: the arena to free
+ */
+void tracecmd_arena_free(struct tracecmd_arena *arena)
+{
+	struct arena_chunk *chunk;
+
+	if (!arena)
+		return;
+
+	while (arena->chunks) {
+		chunk = arena->chunks;
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+}
+
+static struct arena_chunk *add_chunk(struct tracecmd_arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+
+	/* calloc() gets the big ones zeroed from the system */
+	chunk = calloc(1, ARENA_ALIGN + size);
+	if (!chunk)
+		return NULL;
+
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->size += ARENA_ALIGN + size;
+
+	return chunk;
+}
+
+/**
+ * tracecmd_arena_get - allocate an object from an arena
+ * @arena: the arena to allocate from
+ * @size: the size of the object
+ *
+ * Returns the object zeroed, or NULL on error. The object is freed
+ * with the arena, or can be given back before with tracecmd_arena_put().
+ */
+void *tracecmd_arena_get(struct tracecmd_arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+	size_t nr;
+	void *obj;
+
+	size = arena_align(size ? size : 1);
+	nr = size / ARENA_ALIGN - 1;
+
+	if (nr < ARENA_NR_SIZES && arena->free_lists[nr]) {
+		obj = arena->free_lists[nr];
+		arena->free_lists[nr] = *(void **)obj;
+		memset(obj, 0, size);
+		return obj;
+	}
+
+	if ((size_t)(arena->end - arena->next) < size) {
+		/* Big objects get a chunk of their own */
+		if (size > ARENA_CHUNK_SIZE / 4) {
+			chunk = add_chunk(arena, size);
+			return chunk ? (char *)chunk + ARENA_ALIGN : NULL;
+		}
+		chunk = add_chunk(arena, ARENA_CHUNK_SIZE);
+		if (!chunk)
+			return NULL;
+		arena->next = (char *)chunk + ARENA_ALIGN;
+		arena->end = arena->next + ARENA_CHUNK_SIZE;
+	}
+
+	obj = arena->next;
+	arena->next += size;
+
+	return obj;
+}
+
+/**
+ * tracecmd_arena_put - give an object back to its arena
+ * @arena: the arena the object was allocated from
+ * @ptr: the object (may be NULL)
+ * @size: the size it was allocated with
+ *
+ * The next tracecmd_arena_get() of the same size may return @ptr.
+ */
+void tracecmd_arena_put(struct tracecmd_arena *arena, void *ptr, size_t size)
+{
+	size_t nr = arena_align(size ? size : 1) / ARENA_ALIGN - 1;
+
+	/* Bigger ones stay until the arena is freed */
+	if (!ptr || nr >= ARENA_NR_SIZES)
+		return;
+
+	*(void **)ptr = arena->free_lists[nr];
+	arena->free_lists[nr] = ptr;
+}
+
+/**
+ * tracecmd_arena_strdup - duplicate a string in an arena
+ * @arena: the arena to allocate from
+ * @str: the string to copy
+ *
+ * Returns the copy, or NULL on error.
+ */
+char *tracecmd_arena_strdup(struct tracecmd_arena *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *copy;
+
+	copy = tracecmd_arena_get(arena, len);
+	if (copy)
+		memcpy(copy, str, len);
+	return copy;
+}
+
+/**
+ * tracecmd_arena_join - move the memory of an arena into another one
+ * @arena: the arena that takes the memory
+ * @from: the arena to empty
+ *
+ * What was allocated from @from now belongs to @arena, and is freed
+ * with it. Objects allocated from @from may then be given back to
+ * @arena. @from is left empty, and can still be used.
+ */
+void tracecmd_arena_join(struct tracecmd_arena *arena,
+			 struct tracecmd_arena *from)
+{
+	struct arena_chunk **last;
+	void **obj;
+	int i;
+
+	for (last = &from->chunks; *last; last = &(*last)->next)
+		;
+	*last = arena->chunks;
+	arena->chunks = from->chunks;
+	arena->size += from->size;
+
+	for (i = 0; i < ARENA_NR_SIZES; i++) {
+		if (!from->free_lists[i])
+			continue;
+		for (obj = from->free_lists[i]; *obj; obj = *obj)
+			;
+		*obj = arena->free_lists[i];
+		arena->free_lists[i] = from->free_lists[i];
+	}
+
+	/* Keep allocating from the chunk with the most room */
+	if (from->end - from->next > arena->end - arena->next) {
+		arena->next = from->next;
+		arena->end = from->end;
+	}
+
+	memset(from, 0, sizeof(*from));
+}
+
+/**
+ * tracecmd_arena_size - the memory taken by an arena
+ * @arena: the arena
+ *
+ * Returns the size of the chunks allocated by @arena so far.
+ */
+size_t tracecmd_arena_size(struct tracecmd_arena *arena)
+{
+	return arena->size;
+}
@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Compression of the CPU data chunks of "flychunks" trace.dat files.
+ */
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "trace-cmd-local.h"
+
+struct compress_codec {
+	const char	*name;
+	bool		supported;
+};
+
+/* Indexed by enum tracecmd_compress_id, the ids are stored in the file */
+static const struct compress_codec codecs[] = {
+	[TRACECMD_COMPRESS_NONE]	= { "none", true },
+#ifdef HAVE_ZLIB
+	[TRACECMD_COMPRESS_ZLIB]	= { "zlib", true },
+#else
+	[TRACECMD_COMPRESS_ZLIB]	= { "zlib", false },
+#endif
+};
+
+#define NR_CODECS	(int)(sizeof(codecs) / sizeof(codecs[0]))
+
+/**
+ * tracecmd_compress_id - find a compression algorithm by name
+ * @name: the name of the algorithm ("none", "zlib")
+ *
+ * Returns the id of the algorithm, or -1 if it is unknown or this
+ * build does not support it.
+ */
+int tracecmd_compress_id(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NR_CODECS; i++) {
+		if (strcmp(codecs[i].name, name) == 0)
+			return codecs[i].supported ? i : -1;
+	}
+	return -1;
+}
+
+/**
+ * tracecmd_compress_name - get the name of a compression algorithm
+ * @id: the id of the algorithm, as stored in the file
+ */
+const char *tracecmd_compress_name(int id)
+{
+	if (id < 0 || id >= NR_CODECS)
+		return "unknown";
+	return codecs[id].name;
+}
+
+bool tracecmd_compress_supported(int id)
+{
+	return id >= 0 && id < NR_CODECS && codecs[id].supported;
+}
+
+/**
+ * tracecmd_compress_bound - worst case size of compressed data
+ * @id: the id of the algorithm
+ * @size: the size of the data to compress
+ */
+unsigned int tracecmd_compress_bound(int id, unsigned int size)
+{
+#ifdef HAVE_ZLIB
+	if (id == TRACECMD_COMPRESS_ZLIB)
+		return compressBound(size);
+#endif
+	return size;
+}
+
+/**
+ * tracecmd_compress_buffer - compress a chunk of data
+ * @id: the id of the algorithm
+ * @in: the data to compress
+ * @in_size: the size of @in
+ * @out: where to write the compressed data
+ * @out_size: the size of @out, updated to the size of the compressed data
+ *
+ * @out must be at least tracecmd_compress_bound() bytes.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int tracecmd_compress_buffer(int id, const char *in, unsigned int in_size,
+			     char *out, unsigned int *out_size)
+{
+#ifdef HAVE_ZLIB
+	uLongf size = *out_size;
+#endif
+
+	switch (id) {
+	case TRACECMD_COMPRESS_NONE:
+		if (*out_size < in_size)
+			break;
+		memcpy(out, in, in_size);
+		*out_size = in_size;
+		return 0;
+#ifdef HAVE_ZLIB
+	case TRACECMD_COMPRESS_ZLIB:
+		if (compress2((Bytef *)out, &size, (const Bytef *)in, in_size,
+			      Z_BEST_SPEED) != Z_OK)
+			break;
+		*out_size = size;
+		return 0;
+#endif
+	default:
+		break;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * tracecmd_uncompress_buffer - uncompress a chunk of data
+ * @id: the id of the algorithm
+ * @in: the compressed data
+ * @in_size: the size of @in
+ * @out: where to write the uncompressed data
+ * @out_size: the expected size of the uncompressed data
+ *
+ * Returns 0 on success, and -1 on error or if the data does not
+ * uncompress to exactly @out_size bytes.
+ */
+int tracecmd_uncompress_buffer(int id, const char *in, unsigned int in_size,
+			       char *out, unsigned int out_size)
+{
+#ifdef HAVE_ZLIB
+	uLongf size = out_size;
+#endif
+
+	switch (id) {
+	case TRACECMD_COMPRESS_NONE:
+		if (in_size != out_size)
+			break;
+		memcpy(out, in, in_size);
+		return 0;
+#ifdef HAVE_ZLIB
+	case TRACECMD_COMPRESS_ZLIB:
+		if (uncompress((Bytef *)out, &size, (const Bytef *)in, in_size) != Z_OK ||
+		    size != out_size)
+			break;
+		return 0;
+#endif
+	default:
+		break;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
@@ -12,25 +12,86 @@
 #include "trace-cmd-private.h"
 #include "trace-hash.h"
 
-int __hidden trace_hash_init(struct trace_hash *hash, int buckets)
+/*
+ * The hash is open addressing with linear probing. A bucket holds the
+ * items of one key, newest first. The tag of a bucket (a byte, zero if
+ * the bucket was never used) has bits of the hash of its key, so that
+ * probing reads the tags and rarely the items.
+ *
+ * trace_hash_del() only unlinks the item, so a bucket whose items are
+ * all gone keeps its tag. Such buckets are taken again by
+ * trace_hash_add(), and dropped when the table is resized.
+ */
+#define HASH_MULT	0x9e3779b97f4a7c15ULL
+#define HASH_TAG_USED	0x80
+#define HASH_MIN_BITS	3
+
+static inline unsigned long long hash_mix(unsigned long long key)
 {
-	memset(hash, 0, sizeof(*hash));
+	return key * HASH_MULT;
+}
+
+static inline unsigned int hash_bucket(struct trace_hash *hash,
+				       unsigned long long mix)
+{
+	return mix >> (64 - hash->bits);
+}
+
+/* The 7 bits below the ones of the bucket */
+static inline unsigned char hash_tag(struct trace_hash *hash,
+				     unsigned long long mix)
+{
+	return HASH_TAG_USED | ((mix >> (64 - 7 - hash->bits)) & 0x7f);
+}
+
+static int hash_alloc(struct trace_hash *hash, int bits)
+{
+	int buckets = 1 << bits;
 
 	hash->buckets = calloc(sizeof(*hash->buckets), buckets);
-	if (!hash->buckets)
+	hash->tags = calloc(1, buckets);
+	if (!hash->buckets || !hash->tags) {
+		free(hash->buckets);
+		free(hash->tags);
 		return -ENOMEM;
+	}
 	hash->nr_buckets = buckets;
-
-	/* If a power of two then we can shortcut */
-	if (!(buckets & (buckets - 1)))
-		hash->power = buckets - 1;
+	hash->bits = bits;
+	hash->nr_used = 0;
 
 	return 0;
 }
 
+/* Make @item the first of bucket @b */
+static void hash_link(struct trace_hash *hash, int b,
+		      struct trace_hash_item *item)
+{
+	struct trace_hash_item *next = hash->buckets[b];
+
+	if (next)
+		next->prev = item;
+	item->next = next;
+	item->prev = (struct trace_hash_item *)&hash->buckets[b];
+
+	hash->buckets[b] = item;
+}
+
+int __hidden trace_hash_init(struct trace_hash *hash, int buckets)
+{
+	int bits = HASH_MIN_BITS;
+
+	memset(hash, 0, sizeof(*hash));
+
+	while ((1 << bits) < buckets)
+		bits++;
+
+	return hash_alloc(hash, bits);
+}
+
 void __hidden trace_hash_free(struct trace_hash *hash)
 {
 	free(hash->buckets);
+	free(hash->tags);
 }
 
 int __hidden trace_hash_empty(struct trace_hash *hash)
@@ -43,22 +104,88 @@ int __hidden trace_hash_empty(struct trace_hash *hash)
 	return 1;
 }
 
+/*
+ * Move the buckets that still have items to a new table, at most half
+ * full. It is bigger than the old one, unless most of the buckets that
+ * were used are empty now.
+ */
+static int hash_resize(struct trace_hash *hash)
+{
+	struct trace_hash old = *hash;
+	struct trace_hash_item *item;
+	unsigned long long mix;
+	int bits = old.bits;
+	int items = 0;
+	int b, i;
+
+	for (i = 0; i < old.nr_buckets; i++) {
+		if (old.buckets[i])
+			items++;
+	}
+
+	while ((items + 1) * 2 > (1 << bits))
+		bits++;
+
+	if (hash_alloc(hash, bits) < 0) {
+		*hash = old;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < old.nr_buckets; i++) {
+		item = old.buckets[i];
+		if (!item)
+			continue;
+		mix = hash_mix(item->key);
+		b = hash_bucket(hash, mix);
+		while (hash->tags[b])
+			b = (b + 1) & (hash->nr_buckets - 1);
+		hash->tags[b] = hash_tag(hash, mix);
+		hash->buckets[b] = item;
+		item->prev = (struct trace_hash_item *)&hash->buckets[b];
+		hash->nr_used++;
+	}
+
+	trace_hash_free(&old);
+
+	return 0;
+}
+
 int __hidden trace_hash_add(struct trace_hash *hash, struct trace_hash_item *item)
 {
-	struct trace_hash_item *next;
-	int bucket = hash->power ? item->key & hash->power :
-		item->key % hash->nr_buckets;
+	unsigned long long mix;
+	unsigned char tag;
+	int mask;
+	int slot = -1;
+	int b;
+
+	/* Keep it at most 3/4 full, there must be an unused bucket */
+	if ((hash->nr_used + 1) * 4 > hash->nr_buckets * 3 &&
+	    hash_resize(hash) < 0 && hash->nr_used + 1 >= hash->nr_buckets)
+		return -ENOMEM;
 
-	if (hash->buckets[bucket]) {
-		next = hash->buckets[bucket];
-		next->prev = item;
-	} else
-		next = NULL;
+	mix = hash_mix(item->key);
+	tag = hash_tag(hash, mix);
+	mask = hash->nr_buckets - 1;
 
-	item->next = next;
-	item->prev = (struct trace_hash_item *)&hash->buckets[bucket];
+	for (b = hash_bucket(hash, mix); hash->tags[b]; b = (b + 1) & mask) {
+		if (!hash->buckets[b]) {
+			if (slot < 0)
+				slot = b;
+			continue;
+		}
+		if (hash->tags[b] == tag && hash->buckets[b]->key == item->key) {
+			hash_link(hash, b, item);
+			return 1;
+		}
+	}
 
-	hash->buckets[bucket] = item;
+	/* A new key, in the first bucket that has no items */
+	if (slot < 0) {
+		slot = b;
+		hash->nr_used++;
+	}
+	hash->tags[slot] = tag;
+	hash_link(hash, slot, item);
 
 	return 1;
 }
@@ -68,16 +195,24 @@ trace_hash_find(struct trace_hash *hash, unsigned long long key,
 		trace_hash_func match, void *data)
 {
 	struct trace_hash_item *item;
-	int bucket = hash->power ? key & hash->power :
-		key % hash->nr_buckets;
-
-	for (item = hash->buckets[bucket]; item; item = item->next) {
-		if (item->key == key) {
+	unsigned long long mix = hash_mix(key);
+	unsigned char tag = hash_tag(hash, mix);
+	int mask = hash->nr_buckets - 1;
+	int b;
+
+	for (b = hash_bucket(hash, mix); hash->tags[b]; b = (b + 1) & mask) {
+		item = hash->buckets[b];
+		if (hash->tags[b] != tag || !item || item->key != key)
+			continue;
+
+		/* This is the only bucket of the key */
+		for (; item; item = item->next) {
 			if (!match)
 				return item;
 			if (match(item, data))
 				return item;
 		}
+		return NULL;
 	}
 
 	return NULL;
@@ -0,0 +1,152 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Log-linear histograms of latencies, for the percentiles of the
+ * trace-cmd profile. A histogram is a fixed array of counters: values
+ * below 2^SUB_BITS have a bucket each, and every power of two above
+ * is cut in 2^SUB_BITS buckets. A bucket is then at most 1/2^SUB_BITS
+ * (12.5%) of the values it holds wide. Values of 2^MAX_BITS and more
+ * go in the last bucket.
+ *
+ * Adding a value does not allocate anything. A counter that would
+ * wrap halves all of them, which keeps the percentiles.
+ */
+#include <limits.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "trace-cmd-local.h"
+
+#define SUB_BITS	TRACECMD_HISTOGRAM_SUB_BITS
+#define SUB_BUCKETS	(1 << SUB_BITS)
+#define MAX_BITS	TRACECMD_HISTOGRAM_MAX_BITS
+
+static inline int histogram_bucket(unsigned long long val)
+{
+	int bits;
+
+	if (val < SUB_BUCKETS)
+		return val;
+	if (val >> MAX_BITS)
+		return TRACECMD_HISTOGRAM_BUCKETS - 1;
+
+	/* The highest bit picks the power of two, the next ones the bucket */
+	bits = 63 - __builtin_clzll(val);
+	return ((bits - SUB_BITS + 1) << SUB_BITS) +
+		((val >> (bits - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* The highest value that goes in bucket @b */
+static unsigned long long histogram_value(int b)
+{
+	unsigned long long low;
+	int shift;
+
+	if (b < SUB_BUCKETS)
+		return b;
+
+	shift = (b >> SUB_BITS) - 1;
+	low = (unsigned long long)(SUB_BUCKETS + (b & (SUB_BUCKETS - 1))) << shift;
+
+	return low + (1ULL << shift) - 1;
+}
+
+static void histogram_halve(struct tracecmd_histogram *hist)
+{
+	int i;
+
+	/* Round up, the buckets with few values are the tail */
+	for (i = 0; i < TRACECMD_HISTOGRAM_BUCKETS; i++)
+		hist->counts[i] = hist->counts[i] / 2 + (hist->counts[i] & 1);
+}
+
+/**
+ * tracecmd_histogram_add - add a value to a histogram
+ * @hist: the histogram
+ * @val: the value to add
+ */
+void tracecmd_histogram_add(struct tracecmd_histogram *hist,
+			    unsigned long long val)
+{
+	unsigned int *count = &hist->counts[histogram_bucket(val)];
+
+	if (*count == UINT_MAX)
+		histogram_halve(hist);
+	(*count)++;
+}
+
+/**
+ * tracecmd_histogram_merge - add the values of a histogram to another one
+ * @hist: the histogram to add to
+ * @from: the histogram to add
+ */
+void tracecmd_histogram_merge(struct tracecmd_histogram *hist,
+			      struct tracecmd_histogram *from)
+{
+	unsigned long long sum;
+	bool halve = false;
+	int i;
+
+	for (i = 0; i < TRACECMD_HISTOGRAM_BUCKETS; i++) {
+		if ((unsigned long long)hist->counts[i] + from->counts[i] > UINT_MAX)
+			halve = true;
+	}
+
+	for (i = 0; i < TRACECMD_HISTOGRAM_BUCKETS; i++) {
+		sum = (unsigned long long)hist->counts[i] + from->counts[i];
+		hist->counts[i] = halve ? sum / 2 + (sum & 1) : sum;
+	}
+}
+
+/**
+ * tracecmd_histogram_scale - scale the counts of a histogram
+ * @hist: the histogram
+ * @percent: the percent of each count to keep (0 empties it)
+ */
+void tracecmd_histogram_scale(struct tracecmd_histogram *hist, int percent)
+{
+	int i;
+
+	if (!percent) {
+		memset(hist, 0, sizeof(*hist));
+		return;
+	}
+
+	for (i = 0; i < TRACECMD_HISTOGRAM_BUCKETS; i++)
+		hist->counts[i] = (unsigned long long)hist->counts[i] * percent / 100;
+}
+
+/**
+ * tracecmd_histogram_percentile - a percentile of the values of a histogram
+ * @hist: the histogram
+ * @percent: the percentile (like 99.9)
+ *
+ * Returns the highest value of the bucket the percentile is in, that is
+ * at most 12.5% above the real one. Returns 0 if @hist is empty.
+ */
+unsigned long long tracecmd_histogram_percentile(struct tracecmd_histogram *hist,
+						 double percent)
+{
+	unsigned long long total = 0;
+	unsigned long long rank;
+	int i;
+
+	for (i = 0; i < TRACECMD_HISTOGRAM_BUCKETS; i++)
+		total += hist->counts[i];
+	if (!total)
+		return 0;
+
+	/* The value that @percent of them are at or below */
+	rank = total * percent / 100;
+	if (rank < total * percent / 100.0)
+		rank++;
+	if (!rank)
+		rank = 1;
+
+	for (i = 0; i < TRACECMD_HISTOGRAM_BUCKETS - 1; i++) {
+		if (hist->counts[i] >= rank)
+			break;
+		rank -= hist->counts[i];
+	}
+
+	return histogram_value(i);
+}
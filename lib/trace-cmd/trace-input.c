@@ -12,6 +12,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include <linux/time64.h>
 
@@ -32,12 +33,24 @@
 /* for debugging read instead of mmap */
 static int force_read = 0;
 
+/* Buckets of the per CPU page_map lookup table, must be a power of two */
+#define PAGE_MAP_HASH_BITS	5
+#define PAGE_MAP_HASH_SIZE	(1 << PAGE_MAP_HASH_BITS)
+
+/* Number of unused page_maps kept mapped for reuse, per handle */
+#define PAGE_MAP_CACHE_MAX	4	/* per CPU */
+
+/* Pages read ahead of each CPU with TRACECMD_FL_IO_URING */
+#define URING_READ_AHEAD	32
+
 struct page_map {
-	struct list_head	list;
+	struct page_map		*next;		/* hash bucket chain */
+	struct list_head	lru;		/* on map_lru when unused */
 	off64_t			offset;
 	off64_t			size;
 	void			*map;
 	int			ref_count;
+	int			cpu;
 };
 
 struct page {
@@ -54,6 +67,42 @@ struct page {
 #endif
 };
 
+/*
+ * Records handed out by tracecmd_peek_data() come from slabs owned
+ * by their CPU. Freed records go on a free list (linked through
+ * their priv pointer) and the slabs are only released on close.
+ * Keeping the pool per CPU lets different CPUs of a handle be read
+ * from different threads.
+ */
+#define RECORD_SLAB_SIZE	64
+
+struct record_slab {
+	struct record_slab	*next;
+	struct tep_record	records[RECORD_SLAB_SIZE];
+};
+
+struct record_pool {
+	struct record_slab	*slabs;
+	struct tep_record	*free_list;
+	struct tracecmd_record_stats	stats;
+};
+
+/* A chunk of compressed CPU data ("flychunks") */
+struct cpu_chunk {
+	off64_t			offset;		/* in the file */
+	unsigned int		size;		/* compressed size */
+	unsigned long long	ts;		/* of its first page, as in the file */
+};
+
+/* Uncompressed chunks kept per CPU: the current one, and one to seek back to */
+#define CHUNK_CACHE_SIZE	2
+
+struct chunk_cache {
+	char			*data;
+	long long		index;		/* -1 if not holding a chunk */
+	unsigned long		age;
+};
+
 struct cpu_data {
 	/* the first two never change */
 	unsigned long long	file_offset;
@@ -61,18 +110,38 @@ struct cpu_data {
 	unsigned long long	offset;
 	unsigned long long	size;
 	unsigned long long	timestamp;
-	struct list_head	page_maps;
+	struct page_map		*page_maps[PAGE_MAP_HASH_SIZE];
 	struct page_map		*page_map;
+	struct list_head	map_lru;	/* unused page_maps, oldest last */
+	int			nr_lru_maps;
 	struct page		**pages;
 	struct tep_record	*next;
 	struct page		*page;
 	struct kbuffer		*kbuf;
+	void			*page_index;
+	unsigned long long	nr_index;
+	struct record_pool	record_pool;
+	struct cpu_chunk	*chunks;
+	unsigned long long	nr_chunks;
+	struct chunk_cache	chunk_cache[CHUNK_CACHE_SIZE];
+	unsigned long		chunk_age;
+	char			*chunk_buf;	/* compressed chunk read */
+	unsigned int		chunk_buf_size;
 	int			nr_pages;
 	int			page_cnt;
 	int			cpu;
 	int			pipe_fd;
 };
 
+/* Head of a CPU in the heap used to merge the CPUs by time */
+struct merge_heap_node {
+	unsigned long long	ts;
+	int			cpu;
+};
+
+/* Below this many CPUs, a linear scan is as good as the heap */
+#define MERGE_HEAP_MIN_CPUS	8
+
 struct input_buffer_instance {
 	char			*name;
 	size_t			offset;
@@ -124,19 +193,32 @@ struct tracecmd_input {
 	int			long_size;
 	int			page_size;
 	int			page_map_size;
+	int			access_flags;	/* SEQUENTIAL_SCAN or RANDOM_ACCESS */
+	int			max_lru_maps;	/* per CPU */
 	int			cpus;
 	int			ref;
 	int			nr_buffers;	/* buffer instances */
 	bool			use_trace_clock;
 	bool			read_page;
 	bool			use_pipe;
+	bool			use_uring;
+	struct tracecmd_uring	*uring;
+	bool			compressed;	/* "flychunks" */
+	int			compress_id;
+	unsigned int		chunk_size;
 	struct cpu_data 	*cpu_data;
+	void			*page_index_map;
+	size_t			page_index_size;
+	struct merge_heap_node	*merge_heap;
+	int			merge_heap_nr;
+	bool			merge_heap_valid;
 	long long		ts_offset;
 	struct tsc2nsec		tsc_calc;
 
 	struct host_trace_info	host;
 	double			ts2secs;
 	char *			cpustats;
+	char *			recorder_stats;
 	char *			uname;
 	char *			version;
 	char *			trace_clock;
@@ -150,8 +232,10 @@ struct tracecmd_input {
 	struct pid_addr_maps	*pid_maps;
 	/* file information */
 	size_t			header_files_start;
+	size_t			options_start;
 	size_t			ftrace_files_start;
 	size_t			event_files_start;
+	size_t			cmdlines_start;
 	size_t			total_file_size;
 
 	/* For custom profilers. */
@@ -182,6 +266,15 @@ enum tracecmd_file_states tracecmd_get_file_state(struct tracecmd_input *handle)
 	return handle->file_state;
 }
 
+/*
+ * Anything that moves a CPU iterator, other than reading the record
+ * that tracecmd_peek_next_data() returned, must rebuild the heap.
+ */
+static inline void merge_heap_invalidate(struct tracecmd_input *handle)
+{
+	handle->merge_heap_valid = false;
+}
+
 #if DEBUG_RECORD
 static void remove_record(struct page *page, struct tep_record *record)
 {
@@ -902,10 +995,248 @@ static unsigned long long calc_page_offset(struct tracecmd_input *handle,
 	return offset & ~(handle->page_size - 1);
 }
 
+static char *get_chunk(struct tracecmd_input *handle, int cpu,
+		       unsigned long long index, unsigned int size)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	struct cpu_chunk *chunk = &cpu_data->chunks[index];
+	struct chunk_cache *cache = NULL;
+	char *buf;
+	int i;
+
+	for (i = 0; i < CHUNK_CACHE_SIZE; i++) {
+		if (cpu_data->chunk_cache[i].index == (long long)index) {
+			cache = &cpu_data->chunk_cache[i];
+			cache->age = ++cpu_data->chunk_age;
+			return cache->data;
+		}
+		if (!cache || cpu_data->chunk_cache[i].age < cache->age)
+			cache = &cpu_data->chunk_cache[i];
+	}
+
+	if (!cache->data) {
+		cache->data = malloc(handle->chunk_size);
+		if (!cache->data)
+			return NULL;
+	}
+
+	if (chunk->size > cpu_data->chunk_buf_size) {
+		buf = realloc(cpu_data->chunk_buf, chunk->size);
+		if (!buf)
+			return NULL;
+		cpu_data->chunk_buf = buf;
+		cpu_data->chunk_buf_size = chunk->size;
+	}
+
+	cache->index = -1;
+	if (pread64(handle->fd, cpu_data->chunk_buf, chunk->size,
+		    chunk->offset) != chunk->size)
+		return NULL;
+
+	if (tracecmd_uncompress_buffer(handle->compress_id, cpu_data->chunk_buf,
+				       chunk->size, cache->data, size) < 0) {
+		tracecmd_warning("corrupted chunk %llu of cpu %d", index, cpu);
+		return NULL;
+	}
+
+	cache->index = index;
+	cache->age = ++cpu_data->chunk_age;
+
+	return cache->data;
+}
+
+/* Copy a page out of the chunk that holds it, uncompressing it if needed */
+static int read_chunk_page(struct tracecmd_input *handle, off64_t offset,
+			   int cpu, void *map)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	unsigned long long index;
+	unsigned int start;
+	unsigned int size;
+	unsigned int len;
+	char *data;
+
+	offset -= cpu_data->file_offset;
+	index = offset / handle->chunk_size;
+	if (offset < 0 || index >= cpu_data->nr_chunks) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	size = handle->chunk_size;
+	if (index == cpu_data->nr_chunks - 1)
+		size = cpu_data->file_size - index * handle->chunk_size;
+
+	start = offset - index * handle->chunk_size;
+	len = size - start;
+	if (len > (unsigned int)handle->page_size)
+		len = handle->page_size;
+
+	/* Chunks that are not compressed (extents) are read a page at a time */
+	if (handle->compress_id == TRACECMD_COMPRESS_NONE) {
+		if (cpu_data->chunks[index].size != size ||
+		    pread64(handle->fd, map, len,
+			    cpu_data->chunks[index].offset + start) != len) {
+			errno = EINVAL;
+			return -1;
+		}
+	} else {
+		data = get_chunk(handle, cpu, index, size);
+		if (!data)
+			return -1;
+		memcpy(map, data + start, len);
+	}
+	if (len < (unsigned int)handle->page_size)
+		memset(map + len, 0, handle->page_size - len);
+
+	return 0;
+}
+
+static void free_chunks(struct cpu_data *cpu_data)
+{
+	int i;
+
+	for (i = 0; i < CHUNK_CACHE_SIZE; i++) {
+		free(cpu_data->chunk_cache[i].data);
+		cpu_data->chunk_cache[i].data = NULL;
+		cpu_data->chunk_cache[i].index = -1;
+	}
+	free(cpu_data->chunk_buf);
+	cpu_data->chunk_buf = NULL;
+	cpu_data->chunk_buf_size = 0;
+	free(cpu_data->chunks);
+	cpu_data->chunks = NULL;
+	cpu_data->nr_chunks = 0;
+}
+
+/* Read the chunk index entries of a CPU that has @size bytes of data */
+static int read_chunk_entries(struct tracecmd_input *handle,
+			      unsigned long long size,
+			      struct cpu_chunk **pchunks, unsigned long long *pnr)
+{
+	struct cpu_chunk *chunks;
+	unsigned long long nr;
+	unsigned long long i;
+	char *entry;
+	char *buf;
+
+	*pchunks = NULL;
+	*pnr = nr = (size + handle->chunk_size - 1) / handle->chunk_size;
+	if (!nr)
+		return 0;
+
+	chunks = calloc(nr, sizeof(*chunks));
+	buf = malloc(nr * CHUNK_INDEX_ENTRY_SIZE);
+	if (!chunks || !buf)
+		goto fail;
+
+	if (do_read_check(handle, buf, nr * CHUNK_INDEX_ENTRY_SIZE))
+		goto fail;
+
+	for (i = 0; i < nr; i++) {
+		entry = buf + i * CHUNK_INDEX_ENTRY_SIZE;
+		chunks[i].offset = tep_read_number(handle->pevent, entry, 8);
+		chunks[i].size = tep_read_number(handle->pevent, entry + 8, 4);
+		chunks[i].ts = tep_read_number(handle->pevent, entry + 12, 8);
+		if ((size_t)chunks[i].offset + chunks[i].size > handle->total_file_size) {
+			printf("File possibly truncated. "
+			       "Need at least %llu, but file size is %zu.\n",
+			       (unsigned long long)chunks[i].offset + chunks[i].size,
+			       handle->total_file_size);
+			errno = EINVAL;
+			goto fail;
+		}
+	}
+	free(buf);
+
+	*pchunks = chunks;
+	return 0;
+
+ fail:
+	free(chunks);
+	free(buf);
+	return -1;
+}
+
+static int read_cpu_chunks(struct tracecmd_input *handle,
+			   struct cpu_data *cpu_data, unsigned long long size)
+{
+	struct cpu_chunk *chunks;
+	unsigned long long nr;
+
+	if (read_chunk_entries(handle, size, &chunks, &nr) < 0)
+		return -1;
+	if (!nr)
+		return 0;
+
+	free(cpu_data->chunks);
+	cpu_data->chunks = chunks;
+	cpu_data->nr_chunks = nr;
+
+	return 0;
+}
+
+/*
+ * Read the compression header and the chunk index that follow the CPU
+ * headers of a "flychunks" section. See write_cpu_data_chunks().
+ */
+static int read_chunk_index(struct tracecmd_input *handle)
+{
+	struct cpu_data *cpu_data;
+	unsigned int chunk_size;
+	unsigned int id;
+	int cpu;
+	int i;
+
+	if (read4(handle, &id) < 0 || read4(handle, &chunk_size) < 0)
+		return -1;
+
+	if (!tracecmd_compress_supported(id)) {
+		tracecmd_warning("trace data is compressed with %s, which is not supported",
+				 tracecmd_compress_name(id));
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (!chunk_size || chunk_size % handle->page_size) {
+		tracecmd_warning("bad chunk size %u", chunk_size);
+		errno = EINVAL;
+		return -1;
+	}
+	handle->compress_id = id;
+	handle->chunk_size = chunk_size;
+
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		cpu_data = &handle->cpu_data[cpu];
+		for (i = 0; i < CHUNK_CACHE_SIZE; i++)
+			cpu_data->chunk_cache[i].index = -1;
+
+		if (read_cpu_chunks(handle, cpu_data, cpu_data->file_size) < 0)
+			return -1;
+	}
+
+	/* The pages are copied out of the uncompressed chunks */
+	handle->read_page = true;
+
+	return 0;
+}
+
+/**
+ * tracecmd_get_compression - get how the trace data is compressed
+ * @handle: input handle for the trace.dat file
+ *
+ * Returns the name of the compression algorithm of the trace data,
+ * or NULL if the data is not compressed.
+ */
+const char *tracecmd_get_compression(struct tracecmd_input *handle)
+{
+	if (!handle->compressed)
+		return NULL;
+	return tracecmd_compress_name(handle->compress_id);
+}
+
 static int read_page(struct tracecmd_input *handle, off64_t offset,
 		     int cpu, void *map)
 {
-	off64_t save_seek;
 	off64_t ret;
 
 	if (handle->use_pipe) {
@@ -923,19 +1254,17 @@ static int read_page(struct tracecmd_input *handle, off64_t offset,
 		return 0;
 	}
 
-	/* other parts of the code may expect the pointer to not move */
-	save_seek = lseek64(handle->fd, 0, SEEK_CUR);
+	if (handle->compressed)
+		return read_chunk_page(handle, offset, cpu, map);
 
-	ret = lseek64(handle->fd, offset, SEEK_SET);
-	if (ret < 0)
-		return -1;
-	ret = read(handle->fd, map, handle->page_size);
+	/*
+	 * Other parts of the code may expect the pointer to not move,
+	 * and other CPUs may be read from other threads.
+	 */
+	ret = pread64(handle->fd, map, handle->page_size, offset);
 	if (ret < 0)
 		return -1;
 
-	/* reset the file pointer back */
-	lseek64(handle->fd, save_seek, SEEK_SET);
-
 	return 0;
 }
 
@@ -954,15 +1283,147 @@ static unsigned long long normalize_size(unsigned long long size)
 	return size - (size >> 1);
 }
 
-static void free_page_map(struct page_map *page_map)
+/*
+ * Tell the kernel how the mapping of a CPU's data is going to be used.
+ * A sequential scan wants the window faulted in before the cursor gets
+ * to it, and the next window read from disk while this one is parsed.
+ * Seeking around a file (like KernelShark does) would only waste I/O
+ * on readahead.
+ */
+static void advise_page_map(struct tracecmd_input *handle, int cpu,
+			    struct page_map *page_map)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	off64_t end = cpu_data->file_offset + cpu_data->file_size;
+	off64_t next = page_map->offset + page_map->size;
+	off64_t size = handle->page_map_size;
+
+	if (handle->access_flags & TRACECMD_FL_SEQUENTIAL_SCAN) {
+		madvise(page_map->map, page_map->size, MADV_SEQUENTIAL);
+		madvise(page_map->map, page_map->size, MADV_WILLNEED);
+		if (next + size > end)
+			size = end - next;
+		if (size > 0)
+			readahead(handle->fd, next, size);
+	} else if (handle->access_flags & TRACECMD_FL_RANDOM_ACCESS) {
+		madvise(page_map->map, page_map->size, MADV_RANDOM);
+	}
+}
+
+static inline unsigned int page_map_hash(off64_t offset)
+{
+	return ((unsigned long long)offset * 0x9e3779b97f4a7c15ULL) >>
+		(64 - PAGE_MAP_HASH_BITS);
+}
+
+static struct page_map *find_page_map(struct cpu_data *cpu_data, off64_t offset)
+{
+	struct page_map *page_map;
+
+	page_map = cpu_data->page_maps[page_map_hash(offset)];
+	for (; page_map; page_map = page_map->next) {
+		if (page_map->offset == offset)
+			return page_map;
+	}
+	return NULL;
+}
+
+static void add_page_map(struct cpu_data *cpu_data, struct page_map *page_map)
+{
+	struct page_map **bucket;
+
+	bucket = &cpu_data->page_maps[page_map_hash(page_map->offset)];
+	page_map->next = *bucket;
+	*bucket = page_map;
+}
+
+static void unmap_page_map(struct tracecmd_input *handle, struct page_map *page_map)
 {
+	struct cpu_data *cpu_data = &handle->cpu_data[page_map->cpu];
+	struct page_map **p;
+
+	p = &cpu_data->page_maps[page_map_hash(page_map->offset)];
+	for (; *p; p = &(*p)->next) {
+		if (*p == page_map) {
+			*p = page_map->next;
+			break;
+		}
+	}
+
+	munmap(page_map->map, page_map->size);
+	free(page_map);
+}
+
+/* Unmap the oldest unused maps of a CPU until there are at most @max */
+static void trim_page_map_lru(struct tracecmd_input *handle,
+			      struct cpu_data *cpu_data, int max)
+{
+	struct page_map *old;
+
+	while (cpu_data->nr_lru_maps > max) {
+		old = container_of(cpu_data->map_lru.prev, struct page_map, lru);
+		list_del(&old->lru);
+		cpu_data->nr_lru_maps--;
+		unmap_page_map(handle, old);
+	}
+}
+
+/*
+ * Unused maps are not unmapped right away, as random access (like
+ * tracecmd_read_at()) tends to come back to the same windows. They
+ * are kept on an LRU of their CPU, and the oldest ones are unmapped
+ * once there are more than max_lru_maps of them. A sequential scan
+ * will not come back, so there is no point in caching for it.
+ *
+ * The LRU is per CPU, like the maps themselves, so that CPUs iterated
+ * from different threads do not share it.
+ */
+static void free_page_map(struct tracecmd_input *handle, struct page_map *page_map)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[page_map->cpu];
+
 	page_map->ref_count--;
 	if (page_map->ref_count)
 		return;
 
-	munmap(page_map->map, page_map->size);
-	list_del(&page_map->list);
-	free(page_map);
+	if (handle->access_flags & TRACECMD_FL_SEQUENTIAL_SCAN) {
+		unmap_page_map(handle, page_map);
+		return;
+	}
+
+	list_add(&page_map->lru, &cpu_data->map_lru);
+	cpu_data->nr_lru_maps++;
+
+	trim_page_map_lru(handle, cpu_data, handle->max_lru_maps);
+}
+
+/**
+ * tracecmd_set_page_map_cache - set the number of unused maps to keep
+ * @handle: input handle for the trace.dat file
+ * @nr_maps: the maximum number of unused page maps kept mapped per CPU
+ *
+ * The data of the trace.dat file is mapped in windows of about a meg
+ * per CPU. When no more records reference a window, it is kept mapped
+ * in case it is accessed again, up to @nr_maps windows for each CPU.
+ * Setting it to zero unmaps the windows as soon as they are unused.
+ *
+ * This must not be called while CPUs of @handle are read.
+ */
+void tracecmd_set_page_map_cache(struct tracecmd_input *handle, int nr_maps)
+{
+	int cpu;
+
+	if (nr_maps < 0)
+		nr_maps = 0;
+	handle->max_lru_maps = nr_maps;
+
+	if (!handle->cpu_data)
+		return;
+
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		if (handle->cpu_data[cpu].kbuf)
+			trim_page_map_lru(handle, &handle->cpu_data[cpu], nr_maps);
+	}
 }
 
 static void *allocate_page_map(struct tracecmd_input *handle,
@@ -976,6 +1437,13 @@ static void *allocate_page_map(struct tracecmd_input *handle,
 	int ret;
 
 	if (handle->read_page) {
+		if (handle->uring) {
+			map = tracecmd_uring_read_page(handle->uring, cpu, offset,
+						       cpu_data->file_offset +
+						       cpu_data->file_size);
+			if (map)
+				return map;
+		}
 		map = malloc(handle->page_size);
 		if (!map)
 			return NULL;
@@ -1000,14 +1468,19 @@ static void *allocate_page_map(struct tracecmd_input *handle,
 	if (page_map && page_map->offset == map_offset)
 		goto out;
 
-	list_for_each_entry(page_map, &cpu_data->page_maps, list) {
-		if (page_map->offset == map_offset)
-			goto out;
+	page_map = find_page_map(cpu_data, map_offset);
+	if (page_map) {
+		if (!page_map->ref_count) {
+			list_del(&page_map->lru);
+			cpu_data->nr_lru_maps--;
+		}
+		goto out;
 	}
 
 	page_map = calloc(1, sizeof(*page_map));
 	if (!page_map)
 		return NULL;
+	page_map->cpu = cpu;
 
 	if (map_offset + map_size > cpu_data->file_offset + cpu_data->file_size)
 		map_size -= map_offset + map_size -
@@ -1037,14 +1510,26 @@ static void *allocate_page_map(struct tracecmd_input *handle,
 		goto again;
 	}
 
-	list_add(&page_map->list, &cpu_data->page_maps);
+	add_page_map(cpu_data, page_map);
+	advise_page_map(handle, cpu, page_map);
  out:
 	if (cpu_data->page_map != page_map) {
 		struct page_map *old_map = cpu_data->page_map;
 		cpu_data->page_map = page_map;
 		page_map->ref_count++;
-		if (old_map)
-			free_page_map(old_map);
+		if (old_map) {
+			/*
+			 * A sequential scan will not come back to the
+			 * window behind the cursor. Records may still
+			 * point into it, but the mapping is read only,
+			 * so dropping its pages is safe; they will just
+			 * be faulted in again if used.
+			 */
+			if ((handle->access_flags & TRACECMD_FL_SEQUENTIAL_SCAN) &&
+			    old_map->offset < page_map->offset)
+				madvise(old_map->map, old_map->size, MADV_DONTNEED);
+			free_page_map(handle, old_map);
+		}
 	}
 	page->page_map = page_map;
 	page_map->ref_count++;
@@ -1115,7 +1600,7 @@ static void __free_page(struct tracecmd_input *handle, struct page *page)
 	if (handle->read_page)
 		free(page->map);
 	else
-		free_page_map(page->page_map);
+		free_page_map(handle, page->page_map);
 
 	index = (page->offset - cpu_data->file_offset) / handle->page_size;
 	cpu_data->pages[index] = NULL;
@@ -1148,12 +1633,110 @@ static void free_page(struct tracecmd_input *handle, int cpu)
 	handle->cpu_data[cpu].page = NULL;
 }
 
+static struct tep_record *alloc_record(struct tracecmd_input *handle, int cpu)
+{
+	struct record_pool *pool = &handle->cpu_data[cpu].record_pool;
+	struct record_slab *slab;
+	struct tep_record *record;
+	int i;
+
+	if (!pool->free_list) {
+		slab = malloc(sizeof(*slab));
+		if (!slab)
+			return NULL;
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+		pool->stats.slabs++;
+		for (i = RECORD_SLAB_SIZE - 1; i >= 0; i--) {
+			slab->records[i].priv = pool->free_list;
+			pool->free_list = &slab->records[i];
+		}
+	} else {
+		pool->stats.reused++;
+	}
+
+	record = pool->free_list;
+	pool->free_list = record->priv;
+	memset(record, 0, sizeof(*record));
+
+	pool->stats.allocated++;
+	pool->stats.in_use++;
+	if (pool->stats.in_use > pool->stats.max_in_use)
+		pool->stats.max_in_use = pool->stats.in_use;
+
+	return record;
+}
+
+static void release_record(struct page *page, struct tep_record *record)
+{
+	struct record_pool *pool = &page->handle->cpu_data[page->cpu].record_pool;
+
+	record->priv = pool->free_list;
+	pool->free_list = record;
+	pool->stats.freed++;
+	pool->stats.in_use--;
+}
+
+static void free_record_pool(struct tracecmd_input *handle, int cpu)
+{
+	struct record_pool *pool = &handle->cpu_data[cpu].record_pool;
+	struct record_slab *slab;
+
+	if (pool->stats.in_use)
+		tracecmd_warning("%llu records still allocated on cpu %d",
+				 pool->stats.in_use, cpu);
+
+	while (pool->slabs) {
+		slab = pool->slabs;
+		pool->slabs = slab->next;
+		free(slab);
+	}
+	pool->free_list = NULL;
+}
+
+/**
+ * tracecmd_get_record_stats - get the record allocation counters
+ * @handle: input handle for the trace.dat file
+ * @stats: returns the counters
+ *
+ * Fills @stats with the number of records handed out by the handle,
+ * how many of those were recycled, and how many slabs had to be
+ * allocated to back them, summed over all the CPUs.
+ */
+void tracecmd_get_record_stats(struct tracecmd_input *handle,
+			       struct tracecmd_record_stats *stats)
+{
+	struct tracecmd_record_stats *cpu_stats;
+	int cpu;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!handle->cpu_data)
+		return;
+
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		if (!handle->cpu_data[cpu].kbuf)
+			continue;
+		cpu_stats = &handle->cpu_data[cpu].record_pool.stats;
+		stats->allocated += cpu_stats->allocated;
+		stats->reused += cpu_stats->reused;
+		stats->freed += cpu_stats->freed;
+		stats->in_use += cpu_stats->in_use;
+		stats->max_in_use += cpu_stats->max_in_use;
+		stats->slabs += cpu_stats->slabs;
+	}
+}
+
 static void __free_record(struct tep_record *record)
 {
 	if (record->priv) {
 		struct page *page = record->priv;
+		struct tracecmd_input *handle = page->handle;
+
 		remove_record(page, record);
-		__free_page(page->handle, page);
+		release_record(page, record);
+		/* This may free the page, the handle is still valid */
+		__free_page(handle, page);
+		return;
 	}
 
 	free(record);
@@ -1528,6 +2111,8 @@ tracecmd_read_at(struct tracecmd_input *handle, unsigned long long offset,
 	unsigned long long page_offset;
 	int cpu;
 
+	merge_heap_invalidate(handle);
+
 	page_offset = calc_page_offset(handle, offset);
 
 	/* check to see if we have this page already */
@@ -1571,6 +2156,8 @@ int tracecmd_refresh_record(struct tracecmd_input *handle,
 	int index;
 	int ret;
 
+	merge_heap_invalidate(handle);
+
 	page_offset = calc_page_offset(handle, record->offset);
 	index = record->offset & (handle->page_size - 1);
 
@@ -1602,6 +2189,8 @@ tracecmd_read_cpu_first(struct tracecmd_input *handle, int cpu)
 {
 	int ret;
 
+	merge_heap_invalidate(handle);
+
 	ret = get_page(handle, cpu, handle->cpu_data[cpu].file_offset);
 	if (ret < 0)
 		return NULL;
@@ -1615,6 +2204,37 @@ tracecmd_read_cpu_first(struct tracecmd_input *handle, int cpu)
 	return tracecmd_read_data(handle, cpu);
 }
 
+static inline void *page_index_entry(struct cpu_data *cpu_data,
+				     unsigned long long idx)
+{
+	return cpu_data->page_index + idx * PAGE_INDEX_ENTRY_SIZE;
+}
+
+static inline unsigned long long
+page_index_offset(struct tracecmd_input *handle, struct cpu_data *cpu_data,
+		  unsigned long long idx)
+{
+	return tep_read_number(handle->pevent,
+			       page_index_entry(cpu_data, idx), 8);
+}
+
+static inline unsigned long long
+page_index_ts(struct tracecmd_input *handle, struct cpu_data *cpu_data,
+	      unsigned long long idx)
+{
+	return timestamp_calc(tep_read_number(handle->pevent,
+					      page_index_entry(cpu_data, idx) + 8, 8),
+			      cpu_data->cpu, handle);
+}
+
+static inline unsigned int
+page_index_events(struct tracecmd_input *handle, struct cpu_data *cpu_data,
+		  unsigned long long idx)
+{
+	return tep_read_number(handle->pevent,
+			       page_index_entry(cpu_data, idx) + 24, 4);
+}
+
 /**
  * tracecmd_read_cpu_last - get the last record in a CPU
  * @handle: input handle for the trace.dat file
@@ -1627,17 +2247,30 @@ tracecmd_read_cpu_first(struct tracecmd_input *handle, int cpu)
 struct tep_record *
 tracecmd_read_cpu_last(struct tracecmd_input *handle, int cpu)
 {
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
 	struct tep_record *record = NULL;
 	off64_t offset, page_offset;
+	unsigned long long idx;
+
+	merge_heap_invalidate(handle);
 
-	offset = handle->cpu_data[cpu].file_offset +
-		handle->cpu_data[cpu].file_size;
+	offset = cpu_data->file_offset + cpu_data->file_size;
 
 	if (offset & (handle->page_size - 1))
 		offset &= ~(handle->page_size - 1);
 	else
 		offset -= handle->page_size;
 
+	/* The index can tell us which trailing pages hold no events */
+	if (cpu_data->page_index) {
+		for (idx = cpu_data->nr_index; idx > 0; idx--) {
+			if (page_index_events(handle, cpu_data, idx - 1)) {
+				offset = page_index_offset(handle, cpu_data, idx - 1);
+				break;
+			}
+		}
+	}
+
 	page_offset = offset;
 
  again:
@@ -1669,6 +2302,67 @@ tracecmd_read_cpu_last(struct tracecmd_input *handle, int cpu)
 	return record;
 }
 
+/*
+ * Use the page index to find the last page that starts before @ts.
+ * Only one page gets mapped, instead of one per step of the search.
+ */
+static int set_cpu_to_timestamp_index(struct tracecmd_input *handle, int cpu,
+				      unsigned long long ts)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	unsigned long long start = 0;
+	unsigned long long end = cpu_data->nr_index;
+	unsigned long long mid;
+	int ret;
+
+	while (start < end) {
+		mid = start + (end - start) / 2;
+		if (page_index_ts(handle, cpu_data, mid) < ts)
+			start = mid + 1;
+		else
+			end = mid;
+	}
+
+	if (start)
+		start--;
+
+	ret = get_page(handle, cpu, page_index_offset(handle, cpu_data, start));
+	if (ret < 0)
+		return -1;
+
+	/* If the page was already mapped, we need to reset it */
+	if (ret)
+		update_page_info(handle, cpu);
+
+	return 0;
+}
+
+/*
+ * Use the timestamps of the chunk index to find the last chunk that
+ * starts before @ts. Returns the offset of its first page.
+ */
+static off64_t chunk_before_timestamp(struct tracecmd_input *handle,
+				      struct cpu_data *cpu_data,
+				      unsigned long long ts)
+{
+	unsigned long long start = 0;
+	unsigned long long end = cpu_data->nr_chunks;
+	unsigned long long mid;
+
+	while (start < end) {
+		mid = start + (end - start) / 2;
+		if (timestamp_calc(cpu_data->chunks[mid].ts, cpu_data->cpu, handle) < ts)
+			start = mid + 1;
+		else
+			end = mid;
+	}
+
+	if (start)
+		start--;
+
+	return cpu_data->file_offset + start * handle->chunk_size;
+}
+
 /**
  * tracecmd_set_cpu_to_timestamp - set the CPU iterator to a given time
  * @handle: input handle for the trace.dat file
@@ -1690,6 +2384,7 @@ tracecmd_set_cpu_to_timestamp(struct tracecmd_input *handle, int cpu,
 {
 	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
 	off64_t start, end, next;
+	int ret;
 
 	if (cpu < 0 || cpu >= handle->cpus) {
 		errno = -EINVAL;
@@ -1699,6 +2394,8 @@ tracecmd_set_cpu_to_timestamp(struct tracecmd_input *handle, int cpu,
 	if (!cpu_data->size)
 		return -1;
 
+	merge_heap_invalidate(handle);
+
 	if (!cpu_data->page) {
 		if (init_cpu(handle, cpu))
 		    return -1;
@@ -1716,10 +2413,30 @@ tracecmd_set_cpu_to_timestamp(struct tracecmd_input *handle, int cpu,
 		return 0;
 	}
 
+	if (cpu_data->page_index)
+		return set_cpu_to_timestamp_index(handle, cpu, ts);
+
 	/* Set to the first record on current page */
 	update_page_info(handle, cpu);
 
-	if (cpu_data->timestamp < ts) {
+	if (cpu_data->nr_chunks) {
+		/* The chunk index tells which chunk to look in */
+		start = chunk_before_timestamp(handle, cpu_data, ts);
+		end = start + handle->chunk_size;
+		if ((unsigned long long)end > cpu_data->file_offset + cpu_data->file_size)
+			end = cpu_data->file_offset + cpu_data->file_size;
+		if (end & (handle->page_size - 1))
+			end &= ~(handle->page_size - 1);
+		else
+			end -= handle->page_size;
+		next = start;
+
+		ret = get_page(handle, cpu, start);
+		if (ret < 0)
+			return -1;
+		if (ret)
+			update_page_info(handle, cpu);
+	} else if (cpu_data->timestamp < ts) {
 		start = cpu_data->offset;
 		end = cpu_data->file_offset + cpu_data->file_size;
 		if (end & (handle->page_size - 1))
@@ -1824,6 +2541,8 @@ int tracecmd_set_cursor(struct tracecmd_input *handle,
 	    offset > cpu_data->file_offset + cpu_data->file_size)
 		return -1; 	/* cpu does not have this offset. */
 
+	merge_heap_invalidate(handle);
+
 	/* Move this cpu index to point to this offest */
 	page_offset = calc_page_offset(handle, offset);
 
@@ -1986,10 +2705,9 @@ read_again:
 
 	index = kbuffer_curr_offset(kbuf);
 
-	record = malloc(sizeof(*record));
+	record = alloc_record(handle, cpu);
 	if (!record)
 		return NULL;
-	memset(record, 0, sizeof(*record));
 
 	record->ts = handle->cpu_data[cpu].timestamp;
 	record->size = kbuffer_event_size(kbuf);
@@ -2027,6 +2745,11 @@ tracecmd_read_data(struct tracecmd_input *handle, int cpu)
 {
 	struct tep_record *record;
 
+	/* Reading the head of the heap is fixed up by the next peek */
+	if (handle->merge_heap_valid &&
+	    (!handle->merge_heap_nr || handle->merge_heap[0].cpu != cpu))
+		merge_heap_invalidate(handle);
+
 	record = tracecmd_peek_data(handle, cpu);
 	handle->cpu_data[cpu].next = NULL;
 	if (record) {
@@ -2071,6 +2794,105 @@ tracecmd_read_next_data(struct tracecmd_input *handle, int *rec_cpu)
 	return tracecmd_read_data(handle, next_cpu);
 }
 
+static inline bool merge_heap_less(struct merge_heap_node *a,
+				   struct merge_heap_node *b)
+{
+	/* Same order as the linear scan: lowest CPU wins on equal times */
+	return a->ts < b->ts || (a->ts == b->ts && a->cpu < b->cpu);
+}
+
+static void heap_sift_down(struct merge_heap_node *heap, int nr, int i)
+{
+	struct merge_heap_node tmp;
+	int child;
+
+	for (;;) {
+		child = i * 2 + 1;
+		if (child >= nr)
+			break;
+		if (child + 1 < nr && merge_heap_less(&heap[child + 1], &heap[child]))
+			child++;
+		if (!merge_heap_less(&heap[child], &heap[i]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+static void merge_heap_sift_down(struct tracecmd_input *handle, int i)
+{
+	heap_sift_down(handle->merge_heap, handle->merge_heap_nr, i);
+}
+
+static int merge_heap_build(struct tracecmd_input *handle)
+{
+	struct tep_record *record;
+	int cpu;
+	int i;
+
+	if (!handle->merge_heap) {
+		handle->merge_heap = calloc(handle->cpus, sizeof(*handle->merge_heap));
+		if (!handle->merge_heap)
+			return -1;
+	}
+
+	handle->merge_heap_nr = 0;
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		record = tracecmd_peek_data(handle, cpu);
+		if (!record)
+			continue;
+		handle->merge_heap[handle->merge_heap_nr].ts = record->ts;
+		handle->merge_heap[handle->merge_heap_nr].cpu = cpu;
+		handle->merge_heap_nr++;
+	}
+
+	for (i = handle->merge_heap_nr / 2 - 1; i >= 0; i--)
+		merge_heap_sift_down(handle, i);
+
+	handle->merge_heap_valid = true;
+
+	return 0;
+}
+
+/*
+ * Keeps the head of every CPU in a min heap, so that finding the next
+ * record is O(log cpus) instead of peeking at all the CPUs each time.
+ * Only the CPU at the top of the heap can have moved since the last
+ * call; everything else that moves an iterator invalidates the heap.
+ */
+static struct tep_record *
+merge_heap_peek_next(struct tracecmd_input *handle, int *rec_cpu)
+{
+	struct merge_heap_node *top;
+	struct tep_record *record;
+
+	if (!handle->merge_heap_valid && merge_heap_build(handle) < 0)
+		return NULL;
+
+	while (handle->merge_heap_nr) {
+		top = &handle->merge_heap[0];
+		record = tracecmd_peek_data(handle, top->cpu);
+		if (!record) {
+			/* This CPU is done */
+			*top = handle->merge_heap[--handle->merge_heap_nr];
+			merge_heap_sift_down(handle, 0);
+			continue;
+		}
+		if (record->ts != top->ts) {
+			top->ts = record->ts;
+			merge_heap_sift_down(handle, 0);
+			continue;
+		}
+		if (rec_cpu)
+			*rec_cpu = top->cpu;
+		return record;
+	}
+
+	return NULL;
+}
+
 /**
  * tracecmd_peek_next_data - return the next record
  * @handle: input handle to the trace.dat file
@@ -2081,6 +2903,9 @@ tracecmd_read_next_data(struct tracecmd_input *handle, int *rec_cpu)
  * at each CPU and the record with the earliest time stame is
  * returned. If @rec_cpu is not NULL it gets the CPU id the record was
  * on. It does not increment the CPU iterator.
+ *
+ * With many CPUs, the heads of the CPUs are kept in a heap instead of
+ * peeking at each one of them, unless TRACECMD_FL_LINEAR_MERGE is set.
  */
 struct tep_record *
 tracecmd_peek_next_data(struct tracecmd_input *handle, int *rec_cpu)
@@ -2093,6 +2918,11 @@ tracecmd_peek_next_data(struct tracecmd_input *handle, int *rec_cpu)
 	if (rec_cpu)
 		*rec_cpu = -1;
 
+	/* Pipes may get data for a CPU that was empty, they need the scan */
+	if (handle->cpus >= MERGE_HEAP_MIN_CPUS && !handle->use_pipe &&
+	    !(handle->flags & TRACECMD_FL_LINEAR_MERGE))
+		return merge_heap_peek_next(handle, rec_cpu);
+
 	next_cpu = -1;
 	ts = 0;
 
@@ -2105,13 +2935,159 @@ tracecmd_peek_next_data(struct tracecmd_input *handle, int *rec_cpu)
 		}
 	}
 
-	if (next_record) {
-		if (rec_cpu)
-			*rec_cpu = next_cpu;
-		return next_record;
+	if (next_record) {
+		if (rec_cpu)
+			*rec_cpu = next_cpu;
+		return next_record;
+	}
+
+	return NULL;
+}
+
+/*
+ * Fill @record with a view of the next event of @cpu, in place in the
+ * mapped page. Nothing is allocated, and the view is only valid until
+ * the CPU moves on. Returns 0 when the CPU has no more events.
+ */
+static int iterate_peek(struct tracecmd_input *handle, int cpu,
+			struct tep_record *record)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	struct kbuffer *kbuf = cpu_data->kbuf;
+	unsigned long long ts;
+	void *data;
+
+	/* A record cached by tracecmd_peek_data() goes first */
+	if (cpu_data->next) {
+		*record = *cpu_data->next;
+		record->ref_count = 0;
+		record->locked = 0;
+		return 1;
+	}
+
+	for (;;) {
+		if (!cpu_data->page) {
+			if (handle->use_pipe)
+				get_next_page(handle, cpu);
+			if (!cpu_data->page)
+				return 0;
+		}
+		data = kbuffer_read_event(kbuf, &ts);
+		if (data)
+			break;
+		if (get_next_page(handle, cpu))
+			return 0;
+	}
+
+	cpu_data->timestamp = timestamp_calc(ts, cpu, handle);
+
+	memset(record, 0, sizeof(*record));
+	record->ts = cpu_data->timestamp;
+	record->size = kbuffer_event_size(kbuf);
+	record->cpu = cpu;
+	record->data = data;
+	record->offset = cpu_data->offset + kbuffer_curr_offset(kbuf);
+	record->missed_events = kbuffer_missed_events(kbuf);
+	record->record_size = kbuffer_curr_size(kbuf);
+	record->priv = cpu_data->page;
+
+	return 1;
+}
+
+static void iterate_consume(struct tracecmd_input *handle, int cpu)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+
+	if (cpu_data->next)
+		free_next(handle, cpu);
+	else
+		kbuffer_next_event(cpu_data->kbuf, NULL);
+}
+
+/**
+ * tracecmd_iterate_events - call a function for each event in time order
+ * @handle: input handle to the trace.dat file
+ * @cpu: the CPU to read, or -1 for all CPUs
+ * @callback: the function to call for each event
+ * @callback_data: data passed to @callback
+ *
+ * Reads the events from the current location of the CPU iterators,
+ * merging the CPUs by time, and calls @callback for each of them.
+ * Unlike tracecmd_read_next_data(), no record is allocated: @callback
+ * is passed a borrowed record that points into the mapped page, and
+ * that is only valid until @callback returns. It must not be freed or
+ * referenced; use tracecmd_peek_data() for records that need to be kept.
+ *
+ * If @callback returns non zero, the iteration stops after that event
+ * and the value is returned. The event it was given is consumed.
+ *
+ * When iterating a single @cpu, different CPUs of the same handle can
+ * be iterated from different threads at the same time.
+ *
+ * Returns 0 when all the events were read, -1 on error, or the value
+ * returned by @callback.
+ */
+int tracecmd_iterate_events(struct tracecmd_input *handle, int cpu,
+			    tracecmd_iterate_func callback, void *callback_data)
+{
+	struct merge_heap_node *heap;
+	struct tep_record *records;
+	int first = 0;
+	int last = handle->cpus;
+	int ret = 0;
+	int nr = 0;
+	int i;
+
+	if (!callback || cpu >= handle->cpus)
+		return -1;
+
+	if (cpu >= 0) {
+		first = cpu;
+		last = cpu + 1;
+	}
+
+	heap = calloc(handle->cpus, sizeof(*heap));
+	records = calloc(handle->cpus, sizeof(*records));
+	if (!heap || !records) {
+		ret = -1;
+		goto out;
+	}
+
+	/* Hack to work around function graph read ahead */
+	tracecmd_curr_thread_handle = handle;
+
+	/* The CPU iterators move underneath the peek heap */
+	merge_heap_invalidate(handle);
+
+	for (i = first; i < last; i++) {
+		if (!iterate_peek(handle, i, &records[i]))
+			continue;
+		heap[nr].ts = records[i].ts;
+		heap[nr].cpu = i;
+		nr++;
+	}
+
+	for (i = nr / 2 - 1; i >= 0; i--)
+		heap_sift_down(heap, nr, i);
+
+	while (nr) {
+		cpu = heap[0].cpu;
+		ret = callback(handle, &records[cpu], cpu, callback_data);
+		iterate_consume(handle, cpu);
+		if (ret)
+			break;
+
+		if (iterate_peek(handle, cpu, &records[cpu]))
+			heap[0].ts = records[cpu].ts;
+		else
+			heap[0] = heap[--nr];
+		heap_sift_down(heap, nr, 0);
 	}
 
-	return NULL;
+ out:
+	free(heap);
+	free(records);
+	return ret;
 }
 
 /**
@@ -2142,6 +3118,8 @@ tracecmd_read_prev(struct tracecmd_input *handle, struct tep_record *record)
 	if (!record)
 		return NULL;
 
+	merge_heap_invalidate(handle);
+
 	cpu = record->cpu;
 	offset = record->offset;
 	cpu_data = &handle->cpu_data[cpu];
@@ -2221,8 +3199,6 @@ static int init_cpu(struct tracecmd_input *handle, int cpu)
 	cpu_data->size = cpu_data->file_size;
 	cpu_data->timestamp = 0;
 
-	list_head_init(&cpu_data->page_maps);
-
 	if (!cpu_data->size) {
 		printf("CPU %d is empty\n", cpu);
 		return 0;
@@ -2287,6 +3263,7 @@ static int init_cpu(struct tracecmd_input *handle, int cpu)
 void tracecmd_set_ts_offset(struct tracecmd_input *handle,
 			    long long offset)
 {
+	merge_heap_invalidate(handle);
 	handle->ts_offset = offset;
 }
 
@@ -2296,6 +3273,7 @@ void tracecmd_set_ts2secs(struct tracecmd_input *handle,
 	double ts2secs;
 
 	ts2secs = (double)NSEC_PER_SEC / (double)hz;
+	merge_heap_invalidate(handle);
 	handle->ts2secs = ts2secs;
 	handle->use_trace_clock = false;
 }
@@ -2635,6 +3613,8 @@ static int handle_options(struct tracecmd_input *handle)
 	unsigned int size;
 	char *cpustats = NULL;
 	unsigned int cpustats_size = 0;
+	char *recorder_stats = NULL;
+	unsigned int recorder_stats_size = 0;
 	struct input_buffer_instance *buffer;
 	struct hook_list *hook;
 	char *buf;
@@ -2721,6 +3701,16 @@ static int handle_options(struct tracecmd_input *handle)
 			cpustats_size += size;
 			cpustats[cpustats_size] = 0;
 			break;
+		case TRACECMD_OPTION_RECORDER_STATS:
+			buf[size-1] = '\n';
+			recorder_stats = realloc(recorder_stats,
+						 recorder_stats_size + size + 1);
+			if (!recorder_stats)
+				return -ENOMEM;
+			memcpy(recorder_stats + recorder_stats_size, buf, size);
+			recorder_stats_size += size;
+			recorder_stats[recorder_stats_size] = 0;
+			break;
 		case TRACECMD_OPTION_BUFFER:
 			/* A buffer instance is saved at the end of the file */
 			handle->nr_buffers++;
@@ -2790,6 +3780,7 @@ static int handle_options(struct tracecmd_input *handle)
 	}
 
 	handle->cpustats = cpustats;
+	handle->recorder_stats = recorder_stats;
 
 	return 0;
 }
@@ -2806,6 +3797,7 @@ static int read_options_type(struct tracecmd_input *handle)
 
 	/* check if this handles options */
 	if (strncmp(buf, "options", 7) == 0) {
+		handle->options_start = lseek64(handle->fd, 0, SEEK_CUR);
 		if (handle_options(handle) < 0)
 			return -1;
 		handle->file_state = TRACECMD_FILE_OPTIONS;
@@ -2820,12 +3812,128 @@ static int read_options_type(struct tracecmd_input *handle)
 		handle->file_state = TRACECMD_FILE_CPU_LATENCY;
 	else if (strncmp(buf, "flyrecord", 9) == 0)
 		handle->file_state = TRACECMD_FILE_CPU_FLYRECORD;
-	else
+	else if (strncmp(buf, FLYCHUNKS_MAGIC, 9) == 0) {
+		handle->file_state = TRACECMD_FILE_CPU_FLYRECORD;
+		handle->compressed = true;
+	} else
 		return -1;
 
 	return 0;
 }
 
+static void free_page_index(struct tracecmd_input *handle)
+{
+	int cpu;
+
+	if (!handle->page_index_map)
+		return;
+
+	munmap(handle->page_index_map, handle->page_index_size);
+	handle->page_index_map = NULL;
+	handle->page_index_size = 0;
+
+	for (cpu = 0; handle->cpu_data && cpu < handle->cpus; cpu++) {
+		handle->cpu_data[cpu].page_index = NULL;
+		handle->cpu_data[cpu].nr_index = 0;
+	}
+}
+
+/*
+ * Newer files have a page index right after the CPU data, that maps
+ * each page of a CPU to the timestamps it holds. If it is missing or
+ * does not match the CPU data, the page index is simply not used.
+ */
+static void read_page_index(struct tracecmd_input *handle, int cpus)
+{
+	struct cpu_data *cpu_data;
+	unsigned long long index_offset = 0;
+	unsigned long long end;
+	unsigned long long offset;
+	unsigned long long nr_entries;
+	unsigned long long total = 0;
+	unsigned int entry_size;
+	unsigned int index_cpus;
+	size_t header_size;
+	void *entries;
+	char *map;
+	char buf[PAGE_INDEX_MAGIC_SIZE + 8];
+	int cpu;
+
+	if (handle->use_pipe || handle->read_page)
+		return;
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		cpu_data = &handle->cpu_data[cpu];
+		end = cpu_data->file_offset + cpu_data->file_size;
+		end = (end + handle->page_size - 1) & ~(handle->page_size - 1);
+		if (end > index_offset)
+			index_offset = end;
+	}
+
+	if (!index_offset ||
+	    index_offset + sizeof(buf) > handle->total_file_size)
+		return;
+
+	if (pread64(handle->fd, buf, sizeof(buf), index_offset) != sizeof(buf))
+		return;
+
+	if (memcmp(buf, PAGE_INDEX_MAGIC, PAGE_INDEX_MAGIC_SIZE) != 0)
+		return;
+
+	index_cpus = tep_read_number(handle->pevent, buf + PAGE_INDEX_MAGIC_SIZE, 4);
+	entry_size = tep_read_number(handle->pevent, buf + PAGE_INDEX_MAGIC_SIZE + 4, 4);
+	if (index_cpus != (unsigned int)cpus || entry_size != PAGE_INDEX_ENTRY_SIZE)
+		return;
+
+	header_size = sizeof(buf) + index_cpus * 16;
+	if (index_offset + header_size > handle->total_file_size)
+		return;
+
+	/* The size of the index is only known after reading the CPU headers */
+	map = mmap(NULL, header_size, PROT_READ, MAP_PRIVATE,
+		   handle->fd, index_offset);
+	if (map == MAP_FAILED)
+		return;
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		offset = tep_read_number(handle->pevent, map + sizeof(buf) + cpu * 16, 8);
+		nr_entries = tep_read_number(handle->pevent,
+					     map + sizeof(buf) + cpu * 16 + 8, 8);
+		if (offset != handle->cpu_data[cpu].file_offset ||
+		    nr_entries != (handle->cpu_data[cpu].file_size +
+				   handle->page_size - 1) / handle->page_size) {
+			munmap(map, header_size);
+			return;
+		}
+		total += nr_entries;
+	}
+	munmap(map, header_size);
+
+	handle->page_index_size = header_size + total * PAGE_INDEX_ENTRY_SIZE;
+	if (index_offset + handle->page_index_size > handle->total_file_size) {
+		handle->page_index_size = 0;
+		return;
+	}
+
+	map = mmap(NULL, handle->page_index_size, PROT_READ, MAP_PRIVATE,
+		   handle->fd, index_offset);
+	if (map == MAP_FAILED) {
+		handle->page_index_size = 0;
+		return;
+	}
+	handle->page_index_map = map;
+
+	entries = map + header_size;
+	for (cpu = 0; cpu < cpus; cpu++) {
+		cpu_data = &handle->cpu_data[cpu];
+		cpu_data->nr_index = (cpu_data->file_size + handle->page_size - 1) /
+			handle->page_size;
+		if (cpu_data->nr_index)
+			cpu_data->page_index = entries;
+		entries += cpu_data->nr_index * PAGE_INDEX_ENTRY_SIZE;
+	}
+}
+
 static int read_cpu_data(struct tracecmd_input *handle)
 {
 	struct tep_handle *pevent = handle->pevent;
@@ -2854,7 +3962,7 @@ static int read_cpu_data(struct tracecmd_input *handle)
 		return -1;
 	memset(handle->cpu_data, 0, sizeof(*handle->cpu_data) * handle->cpus);
 
-	if (force_read)
+	if (force_read || handle->use_uring)
 		handle->read_page = true;
 
 	if (handle->long_size == 8)
@@ -2871,6 +3979,7 @@ static int read_cpu_data(struct tracecmd_input *handle)
 		unsigned long long offset;
 
 		handle->cpu_data[cpu].cpu = cpu;
+		list_head_init(&handle->cpu_data[cpu].map_lru);
 
 		handle->cpu_data[cpu].kbuf = kbuffer_alloc(long_size, endian);
 		if (!handle->cpu_data[cpu].kbuf)
@@ -2886,7 +3995,9 @@ static int read_cpu_data(struct tracecmd_input *handle)
 		if (size > max_size)
 			max_size = size;
 
-		if (size && (offset + size > handle->total_file_size)) {
+		/* Compressed data is checked against the chunk index */
+		if (size && !handle->compressed &&
+		    (offset + size > handle->total_file_size)) {
 			/* this happens if the file got truncated */
 			printf("File possibly truncated. "
 				"Need at least %llu, but file size is %zu.\n",
@@ -2896,6 +4007,13 @@ static int read_cpu_data(struct tracecmd_input *handle)
 		}
 	}
 
+	if (handle->compressed && read_chunk_index(handle) < 0) {
+		cpu = handle->cpus - 1;
+		goto out_free;
+	}
+
+	read_page_index(handle, cpus);
+
 	/* Calculate about a meg of pages for buffering */
 	pages = handle->page_size ? max_size / handle->page_size : 0;
 	if (!pages)
@@ -2905,6 +4023,14 @@ static int read_cpu_data(struct tracecmd_input *handle)
 	if (handle->page_map_size < handle->page_size)
 		handle->page_map_size = handle->page_size;
 
+	/* Without io_uring, the pages are simply read one by one */
+	if (handle->use_uring && !handle->uring && !handle->compressed) {
+		if (pages > URING_READ_AHEAD)
+			pages = URING_READ_AHEAD;
+		handle->uring = tracecmd_uring_alloc(handle->fd, handle->cpus,
+						     handle->page_size, pages);
+	}
+
 
 	for (cpu = 0; cpu < handle->cpus; cpu++) {
 		if (init_cpu(handle, cpu))
@@ -2935,6 +4061,7 @@ static int read_cpu_data(struct tracecmd_input *handle)
  out_free:
 	for ( ; cpu >= 0; cpu--) {
 		free_page(handle, cpu);
+		free_chunks(&handle->cpu_data[cpu]);
 		kbuffer_free(handle->cpu_data[cpu].kbuf);
 		handle->cpu_data[cpu].kbuf = NULL;
 	}
@@ -2966,6 +4093,9 @@ static int read_and_parse_cmdlines(struct tracecmd_input *handle)
 	if (handle->file_state >= TRACECMD_FILE_CMD_LINES)
 		return 0;
 
+	/* What follows is written again while recording (see tracecmd_refresh()) */
+	handle->cmdlines_start = lseek64(handle->fd, 0, SEEK_CUR);
+
 	if (read_data_and_size(handle, &cmdlines, &size) < 0)
 		return -1;
 	cmdlines[size] = 0;
@@ -3066,6 +4196,259 @@ int tracecmd_init_data(struct tracecmd_input *handle)
 	return ret;
 }
 
+/* Skip the options, when reading the headers again */
+static int skip_options(struct tracecmd_input *handle)
+{
+	unsigned short option;
+	unsigned int size;
+
+	for (;;) {
+		if (do_read_check(handle, &option, 2))
+			return -1;
+		option = tep_read_number(handle->pevent, &option, 2);
+		if (option == TRACECMD_OPTION_DONE)
+			return 0;
+		if (read4(handle, &size) < 0)
+			return -1;
+		if (lseek64(handle->fd, size, SEEK_CUR) == (off64_t)-1)
+			return -1;
+	}
+}
+
+/* More data was added to a CPU, make it readable */
+static int grow_cpu_data(struct tracecmd_input *handle, int cpu,
+			 unsigned long long size)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	unsigned long long end;
+	int i;
+
+	end = cpu_data->file_offset + cpu_data->file_size;
+	end = (end + handle->page_size - 1) & ~(handle->page_size - 1);
+	cpu_data->file_size = size;
+
+	for (i = 0; i < CHUNK_CACHE_SIZE; i++)
+		cpu_data->chunk_cache[i].index = -1;
+
+	/* The CPU had no data yet */
+	if (!cpu_data->pages)
+		return init_cpu(handle, cpu);
+
+	/* Still reading a page, the next ones follow */
+	if (cpu_data->page) {
+		cpu_data->size = cpu_data->file_offset + size - cpu_data->offset;
+		return 0;
+	}
+
+	/* All the data was read, go on with what is after it */
+	return get_page(handle, cpu, end) < 0 ? -1 : 0;
+}
+
+/* The headers of a file being recorded, as read by tracecmd_refresh() */
+struct live_headers {
+	char			*cmdlines;
+	unsigned long long	*sizes;
+	struct cpu_chunk	**chunks;
+	unsigned long long	*nr_chunks;
+};
+
+static void free_live_headers(struct live_headers *live, int cpus)
+{
+	int cpu;
+
+	if (live->chunks) {
+		for (cpu = 0; cpu < cpus; cpu++)
+			free(live->chunks[cpu]);
+	}
+	free(live->cmdlines);
+	free(live->sizes);
+	free(live->chunks);
+	free(live->nr_chunks);
+	memset(live, 0, sizeof(*live));
+}
+
+/*
+ * Read the generation count of the headers of a file being recorded
+ * (see LIVE_GEN_MAGIC). Returns -1 if the file does not have one.
+ */
+static int read_live_generation(struct tracecmd_input *handle,
+				unsigned long long *gen)
+{
+	unsigned long long offset = handle->cpu_data[0].file_offset;
+	char buf[LIVE_GEN_SIZE];
+
+	if (offset < handle->cmdlines_start + LIVE_GEN_SIZE ||
+	    pread64(handle->fd, buf, LIVE_GEN_SIZE,
+		    offset - LIVE_GEN_SIZE) != LIVE_GEN_SIZE ||
+	    memcmp(buf, LIVE_GEN_MAGIC, sizeof(LIVE_GEN_MAGIC)) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*gen = tep_read_number(handle->pevent, buf + 8, 8);
+	return 0;
+}
+
+/*
+ * Read the command lines and the CPU headers of a file being recorded,
+ * without using them yet: they may be written again while being read.
+ */
+static int read_live_headers(struct tracecmd_input *handle,
+			     struct live_headers *live)
+{
+	unsigned long long offset;
+	unsigned long long size;
+	unsigned int chunk_size;
+	unsigned int id;
+	char buf[10];
+	int cpus;
+	int cpu;
+
+	if (lseek64(handle->fd, handle->cmdlines_start, SEEK_SET) == (off64_t)-1)
+		return -1;
+
+	if (read_data_and_size(handle, &live->cmdlines, &size) < 0)
+		return -1;
+	live->cmdlines[size] = 0;
+
+	if (read4(handle, (unsigned int *)&cpus) < 0 || do_read_check(handle, buf, 10))
+		return -1;
+	if (strncmp(buf, "options", 7) == 0 &&
+	    (skip_options(handle) < 0 || do_read_check(handle, buf, 10)))
+		return -1;
+
+	/* The layout must be the same, only the sizes change */
+	if (cpus != handle->cpus || strncmp(buf, FLYCHUNKS_MAGIC, 9) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	live->sizes = calloc(cpus, sizeof(*live->sizes));
+	live->chunks = calloc(cpus, sizeof(*live->chunks));
+	live->nr_chunks = calloc(cpus, sizeof(*live->nr_chunks));
+	if (!live->sizes || !live->chunks || !live->nr_chunks)
+		return -1;
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		if (read8(handle, &offset) < 0 || read8(handle, &live->sizes[cpu]) < 0)
+			return -1;
+		if (offset != handle->cpu_data[cpu].file_offset ||
+		    live->sizes[cpu] < handle->cpu_data[cpu].file_size) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	if (read4(handle, &id) < 0 || read4(handle, &chunk_size) < 0)
+		return -1;
+	if (id != (unsigned int)handle->compress_id || chunk_size != handle->chunk_size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		if (read_chunk_entries(handle, live->sizes[cpu], &live->chunks[cpu],
+				       &live->nr_chunks[cpu]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* How many times to read the headers of a file being recorded, if they change */
+#define LIVE_READ_TRIES		10
+
+/**
+ * tracecmd_refresh - pick up the data added to a file being recorded
+ * @handle: input handle for the trace.dat file
+ *
+ * A file recorded with "trace-cmd record --live" can be read while it
+ * is being recorded, and its CPU headers are written again as the data
+ * grows. This reads them again, and makes the data that was written
+ * since then readable. The reads of each CPU go on from where they
+ * stopped. The new command lines are picked up as well.
+ *
+ * The headers are read again if they were written while being read
+ * (the generation count before the CPU data changed). If they are still
+ * being written after a few tries, they are left for the next call.
+ *
+ * Returns 1 if there is more data, 0 if not, and -1 on error (or if the
+ * file is not one that grows).
+ */
+int tracecmd_refresh(struct tracecmd_input *handle)
+{
+	struct live_headers live = { NULL };
+	struct timespec wait = {
+		.tv_sec = 0,
+		.tv_nsec = 1000000,
+	};
+	struct cpu_data *cpu_data;
+	unsigned long long gen, gen2;
+	int tries = 0;
+	int more = 0;
+	int ret;
+	int cpu;
+
+	if (!handle->compressed || handle->use_pipe || !handle->cmdlines_start ||
+	    !handle->cpus) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	handle->total_file_size = lseek64(handle->fd, 0, SEEK_END);
+
+	for (;;) {
+		if (read_live_generation(handle, &gen) < 0)
+			return -1;
+		if (!(gen & 1)) {
+			ret = read_live_headers(handle, &live);
+			if (read_live_generation(handle, &gen2) < 0) {
+				free_live_headers(&live, handle->cpus);
+				return -1;
+			}
+			if (gen2 == gen)
+				break;
+			free_live_headers(&live, handle->cpus);
+		}
+		if (++tries == LIVE_READ_TRIES)
+			return 0;
+		nanosleep(&wait, NULL);
+	}
+
+	if (ret < 0)
+		goto out;
+
+	tep_parse_saved_cmdlines(handle->pevent, live.cmdlines);
+
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		cpu_data = &handle->cpu_data[cpu];
+		if (!live.nr_chunks[cpu])
+			continue;
+		free(cpu_data->chunks);
+		cpu_data->chunks = live.chunks[cpu];
+		cpu_data->nr_chunks = live.nr_chunks[cpu];
+		live.chunks[cpu] = NULL;
+	}
+
+	ret = -1;
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		cpu_data = &handle->cpu_data[cpu];
+		if (live.sizes[cpu] == cpu_data->file_size)
+			continue;
+		if (grow_cpu_data(handle, cpu, live.sizes[cpu]) < 0)
+			goto out;
+		more = 1;
+	}
+
+	if (more)
+		merge_heap_invalidate(handle);
+
+	ret = more;
+ out:
+	free_live_headers(&live, handle->cpus);
+	return ret;
+}
+
 /**
  * tracecmd_make_pipe - Have the handle read a pipe instead of a file
  * @handle: input handle to read from a pipe
@@ -3118,6 +4501,7 @@ int tracecmd_make_pipe(struct tracecmd_input *handle, int cpu, int fd, int cpus)
 	memset(&handle->cpu_data[cpu], 0, sizeof(handle->cpu_data[cpu]));
 	handle->cpu_data[cpu].pipe_fd = fd;
 	handle->cpu_data[cpu].cpu = cpu;
+	list_head_init(&handle->cpu_data[cpu].map_lru);
 
 	handle->cpu_data[cpu].kbuf = kbuffer_alloc(long_size, endian);
 	if (!handle->cpu_data[cpu].kbuf)
@@ -3180,6 +4564,8 @@ static void show_cpu_stats(struct tracecmd_input *handle)
  *
  * Looks for the option TRACECMD_OPTION_CPUSTAT and prints out what's
  * stored there, if it is found. Otherwise it prints that none were found.
+ * The statistics of the recorders (TRACECMD_OPTION_RECORDER_STATS) follow,
+ * if the file has them.
  */
 void tracecmd_print_stats(struct tracecmd_input *handle)
 {
@@ -3188,6 +4574,9 @@ void tracecmd_print_stats(struct tracecmd_input *handle)
 	else
 		printf(" No stats in this file\n");
 
+	if (handle->recorder_stats)
+		printf("Recorders:\n%s\n", handle->recorder_stats);
+
 	show_cpu_stats(handle);
 }
 
@@ -3265,6 +4654,17 @@ struct tracecmd_input *tracecmd_alloc_fd(int fd, int flags)
 
 	handle->fd = fd;
 	handle->ref = 1;
+	handle->max_lru_maps = PAGE_MAP_CACHE_MAX;
+
+	if (flags & TRACECMD_FL_SEQUENTIAL_SCAN) {
+		handle->access_flags = TRACECMD_FL_SEQUENTIAL_SCAN;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	} else if (flags & TRACECMD_FL_RANDOM_ACCESS) {
+		handle->access_flags = TRACECMD_FL_RANDOM_ACCESS;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+	}
+	if (flags & TRACECMD_FL_IO_URING)
+		handle->use_uring = true;
 
 	if (do_read_check(handle, buf, 3))
 		goto failed_read;
@@ -3467,8 +4867,11 @@ void tracecmd_close(struct tracecmd_input *handle)
 		free_page(handle, cpu);
 		if (handle->cpu_data && handle->cpu_data[cpu].kbuf) {
 			kbuffer_free(handle->cpu_data[cpu].kbuf);
+			free_record_pool(handle, cpu);
+			free_chunks(&handle->cpu_data[cpu]);
 			if (handle->cpu_data[cpu].page_map)
-				free_page_map(handle->cpu_data[cpu].page_map);
+				free_page_map(handle, handle->cpu_data[cpu].page_map);
+			trim_page_map_lru(handle, &handle->cpu_data[cpu], 0);
 
 			if (handle->cpu_data[cpu].page_cnt)
 				tracecmd_warning("%d pages still allocated on cpu %d%s",
@@ -3479,10 +4882,14 @@ void tracecmd_close(struct tracecmd_input *handle)
 		}
 	}
 
+	free_page_index(handle);
+	free(handle->merge_heap);
 	free(handle->cpustats);
+	free(handle->recorder_stats);
 	free(handle->cpu_data);
 	free(handle->uname);
 	free(handle->trace_clock);
+	tracecmd_uring_free(handle->uring);
 	close(handle->fd);
 
 	tracecmd_free_hooks(handle->hooks);
@@ -3712,6 +5119,101 @@ static int copy_command_lines(struct tracecmd_input *handle, int fd)
 	return 0;
 }
 
+/**
+ * tracecmd_copy_options - copy the options of a trace.dat file
+ * @handle: input handle for the trace.dat file to copy from
+ * @ohandle: output handle to add the options to
+ * @buffer_options: returns the buffer options that were added
+ *
+ * Adds the options of @handle to @ohandle, in the same order. The buffer
+ * instance options are added again with no offset, and are returned in
+ * @buffer_options (of tracecmd_buffer_instances() entries), for their CPU
+ * data to be written with tracecmd_append_buffer_cpu_data().
+ *
+ * Returns 0 on success, and -1 on error. If @handle has an option that
+ * is not known, errno is set to ENOTSUP.
+ */
+int tracecmd_copy_options(struct tracecmd_input *handle,
+			  struct tracecmd_output *ohandle,
+			  struct tracecmd_option **buffer_options)
+{
+	struct tracecmd_option *option;
+	unsigned short id;
+	unsigned int size;
+	off64_t offset;
+	int buffer = 0;
+	char *buf;
+
+	/* No options */
+	if (!handle->options_start)
+		return 0;
+
+	offset = handle->options_start;
+	for (;;) {
+		if (pread64(handle->fd, &id, 2, offset) != 2)
+			return -1;
+		id = tep_read_number(handle->pevent, &id, 2);
+		if (id == TRACECMD_OPTION_DONE)
+			break;
+
+		if (pread64(handle->fd, &size, 4, offset + 2) != 4)
+			return -1;
+		size = tep_read_number(handle->pevent, &size, 4);
+		offset += 6;
+
+		switch (id) {
+		case TRACECMD_OPTION_DATE:
+		case TRACECMD_OPTION_CPUSTAT:
+		case TRACECMD_OPTION_BUFFER:
+		case TRACECMD_OPTION_TRACECLOCK:
+		case TRACECMD_OPTION_UNAME:
+		case TRACECMD_OPTION_HOOK:
+		case TRACECMD_OPTION_OFFSET:
+		case TRACECMD_OPTION_CPUCOUNT:
+		case TRACECMD_OPTION_VERSION:
+		case TRACECMD_OPTION_PROCMAPS:
+		case TRACECMD_OPTION_TRACEID:
+		case TRACECMD_OPTION_TIME_SHIFT:
+		case TRACECMD_OPTION_GUEST:
+		case TRACECMD_OPTION_TSC2NSEC:
+		case TRACECMD_OPTION_RECORDER_STATS:
+			break;
+		default:
+			tracecmd_warning("Unknown option %d can not be copied", id);
+			errno = ENOTSUP;
+			return -1;
+		}
+
+		buf = malloc(size);
+		if (!buf)
+			return -1;
+		if (pread64(handle->fd, buf, size, offset) != (ssize_t)size) {
+			free(buf);
+			return -1;
+		}
+
+		if (id == TRACECMD_OPTION_BUFFER) {
+			/* The offset of its CPU data is written with the data */
+			if (size <= 8 || buffer >= handle->nr_buffers) {
+				free(buf);
+				return -1;
+			}
+			buf[size - 1] = 0;
+			option = tracecmd_add_buffer_option(ohandle, buf + 8, 0);
+			buffer_options[buffer++] = option;
+		} else {
+			option = tracecmd_add_option(ohandle, id, size, buf);
+		}
+		free(buf);
+		if (!option)
+			return -1;
+
+		offset += size;
+	}
+
+	return 0;
+}
+
 /**
  * tracecmd_copy_headers - Copy headers from a tracecmd_input handle to a file descriptor
  * @handle: input handle for the trace.dat file to copy from.
@@ -3888,6 +5390,18 @@ void *tracecmd_record_offset(struct tracecmd_input *handle,
 	return page->map + offset;
 }
 
+/**
+ * tracecmd_get_trace_clock - the trace clock of a trace.dat file
+ * @handle: input handle for the trace.dat file
+ *
+ * Returns the clock the events were recorded with, or NULL if the file
+ * does not use it for its timestamps.
+ */
+const char *tracecmd_get_trace_clock(struct tracecmd_input *handle)
+{
+	return handle->trace_clock;
+}
+
 int tracecmd_buffer_instances(struct tracecmd_input *handle)
 {
 	return handle->nr_buffers;
@@ -3922,6 +5436,13 @@ tracecmd_buffer_instance_handle(struct tracecmd_input *handle, int indx)
 
 	*new_handle = *handle;
 	new_handle->cpu_data = NULL;
+	new_handle->page_index_map = NULL;
+	new_handle->page_index_size = 0;
+	new_handle->merge_heap = NULL;
+	new_handle->merge_heap_nr = 0;
+	new_handle->merge_heap_valid = false;
+	new_handle->uring = NULL;
+	new_handle->compressed = false;
 	new_handle->nr_buffers = 0;
 	new_handle->buffers = NULL;
 	new_handle->ref = 1;
@@ -3935,6 +5456,7 @@ tracecmd_buffer_instance_handle(struct tracecmd_input *handle, int indx)
 	memset(&new_handle->host, 0, sizeof(new_handle->host));
 	new_handle->parent = handle;
 	new_handle->cpustats = NULL;
+	new_handle->recorder_stats = NULL;
 	new_handle->hooks = NULL;
 	if (handle->uname)
 		/* Ignore if fails to malloc, no biggy */
@@ -4119,6 +5641,7 @@ int tracecmd_enable_tsync(struct tracecmd_input *handle, bool enable)
 	    (!handle->host.ts_offsets || !handle->host.cpu_count))
 		return -1;
 
+	merge_heap_invalidate(handle);
 	handle->host.sync_enable = enable;
 
 	return 0;
@@ -50,6 +50,9 @@ static inline void dprint(const char *fmt, ...)
 
 #define MSG_MAX_DATA_LEN		(MSG_MAX_LEN - MSG_HDR_LEN)
 
+/* The data messages sent with a single writev() */
+#define MSG_DATA_BATCH			32
+
 unsigned int page_size;
 
 struct tracecmd_msg_tinit {
@@ -158,7 +161,7 @@ static int msg_write(int fd, struct tracecmd_msg *msg)
 {
 	int cmd = ntohl(msg->hdr.cmd);
 	int msg_size, data_size;
-	int ret;
+	struct iovec iov[2];
 
 	if (cmd < 0 || cmd >= MSG_NR_COMMANDS)
 		return -EINVAL;
@@ -171,14 +174,13 @@ static int msg_write(int fd, struct tracecmd_msg *msg)
 	if (data_size < 0)
 		return -EINVAL;
 
-	ret = __do_write_check(fd, msg, msg_size);
-	if (ret < 0)
-		return ret;
-
-	if (!data_size)
-		return 0;
+	/* The header and the data in one go */
+	iov[0].iov_base = msg;
+	iov[0].iov_len = msg_size;
+	iov[1].iov_base = msg->buf;
+	iov[1].iov_len = data_size;
 
-	return __do_write_check(fd, msg->buf, data_size);
+	return __do_writev_check(fd, iov, data_size ? 2 : 1);
 }
 
 enum msg_trace_flags {
@@ -360,16 +362,12 @@ static int msg_read_extra(int fd, struct tracecmd_msg *msg,
 	return 0;
 }
 
-/*
- * Read header information of msg first, then read all data
- */
-static int tracecmd_msg_recv(int fd, struct tracecmd_msg *msg)
+static int msg_read_header(int fd, struct tracecmd_msg *msg, int *n)
 {
 	u32 size = 0;
-	int n = 0;
 	int ret;
 
-	ret = msg_read(fd, msg, MSG_HDR_LEN, &n);
+	ret = msg_read(fd, msg, MSG_HDR_LEN, n);
 	if (ret < 0)
 		return ret;
 
@@ -384,8 +382,6 @@ static int tracecmd_msg_recv(int fd, struct tracecmd_msg *msg)
 	else if (size < MSG_HDR_LEN)
 		/* too small */
 		goto error;
-	else if (size > MSG_HDR_LEN)
-		return msg_read_extra(fd, msg, &n, size);
 
 	return 0;
 error:
@@ -393,6 +389,26 @@ error:
 	return -ENOMSG;
 }
 
+/*
+ * Read header information of msg first, then read all data
+ */
+static int tracecmd_msg_recv(int fd, struct tracecmd_msg *msg)
+{
+	u32 size;
+	int n = 0;
+	int ret;
+
+	ret = msg_read_header(fd, msg, &n);
+	if (ret < 0)
+		return ret;
+
+	size = ntohl(msg->hdr.size);
+	if (size > MSG_HDR_LEN)
+		return msg_read_extra(fd, msg, &n, size);
+
+	return 0;
+}
+
 #define MSG_WAIT_MSEC	5000
 static int msg_wait_to = MSG_WAIT_MSEC;
 
@@ -411,10 +427,7 @@ static void error_operation(struct tracecmd_msg *msg)
 	tracecmd_warning("Message: cmd=%d size=%d\n", ntohl(msg->hdr.cmd), ntohl(msg->hdr.size));
 }
 
-/*
- * A return value of 0 indicates time-out
- */
-static int tracecmd_msg_recv_wait(int fd, struct tracecmd_msg *msg)
+static int msg_wait(int fd)
 {
 	struct pollfd pfd;
 	int ret;
@@ -427,6 +440,20 @@ static int tracecmd_msg_recv_wait(int fd, struct tracecmd_msg *msg)
 	else if (ret == 0)
 		return -ETIMEDOUT;
 
+	return 0;
+}
+
+/*
+ * A return value of 0 indicates time-out
+ */
+static int tracecmd_msg_recv_wait(int fd, struct tracecmd_msg *msg)
+{
+	int ret;
+
+	ret = msg_wait(fd);
+	if (ret < 0)
+		return ret;
+
 	return tracecmd_msg_recv(fd, msg);
 }
 
@@ -689,14 +716,21 @@ int tracecmd_msg_send_close_resp_msg(struct tracecmd_msg_handle *msg_handle)
 	return tracecmd_msg_send(msg_handle->fd, &msg);
 }
 
+/*
+ * The data is split in MSG_SEND_DATA messages, that are sent in batches
+ * with writev(): the headers are built here, but the data is sent from
+ * @buf, without copying it.
+ */
 int tracecmd_msg_data_send(struct tracecmd_msg_handle *msg_handle,
 			   const char *buf, int size)
 {
+	struct tracecmd_msg_header hdr[MSG_DATA_BATCH];
+	struct iovec iov[MSG_DATA_BATCH * 2];
 	struct tracecmd_msg msg;
 	int fd = msg_handle->fd;
-	int n;
-	int ret;
 	int count = 0;
+	int len;
+	int nr;
 
 	/* Don't bother doing anything if there's nothing to do */
 	if (!size)
@@ -704,30 +738,28 @@ int tracecmd_msg_data_send(struct tracecmd_msg_handle *msg_handle,
 
 	tracecmd_msg_init(MSG_SEND_DATA, &msg);
 
-	msg.buf = malloc(MSG_MAX_DATA_LEN);
-	if (!msg.buf)
-		return -ENOMEM;
-
-	msg.hdr.size = htonl(MSG_MAX_LEN);
-
-	n = size;
-	while (n) {
-		if (n > MSG_MAX_DATA_LEN) {
-			memcpy(msg.buf, buf + count, MSG_MAX_DATA_LEN);
-			n -= MSG_MAX_DATA_LEN;
-			count += MSG_MAX_DATA_LEN;
-		} else {
-			msg.hdr.size = htonl(MSG_HDR_LEN + n);
-			memcpy(msg.buf, buf + count, n);
-			n = 0;
+	while (count < size) {
+		for (nr = 0; nr < MSG_DATA_BATCH && count < size; nr++) {
+			len = size - count;
+			if (len > (int)MSG_MAX_DATA_LEN)
+				len = MSG_MAX_DATA_LEN;
+
+			hdr[nr] = msg.hdr;
+			hdr[nr].size = htonl(MSG_HDR_LEN + len);
+			dprint("msg send: %d (%s) [%d]\n", MSG_SEND_DATA,
+			       cmd_to_name(MSG_SEND_DATA), MSG_HDR_LEN + len);
+
+			iov[nr * 2].iov_base = &hdr[nr];
+			iov[nr * 2].iov_len = MSG_HDR_LEN;
+			iov[nr * 2 + 1].iov_base = (char *)buf + count;
+			iov[nr * 2 + 1].iov_len = len;
+			count += len;
 		}
-		ret = msg_write(fd, &msg);
-		if (ret < 0)
-			break;
+		if (__do_writev_check(fd, iov, nr * 2) < 0)
+			return -1;
 	}
 
-	msg_free(&msg);
-	return ret;
+	return 0;
 }
 
 int tracecmd_msg_finish_sending_data(struct tracecmd_msg_handle *msg_handle)
@@ -742,24 +774,179 @@ int tracecmd_msg_finish_sending_data(struct tracecmd_msg_handle *msg_handle)
 	return 0;
 }
 
+/*
+ * The data of the MSG_SEND_DATA messages is moved from the socket to
+ * the output file through a pipe, without being copied. It is left in
+ * the pipe until it is full, to write more at a time.
+ */
+struct msg_pipe {
+	int			fd[2];
+	int			size;
+	int			len;	/* what is in the pipe */
+	bool			copy;	/* the output can not be spliced to */
+};
+
+static void msg_pipe_init(struct msg_pipe *pipe_data)
+{
+	pipe_data->len = 0;
+	pipe_data->copy = false;
+	if (pipe(pipe_data->fd) < 0) {
+		pipe_data->fd[0] = -1;
+		return;
+	}
+
+	/* Room for a batch of messages, as sent by tracecmd_msg_data_send() */
+	pipe_data->size = fcntl(pipe_data->fd[0], F_SETPIPE_SZ,
+				MSG_DATA_BATCH * MSG_MAX_LEN);
+	if (pipe_data->size < 0)
+		pipe_data->size = fcntl(pipe_data->fd[0], F_GETPIPE_SZ);
+	if (pipe_data->size < (int)MSG_MAX_DATA_LEN) {
+		close(pipe_data->fd[0]);
+		close(pipe_data->fd[1]);
+		pipe_data->fd[0] = -1;
+	}
+}
+
+static void msg_pipe_close(struct msg_pipe *pipe_data)
+{
+	if (pipe_data->fd[0] < 0)
+		return;
+	close(pipe_data->fd[0]);
+	close(pipe_data->fd[1]);
+	pipe_data->fd[0] = -1;
+}
+
+/* For an output that can not be spliced to */
+static int msg_pipe_copy(struct msg_pipe *pipe_data, int ofd)
+{
+	char buf[MSG_MAX_LEN];
+	ssize_t s;
+	int n;
+
+	while (pipe_data->len) {
+		n = 0;
+		s = pipe_data->len;
+		if (s > MSG_MAX_LEN)
+			s = MSG_MAX_LEN;
+		if (msg_read(pipe_data->fd[0], buf, s, &n) < 0 ||
+		    __do_write_check(ofd, buf, s) < 0) {
+			tracecmd_warning("writing to file");
+			return -EIO;
+		}
+		pipe_data->len -= s;
+	}
+
+	return 0;
+}
+
+static int msg_pipe_flush(struct msg_pipe *pipe_data, int ofd)
+{
+	ssize_t s;
+
+	while (pipe_data->len) {
+		if (pipe_data->copy)
+			return msg_pipe_copy(pipe_data, ofd);
+
+		s = splice(pipe_data->fd[0], NULL, ofd, NULL, pipe_data->len,
+			   SPLICE_F_MOVE);
+		if (s < 0 && errno == EINTR)
+			continue;
+		if (s < 0 && errno == EINVAL) {
+			pipe_data->copy = true;
+			continue;
+		}
+		if (s <= 0) {
+			tracecmd_warning("writing to file");
+			return s < 0 ? -errno : -EIO;
+		}
+		pipe_data->len -= s;
+	}
+
+	return 0;
+}
+
+static int msg_pipe_data(struct msg_pipe *pipe_data, int fd, int ofd, int size)
+{
+	ssize_t s;
+	int left;
+	int ret;
+
+	if (pipe_data->len + size > pipe_data->size) {
+		ret = msg_pipe_flush(pipe_data, ofd);
+		if (ret < 0)
+			return ret;
+	}
+
+	for (left = size; left; left -= s) {
+		s = splice(fd, NULL, pipe_data->fd[1], NULL, left, SPLICE_F_MOVE);
+		if (s < 0 && errno == EINTR) {
+			s = 0;
+			continue;
+		}
+		/* The socket can not be spliced from, read it instead */
+		if (s < 0 && errno == EINVAL && left == size)
+			return -EINVAL;
+		if (s <= 0) {
+			tracecmd_warning("reading client");
+			return s < 0 ? -errno : -ENOTCONN;
+		}
+		pipe_data->len += s;
+	}
+
+	return 0;
+}
+
 int tracecmd_msg_read_data(struct tracecmd_msg_handle *msg_handle, int ofd)
 {
+	struct msg_pipe pipe_data;
 	struct tracecmd_msg msg;
+	int fd = msg_handle->fd;
+	bool use_splice;
 	int t, n, cmd;
 	ssize_t s;
 	int ret;
 
+	msg_pipe_init(&pipe_data);
+	use_splice = pipe_data.fd[0] >= 0;
+
+	memset(&msg, 0, sizeof(msg));
+
 	while (!tracecmd_msg_done(msg_handle)) {
-		ret = tracecmd_msg_recv_wait(msg_handle->fd, &msg);
+		ret = msg_wait(fd);
+		n = 0;
+		if (!ret)
+			ret = msg_read_header(fd, &msg, &n);
 		if (ret < 0) {
 			if (ret == -ETIMEDOUT)
 				tracecmd_warning("Connection timed out\n");
 			else
 				tracecmd_warning("reading client");
-			return ret;
+			goto out;
 		}
 
 		cmd = ntohl(msg.hdr.cmd);
+		if (use_splice && cmd == MSG_SEND_DATA && !msg.hdr.cmd_size) {
+			ret = msg_pipe_data(&pipe_data, fd, ofd, msg_buf_len(&msg));
+			if (!ret)
+				continue;
+			if (ret != -EINVAL)
+				goto error;
+			use_splice = false;
+		}
+
+		if (ntohl(msg.hdr.size) > MSG_HDR_LEN) {
+			ret = msg_read_extra(fd, &msg, &n, ntohl(msg.hdr.size));
+			if (ret < 0) {
+				tracecmd_warning("reading client");
+				goto error;
+			}
+		}
+
+		/* What is in the pipe goes first */
+		ret = msg_pipe_flush(&pipe_data, ofd);
+		if (ret < 0)
+			goto error;
+
 		if (cmd == MSG_FIN_DATA) {
 			/* Finish receiving data */
 			break;
@@ -790,11 +977,14 @@ next:
 		msg_free(&msg);
 	}
 
-	return 0;
+	ret = msg_pipe_flush(&pipe_data, ofd);
+	goto out;
 
 error:
 	error_operation(&msg);
 	msg_free(&msg);
+out:
+	msg_pipe_close(&pipe_data);
 	return ret;
 }
 
@@ -17,6 +17,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <limits.h>
 #include <errno.h>
 #include <glob.h>
 
@@ -24,6 +25,7 @@
 #include "trace-cmd.h"
 #include "trace-cmd-local.h"
 #include "trace-write-local.h"
+#include "kbuffer.h"
 #include "list.h"
 #include "trace-msg.h"
 
@@ -60,6 +62,14 @@ struct tracecmd_output {
 	struct list_head	options;
 	struct tracecmd_msg_handle *msg_handle;
 	char			*trace_clock;
+	int			compression;	/* enum tracecmd_compress_id */
+
+	/* See tracecmd_reserve_cpu_data() */
+	struct tracecmd_extents	*extents;
+	size_t			extents_size;
+	int			reserved_cpus;
+	bool			synced;		/* readable while recording */
+	unsigned long long	generation;	/* of the headers, see LIVE_GEN_MAGIC */
 };
 
 struct list_event {
@@ -125,6 +135,32 @@ void tracecmd_set_out_clock(struct tracecmd_output *handle, char *clock)
 		handle->trace_clock = strdup(clock);
 }
 
+/**
+ * tracecmd_output_set_compression - compress the CPU data of the file
+ * @handle: the output handle
+ * @name: the compression algorithm ("zlib"), or "none"
+ *
+ * The CPU data written from now on is compressed in chunks, that the
+ * reader uncompresses on demand. Data that is sent over the network is
+ * never compressed.
+ *
+ * Returns 0 on success, or -1 if the algorithm is not supported by
+ * this build.
+ */
+int tracecmd_output_set_compression(struct tracecmd_output *handle,
+				    const char *name)
+{
+	int id;
+
+	id = tracecmd_compress_id(name);
+	if (id < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	handle->compression = id;
+	return 0;
+}
+
 /**
  * tracecmd_get_quiet - Get if to print output to the screen
  * Returns non zero, if no output to the screen should be printed
@@ -158,6 +194,8 @@ void tracecmd_output_free(struct tracecmd_output *handle)
 		free(option);
 	}
 	free(handle->trace_clock);
+	if (handle->extents)
+		munmap(handle->extents, handle->extents_size);
 	free(handle);
 }
 
@@ -1405,118 +1443,1472 @@ static char *get_clock(struct tracecmd_output *handle)
 	return handle->trace_clock;
 }
 
-int tracecmd_write_cpu_data(struct tracecmd_output *handle,
-			    int cpus, char * const *cpu_data_files)
+/* Number of page index entries to hold before writing them out */
+#define PAGE_INDEX_BATCH	512
+
+/*
+ * The ring buffer sub buffer header holds a "long" of the kernel that
+ * recorded the data, which is not necessarily the same as ours.
+ */
+static int get_kernel_long_size(struct tracecmd_output *handle)
 {
-	off64_t *offsets = NULL;
-	unsigned long long *sizes = NULL;
-	off64_t offset;
-	unsigned long long endian8;
-	char *clock = NULL;
-	off64_t check_size;
-	char *file;
+	struct tep_handle *tep;
+	int long_size = sizeof(long);
+	char *path;
+	char *buf;
+	int size;
+	int fd;
+
+	if (handle->pevent)
+		return tep_get_header_page_size(handle->pevent);
+
+	path = get_tracing_file(handle, "events/header_page");
+	if (!path)
+		return long_size;
+
+	size = get_size(path);
+	fd = open(path, O_RDONLY);
+	put_tracing_file(path);
+	if (fd < 0 || !size)
+		goto out_close;
+
+	buf = malloc(size);
+	if (!buf)
+		goto out_close;
+
+	tep = tep_alloc();
+	if (tep && read(fd, buf, size) == size) {
+		tep_parse_header_page(tep, buf, size, long_size);
+		long_size = tep_get_header_page_size(tep);
+	}
+	tep_free(tep);
+	free(buf);
+
+ out_close:
+	if (fd >= 0)
+		close(fd);
+	return long_size;
+}
+
+static struct kbuffer *alloc_index_kbuf(struct tracecmd_output *handle)
+{
+	enum kbuffer_long_size long_size;
+	enum kbuffer_endian endian;
+	struct kbuffer *kbuf;
+	int bigendian;
+
+	if (get_kernel_long_size(handle) == 8)
+		long_size = KBUFFER_LSIZE_8;
+	else
+		long_size = KBUFFER_LSIZE_4;
+
+	if (handle->pevent)
+		bigendian = tep_is_file_bigendian(handle->pevent);
+	else
+		bigendian = tracecmd_host_bigendian();
+
+	if (bigendian)
+		endian = KBUFFER_ENDIAN_BIG;
+	else
+		endian = KBUFFER_ENDIAN_LITTLE;
+
+	kbuf = kbuffer_alloc(long_size, endian);
+	if (kbuf && handle->pevent && tep_is_old_format(handle->pevent))
+		kbuffer_set_old_format(kbuf);
+
+	return kbuf;
+}
+
+static int write_index_batch(struct tracecmd_output *handle, char *buf,
+			     int size, off64_t *index_pos)
+{
+	ssize_t w;
+	int tot = 0;
+
+	while (tot < size) {
+		w = pwrite64(handle->fd, buf + tot, size - tot, *index_pos + tot);
+		if (w <= 0)
+			return -1;
+		tot += w;
+	}
+	*index_pos += size;
+
+	return 0;
+}
+
+/*
+ * Copy the data of a CPU into the output file. The kernel does it if it
+ * can (and the file system may share the blocks instead), otherwise it
+ * goes through here.
+ */
+static tsize_t copy_cpu_fd(struct tracecmd_output *handle, int fd)
+{
+	long long copied = 0;
 	struct stat st;
-	int ret;
-	int i;
 
-	/* This can be called multiple times (when recording instances) */
-	ret = handle->file_state == TRACECMD_FILE_CPU_FLYRECORD ? 0 :
-		check_out_state(handle, TRACECMD_FILE_CPU_FLYRECORD);
-	if (ret < 0) {
-		tracecmd_warning("Cannot write trace data into the file, unexpected state 0x%X",
-				 handle->file_state);
-		goto out_free;
+	if (!handle->msg_handle && fstat(fd, &st) == 0 && st.st_size) {
+		copied = copy_file_data(handle->fd, fd, 0, st.st_size);
+		if (copied == st.st_size)
+			return copied;
+		if (copied < 0)
+			copied = 0;
 	}
 
-	if (do_write_check(handle, "flyrecord", 10))
-		goto out_free;
+	if (lseek64(fd, copied, SEEK_SET) == (off64_t)-1)
+		return 0;
 
-	offsets = malloc(sizeof(*offsets) * cpus);
-	if (!offsets)
-		goto out_free;
-	sizes = malloc(sizeof(*sizes) * cpus);
-	if (!sizes)
-		goto out_free;
+	return copied + copy_file_fd(handle, fd);
+}
 
-	offset = lseek64(handle->fd, 0, SEEK_CUR);
+static tsize_t copy_cpu_file(struct tracecmd_output *handle, const char *file)
+{
+	tsize_t size;
+	int fd;
 
-	/* hold any extra data for data */
-	offset += cpus * (16);
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		tracecmd_warning("Can't read '%s'", file);
+		return 0;
+	}
+	size = copy_cpu_fd(handle, fd);
+	close(fd);
 
-	/*
-	 * Unfortunately, the trace_clock data was placed after the
-	 * cpu data, and wasn't accounted for with the offsets.
-	 * We need to save room for the trace_clock file. This means
-	 * we need to find the size of it before we define the final
-	 * offsets.
-	 */
-	clock = get_clock(handle);
-	if (!clock)
-		goto out_free;
-	/* Save room for storing the size */
-	offset += 8;
-	offset += strlen(clock);
-	/* 2 bytes for [] around the clock */
-	offset += 2;
+	return size;
+}
 
-	/* Page align offset */
-	offset = (offset + (handle->page_size - 1)) & ~(handle->page_size - 1);
+/*
+ * Write the page index entries at @index_pos for the @size bytes of CPU
+ * data that are at @offset in @fd, and at @data_offset in the output file.
+ */
+static int index_cpu_data(struct tracecmd_output *handle, struct kbuffer *kbuf,
+			  int fd, off64_t offset, tsize_t size,
+			  off64_t data_offset, off64_t index_pos)
+{
+	unsigned long long first_ts;
+	unsigned long long last_ts;
+	unsigned long long ts;
+	unsigned long long endian8;
+	unsigned int endian4;
+	unsigned int events;
+	char *index_buf = NULL;
+	char *entry;
+	int nr_entries = 0;
+	tsize_t pos;
+	stsize_t r;
+	char *page;
+	int ret = -1;
 
-	for (i = 0; i < cpus; i++) {
-		file = cpu_data_files[i];
-		ret = stat(file, &st);
-		if (ret < 0) {
-			tracecmd_warning("can not stat '%s'", file);
-			goto out_free;
+	page = malloc(handle->page_size);
+	index_buf = malloc(PAGE_INDEX_BATCH * PAGE_INDEX_ENTRY_SIZE);
+	if (!page || !index_buf)
+		goto out;
+
+	for (pos = 0; pos < size; pos += r) {
+		r = pread64(fd, page, handle->page_size, offset + pos);
+		if (r <= 0)
+			goto out;
+
+		/* A partial page at the end is padded out */
+		if (r < handle->page_size)
+			memset(page + r, 0, handle->page_size - r);
+
+		events = 0;
+		first_ts = 0;
+		last_ts = 0;
+		if (!kbuffer_load_subbuffer(kbuf, page) &&
+		    kbuffer_subbuffer_size(kbuf) <= handle->page_size) {
+			first_ts = kbuffer_timestamp(kbuf);
+			last_ts = first_ts;
+			while (kbuffer_read_event(kbuf, &ts)) {
+				last_ts = ts;
+				events++;
+				kbuffer_next_event(kbuf, NULL);
+			}
 		}
-		offsets[i] = offset;
-		sizes[i] = st.st_size;
-		offset += st.st_size;
-		offset = (offset + (handle->page_size - 1)) & ~(handle->page_size - 1);
 
+		entry = index_buf + nr_entries * PAGE_INDEX_ENTRY_SIZE;
+		endian8 = convert_endian_8(handle, data_offset + pos);
+		memcpy(entry, &endian8, 8);
+		endian8 = convert_endian_8(handle, first_ts);
+		memcpy(entry + 8, &endian8, 8);
+		endian8 = convert_endian_8(handle, last_ts);
+		memcpy(entry + 16, &endian8, 8);
+		endian4 = convert_endian_4(handle, events);
+		memcpy(entry + 24, &endian4, 4);
+
+		if (++nr_entries == PAGE_INDEX_BATCH) {
+			if (write_index_batch(handle, index_buf,
+					      nr_entries * PAGE_INDEX_ENTRY_SIZE,
+					      &index_pos))
+				goto out;
+			nr_entries = 0;
+		}
+	}
+
+	if (nr_entries &&
+	    write_index_batch(handle, index_buf,
+			      nr_entries * PAGE_INDEX_ENTRY_SIZE, &index_pos))
+		goto out;
+
+	ret = 0;
+ out:
+	free(index_buf);
+	free(page);
+
+	return ret;
+}
+
+/*
+ * Copy the data of a CPU into the output file, and write the page index
+ * entries for it at @index_pos. The pages are read back from the per CPU
+ * file, which was just written and should still be in the page cache.
+ */
+static tsize_t copy_cpu_file_indexed(struct tracecmd_output *handle,
+				     const char *file, struct kbuffer *kbuf,
+				     off64_t data_offset, off64_t index_pos)
+{
+	tsize_t size;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		tracecmd_warning("Can't read '%s'", file);
+		return 0;
+	}
+
+	size = copy_cpu_fd(handle, fd);
+	if (size && index_cpu_data(handle, kbuf, fd, 0, size,
+				   data_offset, index_pos) < 0)
+		size = 0;
+
+	close(fd);
+
+	return size;
+}
+
+/*
+ * The page index follows the CPU data:
+ *  "pageindex\0"
+ *  4 bytes: number of CPUs
+ *  4 bytes: size of an index entry
+ *  For each CPU:
+ *   8 bytes: offset of the CPU data (must match the flyrecord header)
+ *   8 bytes: number of index entries (pages) for the CPU
+ *  For each CPU, an entry for each of its pages.
+ */
+static int write_page_index_header(struct tracecmd_output *handle, int cpus,
+				   off64_t *offsets, unsigned long long *sizes)
+{
+	unsigned long long endian8;
+	unsigned int endian4;
+	int i;
+
+	if (do_write_check(handle, PAGE_INDEX_MAGIC, PAGE_INDEX_MAGIC_SIZE))
+		return -1;
+
+	endian4 = convert_endian_4(handle, cpus);
+	if (do_write_check(handle, &endian4, 4))
+		return -1;
+
+	endian4 = convert_endian_4(handle, PAGE_INDEX_ENTRY_SIZE);
+	if (do_write_check(handle, &endian4, 4))
+		return -1;
+
+	for (i = 0; i < cpus; i++) {
 		endian8 = convert_endian_8(handle, offsets[i]);
 		if (do_write_check(handle, &endian8, 8))
-			goto out_free;
-		endian8 = convert_endian_8(handle, sizes[i]);
+			return -1;
+		endian8 = convert_endian_8(handle, (sizes[i] + handle->page_size - 1) /
+					   handle->page_size);
 		if (do_write_check(handle, &endian8, 8))
-			goto out_free;
+			return -1;
 	}
 
-	if (save_clock(handle, clock))
-		goto out_free;
+	return 0;
+}
 
-	for (i = 0; i < cpus; i++) {
-		if (!tracecmd_get_quiet(handle))
-			fprintf(stderr, "CPU%d data recorded at offset=0x%llx\n",
-				i, (unsigned long long) offsets[i]);
-		offset = lseek64(handle->fd, offsets[i], SEEK_SET);
-		if (offset == (off64_t)-1) {
-			tracecmd_warning("could not seek to %lld\n", offsets[i]);
-			goto out_free;
-		}
-		check_size = copy_file(handle, cpu_data_files[i]);
-		if (check_size != sizes[i]) {
-			errno = EINVAL;
-			tracecmd_warning("did not match size of %lld to %lld",
-					 check_size, sizes[i]);
-			goto out_free;
-		}
-		if (!tracecmd_get_quiet(handle))
-			fprintf(stderr, "    %llu bytes in size\n",
-				(unsigned long long)check_size);
+/* Read up to @size bytes, short only at the end of the file */
+static ssize_t read_chunk(int fd, char *buf, size_t size)
+{
+	ssize_t tot = 0;
+	ssize_t r;
+
+	while (tot < (ssize_t)size) {
+		r = read(fd, buf + tot, size - tot);
+		if (r < 0)
+			return -1;
+		if (!r)
+			break;
+		tot += r;
 	}
+	return tot;
+}
 
-	free(offsets);
-	free(sizes);
+struct chunk_writer {
+	char		*index_buf;
+	int		nr_entries;
+	off64_t		offset;		/* where the next chunk goes */
+	off64_t		*index_pos;
+	tsize_t		*compressed;
+};
 
-	handle->file_state = TRACECMD_FILE_CPU_FLYRECORD;
+/*
+ * Append a compressed chunk to the file, and add its index entry.
+ * @page is the uncompressed data of the chunk, its first 8 bytes are
+ * the timestamp of the first page, as the kernel wrote it.
+ */
+static int write_compressed_chunk(struct tracecmd_output *handle,
+				  struct chunk_writer *cw, const char *page,
+				  const char *data, unsigned int size)
+{
+	unsigned long long endian8;
+	unsigned int endian4;
+	char *entry;
 
-	return 0;
+	if (do_write_check(handle, data, size))
+		return -1;
 
- out_free:
-	free(offsets);
-	free(sizes);
-	return -1;
+	entry = cw->index_buf + cw->nr_entries * CHUNK_INDEX_ENTRY_SIZE;
+	endian8 = convert_endian_8(handle, cw->offset);
+	memcpy(entry, &endian8, 8);
+	endian4 = convert_endian_4(handle, size);
+	memcpy(entry + 8, &endian4, 4);
+	memcpy(entry + 12, page, 8);
+
+	cw->offset += size;
+	*cw->compressed += size;
+
+	if (++cw->nr_entries < PAGE_INDEX_BATCH)
+		return 0;
+
+	cw->nr_entries = 0;
+	return write_index_batch(handle, cw->index_buf,
+				 PAGE_INDEX_BATCH * CHUNK_INDEX_ENTRY_SIZE,
+				 cw->index_pos);
+}
+
+static int compress_chunk(struct tracecmd_output *handle,
+			  struct chunk_writer *cw, const char *in,
+			  unsigned int size, char *out, unsigned int bound)
+{
+	unsigned int out_size = bound;
+
+	if (tracecmd_compress_buffer(handle->compression, in, size,
+				     out, &out_size) < 0)
+		return -1;
+
+	return write_compressed_chunk(handle, cw, in, out, out_size);
+}
+
+/*
+ * Copy a file of compressed chunks written by a recorder. The chunks
+ * are copied as they are if they use the compression and the chunk
+ * size of the file, otherwise they are uncompressed and compressed
+ * again.
+ */
+static stsize_t copy_record_chunks(struct tracecmd_output *handle,
+				   struct chunk_writer *cw, int fd, int codec,
+				   unsigned int file_chunk_size,
+				   unsigned int chunk_size, char *in, char *out,
+				   unsigned int bound)
+{
+	unsigned int header[2];
+	unsigned int zsize = 0;
+	unsigned int fill = 0;
+	unsigned int len;
+	char *zbuf = NULL;
+	char *raw = NULL;
+	char *tmp;
+	stsize_t size = 0;
+	ssize_t r;
+	size_t i;
+
+	raw = malloc(file_chunk_size);
+	if (!raw)
+		return -1;
+
+	for (;;) {
+		r = read_chunk(fd, (char *)header, RECORD_CHUNK_HEADER_SIZE);
+		if (!r)
+			break;
+		if (r != RECORD_CHUNK_HEADER_SIZE || header[0] > file_chunk_size)
+			goto fail;
+
+		if (header[1] > zsize) {
+			tmp = realloc(zbuf, header[1]);
+			if (!tmp)
+				goto fail;
+			zbuf = tmp;
+			zsize = header[1];
+		}
+		if (read_chunk(fd, zbuf, header[1]) != header[1])
+			goto fail;
+
+		size += header[0];
+
+		/* Even a chunk copied as it is, for the timestamp of its index entry */
+		if (tracecmd_uncompress_buffer(codec, zbuf, header[1],
+					       raw, header[0]) < 0)
+			goto fail;
+
+		if (codec == handle->compression && header[0] == chunk_size &&
+		    !fill) {
+			if (write_compressed_chunk(handle, cw, raw, zbuf, header[1]))
+				goto fail;
+			continue;
+		}
+
+		for (i = 0; i < header[0]; i += len) {
+			len = chunk_size - fill;
+			if (len > header[0] - i)
+				len = header[0] - i;
+			memcpy(in + fill, raw + i, len);
+			fill += len;
+			if (fill < chunk_size)
+				continue;
+			if (compress_chunk(handle, cw, in, fill, out, bound))
+				goto fail;
+			fill = 0;
+		}
+	}
+
+	if (fill && compress_chunk(handle, cw, in, fill, out, bound))
+		goto fail;
+
+	free(zbuf);
+	free(raw);
+	return size;
+
+ fail:
+	free(zbuf);
+	free(raw);
+	return -1;
+}
+
+/*
+ * Compress the data of a CPU in chunks, appending them to the file,
+ * and write the index entries of the chunks at @index_pos.
+ */
+static tsize_t copy_cpu_file_chunks(struct tracecmd_output *handle,
+				    const char *file, unsigned int chunk_size,
+				    off64_t *index_pos, tsize_t *compressed)
+{
+	struct chunk_writer cw = {
+		.index_pos	= index_pos,
+		.compressed	= compressed,
+	};
+	unsigned int file_chunk_size;
+	unsigned int bound;
+	char *out = NULL;
+	char *in;
+	tsize_t size = 0;
+	stsize_t copied;
+	ssize_t r;
+	int codec;
+	int ret;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		tracecmd_warning("Can't read '%s'", file);
+		return 0;
+	}
+
+	bound = tracecmd_compress_bound(handle->compression, chunk_size);
+	in = malloc(chunk_size);
+	out = malloc(bound);
+	cw.index_buf = malloc(PAGE_INDEX_BATCH * CHUNK_INDEX_ENTRY_SIZE);
+	if (!in || !out || !cw.index_buf)
+		goto out;
+
+	cw.offset = lseek64(handle->fd, 0, SEEK_CUR);
+
+	ret = read_record_chunks_header(fd, &codec, &file_chunk_size, NULL);
+	if (ret < 0)
+		goto out;
+
+	if (ret) {
+		if (!tracecmd_compress_supported(codec)) {
+			tracecmd_warning("'%s' uses unsupported compression %s",
+					 file, tracecmd_compress_name(codec));
+			goto out;
+		}
+		copied = copy_record_chunks(handle, &cw, fd, codec, file_chunk_size,
+					    chunk_size, in, out, bound);
+		if (copied < 0) {
+			tracecmd_warning("Failed to copy the chunks of '%s'", file);
+			goto out;
+		}
+		size = copied;
+	} else {
+		for (;;) {
+			r = read_chunk(fd, in, chunk_size);
+			if (r <= 0)
+				break;
+
+			if (compress_chunk(handle, &cw, in, r, out, bound)) {
+				tracecmd_warning("Failed to compress '%s'", file);
+				size = 0;
+				goto out;
+			}
+			size += r;
+
+			if (r < chunk_size)
+				break;
+		}
+	}
+
+	if (cw.nr_entries &&
+	    write_index_batch(handle, cw.index_buf,
+			      cw.nr_entries * CHUNK_INDEX_ENTRY_SIZE, index_pos))
+		size = 0;
+
+ out:
+	free(cw.index_buf);
+	free(out);
+	free(in);
+	close(fd);
+
+	return size;
+}
+
+/*
+ * The size of the data in a per CPU file, before compression if it
+ * was written by a recorder that compresses it.
+ */
+static int cpu_file_size(const char *file, unsigned long long *size)
+{
+	unsigned int header[2];
+	unsigned int chunk_size;
+	struct stat st;
+	int codec;
+	int ret;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	ret = read_record_chunks_header(fd, &codec, &chunk_size, NULL);
+	if (ret <= 0) {
+		if (!ret)
+			ret = fstat(fd, &st);
+		if (!ret)
+			*size = st.st_size;
+		goto out;
+	}
+
+	ret = 0;
+	*size = 0;
+	while (read_chunk(fd, (char *)header, RECORD_CHUNK_HEADER_SIZE) ==
+	       RECORD_CHUNK_HEADER_SIZE) {
+		*size += header[0];
+		if (lseek64(fd, header[1], SEEK_CUR) == (off64_t)-1) {
+			ret = -1;
+			break;
+		}
+	}
+ out:
+	close(fd);
+	return ret;
+}
+
+/* Returns the compression of a file written by a recorder, or -1 */
+static int cpu_file_compression(const char *file)
+{
+	unsigned int chunk_size;
+	int codec;
+	int ret;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	ret = read_record_chunks_header(fd, &codec, &chunk_size, NULL);
+	close(fd);
+
+	return ret == 1 ? codec : -1;
+}
+
+/*
+ * Same as the "flyrecord" section, but the data of each CPU is
+ * compressed in chunks. The offsets in the CPU headers are where the
+ * data would be if it were not compressed, which keeps the record
+ * offsets the same as with uncompressed files. The chunk index maps
+ * them to the compressed data:
+ *
+ *  "flychunks\0"
+ *  For each CPU:
+ *   8 bytes: offset of the (uncompressed) CPU data
+ *   8 bytes: size of the (uncompressed) CPU data
+ *  4 bytes: the compression algorithm
+ *  4 bytes: the size of a chunk, before compression
+ *  For each CPU, an entry for each of its chunks (see copy_cpu_file_chunks)
+ *  The trace clock, as in "flyrecord"
+ *  The compressed chunks
+ */
+static int write_cpu_data_chunks(struct tracecmd_output *handle,
+				 int cpus, char * const *cpu_data_files)
+{
+	unsigned long long *sizes = NULL;
+	unsigned long long nr_chunks = 0;
+	unsigned long long endian8;
+	unsigned int chunk_size;
+	unsigned int endian4;
+	tsize_t compressed;
+	tsize_t check_size;
+	off64_t index_pos;
+	off64_t offset;
+	char *clock;
+	int i;
+
+	if (do_write_check(handle, FLYCHUNKS_MAGIC, 10))
+		return -1;
+
+	sizes = malloc(sizeof(*sizes) * cpus);
+	if (!sizes)
+		return -1;
+
+	clock = get_clock(handle);
+	if (!clock)
+		goto out_free;
+
+	chunk_size = CHUNK_PAGES * handle->page_size;
+
+	offset = lseek64(handle->fd, 0, SEEK_CUR);
+	offset = (offset + (handle->page_size - 1)) & ~(handle->page_size - 1);
+
+	for (i = 0; i < cpus; i++) {
+		if (cpu_file_size(cpu_data_files[i], &sizes[i]) < 0) {
+			tracecmd_warning("can not stat '%s'", cpu_data_files[i]);
+			goto out_free;
+		}
+		nr_chunks += (sizes[i] + chunk_size - 1) / chunk_size;
+
+		endian8 = convert_endian_8(handle, offset);
+		if (do_write_check(handle, &endian8, 8))
+			goto out_free;
+		endian8 = convert_endian_8(handle, sizes[i]);
+		if (do_write_check(handle, &endian8, 8))
+			goto out_free;
+
+		offset += sizes[i];
+		offset = (offset + (handle->page_size - 1)) & ~(handle->page_size - 1);
+	}
+
+	endian4 = convert_endian_4(handle, handle->compression);
+	if (do_write_check(handle, &endian4, 4))
+		goto out_free;
+	endian4 = convert_endian_4(handle, chunk_size);
+	if (do_write_check(handle, &endian4, 4))
+		goto out_free;
+
+	/* The index is filled in as the chunks are written */
+	index_pos = lseek64(handle->fd, 0, SEEK_CUR);
+	if (lseek64(handle->fd, nr_chunks * CHUNK_INDEX_ENTRY_SIZE,
+		    SEEK_CUR) == (off64_t)-1)
+		goto out_free;
+
+	if (save_clock(handle, clock))
+		goto out_free;
+
+	for (i = 0; i < cpus; i++) {
+		compressed = 0;
+		check_size = copy_cpu_file_chunks(handle, cpu_data_files[i],
+						  chunk_size, &index_pos,
+						  &compressed);
+		if (check_size != sizes[i]) {
+			errno = EINVAL;
+			tracecmd_warning("did not match size of %lld to %lld",
+					 check_size, sizes[i]);
+			goto out_free;
+		}
+		if (!tracecmd_get_quiet(handle))
+			fprintf(stderr, "CPU%d data: %llu bytes, %s compressed to %llu bytes\n",
+				i, (unsigned long long)check_size,
+				tracecmd_compress_name(handle->compression),
+				(unsigned long long)compressed);
+	}
+
+	free(sizes);
+
+	handle->file_state = TRACECMD_FILE_CPU_FLYRECORD;
+
+	return 0;
+
+ out_free:
+	free(sizes);
+	return -1;
+}
+
+int tracecmd_write_cpu_data(struct tracecmd_output *handle,
+			    int cpus, char * const *cpu_data_files)
+{
+	off64_t *offsets = NULL;
+	unsigned long long *sizes = NULL;
+	struct kbuffer *kbuf = NULL;
+	off64_t index_offset;
+	off64_t index_pos;
+	off64_t offset;
+	unsigned long long endian8;
+	char *clock = NULL;
+	off64_t check_size;
+	char *file;
+	struct stat st;
+	int ret;
+	int i;
+
+	/* This can be called multiple times (when recording instances) */
+	ret = handle->file_state == TRACECMD_FILE_CPU_FLYRECORD ? 0 :
+		check_out_state(handle, TRACECMD_FILE_CPU_FLYRECORD);
+	if (ret < 0) {
+		tracecmd_warning("Cannot write trace data into the file, unexpected state 0x%X",
+				 handle->file_state);
+		goto out_free;
+	}
+
+	/*
+	 * Keep the compression of the recorders, to copy their chunks
+	 * without compressing them again.
+	 */
+	if (handle->compression == TRACECMD_COMPRESS_NONE && !handle->msg_handle) {
+		for (i = 0; i < cpus; i++) {
+			ret = cpu_file_compression(cpu_data_files[i]);
+			if (ret > TRACECMD_COMPRESS_NONE) {
+				handle->compression = ret;
+				break;
+			}
+		}
+	}
+
+	if (handle->compression != TRACECMD_COMPRESS_NONE && !handle->msg_handle)
+		return write_cpu_data_chunks(handle, cpus, cpu_data_files);
+
+	if (do_write_check(handle, "flyrecord", 10))
+		goto out_free;
+
+	offsets = malloc(sizeof(*offsets) * cpus);
+	if (!offsets)
+		goto out_free;
+	sizes = malloc(sizeof(*sizes) * cpus);
+	if (!sizes)
+		goto out_free;
+
+	offset = lseek64(handle->fd, 0, SEEK_CUR);
+
+	/* hold any extra data for data */
+	offset += cpus * (16);
+
+	/*
+	 * Unfortunately, the trace_clock data was placed after the
+	 * cpu data, and wasn't accounted for with the offsets.
+	 * We need to save room for the trace_clock file. This means
+	 * we need to find the size of it before we define the final
+	 * offsets.
+	 */
+	clock = get_clock(handle);
+	if (!clock)
+		goto out_free;
+	/* Save room for storing the size */
+	offset += 8;
+	offset += strlen(clock);
+	/* 2 bytes for [] around the clock */
+	offset += 2;
+
+	/* Page align offset */
+	offset = (offset + (handle->page_size - 1)) & ~(handle->page_size - 1);
+
+	for (i = 0; i < cpus; i++) {
+		file = cpu_data_files[i];
+		ret = stat(file, &st);
+		if (ret < 0) {
+			tracecmd_warning("can not stat '%s'", file);
+			goto out_free;
+		}
+		offsets[i] = offset;
+		sizes[i] = st.st_size;
+		offset += st.st_size;
+		offset = (offset + (handle->page_size - 1)) & ~(handle->page_size - 1);
+
+		endian8 = convert_endian_8(handle, offsets[i]);
+		if (do_write_check(handle, &endian8, 8))
+			goto out_free;
+		endian8 = convert_endian_8(handle, sizes[i]);
+		if (do_write_check(handle, &endian8, 8))
+			goto out_free;
+	}
+
+	if (save_clock(handle, clock))
+		goto out_free;
+
+	/* The page index goes right after the data of the last CPU */
+	index_offset = offset;
+	index_pos = index_offset + PAGE_INDEX_MAGIC_SIZE + 8 + cpus * 16;
+
+	/* The index is written with pwrite, it can not be sent over the network */
+	if (!handle->msg_handle)
+		kbuf = alloc_index_kbuf(handle);
+
+	for (i = 0; i < cpus; i++) {
+		if (!tracecmd_get_quiet(handle))
+			fprintf(stderr, "CPU%d data recorded at offset=0x%llx\n",
+				i, (unsigned long long) offsets[i]);
+		offset = lseek64(handle->fd, offsets[i], SEEK_SET);
+		if (offset == (off64_t)-1) {
+			tracecmd_warning("could not seek to %lld\n", offsets[i]);
+			goto out_free;
+		}
+		if (kbuf) {
+			check_size = copy_cpu_file_indexed(handle, cpu_data_files[i],
+							   kbuf, offsets[i], index_pos);
+			index_pos += ((sizes[i] + handle->page_size - 1) /
+				      handle->page_size) * PAGE_INDEX_ENTRY_SIZE;
+		} else
+			check_size = copy_cpu_file(handle, cpu_data_files[i]);
+		if ((unsigned long long)check_size != sizes[i]) {
+			errno = EINVAL;
+			tracecmd_warning("did not match size of %lld to %lld",
+					 check_size, sizes[i]);
+			goto out_free;
+		}
+		if (!tracecmd_get_quiet(handle))
+			fprintf(stderr, "    %llu bytes in size\n",
+				(unsigned long long)check_size);
+	}
+
+	if (kbuf) {
+		offset = lseek64(handle->fd, index_offset, SEEK_SET);
+		if (offset == (off64_t)-1) {
+			tracecmd_warning("could not seek to %lld\n", index_offset);
+			goto out_free;
+		}
+		if (write_page_index_header(handle, cpus, offsets, sizes))
+			goto out_free;
+		/* Leave the file pointer after the index, for following buffers */
+		if (lseek64(handle->fd, index_pos, SEEK_SET) == (off64_t)-1)
+			goto out_free;
+	}
+
+	kbuffer_free(kbuf);
+	free(offsets);
+	free(sizes);
+
+	handle->file_state = TRACECMD_FILE_CPU_FLYRECORD;
+
+	return 0;
+
+ out_free:
+	kbuffer_free(kbuf);
+	free(offsets);
+	free(sizes);
+	return -1;
+}
+
+/**
+ * tracecmd_reserve_cpu_data - make room in the file for the CPU data
+ * @handle: the output handle, with the headers written (up to printk)
+ * @cpus: the number of CPUs
+ * @size: the size of the extents of the CPU data (rounded down to pages)
+ * @header_room: the room to leave for what is still to be written before
+ *   the CPU data (the command lines, the options and the CPU headers)
+ * @offsets: filled with where the data of each CPU goes in the file
+ *
+ * To have the recorders write straight into the trace.dat file instead
+ * of temp files, that would then have to be copied. Each CPU starts with
+ * an extent of @size bytes at @offsets, and more extents are taken after
+ * the ones of the CPUs as the recorders fill them (see
+ * tracecmd_recorder_set_limit() and tracecmd_recorder_set_extents()).
+ * The extents are allocated, if the file system can do it, so that the
+ * recorders do not run out of space. Once the recorders are done, call
+ * tracecmd_append_reserved_cpu_data() in place of tracecmd_append_cpu_data().
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int tracecmd_reserve_cpu_data(struct tracecmd_output *handle, int cpus,
+			      unsigned long long size,
+			      unsigned long long header_room,
+			      unsigned long long *offsets)
+{
+	unsigned long long page_mask = handle->page_size - 1;
+	struct tracecmd_extents *extents;
+	unsigned long long max;
+	size_t map_size;
+	off64_t offset;
+	int i;
+
+	size &= ~page_mask;
+	if (handle->msg_handle || handle->reserved_cpus || !size || cpus <= 0 ||
+	    size > UINT_MAX || handle->compression != TRACECMD_COMPRESS_NONE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	offset = lseek64(handle->fd, 0, SEEK_CUR);
+	if (offset == (off64_t)-1)
+		return -1;
+
+	offset = (offset + header_room + page_mask) & ~page_mask;
+
+	/* Leave half of the header room for the chunk index */
+	max = header_room / 2 / CHUNK_INDEX_ENTRY_SIZE;
+	if (max > UINT_MAX)
+		max = UINT_MAX;
+	if (max < (unsigned long long)cpus)
+		max = cpus;
+
+	map_size = sizeof(*extents) + max * sizeof(extents->extent[0]);
+	extents = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (extents == MAP_FAILED)
+		return -1;
+
+	/* Not all file systems can do it, the data is then written as usual */
+	if (fallocate(handle->fd, FALLOC_FL_KEEP_SIZE, offset, size * cpus) < 0 &&
+	    errno != EOPNOTSUPP && errno != ENOSYS) {
+		munmap(extents, map_size);
+		return -1;
+	}
+
+	extents->start = offset;
+	extents->size = size;
+	extents->fd = handle->fd;
+	extents->max = max;
+	extents->next = cpus;
+
+	for (i = 0; i < cpus; i++) {
+		extents->extent[i].owner = i + 1;
+		offsets[i] = offset + i * size;
+	}
+
+	handle->extents = extents;
+	handle->extents_size = map_size;
+	handle->reserved_cpus = cpus;
+
+	return 0;
+}
+
+/**
+ * tracecmd_get_cpu_extents - get the extents of the reserved CPU data
+ * @handle: the output handle (see tracecmd_reserve_cpu_data())
+ *
+ * Returns the extents to give to the recorders (with
+ * tracecmd_recorder_set_extents()), or NULL if no room was reserved.
+ */
+struct tracecmd_extents *tracecmd_get_cpu_extents(struct tracecmd_output *handle)
+{
+	return handle->extents;
+}
+
+/*
+ * Take a free extent for @cpu. Returns its number, or -1 if there is
+ * no room left. Called by the recorders.
+ */
+int tracecmd_extents_next(struct tracecmd_extents *extents, int cpu)
+{
+	unsigned long long offset;
+	unsigned int e;
+
+	e = __atomic_fetch_add(&extents->next, 1, __ATOMIC_RELAXED);
+	if (e >= extents->max) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	offset = extents->start + e * extents->size;
+	if (fallocate(extents->fd, FALLOC_FL_KEEP_SIZE, offset, extents->size) < 0 &&
+	    errno != EOPNOTSUPP && errno != ENOSYS)
+		return -1;
+
+	__atomic_store_n(&extents->extent[e].owner, cpu + 1, __ATOMIC_RELEASE);
+
+	return e;
+}
+
+/*
+ * Sort the extents that are in use by CPU, keeping the order in which
+ * each CPU took them. The extents of CPU i are then
+ * list[first[i]] .. list[first[i + 1] - 1].
+ */
+static int sort_extents(struct tracecmd_extents *extents, int cpus,
+			unsigned int **plist, unsigned int **pfirst)
+{
+	unsigned int *first;
+	unsigned int *list;
+	unsigned int *pos;
+	unsigned int nr;
+	unsigned int e;
+	int owner;
+	int i;
+
+	nr = __atomic_load_n(&extents->next, __ATOMIC_ACQUIRE);
+	if (nr > extents->max)
+		nr = extents->max;
+
+	first = calloc(cpus + 1, sizeof(*first));
+	pos = calloc(cpus, sizeof(*pos));
+	list = malloc(sizeof(*list) * nr);
+	if (!first || !pos || !list)
+		goto fail;
+
+	for (e = 0; e < nr; e++) {
+		owner = __atomic_load_n(&extents->extent[e].owner, __ATOMIC_ACQUIRE);
+		if (owner > 0 && owner <= cpus)
+			first[owner]++;
+	}
+	for (i = 0; i < cpus; i++) {
+		first[i + 1] += first[i];
+		pos[i] = first[i];
+	}
+	for (e = 0; e < nr; e++) {
+		owner = extents->extent[e].owner;
+		if (owner > 0 && owner <= cpus)
+			list[pos[owner - 1]++] = e;
+	}
+
+	free(pos);
+	*plist = list;
+	*pfirst = first;
+	return 0;
+
+ fail:
+	free(first);
+	free(pos);
+	free(list);
+	return -1;
+}
+
+/*
+ * Write the CPU headers of data that is in more than one extent per CPU.
+ * It is written as a "flychunks" section (see write_cpu_data_chunks())
+ * with chunks that are not compressed, one per extent. Each CPU gets
+ * the room for all the extents in the offsets of its records, so that
+ * they do not change as the data grows (see tracecmd_refresh()).
+ */
+static int write_extent_chunks(struct tracecmd_output *handle, int cpus,
+			       unsigned long long *sizes, unsigned int *list,
+			       unsigned int *first, char *clock)
+{
+	struct tracecmd_extents *extents = handle->extents;
+	unsigned long long endian8;
+	unsigned long long offset;
+	unsigned long long left;
+	unsigned long long size;
+	unsigned int endian4;
+	unsigned int e;
+	char ts[8];
+	int i;
+
+	if (do_write_check(handle, FLYCHUNKS_MAGIC, 10))
+		return -1;
+
+	for (i = 0; i < cpus; i++) {
+		if (sizes[i] > (first[i + 1] - first[i]) * extents->size) {
+			tracecmd_warning("CPU %d: %llu bytes do not fit in its extents",
+					 i, sizes[i]);
+			errno = EINVAL;
+			return -1;
+		}
+		endian8 = convert_endian_8(handle, extents->start +
+					   i * extents->max * extents->size);
+		if (do_write_check(handle, &endian8, 8))
+			return -1;
+		endian8 = convert_endian_8(handle, sizes[i]);
+		if (do_write_check(handle, &endian8, 8))
+			return -1;
+	}
+
+	endian4 = convert_endian_4(handle, TRACECMD_COMPRESS_NONE);
+	if (do_write_check(handle, &endian4, 4))
+		return -1;
+	endian4 = convert_endian_4(handle, extents->size);
+	if (do_write_check(handle, &endian4, 4))
+		return -1;
+
+	for (i = 0; i < cpus; i++) {
+		left = sizes[i];
+		for (e = first[i]; left && e < first[i + 1]; e++) {
+			size = left < extents->size ? left : extents->size;
+			left -= size;
+
+			offset = extents->start + list[e] * extents->size;
+			endian8 = convert_endian_8(handle, offset);
+			if (do_write_check(handle, &endian8, 8))
+				return -1;
+			endian4 = convert_endian_4(handle, size);
+			if (do_write_check(handle, &endian4, 4))
+				return -1;
+
+			/* The timestamp of the first page, as the kernel wrote it */
+			if (pread64(extents->fd, ts, 8, offset) != 8)
+				memset(ts, 0, 8);
+			if (do_write_check(handle, ts, 8))
+				return -1;
+		}
+	}
+
+	return save_clock(handle, clock);
+}
+
+/* Give back to the file system the room in the extents that was not used */
+static void release_extents(struct tracecmd_output *handle, int cpus,
+			    unsigned long long *sizes, unsigned int *list,
+			    unsigned int *first)
+{
+	struct tracecmd_extents *extents = handle->extents;
+	unsigned long long page_mask = handle->page_size - 1;
+	unsigned long long left;
+	unsigned long long size;
+	unsigned int e;
+	off64_t offset;
+	int i;
+
+	for (i = 0; i < cpus; i++) {
+		if (!tracecmd_get_quiet(handle))
+			fprintf(stderr, "CPU%d data recorded in %u extents of %llu bytes\n"
+				"    %llu bytes in size\n", i, first[i + 1] - first[i],
+				extents->size, sizes[i]);
+
+		left = sizes[i];
+		for (e = first[i]; e < first[i + 1]; e++) {
+			size = left < extents->size ? left : extents->size;
+			left -= size;
+			size = (size + page_mask) & ~page_mask;
+			if (size == extents->size)
+				continue;
+			offset = extents->start + list[e] * extents->size;
+			fallocate(extents->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				  offset + size, extents->size - size);
+		}
+	}
+}
+
+/*
+ * Write the CPU count, the options and the CPU headers of the data in
+ * the extents. The command lines must have been written.
+ */
+static int write_extents(struct tracecmd_output *handle, int cpus,
+			 unsigned long long *sizes, bool release)
+{
+	unsigned int *first;
+	unsigned int *list;
+	char *clock;
+	int ret = -1;
+
+	if (tracecmd_write_cpus(handle, cpus) < 0 ||
+	    tracecmd_write_options(handle) < 0)
+		return -1;
+
+	if (check_out_state(handle, TRACECMD_FILE_CPU_FLYRECORD) < 0) {
+		tracecmd_warning("Cannot write trace data into the file, unexpected state 0x%X",
+				 handle->file_state);
+		return -1;
+	}
+
+	clock = get_clock(handle);
+	if (!clock)
+		return -1;
+
+	if (sort_extents(handle->extents, cpus, &list, &first) < 0)
+		return -1;
+
+	if (write_extent_chunks(handle, cpus, sizes, list, first, clock) < 0)
+		goto out;
+
+	if ((unsigned long long)lseek64(handle->fd, 0, SEEK_CUR) >
+	    handle->extents->start - LIVE_GEN_SIZE) {
+		tracecmd_warning("The headers do not fit before the CPU data");
+		errno = ENOSPC;
+		goto out;
+	}
+
+	if (release)
+		release_extents(handle, cpus, sizes, list, first);
+
+	handle->file_state = TRACECMD_FILE_CPU_FLYRECORD;
+	ret = 0;
+ out:
+	free(first);
+	free(list);
+	return ret;
+}
+
+/*
+ * Write the next generation count of the headers, before the CPU data.
+ * Readers retry reading the headers if it is odd, or changed while they
+ * read them (see tracecmd_refresh()).
+ */
+static int write_generation(struct tracecmd_output *handle)
+{
+	char buf[LIVE_GEN_SIZE] = LIVE_GEN_MAGIC;
+	unsigned long long endian8;
+
+	handle->generation++;
+	endian8 = convert_endian_8(handle, handle->generation);
+	memcpy(buf + 8, &endian8, 8);
+
+	if (pwrite64(handle->fd, buf, LIVE_GEN_SIZE,
+		     handle->extents->start - LIVE_GEN_SIZE) != LIVE_GEN_SIZE)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Write the command lines, the CPU count, the options and the CPU
+ * headers of the data in the extents again, for a file that may be read
+ * while it is written. They are written aside, to then be copied in
+ * one go with the generation count odd during the copy. Unless @final,
+ * the output is left as it was, so that this can be done again.
+ */
+static int rewrite_headers(struct tracecmd_output *handle,
+			   unsigned long long *sizes, bool final)
+{
+	struct tracecmd_extents *extents = handle->extents;
+	unsigned long file_state;
+	char *buf = NULL;
+	FILE *tmp;
+	off64_t start;
+	off64_t size;
+	int ret = -1;
+	int fd;
+
+	start = lseek64(handle->fd, 0, SEEK_CUR);
+	if (start == (off64_t)-1)
+		return -1;
+
+	tmp = tmpfile();
+	if (!tmp)
+		return -1;
+
+	fd = handle->fd;
+	file_state = handle->file_state;
+	handle->fd = fileno(tmp);
+
+	if (tracecmd_write_cmdlines(handle) == 0)
+		ret = write_extents(handle, handle->reserved_cpus, sizes, final);
+	size = lseek64(handle->fd, 0, SEEK_CUR);
+
+	handle->fd = fd;
+	if (!final || ret < 0)
+		handle->file_state = file_state;
+
+	if (ret < 0)
+		goto out;
+	ret = -1;
+
+	if ((unsigned long long)(start + size) > extents->start - LIVE_GEN_SIZE) {
+		errno = ENOSPC;
+		goto out;
+	}
+
+	buf = malloc(size);
+	if (!buf)
+		goto out;
+	if (pread64(fileno(tmp), buf, size, 0) != size)
+		goto out;
+
+	if (write_generation(handle) < 0 ||
+	    pwrite64(handle->fd, buf, size, start) != size ||
+	    write_generation(handle) < 0)
+		goto out;
+
+	if (final && lseek64(handle->fd, start + size, SEEK_SET) == (off64_t)-1)
+		goto out;
+
+	ret = 0;
+ out:
+	fclose(tmp);
+	free(buf);
+	return ret;
+}
+
+/**
+ * tracecmd_sync_reserved_cpu_data - make the file readable while recording
+ * @handle: the output handle (see tracecmd_reserve_cpu_data())
+ *
+ * Writes the command lines, the CPU count, the options (as added so far)
+ * and the CPU headers of the data that the recorders wrote up to now, in
+ * the room left before the CPU data. A generation count before the CPU
+ * data is odd while they are written, so that a reader can tell when it
+ * read a mix of the old headers and the new ones. The file can then be
+ * read while recording, and a reader picks up the data written after
+ * that with tracecmd_refresh(), once this is called again.
+ *
+ * Once this is called, tracecmd_append_reserved_cpu_data() keeps the data
+ * in a chunk index, for the offsets of the records not to change.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int tracecmd_sync_reserved_cpu_data(struct tracecmd_output *handle)
+{
+	struct tracecmd_extents *extents = handle->extents;
+	unsigned long long *sizes;
+	unsigned int nr;
+	unsigned int e;
+	int owner;
+	int ret;
+
+	if (!extents) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Only full extents are left behind, the sum is the data of the CPU */
+	sizes = calloc(handle->reserved_cpus, sizeof(*sizes));
+	if (!sizes)
+		return -1;
+	nr = __atomic_load_n(&extents->next, __ATOMIC_ACQUIRE);
+	if (nr > extents->max)
+		nr = extents->max;
+	for (e = 0; e < nr; e++) {
+		owner = __atomic_load_n(&extents->extent[e].owner, __ATOMIC_ACQUIRE);
+		if (owner > 0 && owner <= handle->reserved_cpus)
+			sizes[owner - 1] += __atomic_load_n(&extents->extent[e].used,
+							    __ATOMIC_ACQUIRE);
+	}
+
+	ret = rewrite_headers(handle, sizes, false);
+	if (!ret)
+		handle->synced = true;
+
+	free(sizes);
+	return ret;
+}
+
+/**
+ * tracecmd_append_reserved_cpu_data - finish a file with reserved CPU data
+ * @handle: the output handle (see tracecmd_reserve_cpu_data())
+ * @cpus: the number of CPUs
+ * @sizes: the size of the data written for each CPU
+ *
+ * Writes the command lines, the CPU count, the options and the CPU headers
+ * pointing at the data that the recorders wrote in the room reserved for
+ * it. If each CPU fit in its first extent, the data is a "flyrecord"
+ * section with a page index, otherwise the extents of each CPU are listed
+ * in a chunk index. The room that was not used is given back to the file
+ * system.
+ *
+ * Returns 0 on success and -1 on error, with errno ENOSPC if the command
+ * lines and options did not fit in the header room.
+ */
+int tracecmd_append_reserved_cpu_data(struct tracecmd_output *handle, int cpus,
+				      unsigned long long *sizes)
+{
+	unsigned long long page_mask = handle->page_size - 1;
+	struct tracecmd_extents *extents = handle->extents;
+	unsigned long long endian8;
+	unsigned long long used;
+	struct kbuffer *kbuf = NULL;
+	off64_t *offsets = NULL;
+	off64_t index_offset;
+	off64_t index_pos;
+	off64_t end;
+	char *clock;
+	int ret = -1;
+	int i;
+
+	if (!extents || cpus != handle->reserved_cpus) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* A reader may be following the file, keep the offsets the same */
+	if (handle->synced)
+		return rewrite_headers(handle, sizes, true);
+
+	if (tracecmd_write_cmdlines(handle) < 0)
+		return -1;
+
+	if (__atomic_load_n(&extents->next, __ATOMIC_ACQUIRE) > (unsigned int)cpus)
+		return write_extents(handle, cpus, sizes, true);
+
+	if (tracecmd_write_cpus(handle, cpus) < 0 ||
+	    tracecmd_write_options(handle) < 0)
+		return -1;
+
+	if (check_out_state(handle, TRACECMD_FILE_CPU_FLYRECORD) < 0) {
+		tracecmd_warning("Cannot write trace data into the file, unexpected state 0x%X",
+				 handle->file_state);
+		return -1;
+	}
+
+	clock = get_clock(handle);
+	if (!clock)
+		return -1;
+
+	offsets = malloc(sizeof(*offsets) * cpus);
+	if (!offsets)
+		return -1;
+
+	if (do_write_check(handle, "flyrecord", 10))
+		goto out;
+
+	index_offset = 0;
+	for (i = 0; i < cpus; i++) {
+		if (sizes[i] > extents->size) {
+			errno = EINVAL;
+			goto out;
+		}
+		offsets[i] = extents->start + i * extents->size;
+		end = (offsets[i] + sizes[i] + page_mask) & ~page_mask;
+		if (end > index_offset)
+			index_offset = end;
+
+		endian8 = convert_endian_8(handle, offsets[i]);
+		if (do_write_check(handle, &endian8, 8))
+			goto out;
+		endian8 = convert_endian_8(handle, sizes[i]);
+		if (do_write_check(handle, &endian8, 8))
+			goto out;
+	}
+
+	if (save_clock(handle, clock))
+		goto out;
+
+	if (lseek64(handle->fd, 0, SEEK_CUR) > (off64_t)extents->start) {
+		tracecmd_warning("The headers do not fit before the CPU data");
+		errno = ENOSPC;
+		goto out;
+	}
+
+	for (i = 0; i < cpus; i++) {
+		if (!tracecmd_get_quiet(handle))
+			fprintf(stderr, "CPU%d data recorded at offset=0x%llx\n"
+				"    %llu bytes in size\n", i,
+				(unsigned long long)offsets[i], sizes[i]);
+
+		/* Give back what was not used */
+		used = (sizes[i] + page_mask) & ~page_mask;
+		if (used < extents->size)
+			fallocate(handle->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				  offsets[i] + used, extents->size - used);
+	}
+
+	/* The page index is read back from the data in the file */
+	kbuf = alloc_index_kbuf(handle);
+	if (kbuf) {
+		if (lseek64(handle->fd, index_offset, SEEK_SET) == (off64_t)-1 ||
+		    write_page_index_header(handle, cpus, offsets, sizes))
+			goto out;
+		index_pos = lseek64(handle->fd, 0, SEEK_CUR);
+		for (i = 0; i < cpus; i++) {
+			if (index_cpu_data(handle, kbuf, handle->fd, offsets[i],
+					   sizes[i], offsets[i], index_pos) < 0)
+				goto out;
+			index_pos += ((sizes[i] + page_mask) / handle->page_size) *
+				PAGE_INDEX_ENTRY_SIZE;
+		}
+		if (lseek64(handle->fd, index_pos, SEEK_SET) == (off64_t)-1)
+			goto out;
+	}
+
+	handle->file_state = TRACECMD_FILE_CPU_FLYRECORD;
+	ret = 0;
+ out:
+	kbuffer_free(kbuf);
+	free(offsets);
+	return ret;
 }
 
 int tracecmd_append_cpu_data(struct tracecmd_output *handle,
@@ -6,11 +6,15 @@
 #define _LARGEFILE64_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <time.h>
 #include <poll.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
 
 #include "tracefs.h"
 #include "trace-cmd-private.h"
@@ -33,28 +37,50 @@
 
 struct tracecmd_recorder {
 	int		fd;
-	int		fd1;
-	int		fd2;
+	int		*segments;	/* the files of the ring, or NULL */
+	int		nr_segments;
+	int		segment;	/* the one being written */
+	int		used;		/* the segments holding data */
 	int		trace_fd;
 	int		brass[2];
+	int		stop_fd;	/* eventfd, to wake up the recorder to stop */
 	int		pipe_size;
 	int		page_size;
 	int		cpu;
 	int		stop;
-	int		max;
+	int		max;		/* pages per segment */
 	int		pages;
+	unsigned long long	limit;	/* most bytes to write, 0 if no limit */
+	struct tracecmd_extents	*extents;	/* to go past the limit */
+	int			extent;		/* the one being written */
 	int		count;
 	unsigned	fd_flags;
 	unsigned	trace_fd_flags;
 	unsigned	flags;
+
+	/* Compression of the data, see tracecmd_recorder_set_compression() */
+	int			compression;	/* -1 if not compressing */
+	char			*chunk;
+	char			*zbuf;
+	unsigned int		chunk_size;
+	unsigned int		chunk_len;
+	unsigned int		zbuf_size;
+	unsigned long long	bytes_in;
+	unsigned long long	bytes_out;
+	unsigned long long	compress_ns;
+	unsigned long long	record_ns;
+
+	struct tracecmd_recorder_stats	stats;
 };
 
-static int append_file(int size, int dst, int src)
+static int write_chunk(struct tracecmd_recorder *recorder);
+
+static int append_file(int size, int dst, int src, off64_t offset)
 {
 	char buf[size];
 	int r;
 
-	lseek64(src, 0, SEEK_SET);
+	lseek64(src, offset, SEEK_SET);
 
 	/* If there's an error, then we are pretty much screwed :-p */
 	do {
@@ -68,32 +94,87 @@ static int append_file(int size, int dst, int src)
 	return 0;
 }
 
+/* Append the content of the segment @src to the segment @dst */
+static int append_segment(struct tracecmd_recorder *recorder, int dst, int src)
+{
+	struct stat st;
+	long long ret;
+
+	if (fstat(src, &st) < 0)
+		return -1;
+
+	lseek64(dst, 0, SEEK_END);
+
+	ret = copy_file_data(dst, src, 0, st.st_size);
+	if (ret == st.st_size)
+		return 0;
+
+	/* The kernel could not do it (all of it), copy the rest */
+	if (ret < 0)
+		ret = 0;
+	return append_file(recorder->page_size, dst, src, ret);
+}
+
+/*
+ * Put the data of the ring in order into the first segment, which is
+ * the file the recorder was created with. The segments are not copied
+ * by user space, and if the ring did not wrap, the first segment does
+ * not move at all.
+ */
+static int join_segments(struct tracecmd_recorder *recorder)
+{
+	int nr = recorder->nr_segments;
+	int *segs = recorder->segments;
+	int first = 0;
+	int i;
+
+	if (recorder->used == nr)
+		first = (recorder->segment + 1) % nr;
+
+	if (!first) {
+		for (i = 1; i < recorder->used; i++) {
+			if (append_segment(recorder, segs[0], segs[i]) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	/*
+	 * The first segment holds data from the middle of the ring.
+	 * Move it behind the last segment, which comes right before it.
+	 */
+	if (append_segment(recorder, segs[nr - 1], segs[0]) < 0)
+		return -1;
+
+	lseek64(segs[0], 0, SEEK_SET);
+	ftruncate(segs[0], 0);
+
+	for (i = first; i < nr; i++) {
+		if (append_segment(recorder, segs[0], segs[i]) < 0)
+			return -1;
+	}
+	for (i = 1; i < first; i++) {
+		if (append_segment(recorder, segs[0], segs[i]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
 void tracecmd_free_recorder(struct tracecmd_recorder *recorder)
 {
+	int i;
+
 	if (!recorder)
 		return;
 
-	if (recorder->max) {
-		/* Need to put everything into fd1 */
-		if (recorder->fd == recorder->fd1) {
-			int ret;
-			/*
-			 * Crap, the older data is in fd2, and we need
-			 * to append fd1 onto it, and then copy over to fd1
-			 */
-			ret = append_file(recorder->page_size,
-					  recorder->fd2, recorder->fd1);
-			/* Error on copying, then just keep fd1 */
-			if (ret) {
-				lseek64(recorder->fd1, 0, SEEK_END);
-				goto close;
-			}
-			lseek64(recorder->fd1, 0, SEEK_SET);
-			ftruncate(recorder->fd1, 0);
-		}
-		append_file(recorder->page_size, recorder->fd1, recorder->fd2);
-	}
- close:
+	if (recorder->chunk_len)
+		write_chunk(recorder);
+
+	/* On error, what is in the first segment is all that is left */
+	if (recorder->segments && join_segments(recorder) < 0)
+		tracecmd_warning("Failed to put the recorded segments together");
+
 	if (recorder->brass[0] >= 0)
 		close(recorder->brass[0]);
 
@@ -103,18 +184,41 @@ void tracecmd_free_recorder(struct tracecmd_recorder *recorder)
 	if (recorder->trace_fd >= 0)
 		close(recorder->trace_fd);
 
-	if (recorder->fd1 >= 0)
-		close(recorder->fd1);
+	if (recorder->stop_fd >= 0)
+		close(recorder->stop_fd);
 
-	if (recorder->fd2 >= 0)
-		close(recorder->fd2);
+	if (recorder->segments) {
+		for (i = 0; i < recorder->nr_segments; i++) {
+			if (recorder->segments[i] >= 0)
+				close(recorder->segments[i]);
+		}
+		free(recorder->segments);
+	} else if (recorder->fd >= 0)
+		close(recorder->fd);
 
+	free(recorder->chunk);
+	free(recorder->zbuf);
 	free(recorder);
 }
 
+/*
+ * Recorders that poll the trace fd (or have it polled for them) must
+ * never block in read() or splice().
+ */
+static void set_trace_fd_nonblock(struct tracecmd_recorder *recorder)
+{
+	long flags;
+
+	if (!(recorder->flags & (TRACECMD_RECORD_POLL | TRACECMD_RECORD_WAKEUP)))
+		return;
+
+	flags = fcntl(recorder->trace_fd, F_GETFL);
+	fcntl(recorder->trace_fd, F_SETFL, flags | O_NONBLOCK);
+	recorder->trace_fd_flags |= SPLICE_F_NONBLOCK;
+}
+
 struct tracecmd_recorder *
-tracecmd_create_buffer_recorder_fd2(int fd, int fd2, int cpu, unsigned flags,
-				    const char *buffer, int maxkb)
+tracecmd_create_buffer_recorder_fd(int fd, int cpu, unsigned flags, const char *buffer)
 {
 	struct tracecmd_recorder *recorder;
 	char *path = NULL;
@@ -139,28 +243,31 @@ tracecmd_create_buffer_recorder_fd2(int fd, int fd2, int cpu, unsigned flags,
 	recorder->trace_fd = -1;
 	recorder->brass[0] = -1;
 	recorder->brass[1] = -1;
+	recorder->stop_fd = -1;
+	recorder->stop = 0;
 
 	recorder->page_size = getpagesize();
-	if (maxkb) {
-		int kb_per_page = recorder->page_size >> 10;
-
-		if (!kb_per_page)
-			kb_per_page = 1;
-		recorder->max = maxkb / kb_per_page;
-		/* keep max half */
-		recorder->max >>= 1;
-		if (!recorder->max)
-			recorder->max = 1;
-	} else
-		recorder->max = 0;
+	recorder->max = 0;
+	recorder->limit = 0;
+	recorder->extents = NULL;
+	recorder->segments = NULL;
+	recorder->nr_segments = 0;
 
 	recorder->count = 0;
 	recorder->pages = 0;
 
+	recorder->compression = -1;
+	recorder->chunk = NULL;
+	recorder->zbuf = NULL;
+	recorder->chunk_len = 0;
+	recorder->bytes_in = 0;
+	recorder->bytes_out = 0;
+	recorder->compress_ns = 0;
+	recorder->record_ns = 0;
+	memset(&recorder->stats, 0, sizeof(recorder->stats));
+
 	/* fd always points to what to write to */
 	recorder->fd = fd;
-	recorder->fd1 = fd;
-	recorder->fd2 = fd2;
 
 	if (buffer) {
 		if (flags & TRACECMD_RECORD_SNAPSHOT)
@@ -177,6 +284,14 @@ tracecmd_create_buffer_recorder_fd2(int fd, int fd2, int cpu, unsigned flags,
 
 		if (recorder->trace_fd < 0)
 			goto out_free;
+
+		set_trace_fd_nonblock(recorder);
+	}
+
+	if (flags & TRACECMD_RECORD_WAKEUP) {
+		recorder->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (recorder->stop_fd < 0)
+			goto out_free;
 	}
 
 	if (!(recorder->flags & (TRACECMD_RECORD_NOSPLICE |
@@ -201,16 +316,12 @@ tracecmd_create_buffer_recorder_fd2(int fd, int fd2, int cpu, unsigned flags,
 	return recorder;
 
  out_free:
+	/* The caller still owns fd */
+	recorder->fd = -1;
 	tracecmd_free_recorder(recorder);
 	return NULL;
 }
 
-struct tracecmd_recorder *
-tracecmd_create_buffer_recorder_fd(int fd, int cpu, unsigned flags, const char *buffer)
-{
-	return tracecmd_create_buffer_recorder_fd2(fd, -1, cpu, flags, buffer, 0);
-}
-
 static struct tracecmd_recorder *
 __tracecmd_create_buffer_recorder(const char *file, int cpu, unsigned flags,
 				  const char *buffer)
@@ -231,49 +342,104 @@ __tracecmd_create_buffer_recorder(const char *file, int cpu, unsigned flags,
 	return recorder;
 }
 
+/**
+ * tracecmd_create_buffer_recorder_ring - create a recorder that keeps the latest data
+ * @file: output filename where tracing data will be written
+ * @cpu: which CPU is being traced
+ * @flags: flags configuring the recorder (see TRACECMD_RECORDER_* enums)
+ * @buffer: the tracing instance directory
+ * @segments: the number of segments of the ring (at least 2)
+ * @segment_kb: the size of a segment
+ *
+ * The data is written into a ring of @segments files of @segment_kb
+ * each. When the last one is full, the recorder goes back to the first
+ * one and drops what it held, so that only the latest data is kept.
+ * Nothing is copied when going to the next segment. When the recorder
+ * is freed, the segments are put together in order into @file.
+ *
+ * If @segments is zero, this is the same as tracecmd_create_buffer_recorder().
+ */
 struct tracecmd_recorder *
-tracecmd_create_buffer_recorder_maxkb(const char *file, int cpu, unsigned flags,
-				      const char *buffer, int maxkb)
+tracecmd_create_buffer_recorder_ring(const char *file, int cpu, unsigned flags,
+				     const char *buffer, int segments,
+				     int segment_kb)
 {
-	struct tracecmd_recorder *recorder = NULL;
-	char *file2;
-	int len;
+	struct tracecmd_recorder *recorder;
+	int kb_per_page;
+	char *seg_file;
+	int *fds;
 	int fd;
-	int fd2;
+	int i;
 
-	if (!maxkb)
+	if (!segments)
 		return tracecmd_create_buffer_recorder(file, cpu, flags, buffer);
 
-	len = strlen(file);
-	file2 = malloc(len + 3);
-	if (!file2)
+	if (segments < 2 || segment_kb <= 0) {
+		errno = EINVAL;
 		return NULL;
+	}
 
-	sprintf(file2, "%s.1", file);
+	fds = malloc(sizeof(*fds) * segments);
+	if (!fds)
+		return NULL;
+	for (i = 0; i < segments; i++)
+		fds[i] = -1;
 
+	/* The first segment is the file itself, where the data ends up */
 	fd = open(file, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
 	if (fd < 0)
-		goto out;
-
-	fd2 = open(file2, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
-	if (fd2 < 0)
-		goto err;
+		goto fail;
+	fds[0] = fd;
+
+	for (i = 1; i < segments; i++) {
+		if (asprintf(&seg_file, "%s.%d", file, i) < 0)
+			goto fail;
+		fds[i] = open(seg_file, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+		/* Only the file descriptor is needed */
+		unlink(seg_file);
+		free(seg_file);
+		if (fds[i] < 0)
+			goto fail;
+	}
 
-	recorder = tracecmd_create_buffer_recorder_fd2(fd, fd2, cpu, flags, buffer, maxkb);
+	recorder = tracecmd_create_buffer_recorder_fd(fd, cpu, flags, buffer);
 	if (!recorder)
-		goto err2;
- out:
-	/* Unlink file2, we need to add everything to file at the end */
-	unlink(file2);
-	free(file2);
+		goto fail;
+
+	kb_per_page = recorder->page_size >> 10;
+	if (!kb_per_page)
+		kb_per_page = 1;
+	recorder->max = segment_kb / kb_per_page;
+	if (!recorder->max)
+		recorder->max = 1;
+
+	recorder->segments = fds;
+	recorder->nr_segments = segments;
+	recorder->segment = 0;
+	recorder->used = 1;
 
 	return recorder;
- err2:
-	close(fd2);
- err:
-	close(fd);
+
+ fail:
+	for (i = 0; i < segments; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+	free(fds);
 	unlink(file);
-	goto out;
+	return NULL;
+}
+
+struct tracecmd_recorder *
+tracecmd_create_buffer_recorder_maxkb(const char *file, int cpu, unsigned flags,
+				      const char *buffer, int maxkb)
+{
+	if (!maxkb)
+		return tracecmd_create_buffer_recorder(file, cpu, flags, buffer);
+
+	/* keep max half */
+	return tracecmd_create_buffer_recorder_ring(file, cpu, flags, buffer,
+						    2, maxkb / 2);
 }
 
 struct tracecmd_recorder *
@@ -298,8 +464,10 @@ tracecmd_create_recorder_virt(const char *file, int cpu, unsigned flags,
 	struct tracecmd_recorder *recorder;
 
 	recorder = __tracecmd_create_buffer_recorder(file, cpu, flags, NULL);
-	if (recorder)
+	if (recorder) {
 		recorder->trace_fd = trace_fd;
+		set_trace_fd_nonblock(recorder);
+	}
 
 	return recorder;
 }
@@ -344,32 +512,436 @@ tracecmd_create_recorder_maxkb(const char *file, int cpu, unsigned flags, int ma
 	return tracecmd_create_buffer_recorder_maxkb(file, cpu, flags, tracing, maxkb);
 }
 
+struct tracecmd_recorder *
+tracecmd_create_recorder_ring(const char *file, int cpu, unsigned flags,
+			      int segments, int segment_kb)
+{
+	const char *tracing;
+
+	tracing = tracefs_tracing_dir();
+	if (!tracing) {
+		errno = ENODEV;
+		return NULL;
+	}
+
+	return tracecmd_create_buffer_recorder_ring(file, cpu, flags, tracing,
+						    segments, segment_kb);
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+	ssize_t w;
+
+	while (size) {
+		w = write(fd, buf, size);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += w;
+		size -= w;
+	}
+	return 0;
+}
+
+static unsigned long long ts_delta_ns(struct timespec *start,
+				      struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000ULL +
+		end->tv_nsec - start->tv_nsec;
+}
+
+static void hist_add(unsigned long long *hist, unsigned long long ns)
+{
+	unsigned long long usecs = ns / 1000;
+	int i = 0;
+
+	while (usecs && i < TRACECMD_RECORDER_HIST_SIZE - 1) {
+		usecs >>= 1;
+		i++;
+	}
+	hist[i]++;
+}
+
+/* Account a read of the ring buffer that started at @start */
+static void stat_read(struct tracecmd_recorder *recorder,
+		      struct timespec *start, long size)
+{
+	struct timespec end;
+	unsigned long long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = ts_delta_ns(start, &end);
+	recorder->stats.bytes += size;
+	recorder->stats.reads++;
+	recorder->stats.read_ns += ns;
+	hist_add(recorder->stats.read_hist, ns);
+}
+
+/* Account a write of the data that started at @start */
+static void stat_write(struct tracecmd_recorder *recorder,
+		       struct timespec *start)
+{
+	struct timespec end;
+	unsigned long long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = ts_delta_ns(start, &end);
+	recorder->stats.writes++;
+	recorder->stats.write_ns += ns;
+	hist_add(recorder->stats.write_hist, ns);
+}
+
+static void stat_sleep(struct tracecmd_recorder *recorder,
+		       struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	recorder->stats.sleep_ns += ts_delta_ns(start, &end);
+}
+
+static void stat_poll(struct tracecmd_recorder *recorder, long read)
+{
+	recorder->stats.polls++;
+	if (!read)
+		recorder->stats.empty_polls++;
+}
+
+/**
+ * tracecmd_recorder_set_compression - compress the data as it is recorded
+ * @recorder: the recorder, before it started recording
+ * @name: the compression algorithm ("zlib")
+ *
+ * Instead of splicing the raw pages to the file, the recorder reads
+ * them and writes them in compressed chunks, which
+ * tracecmd_write_cpu_data() copies as is into the trace.dat file when
+ * it uses the same algorithm. This trades CPU time of the recorder for
+ * less disk bandwidth.
+ *
+ * Only works for recorders writing to a file, and not with a maximum
+ * size (maxkb or ring).
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int tracecmd_recorder_set_compression(struct tracecmd_recorder *recorder,
+				      const char *name)
+{
+	char header[RECORD_CHUNKS_HEADER_SIZE];
+	unsigned int val;
+	int id;
+
+	id = tracecmd_compress_id(name);
+	if (id <= TRACECMD_COMPRESS_NONE || recorder->max ||
+	    recorder->compression >= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* The chunks need to be at the start of a regular file */
+	if (lseek64(recorder->fd, 0, SEEK_CUR) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	recorder->chunk_size = CHUNK_PAGES * recorder->page_size;
+	recorder->zbuf_size = tracecmd_compress_bound(id, recorder->chunk_size);
+	recorder->chunk = malloc(recorder->chunk_size);
+	recorder->zbuf = malloc(recorder->zbuf_size);
+	if (!recorder->chunk || !recorder->zbuf)
+		goto fail;
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, RECORD_CHUNKS_MAGIC, RECORD_CHUNKS_MAGIC_SIZE);
+	val = id;
+	memcpy(header + RECORD_CHUNKS_MAGIC_SIZE, &val, 4);
+	val = recorder->chunk_size;
+	memcpy(header + RECORD_CHUNKS_MAGIC_SIZE + 4, &val, 4);
+	if (write_all(recorder->fd, header, sizeof(header)) < 0)
+		goto fail;
+
+	recorder->compression = id;
+	return 0;
+
+ fail:
+	free(recorder->chunk);
+	free(recorder->zbuf);
+	recorder->chunk = NULL;
+	recorder->zbuf = NULL;
+	return -1;
+}
+
+/**
+ * tracecmd_recorder_set_limit - limit the size of the recorded data
+ * @recorder: the recorder
+ * @size: the most bytes to write (rounded down to pages)
+ *
+ * For a recorder that writes into a given region of a file. Once @size
+ * bytes were written, the rest of the data is read and dropped (and
+ * counted as dropped in the statistics), unless the recorder can take
+ * more room (see tracecmd_recorder_set_extents()).
+ *
+ * Does not work with compression or a ring of segments.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int tracecmd_recorder_set_limit(struct tracecmd_recorder *recorder,
+				unsigned long long size)
+{
+	size &= ~((unsigned long long)recorder->page_size - 1);
+
+	if (!size || recorder->max || recorder->compression >= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	recorder->limit = size;
+
+	return 0;
+}
+
+/**
+ * tracecmd_recorder_set_extents - let the recorder grow past its limit
+ * @recorder: the recorder, with a limit (see tracecmd_recorder_set_limit())
+ * @extents: the extents of the output file (see tracecmd_get_cpu_extents())
+ *
+ * The limit must be the size of the extents, and the recorder must start
+ * at the beginning of the extent of its CPU. Each time the recorder fills
+ * an extent, it takes a new one and goes on writing there. The data is
+ * only dropped when there are no extents left. How much of its extent is
+ * used is kept up to date, for tracecmd_sync_reserved_cpu_data().
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int tracecmd_recorder_set_extents(struct tracecmd_recorder *recorder,
+				  struct tracecmd_extents *extents)
+{
+	if (!extents || recorder->limit != extents->size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	recorder->extents = extents;
+	recorder->extent = recorder->cpu;
+
+	return 0;
+}
+
+/* The current extent is full, go on writing in a new one */
+static int next_extent(struct tracecmd_recorder *recorder)
+{
+	struct tracecmd_extents *extents = recorder->extents;
+	int e;
+
+	e = tracecmd_extents_next(extents, recorder->cpu);
+	if (e < 0 || lseek64(recorder->fd, extents->start + e * extents->size,
+			     SEEK_SET) == (off64_t)-1) {
+		tracecmd_warning("CPU %d: no room left in the output file",
+				 recorder->cpu);
+		recorder->extents = NULL;
+		return -1;
+	}
+
+	recorder->extent = e;
+	recorder->limit += extents->size;
+
+	return 0;
+}
+
+/* The room left for the data, in what can be read at once */
+static long room_left(struct tracecmd_recorder *recorder, long size)
+{
+	unsigned long long left;
+
+	if (!recorder->limit)
+		return size;
+
+	left = recorder->limit - recorder->stats.written;
+	if (!left && recorder->extents && next_extent(recorder) == 0)
+		left = recorder->limit - recorder->stats.written;
+
+	return left < (unsigned long long)size ? (long)left : size;
+}
+
+/* Compress the pending data of the recorder and write it as a chunk */
+static int write_chunk(struct tracecmd_recorder *recorder)
+{
+	unsigned int header[2];
+	struct timespec start;
+	struct timespec end;
+	unsigned int size;
+	int ret;
+
+	size = recorder->zbuf_size;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = tracecmd_compress_buffer(recorder->compression, recorder->chunk,
+				       recorder->chunk_len, recorder->zbuf, &size);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (ret < 0) {
+		tracecmd_warning("recorder failed to compress data");
+		return -1;
+	}
+	recorder->compress_ns += ts_delta_ns(&start, &end);
+
+	header[0] = recorder->chunk_len;
+	header[1] = size;
+	if (write_all(recorder->fd, header, RECORD_CHUNK_HEADER_SIZE) < 0 ||
+	    write_all(recorder->fd, recorder->zbuf, size) < 0) {
+		tracecmd_warning("recorder error writing compressed data");
+		return -1;
+	}
+
+	recorder->bytes_in += recorder->chunk_len;
+	recorder->bytes_out += RECORD_CHUNK_HEADER_SIZE + size;
+	recorder->chunk_len = 0;
+
+	return 0;
+}
+
+/* Add data to the pending chunk, writing it out when it is full */
+static long compress_data(struct tracecmd_recorder *recorder,
+			  const char *buf, long size)
+{
+	long left = size;
+	long len;
+
+	recorder->stats.written += size;
+
+	while (left) {
+		len = recorder->chunk_size - recorder->chunk_len;
+		if (len > left)
+			len = left;
+		memcpy(recorder->chunk + recorder->chunk_len, buf, len);
+		recorder->chunk_len += len;
+		buf += len;
+		left -= len;
+
+		if (recorder->chunk_len == recorder->chunk_size &&
+		    write_chunk(recorder) < 0)
+			return -1;
+	}
+
+	return size;
+}
+
+/* Write the totals into the header of the file */
+static void write_compress_stats(struct tracecmd_recorder *recorder)
+{
+	unsigned long long stats[4];
+
+	stats[0] = recorder->bytes_in;
+	stats[1] = recorder->bytes_out;
+	stats[2] = recorder->compress_ns;
+	stats[3] = recorder->record_ns;
+
+	if (pwrite64(recorder->fd, stats, sizeof(stats),
+		     RECORD_CHUNKS_STATS_OFFSET) != sizeof(stats))
+		tracecmd_warning("recorder failed to write compression stats");
+}
+
+/*
+ * Returns 1 and fills in @codec, @chunk_size and @stats (if not NULL)
+ * if @fd is a file of compressed chunks, leaving the file offset at its
+ * first chunk. Returns 0, with the offset at the start of the file, if
+ * it holds raw data, and -1 on error.
+ */
+int read_record_chunks_header(int fd, int *codec, unsigned int *chunk_size,
+			      struct tracecmd_recorder_compress_stats *stats)
+{
+	char header[RECORD_CHUNKS_HEADER_SIZE];
+	unsigned long long val[4];
+	unsigned int id;
+	ssize_t r;
+
+	if (lseek64(fd, 0, SEEK_SET) == (off64_t)-1)
+		return -1;
+
+	r = read(fd, header, sizeof(header));
+	if (r < 0)
+		return -1;
+
+	if (r < (ssize_t)sizeof(header) ||
+	    memcmp(header, RECORD_CHUNKS_MAGIC, RECORD_CHUNKS_MAGIC_SIZE) != 0) {
+		if (lseek64(fd, 0, SEEK_SET) == (off64_t)-1)
+			return -1;
+		return 0;
+	}
+
+	memcpy(&id, header + RECORD_CHUNKS_MAGIC_SIZE, 4);
+	*codec = id;
+	memcpy(chunk_size, header + RECORD_CHUNKS_MAGIC_SIZE + 4, 4);
+
+	if (stats) {
+		memcpy(val, header + RECORD_CHUNKS_STATS_OFFSET, sizeof(val));
+		stats->compression = tracecmd_compress_name(*codec);
+		stats->bytes_in = val[0];
+		stats->bytes_out = val[1];
+		stats->compress_ns = val[2];
+		stats->record_ns = val[3];
+	}
+
+	return 1;
+}
+
+/**
+ * tracecmd_recorder_compress_stats - get the compression stats of a recording
+ * @file: a file written by a recorder
+ * @stats: filled in with the stats of the recording
+ *
+ * Returns 0 on success, or -1 if @file can not be read or the recorder
+ * that wrote it did not compress the data.
+ */
+int tracecmd_recorder_compress_stats(const char *file,
+				     struct tracecmd_recorder_compress_stats *stats)
+{
+	unsigned int chunk_size;
+	int codec;
+	int ret;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	ret = read_record_chunks_header(fd, &codec, &chunk_size, stats);
+	close(fd);
+
+	return ret == 1 ? 0 : -1;
+}
+
 static inline void update_fd(struct tracecmd_recorder *recorder, int size)
 {
 	int fd;
 
+	recorder->stats.written += size;
+
+	/* The data is in the file, it can be read from there */
+	if (recorder->extents)
+		__atomic_store_n(&recorder->extents->extent[recorder->extent].used,
+				 recorder->extents->size -
+				 (recorder->limit - recorder->stats.written),
+				 __ATOMIC_RELEASE);
+
 	if (!recorder->max)
 		return;
 
+	/* A splice may write many pages at once */
 	recorder->count += size;
-
-	if (recorder->count >= recorder->page_size) {
-		recorder->count = 0;
-		recorder->pages++;
-	}
+	recorder->pages += recorder->count / recorder->page_size;
+	recorder->count %= recorder->page_size;
 
 	if (recorder->pages < recorder->max)
 		return;
 
 	recorder->pages = 0;
 
-	fd = recorder->fd;
+	/* Go to the next segment of the ring, dropping its old data */
+	recorder->segment = (recorder->segment + 1) % recorder->nr_segments;
+	if (recorder->used < recorder->nr_segments)
+		recorder->used++;
 
-	/* Swap fd to next file. */
-	if (fd == recorder->fd1)
-		fd = recorder->fd2;
-	else
-		fd = recorder->fd1;
+	fd = recorder->segments[recorder->segment];
 
 	/* Zero out the new file we are writing to */
 	lseek64(fd, 0, SEEK_SET);
@@ -378,18 +950,49 @@ static inline void update_fd(struct tracecmd_recorder *recorder, int size)
 	recorder->fd = fd;
 }
 
+/*
+ * The limit of the data to write was reached, read the data anyway to
+ * not leave it in the ring buffer. Returns -1 on error, or the bytes
+ * dropped.
+ */
+static long drop_data(struct tracecmd_recorder *recorder)
+{
+	char buf[recorder->page_size];
+	long r;
+
+	r = read(recorder->trace_fd, buf, recorder->page_size);
+	if (r < 0) {
+		if (errno == EAGAIN || errno == EINTR || errno == ENOTCONN)
+			return 0;
+
+		tracecmd_warning("recorder error in read input");
+		return -1;
+	}
+
+	recorder->stats.dropped += r;
+
+	return r;
+}
+
 /*
  * Returns -1 on error.
  *          or bytes of data read.
  */
 static long splice_data(struct tracecmd_recorder *recorder)
 {
+	struct timespec start;
 	long total_read = 0;
+	int backlog;
 	long read;
 	long ret;
 
+	read = room_left(recorder, recorder->pipe_size);
+	if (!read)
+		return drop_data(recorder);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	read = splice(recorder->trace_fd, NULL, recorder->brass[1], NULL,
-		      recorder->pipe_size, recorder->trace_fd_flags);
+		      read, recorder->trace_fd_flags);
 	if (read < 0) {
 		if (errno == EAGAIN || errno == EINTR || errno == ENOTCONN)
 			return 0;
@@ -399,9 +1002,18 @@ static long splice_data(struct tracecmd_recorder *recorder)
 	} else if (read == 0)
 		return 0;
 
+	stat_read(recorder, &start, read);
+
+	/* What the output side did not keep up with is still in the pipe */
+	if (ioctl(recorder->brass[0], FIONREAD, &backlog) == 0 &&
+	    (unsigned long long)backlog > recorder->stats.max_backlog)
+		recorder->stats.max_backlog = backlog;
+
  again:
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	ret = splice(recorder->brass[0], NULL, recorder->fd, NULL,
 		     read, recorder->fd_flags);
+	stat_write(recorder, &start);
 	if (ret < 0) {
 		if (errno != EAGAIN && errno != EINTR) {
 			tracecmd_warning("recorder error in splice output");
@@ -428,6 +1040,8 @@ static long direct_splice_data(struct tracecmd_recorder *recorder)
 		.fd = recorder->trace_fd,
 		.events = POLLIN,
 	};
+	int timeout = POLL_TIMEOUT_MS;
+	struct timespec start;
 	long read;
 	int ret;
 
@@ -438,16 +1052,27 @@ static long direct_splice_data(struct tracecmd_recorder *recorder)
 	 * here. This poll() is not necessary on newer kernels.
 	 *
 	 * [1] https://github.com/torvalds/linux/commit/ee5e001196d1345b8fee25925ff5f1d67936081e
+	 *
+	 * There is no need to wait when stopping, or when the recorder
+	 * already waited for the data.
 	 */
-	ret = poll(&pfd, 1, POLL_TIMEOUT_MS);
+	if (recorder->stop ||
+	    recorder->flags & (TRACECMD_RECORD_POLL | TRACECMD_RECORD_WAKEUP))
+		timeout = 0;
+	ret = poll(&pfd, 1, timeout);
 	if (ret < 0)
 		return -1;
 
-	if (!(pfd.revents | POLLIN))
+	if (!(pfd.revents & POLLIN))
 		return 0;
 
+	read = room_left(recorder, recorder->pipe_size);
+	if (!read)
+		return drop_data(recorder);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	read = splice(recorder->trace_fd, NULL, recorder->fd, NULL,
-		      recorder->pipe_size, recorder->fd_flags);
+		      read, recorder->fd_flags);
 	if (read < 0) {
 		if (errno == EAGAIN || errno == EINTR || errno == ENOTCONN)
 			return 0;
@@ -456,6 +1081,12 @@ static long direct_splice_data(struct tracecmd_recorder *recorder)
 		return -1;
 	}
 
+	/* The data goes straight to the file, there is no write to time */
+	if (read) {
+		stat_read(recorder, &start, read);
+		update_fd(recorder, read);
+	}
+
 	return read;
 }
 
@@ -466,9 +1097,14 @@ static long direct_splice_data(struct tracecmd_recorder *recorder)
 static long read_data(struct tracecmd_recorder *recorder)
 {
 	char buf[recorder->page_size];
+	struct timespec start;
 	long left;
 	long r, w;
 
+	if (!room_left(recorder, recorder->page_size))
+		return drop_data(recorder);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	r = read(recorder->trace_fd, buf, recorder->page_size);
 	if (r < 0) {
 		if (errno == EAGAIN || errno == EINTR || errno == ENOTCONN)
@@ -477,6 +1113,17 @@ static long read_data(struct tracecmd_recorder *recorder)
 		tracecmd_warning("recorder error in read input");
 		return -1;
 	}
+	if (!r)
+		return 0;
+
+	stat_read(recorder, &start, r);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (recorder->compression >= 0) {
+		r = compress_data(recorder, buf, r);
+		stat_write(recorder, &start);
+		return r;
+	}
 
 	left = r;
 	do {
@@ -487,6 +1134,8 @@ static long read_data(struct tracecmd_recorder *recorder)
 		}
 	} while (w >= 0 && left);
 
+	stat_write(recorder, &start);
+
 	if (w < 0)
 		r = w;
 
@@ -495,7 +1144,9 @@ static long read_data(struct tracecmd_recorder *recorder)
 
 static long move_data(struct tracecmd_recorder *recorder)
 {
-	if (recorder->flags & TRACECMD_RECORD_NOSPLICE)
+	/* The data has to go through the recorder to be compressed */
+	if (recorder->flags & TRACECMD_RECORD_NOSPLICE ||
+	    recorder->compression >= 0)
 		return read_data(recorder);
 
 	if (recorder->flags & TRACECMD_RECORD_NOBRASS)
@@ -504,6 +1155,113 @@ static long move_data(struct tracecmd_recorder *recorder)
 	return splice_data(recorder);
 }
 
+/**
+ * tracecmd_recorder_get_trace_fd - get the file descriptor the data is read from
+ * @recorder: the recorder
+ *
+ * For a recorder created with TRACECMD_RECORD_POLL, this is the file
+ * descriptor to poll for tracecmd_recorder_read_data().
+ */
+int tracecmd_recorder_get_trace_fd(struct tracecmd_recorder *recorder)
+{
+	return recorder->trace_fd;
+}
+
+/**
+ * tracecmd_recorder_read_data - record the data that is available
+ * @recorder: the recorder, created with TRACECMD_RECORD_POLL
+ *
+ * This is the alternative to tracecmd_start_recording() for callers that
+ * service several recorders, and wait for data on their trace file
+ * descriptors by themselves. It records all the data that can be read
+ * without blocking. At the end, tracecmd_flush_recording() must be
+ * called to get the rest.
+ *
+ * Returns the number of bytes recorded, or -1 on error.
+ */
+long tracecmd_recorder_read_data(struct tracecmd_recorder *recorder)
+{
+	long total = 0;
+	long ret;
+
+	do {
+		ret = move_data(recorder);
+		if (ret < 0)
+			return ret;
+		total += ret;
+	} while (ret);
+
+	stat_poll(recorder, total);
+
+	return total;
+}
+
+/**
+ * tracecmd_recorder_get_stats - get the statistics of a recorder
+ * @recorder: the recorder
+ * @stats: filled with the statistics of @recorder
+ *
+ * The statistics are about the data moved by the recorder: how much,
+ * how long the reads and writes took, and how long it waited for data.
+ */
+void tracecmd_recorder_get_stats(struct tracecmd_recorder *recorder,
+				 struct tracecmd_recorder_stats *stats)
+{
+	*stats = recorder->stats;
+}
+
+static void print_hist(struct trace_seq *s, const char *name,
+		       unsigned long long *hist)
+{
+	int i;
+
+	trace_seq_printf(s, "  %s latency (usecs):", name);
+	for (i = 0; i < TRACECMD_RECORDER_HIST_SIZE; i++) {
+		if (!hist[i])
+			continue;
+		if (!i)
+			trace_seq_printf(s, " <1:%llu", hist[i]);
+		else if (i == 1)
+			trace_seq_printf(s, " 1:%llu", hist[i]);
+		else if (i == TRACECMD_RECORDER_HIST_SIZE - 1)
+			trace_seq_printf(s, " >=%llu:%llu", 1ULL << (i - 1), hist[i]);
+		else
+			trace_seq_printf(s, " %llu-%llu:%llu", 1ULL << (i - 1),
+					 (1ULL << i) - 1, hist[i]);
+	}
+	trace_seq_putc(s, '\n');
+}
+
+/**
+ * tracecmd_recorder_print_stats - print the statistics of a recorder
+ * @s: the trace_seq to print into
+ * @cpu: the CPU the recorder was recording
+ * @stats: the statistics (see tracecmd_recorder_get_stats())
+ */
+void tracecmd_recorder_print_stats(struct trace_seq *s, int cpu,
+				   struct tracecmd_recorder_stats *stats)
+{
+	trace_seq_printf(s, "CPU: %d\n", cpu);
+	trace_seq_printf(s, "  bytes: %llu\n", stats->bytes);
+	trace_seq_printf(s, "  written: %llu\n", stats->written);
+	if (stats->dropped)
+		trace_seq_printf(s, "  dropped: %llu\n", stats->dropped);
+	trace_seq_printf(s, "  reads: %llu (avg %llu ns)\n", stats->reads,
+			 stats->reads ? stats->read_ns / stats->reads : 0);
+	trace_seq_printf(s, "  writes: %llu (avg %llu ns)\n", stats->writes,
+			 stats->writes ? stats->write_ns / stats->writes : 0);
+	trace_seq_printf(s, "  asleep: %llu.%06llu secs\n",
+			 stats->sleep_ns / 1000000000ULL,
+			 (stats->sleep_ns % 1000000000ULL) / 1000);
+	trace_seq_printf(s, "  polls: %llu (empty %llu)\n",
+			 stats->polls, stats->empty_polls);
+	trace_seq_printf(s, "  max pipe backlog: %llu\n", stats->max_backlog);
+	if (stats->reads)
+		print_hist(s, "read", stats->read_hist);
+	if (stats->writes)
+		print_hist(s, "write", stats->write_hist);
+}
+
 static void set_nonblock(struct tracecmd_recorder *recorder)
 {
 	long flags;
@@ -516,6 +1274,21 @@ static void set_nonblock(struct tracecmd_recorder *recorder)
 	recorder->fd_flags |= SPLICE_F_NONBLOCK;
 }
 
+static void write_data(struct tracecmd_recorder *recorder,
+		       const char *buf, long size)
+{
+	if (room_left(recorder, size) < size) {
+		recorder->stats.dropped += size;
+		return;
+	}
+
+	if (recorder->compression >= 0) {
+		compress_data(recorder, buf, size);
+	} else if (write(recorder->fd, buf, size) > 0) {
+		update_fd(recorder, size);
+	}
+}
+
 long tracecmd_flush_recording(struct tracecmd_recorder *recorder)
 {
 	char buf[recorder->page_size];
@@ -536,7 +1309,7 @@ long tracecmd_flush_recording(struct tracecmd_recorder *recorder)
 	do {
 		ret = read(recorder->trace_fd, buf, recorder->page_size);
 		if (ret > 0) {
-			write(recorder->fd, buf, ret);
+			write_data(recorder, buf, ret);
 			wrote += ret;
 		}
 
@@ -546,37 +1319,129 @@ long tracecmd_flush_recording(struct tracecmd_recorder *recorder)
 	wrote &= recorder->page_size - 1;
 	if (wrote) {
 		memset(buf, 0, recorder->page_size);
-		write(recorder->fd, buf, recorder->page_size - wrote);
+		write_data(recorder, buf, recorder->page_size - wrote);
 		total += recorder->page_size;
 	}
 
+	if (recorder->compression >= 0) {
+		if (recorder->chunk_len && write_chunk(recorder) < 0)
+			return -1;
+		write_compress_stats(recorder);
+	}
+
 	return total;
 }
 
+/*
+ * Wait for the kernel to wake us up, which it does when the buffer is
+ * filled up to its buffer_percent watermark, or for the recorder to be
+ * stopped. Returns the number of file descriptors ready (0 on timeout),
+ * or -1 on error.
+ */
+static int wait_for_data(struct tracecmd_recorder *recorder, int timeout)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = recorder->trace_fd, .events = POLLIN },
+		{ .fd = recorder->stop_fd, .events = POLLIN },
+	};
+	int ret;
+
+	ret = poll(pfd, 2, timeout);
+	if (ret < 0 && errno != EINTR) {
+		tracecmd_warning("recorder error waiting for data");
+		return -1;
+	}
+
+	return ret < 0 ? 0 : ret;
+}
+
+/*
+ * Record the data as the kernel wakes us up, with @sleep (if not zero)
+ * the longest time to wait for it.
+ */
+static int wakeup_recording(struct tracecmd_recorder *recorder, unsigned long sleep)
+{
+	struct timespec req = {
+		.tv_sec = 0,
+		.tv_nsec = 1000000,
+	};
+	int timeout = POLL_TIMEOUT_MS;
+	struct timespec start;
+	bool woken = false;
+	long read;
+	int ret;
+
+	if (sleep)
+		timeout = (sleep + 999) / 1000;
+
+	while (!recorder->stop) {
+		read = tracecmd_recorder_read_data(recorder);
+		if (read < 0)
+			return -1;
+		if (read)
+			continue;
+
+		/*
+		 * Without a watermark, the trace fd is readable as soon as
+		 * there is an event, but splice only moves full pages. Do
+		 * not spin on it.
+		 */
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (woken)
+			nanosleep(&req, NULL);
+
+		ret = wait_for_data(recorder, timeout);
+		stat_sleep(recorder, &start);
+		if (ret < 0)
+			return -1;
+		woken = ret > 0;
+	}
+
+	return 0;
+}
+
 int tracecmd_start_recording(struct tracecmd_recorder *recorder, unsigned long sleep)
 {
 	struct timespec req = {
 		.tv_sec = sleep / 1000000,
 		.tv_nsec = (sleep % 1000000) * 1000,
 	};
+	struct timespec start;
+	struct timespec end;
 	long read = 1;
 	long ret;
 
-	recorder->stop = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	do {
-		/* Only sleep if we did not read anything last time */
-		if (!read && sleep)
-			nanosleep(&req, NULL);
-
-		read = 0;
+	/* A stop that came before is not lost, the stop_fd stays readable */
+	if (recorder->stop_fd >= 0) {
+		if (wakeup_recording(recorder, sleep) < 0)
+			return -1;
+	} else {
+		recorder->stop = 0;
 		do {
-			ret = move_data(recorder);
-			if (ret < 0)
-				return ret;
-			read += ret;
-		} while (ret);
-	} while (!recorder->stop);
+			/* Only sleep if we did not read anything last time */
+			if (!read && sleep) {
+				struct timespec slept;
+
+				clock_gettime(CLOCK_MONOTONIC, &slept);
+				nanosleep(&req, NULL);
+				stat_sleep(recorder, &slept);
+			}
+
+			read = 0;
+			do {
+				ret = move_data(recorder);
+				if (ret < 0)
+					return ret;
+				read += ret;
+			} while (ret);
+			stat_poll(recorder, read);
+		} while (!recorder->stop);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	recorder->record_ns += ts_delta_ns(&start, &end);
 
 	/* Flush out the rest */
 	ret = tracecmd_flush_recording(recorder);
@@ -589,10 +1454,16 @@ int tracecmd_start_recording(struct tracecmd_recorder *recorder, unsigned long s
 
 void tracecmd_stop_recording(struct tracecmd_recorder *recorder)
 {
+	unsigned long long val = 1;
+
 	if (!recorder)
 		return;
 
 	set_nonblock(recorder);
 
 	recorder->stop = 1;
+
+	/* Wake up the recorder, this may be called from a signal handler */
+	if (recorder->stop_fd >= 0)
+		write(recorder->stop_fd, &val, sizeof(val));
 }
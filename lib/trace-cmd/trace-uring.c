@@ -0,0 +1,403 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Read ahead the pages of a trace.dat file with io_uring, for the
+ * cases where the file can not be mapped.
+ *
+ * The raw system calls are used, so that there is no dependency on
+ * liburing.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+
+#include "trace-cmd-local.h"
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup	425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter	426
+#endif
+
+/* Limit on the reads in flight, for all the CPUs together */
+#define URING_MAX_ENTRIES	4096
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_BUSY,	/* submitted, the kernel owns the buffer */
+	SLOT_DONE,
+};
+
+struct uring_slot {
+	off64_t			offset;
+	void			*buf;
+	enum slot_state		state;
+	int			res;
+};
+
+/*
+ * The ring is shared by all the CPUs of a handle, that may be read from
+ * different threads (see tracecmd_iterate_events()): @lock serializes
+ * the queues and the slots.
+ */
+struct tracecmd_uring {
+	pthread_mutex_t		lock;
+	int			ring_fd;
+	int			fd;		/* the trace.dat file */
+	int			page_size;
+	int			cpus;
+	int			depth;		/* pages read ahead per CPU */
+	struct uring_slot	*slots;		/* cpus * depth */
+
+	/* submission queue */
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_size;
+	unsigned int		to_submit;
+
+	/* completion queue */
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	bool			broken;
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int ring_fd, unsigned int to_submit,
+		       unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int map_rings(struct tracecmd_uring *ring, struct io_uring_params *p)
+{
+	ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		return -1;
+
+	if (ring->cq_ring_size) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			return -1;
+		}
+	} else {
+		ring->cq_ring = ring->sq_ring;
+	}
+
+	ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		return -1;
+	}
+
+	ring->sq_tail = ring->sq_ring + p->sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p->sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p->sq_off.array;
+
+	ring->cq_head = ring->cq_ring + p->cq_off.head;
+	ring->cq_tail = ring->cq_ring + p->cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p->cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p->cq_off.cqes;
+
+	return 0;
+}
+
+/**
+ * tracecmd_uring_alloc - set up io_uring to read ahead trace data pages
+ * @fd: the file descriptor of the trace.dat file
+ * @cpus: the number of CPUs of the data
+ * @page_size: the size of the pages to read
+ * @depth: the number of pages to read ahead of each CPU
+ *
+ * Returns the ring, or NULL if io_uring is not available (old kernel,
+ * disabled by seccomp or sysctl, ...). The caller is then expected to
+ * read the pages by itself.
+ */
+struct tracecmd_uring *tracecmd_uring_alloc(int fd, int cpus, int page_size,
+					    int depth)
+{
+	struct tracecmd_uring *ring;
+	struct io_uring_params p;
+	int i;
+
+	if (cpus <= 0)
+		return NULL;
+
+	if (cpus * depth > URING_MAX_ENTRIES)
+		depth = URING_MAX_ENTRIES / cpus;
+	/* Reading a single page ahead is not worth the trouble */
+	if (depth < 2)
+		return NULL;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	pthread_mutex_init(&ring->lock, NULL);
+	ring->fd = fd;
+	ring->cpus = cpus;
+	ring->depth = depth;
+	ring->page_size = page_size;
+	ring->slots = calloc(cpus * depth, sizeof(*ring->slots));
+	if (!ring->slots)
+		goto fail;
+	for (i = 0; i < cpus * depth; i++)
+		ring->slots[i].offset = -1;
+
+	memset(&p, 0, sizeof(p));
+	ring->ring_fd = uring_setup(cpus * depth, &p);
+	if (ring->ring_fd < 0)
+		goto fail;
+
+	if (map_rings(ring, &p) < 0)
+		goto fail_ring;
+
+	return ring;
+
+ fail_ring:
+	tracecmd_uring_free(ring);
+	return NULL;
+ fail:
+	pthread_mutex_destroy(&ring->lock);
+	free(ring->slots);
+	free(ring);
+	return NULL;
+}
+
+static void reap_completions(struct tracecmd_uring *ring)
+{
+	struct io_uring_cqe *cqe;
+	struct uring_slot *slot;
+	unsigned int head;
+	unsigned int tail;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		slot = &ring->slots[cqe->user_data];
+		slot->res = cqe->res;
+		slot->state = SLOT_DONE;
+		/* IORING_OP_READ is 5.6 and later */
+		if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+			ring->broken = true;
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Wait for at least one completion */
+static int wait_completion(struct tracecmd_uring *ring)
+{
+	int ret;
+
+	do {
+		ret = uring_enter(ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		ring->broken = true;
+		return -1;
+	}
+
+	reap_completions(ring);
+	return 0;
+}
+
+static void queue_read(struct tracecmd_uring *ring, int index, off64_t offset)
+{
+	struct uring_slot *slot = &ring->slots[index];
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+
+	tail = *ring->sq_tail;
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = ring->fd;
+	sqe->off = offset;
+	sqe->addr = (unsigned long)slot->buf;
+	sqe->len = ring->page_size;
+	sqe->user_data = index;
+	ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+
+	slot->offset = offset;
+	slot->state = SLOT_BUSY;
+}
+
+static void submit_reads(struct tracecmd_uring *ring)
+{
+	int ret;
+
+	if (!ring->to_submit)
+		return;
+
+	do {
+		ret = uring_enter(ring->ring_fd, ring->to_submit, 0, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		ring->broken = true;
+		return;
+	}
+	ring->to_submit -= ret;
+}
+
+static inline int slot_index(struct tracecmd_uring *ring, int cpu, off64_t offset)
+{
+	return cpu * ring->depth + (offset / ring->page_size) % ring->depth;
+}
+
+/* Queue the reads of the pages that follow @offset, up to @end */
+static void read_ahead(struct tracecmd_uring *ring, int cpu,
+		       off64_t offset, off64_t end)
+{
+	struct uring_slot *slot;
+	int index;
+	int i;
+
+	for (i = 1; i < ring->depth; i++) {
+		offset += ring->page_size;
+		if (offset >= end)
+			break;
+
+		index = slot_index(ring, cpu, offset);
+		slot = &ring->slots[index];
+		if (slot->offset == offset && slot->state != SLOT_FREE)
+			continue;
+		/* Still owned by the kernel, try again next time */
+		if (slot->state == SLOT_BUSY)
+			continue;
+		if (!slot->buf) {
+			slot->buf = malloc(ring->page_size);
+			if (!slot->buf)
+				break;
+		}
+		queue_read(ring, index, offset);
+	}
+
+	submit_reads(ring);
+}
+
+/**
+ * tracecmd_uring_read_page - read a page, and read ahead the next ones
+ * @ring: the ring returned by tracecmd_uring_alloc()
+ * @cpu: the CPU the page belongs to
+ * @offset: the offset of the page in the file
+ * @end: the end of the data of @cpu in the file
+ *
+ * Returns a buffer holding the page at @offset, that must be freed by
+ * the caller, or NULL if the page was not read ahead (or the read
+ * failed). In that case the caller should read the page itself. In
+ * both cases, the reads of the pages that follow are queued.
+ */
+void *tracecmd_uring_read_page(struct tracecmd_uring *ring, int cpu,
+			       off64_t offset, off64_t end)
+{
+	struct uring_slot *slot;
+	void *buf = NULL;
+
+	if (cpu >= ring->cpus)
+		return NULL;
+
+	pthread_mutex_lock(&ring->lock);
+	if (ring->broken)
+		goto out;
+
+	reap_completions(ring);
+
+	slot = &ring->slots[slot_index(ring, cpu, offset)];
+	if (slot->offset == offset && slot->state != SLOT_FREE) {
+		while (slot->state == SLOT_BUSY) {
+			if (wait_completion(ring) < 0)
+				goto out;
+		}
+		if (slot->res == ring->page_size) {
+			buf = slot->buf;
+			slot->buf = NULL;
+		}
+		slot->state = SLOT_FREE;
+		slot->offset = -1;
+	}
+
+	if (!ring->broken)
+		read_ahead(ring, cpu, offset, end);
+ out:
+	pthread_mutex_unlock(&ring->lock);
+	return buf;
+}
+
+/**
+ * tracecmd_uring_free - tear down the ring
+ * @ring: the ring returned by tracecmd_uring_alloc()
+ *
+ * Waits for the reads still in flight, as their buffers are owned by
+ * the kernel until they complete.
+ */
+void tracecmd_uring_free(struct tracecmd_uring *ring)
+{
+	int busy;
+	int i;
+
+	if (!ring)
+		return;
+
+	if (ring->sqes) {
+		do {
+			reap_completions(ring);
+			for (busy = 0, i = 0; i < ring->cpus * ring->depth; i++)
+				if (ring->slots[i].state == SLOT_BUSY)
+					busy++;
+		} while (busy && wait_completion(ring) == 0);
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->ring_fd);
+
+	for (i = 0; i < ring->cpus * ring->depth; i++)
+		free(ring->slots[i].buf);
+	free(ring->slots);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring);
+}
@@ -3,6 +3,7 @@
  * Copyright (C) 2009, 2010 Red Hat Inc, Steven Rostedt <srostedt@redhat.com>
  *
  */
+#define _LARGEFILE64_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,12 +20,30 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/sysinfo.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
 #include <time.h>
 #include <traceevent/event-utils.h>
 
 #include "trace-cmd-private.h"
 #include "trace-cmd-local.h"
 
+/* linux/fs.h conflicts with sys/mount.h */
+#ifndef FICLONERANGE
+struct file_clone_range {
+	__s64 src_fd;
+	__u64 src_offset;
+	__u64 src_length;
+	__u64 dest_offset;
+};
+#define FICLONERANGE	_IOW(0x94, 13, struct file_clone_range)
+#endif
+
+/* Older headers, the syscall then fails with ENOSYS */
+#ifndef __NR_copy_file_range
+# define __NR_copy_file_range	-1
+#endif
+
 #define LOCAL_PLUGIN_DIR ".trace-cmd/plugins"
 #define PROC_STACK_FILE "/proc/sys/kernel/stack_tracer_enabled"
 
@@ -582,3 +601,59 @@ unsigned long long tracecmd_generate_traceid(void)
 	free(str);
 	return hash;
 }
+
+/**
+ * copy_file_data - copy data between files without going through user space
+ * @dst: the file to copy to, at its current position
+ * @src: the file to copy from
+ * @offset: where to copy from in @src
+ * @size: how much to copy
+ *
+ * Tries to clone the blocks first (FICLONERANGE, on file systems like
+ * btrfs and XFS), which needs @offset and the position of @dst to be
+ * aligned on blocks, and the range to go to the end of @src. Otherwise
+ * uses copy_file_range(2), which copies the data in the kernel. The
+ * file position of @src is not used nor changed.
+ *
+ * Returns the number of bytes copied, or -1 if nothing could be copied
+ * (for instance, errno is ENOSYS, EXDEV or EINVAL if the kernel or the
+ * file systems do not support it). Less than @size is returned if @src
+ * is shorter, or on an error after some data was copied: the caller has
+ * to copy the rest itself.
+ */
+long long copy_file_data(int dst, int src, long long offset,
+			 unsigned long long size)
+{
+	struct file_clone_range range;
+	long long total = 0;
+	loff_t off = offset;
+	off64_t pos;
+	long ret;
+
+	pos = lseek64(dst, 0, SEEK_CUR);
+	if (pos != (off64_t)-1) {
+		range.src_fd = src;
+		range.src_offset = offset;
+		range.src_length = size;
+		range.dest_offset = pos;
+		if (ioctl(dst, FICLONERANGE, &range) == 0 &&
+		    lseek64(dst, pos + size, SEEK_SET) != (off64_t)-1)
+			return size;
+	}
+
+	while ((unsigned long long)total < size) {
+		ret = syscall(__NR_copy_file_range, src, &off, dst, NULL,
+			      size - total, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Nothing copied yet, let the caller fall back */
+			return total ? total : -1;
+		}
+		if (!ret)
+			break;
+		total += ret;
+	}
+
+	return total;
+}
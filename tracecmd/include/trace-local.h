@@ -7,6 +7,7 @@
 #define __TRACE_LOCAL_H
 
 #include <sys/types.h>
+#include <sched.h>	/* for cpu_set_t */
 #include <dirent.h>	/* for DIR */
 #include <ctype.h>	/* for isdigit() */
 #include <limits.h>
@@ -73,6 +74,8 @@ void trace_report(int argc, char **argv);
 
 void trace_split(int argc, char **argv);
 
+void trace_convert(int argc, char **argv);
+
 void trace_listen(int argc, char **argv);
 
 void trace_agent(int argc, char **argv);
@@ -116,6 +119,13 @@ void trace_init_profile(struct tracecmd_input *handle, struct hook_list *hooks,
 			int global);
 int do_trace_profile(void);
 void trace_profile_set_merge_like_comms(void);
+void trace_profile_set_snapshot(int secs);
+void trace_profile_set_decay(int percent);
+void trace_profile_set_evict(int secs);
+void trace_profile_check_snapshot(void);
+int trace_profile_set_percentiles(const char *list);
+int trace_profile_threads(struct tracecmd_input *handle,
+			  struct tracecmd_input **inputs, int nr_threads);
 
 struct tracecmd_input *
 trace_stream_init(struct buffer_instance *instance, int cpu, int fd, int cpus,
@@ -125,6 +135,37 @@ int trace_stream_read(struct pid_record_data *pids, int nr_pids, struct timeval
 
 void trace_show_data(struct tracecmd_input *handle, struct tep_record *record);
 
+struct recorder_pool;
+
+int recorder_pool_parse_cpus(const char *list, cpu_set_t *set);
+struct recorder_pool *recorder_pool_alloc(int nr_threads, cpu_set_t *cpus,
+					  int sleep_usecs);
+int recorder_pool_add(struct recorder_pool *pool,
+		      struct tracecmd_recorder *recorder,
+		      struct tracecmd_recorder_stats *stats);
+int recorder_pool_start(struct recorder_pool *pool);
+int recorder_pool_nr_threads(struct recorder_pool *pool);
+pid_t recorder_pool_get_tid(struct recorder_pool *pool, int thread);
+int recorder_pool_stop(struct recorder_pool *pool);
+void recorder_pool_free(struct recorder_pool *pool);
+
+struct listen_pool;
+struct listen_stream;
+
+struct listen_stream_stats {
+	unsigned long long	bytes;
+	struct timespec		start;	/* when the first data came in */
+	struct timespec		end;	/* and the last */
+};
+
+struct listen_pool *listen_pool_alloc(int nr_threads);
+struct listen_stream *listen_pool_add(struct listen_pool *pool, int sfd, int fd,
+				      int page_size, bool use_tcp);
+void listen_pool_remove(struct listen_pool *pool, struct listen_stream *stream,
+			struct listen_stream_stats *stats);
+void listen_pool_free(struct listen_pool *pool);
+int listen_splice_to_file(int *brass, int fd, int size);
+
 /* --- event interation --- */
 
 /*
@@ -247,6 +288,8 @@ struct buffer_instance {
 
 	struct trace_seq	*s_save;
 	struct trace_seq	*s_print;
+	/* shared with the recorders, filled when they finish */
+	struct tracecmd_recorder_stats	*recorder_stats;
 
 	struct tracecmd_input	*handle;
 
@@ -261,6 +304,7 @@ struct buffer_instance {
 	int			tracing_on_init_val;
 	int			tracing_on_fd;
 	int			buffer_size;
+	int			buffer_percent;	/* -1 if not set */
 	int			cpu_count;
 
 	int			argc;
@@ -85,6 +85,7 @@ struct command commands[] = {
 	{"setup-guest", trace_setup_guest},
 #endif
 	{"split", trace_split},
+	{"convert", trace_convert},
 	{"restore", trace_restore},
 	{"stack", trace_stack},
 	{"check-events", trace_check_events},
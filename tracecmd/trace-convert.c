@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Rewrite a trace.dat file with its CPU data compressed (or not).
+ */
+#define _LARGEFILE64_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "trace-local.h"
+
+static const char *default_input_file = DEFAULT_INPUT_FILE;
+
+/* Copy the pages of @cpu that hold events into @file */
+static void write_cpu_pages(struct tracecmd_input *handle, int cpu,
+			    const char *file)
+{
+	unsigned long long page_offset = -1ULL;
+	struct tep_record *record;
+	int page_size;
+	void *page;
+	int fd;
+
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+	if (fd < 0)
+		die("Failed to create %s", file);
+
+	page_size = tracecmd_page_size(handle);
+
+	for (record = tracecmd_read_cpu_first(handle, cpu); record;
+	     record = tracecmd_read_data(handle, cpu)) {
+		if ((record->offset & ~(page_size - 1)) != page_offset) {
+			page_offset = record->offset & ~(page_size - 1);
+			page = tracecmd_record_page(handle, record);
+			if (!page || write(fd, page, page_size) != page_size)
+				die("Failed to write %s", file);
+		}
+		tracecmd_free_record(record);
+	}
+
+	close(fd);
+}
+
+/* Write the CPU data of @handle in a temp file per CPU, in @dir */
+static char **write_cpu_files(struct tracecmd_input *handle, const char *dir,
+			      const char *base, int *nr_cpus)
+{
+	char **cpu_list;
+	int cpus;
+	int cpu;
+
+	cpus = tracecmd_cpus(handle);
+	cpu_list = calloc(cpus, sizeof(*cpu_list));
+	if (!cpu_list)
+		die("Failed to allocate cpu_list for %d cpus", cpus);
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		if (asprintf(&cpu_list[cpu], "%s/.tmp.%s.%d", dir, base, cpu) < 0)
+			die("Failed to allocate file for %s %s %d", dir, base, cpu);
+		write_cpu_pages(handle, cpu, cpu_list[cpu]);
+	}
+
+	*nr_cpus = cpus;
+	return cpu_list;
+}
+
+static void put_cpu_files(char **cpu_list, int cpus)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		unlink(cpu_list[cpu]);
+		free(cpu_list[cpu]);
+	}
+	free(cpu_list);
+}
+
+void trace_convert(int argc, char **argv)
+{
+	struct tracecmd_option **buffer_options = NULL;
+	struct tracecmd_input *buffer_handle;
+	struct tracecmd_output *ohandle;
+	struct tracecmd_input *handle;
+	const char *input_file = NULL;
+	const char *compression = "zlib";
+	const char *current;
+	const char *clock;
+	char *output_file = NULL;
+	char **cpu_list;
+	char *output;
+	char *name;
+	char *base;
+	char *dir;
+	int buffers;
+	int cpus;
+	int c;
+	int i;
+
+	if (strcmp(argv[1], "convert") != 0)
+		usage(argv);
+
+	while ((c = getopt(argc-1, argv+1, "+hi:o:c:")) >= 0) {
+		switch (c) {
+		case 'h':
+			usage(argv);
+			break;
+		case 'i':
+			input_file = optarg;
+			break;
+		case 'o':
+			output_file = optarg;
+			break;
+		case 'c':
+			compression = optarg;
+			break;
+		default:
+			usage(argv);
+		}
+	}
+
+	if (!output_file)
+		die("No output file specified (-o)");
+	if (!input_file)
+		input_file = default_input_file;
+
+	handle = tracecmd_open(input_file, TRACECMD_FL_SEQUENTIAL_SCAN);
+	if (!handle)
+		die("error reading %s", input_file);
+
+	if (tracecmd_get_file_state(handle) == TRACECMD_FILE_CPU_LATENCY)
+		die("trace-cmd convert does not work with latency traces\n");
+
+	current = tracecmd_get_compression(handle);
+	printf("%s: %s, converting to %s\n", input_file,
+	       current ? current : "not compressed", compression);
+
+	ohandle = tracecmd_copy(handle, output_file);
+	if (!ohandle)
+		die("error creating %s", output_file);
+
+	if (tracecmd_output_set_compression(ohandle, compression) < 0)
+		die("Compression '%s' is not supported", compression);
+
+	/*
+	 * Keep the clock of the input, not the one of the local tracing
+	 * dir. Without the trace clock option the file's clock is not
+	 * used by the readers, and is written as "local".
+	 */
+	clock = tracecmd_get_trace_clock(handle);
+	tracecmd_set_out_clock(ohandle, (char *)(clock ? clock : "local"));
+
+	buffers = tracecmd_buffer_instances(handle);
+	if (buffers) {
+		buffer_options = calloc(buffers, sizeof(*buffer_options));
+		if (!buffer_options)
+			die("Failed to allocate buffer options");
+	}
+
+	if (tracecmd_copy_options(handle, ohandle, buffer_options) < 0) {
+		if (errno == ENOTSUP)
+			die("%s has options that can not be converted", input_file);
+		die("Failed to copy the options of %s", input_file);
+	}
+
+	/* dirname() and basename() may modify their argument */
+	output = strdup(output_file);
+	name = strdup(output_file);
+	if (!output || !name)
+		die("Failed to allocate for %s", output_file);
+	dir = dirname(output);
+	base = basename(name);
+
+	cpu_list = write_cpu_files(handle, dir, base, &cpus);
+	if (tracecmd_append_cpu_data(ohandle, cpus, cpu_list) < 0)
+		die("Failed to write the CPU data to %s", output_file);
+	put_cpu_files(cpu_list, cpus);
+
+	for (i = 0; i < buffers; i++) {
+		buffer_handle = tracecmd_buffer_instance_handle(handle, i);
+		if (!buffer_handle)
+			die("Failed to read buffer %s of %s",
+			    tracecmd_buffer_instance_name(handle, i), input_file);
+
+		cpu_list = write_cpu_files(buffer_handle, dir, base, &cpus);
+		if (tracecmd_append_buffer_cpu_data(ohandle, buffer_options[i],
+						    cpus, cpu_list) < 0)
+			die("Failed to write the CPU data of buffer %s to %s",
+			    tracecmd_buffer_instance_name(handle, i), output_file);
+		put_cpu_files(cpu_list, cpus);
+		tracecmd_close(buffer_handle);
+	}
+
+	free(buffer_options);
+	free(output);
+	free(name);
+
+	tracecmd_output_close(ohandle);
+	tracecmd_close(handle);
+}
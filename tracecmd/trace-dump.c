@@ -19,6 +19,7 @@
 #define HEAD_OPTIONS	"options  "
 #define HEAD_LATENCY	"latency  "
 #define HEAD_FLYRECORD	"flyrecord"
+#define HEAD_FLYCHUNKS	"flychunks"
 
 #define DUMP_SIZE	1024
 
@@ -568,6 +569,9 @@ static void dump_options(int fd)
 		case TRACECMD_OPTION_TSC2NSEC:
 			dump_option_tsc2nsec(fd, size);
 			break;
+		case TRACECMD_OPTION_RECORDER_STATS:
+			dump_option_string(fd, size, "RECORDER_STATS");
+			break;
 		default:
 			do_print(OPTIONS, " %d %d\t[Unknown option, size - skipping]\n",
 				 option, size);
@@ -626,6 +630,55 @@ static void dump_flyrecord(int fd)
 	dump_clock(fd);
 }
 
+static void dump_flychunks(int fd)
+{
+	long long *cpu_size;
+	long long cpu_offset;
+	long long offset;
+	long long ts;
+	long long nr;
+	int chunk_size;
+	int size;
+	int algo;
+	int i, j;
+
+	do_print((SUMMARY | FLYRECORD), "\t[Compressed flyrecord tracing data]\n");
+
+	cpu_size = calloc(trace_cpus, sizeof(*cpu_size));
+	if (!cpu_size)
+		die("cannot allocate the sizes of %d cpus", trace_cpus);
+
+	for (i = 0; i < (int)trace_cpus; i++) {
+		if (read_file_number(fd, &cpu_offset, 8))
+			die("cannot read the cpu %d offset", i);
+		if (read_file_number(fd, &cpu_size[i], 8))
+			die("cannot read the cpu %d size", i);
+		do_print(FLYRECORD, "\t\t %lld %lld\t[offset, uncompressed size of cpu %d]\n",
+			 cpu_offset, cpu_size[i], i);
+	}
+	if (read_file_number(fd, &algo, 4))
+		die("cannot read the compression algorithm");
+	if (read_file_number(fd, &chunk_size, 4) || chunk_size <= 0)
+		die("cannot read the chunk size");
+	do_print(FLYRECORD, "\t\t%d\t[compression algorithm]\n", algo);
+	do_print(FLYRECORD, "\t\t%d\t[chunk size]\n", chunk_size);
+
+	for (i = 0; i < (int)trace_cpus; i++) {
+		nr = (cpu_size[i] + chunk_size - 1) / chunk_size;
+		do_print(FLYRECORD, "\t\t%lld\t[chunks of cpu %d]\n", nr, i);
+		for (j = 0; j < nr; j++) {
+			if (read_file_number(fd, &offset, 8) ||
+			    read_file_number(fd, &size, 4) ||
+			    read_file_number(fd, &ts, 8))
+				die("cannot read chunk %d of cpu %d", j, i);
+			do_print(FLYRECORD, "\t\t  %lld %d %lld\t[offset, compressed size, timestamp]\n",
+				 offset, size, ts);
+		}
+	}
+	free(cpu_size);
+	dump_clock(fd);
+}
+
 static void dump_therest(int fd)
 {
 	char str[10];
@@ -640,6 +693,8 @@ static void dump_therest(int fd)
 			dump_latency(fd);
 		else if (strncmp(str, HEAD_FLYRECORD, 10) == 0)
 			dump_flyrecord(fd);
+		else if (strncmp(str, HEAD_FLYCHUNKS, 10) == 0)
+			dump_flychunks(fd);
 		else {
 			lseek64(fd, -10, SEEK_CUR);
 			break;
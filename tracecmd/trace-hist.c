@@ -50,6 +50,9 @@ static struct tep_format_field *kernel_stack_caller_field;
 
 static int compact;
 
+/* The chains and saved stacks, freed at once at the end */
+static struct tracecmd_arena *arena;
+
 static void *zalloc(size_t size)
 {
 	return calloc(1, size);
@@ -83,7 +86,7 @@ static void save_stack(void)
 {
 	struct stack_save *stack;
 
-	stack = zalloc(sizeof(*stack));
+	stack = tracecmd_arena_get(arena, sizeof(*stack));
 	if (!stack)
 		die("malloc");
 
@@ -120,7 +123,7 @@ static void restore_stack(int pid)
 	func_depth = stack->func_depth;
 	free(ips);
 	ips = stack->ips;
-	free(stack);
+	tracecmd_arena_put(arena, stack, sizeof(*stack));
 }
 
 struct pid_list;
@@ -180,7 +183,7 @@ insert_chain(struct pid_list *pid_list, struct chain *chain_list,
 	}
 
 	chain_list->nr_parents++;
-	chain = zalloc(sizeof(struct chain));
+	chain = tracecmd_arena_get(arena, sizeof(struct chain));
 	if (!chain)
 		die("malloc");
 	chain->sibling = chain_list->parents;
@@ -209,7 +212,7 @@ static void save_call_chain(int pid, const char **chain, int size, int event)
 				break;
 		}
 		if (!pid_list) {
-			pid_list = zalloc(sizeof(*pid_list));
+			pid_list = tracecmd_arena_get(arena, sizeof(*pid_list));
 			if (!pid_list)
 				die("malloc");
 			pid_list->pid = pid;
@@ -931,6 +934,20 @@ static void print_chains(struct tep_handle *pevent)
 	}
 }
 
+static int hist_event(struct tracecmd_input *handle,
+		      struct tep_record *record, int cpu, void *data)
+{
+	struct tep_handle *pevent = data;
+
+	/* If we missed events, just flush out the current stack */
+	if (record->missed_events)
+		flush_stack();
+
+	process_record(pevent, record);
+
+	return 0;
+}
+
 static void do_trace_hist(struct tracecmd_input *handle)
 {
 	struct tep_handle *pevent = tracecmd_get_tep(handle);
@@ -973,20 +990,8 @@ static void do_trace_hist(struct tracecmd_input *handle)
 	update_kernel_stack(pevent);
 
 	for (cpu = 0; cpu < cpus; cpu++) {
-		for (;;) {
-			struct tep_record *record;
-
-			record = tracecmd_read_data(handle, cpu);
-			if (!record)
-				break;
-
-			/* If we missed events, just flush out the current stack */
-			if (record->missed_events)
-				flush_stack();
-
-			process_record(pevent, record);
-			tracecmd_free_record(record);
-		}
+		if (tracecmd_iterate_events(handle, cpu, hist_event, pevent) < 0)
+			die("Failed to read the events of cpu %d", cpu);
 	}
 
 	if (current_pid >= 0)
@@ -1039,7 +1044,7 @@ void trace_hist(int argc, char **argv)
 	if (!input_file)
 		input_file = DEFAULT_INPUT_FILE;
 
-	handle = tracecmd_alloc(input_file, 0);
+	handle = tracecmd_alloc(input_file, TRACECMD_FL_SEQUENTIAL_SCAN);
 	if (!handle)
 		die("can't open %s\n", input_file);
 
@@ -1054,6 +1059,10 @@ void trace_hist(int argc, char **argv)
 	if (ret > 0)
 		die("trace-cmd hist does not work with latency traces\n");
 
+	arena = tracecmd_arena_alloc();
+	if (!arena)
+		die("malloc");
+
 	instances = tracecmd_buffer_instances(handle);
 	if (instances) {
 		struct tracecmd_input *new_handle;
@@ -1072,5 +1081,6 @@ void trace_hist(int argc, char **argv)
 		do_trace_hist(handle);
 	}
 
+	tracecmd_arena_free(arena);
 	tracecmd_close(handle);
 }
@@ -0,0 +1,475 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Receive the per CPU data of the clients of listen with a small pool of
+ * threads, instead of a process per CPU of each client. Each thread waits
+ * with epoll on the sockets of the streams it was given.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "trace-local.h"
+
+#define MAX_EVENTS	64
+
+/*
+ * The most datagrams read from a UDP stream at a time, so that the
+ * other streams of the thread are not kept waiting.
+ */
+#define UDP_BATCH	16
+
+struct listen_stream {
+	struct listen_thread		*thread;
+	struct listen_stream		*next;	/* to be removed */
+	int				sfd;	/* the port, or -1 */
+	int				cfd;	/* the connection, or -1 */
+	int				fd;	/* where the data goes */
+	int				brass[2];
+	int				pipe_size;
+	int				page_size;
+	char				*buf;	/* for UDP */
+	bool				use_tcp;
+	bool				done;
+	struct listen_stream_stats	stats;
+};
+
+struct listen_thread {
+	struct listen_pool		*pool;
+	pthread_t			thread;
+	int				epoll_fd;
+	int				wake_fd;
+	struct listen_stream		*remove;
+	bool				started;
+};
+
+struct listen_pool {
+	struct listen_thread		*threads;
+	int				nr_threads;
+	int				next;	/* thread for the next stream */
+	bool				stop;
+	pthread_mutex_t			lock;
+	pthread_cond_t			cond;
+};
+
+/**
+ * listen_splice_to_file - move the data in a pipe to a file
+ * @brass: the pipe
+ * @fd: the file
+ * @size: the bytes in the pipe to move
+ *
+ * Returns 0, or -1 if it could not all be written.
+ */
+int listen_splice_to_file(int *brass, int fd, int size)
+{
+	int w;
+
+	while (size) {
+		w = splice(brass[0], NULL, fd, NULL, size, SPLICE_F_MOVE);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return -1;
+		size -= w;
+	}
+
+	return 0;
+}
+
+static void stream_close_socket(struct listen_stream *stream, int *sock)
+{
+	epoll_ctl(stream->thread->epoll_fd, EPOLL_CTL_DEL, *sock, NULL);
+	close(*sock);
+	*sock = -1;
+}
+
+static void stream_account(struct listen_stream *stream, long size)
+{
+	if (!stream->stats.bytes)
+		clock_gettime(CLOCK_MONOTONIC, &stream->stats.start);
+	stream->stats.bytes += size;
+	clock_gettime(CLOCK_MONOTONIC, &stream->stats.end);
+}
+
+/* The client connected to the port of a TCP stream */
+static void stream_accept(struct listen_stream *stream)
+{
+	struct epoll_event ev;
+	int cfd;
+
+	cfd = accept4(stream->sfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (cfd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			stream_close_socket(stream, &stream->sfd);
+		return;
+	}
+
+	/* Only one connection per CPU */
+	stream_close_socket(stream, &stream->sfd);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = stream;
+	if (epoll_ctl(stream->thread->epoll_fd, EPOLL_CTL_ADD, cfd, &ev) < 0) {
+		tracecmd_plog("Failed to wait on a client connection\n");
+		close(cfd);
+		return;
+	}
+	stream->cfd = cfd;
+}
+
+/*
+ * Read what the client sent, up to a pipe full. The socket is only read
+ * as fast as the file is written: if the file is slow, the data stays in
+ * the socket, and the client is slowed down by TCP.
+ */
+static void stream_read_tcp(struct listen_stream *stream)
+{
+	long r;
+
+	r = splice(stream->cfd, NULL, stream->brass[1], NULL,
+		   stream->pipe_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (r < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (r <= 0) {
+		/* The client is done, or gone */
+		stream_close_socket(stream, &stream->cfd);
+		return;
+	}
+
+	if (listen_splice_to_file(stream->brass, stream->fd, r) < 0) {
+		tracecmd_plog("Failed to write the data of a client\n");
+		stream_close_socket(stream, &stream->cfd);
+		return;
+	}
+	stream_account(stream, r);
+}
+
+static void stream_read_udp(struct listen_stream *stream)
+{
+	long r;
+	int i;
+
+	for (i = 0; i < UDP_BATCH; i++) {
+		r = recv(stream->sfd, stream->buf, stream->page_size, MSG_DONTWAIT);
+		if (r < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (r < 0) {
+			stream_close_socket(stream, &stream->sfd);
+			return;
+		}
+		if (write(stream->fd, stream->buf, r) != r) {
+			tracecmd_plog("Failed to write the data of a client\n");
+			stream_close_socket(stream, &stream->sfd);
+			return;
+		}
+		stream_account(stream, r);
+	}
+}
+
+static void stream_event(struct listen_stream *stream)
+{
+	if (!stream->use_tcp)
+		stream_read_udp(stream);
+	else if (stream->cfd < 0)
+		stream_accept(stream);
+	else
+		stream_read_tcp(stream);
+}
+
+/* Take what is left in the socket, and let go of the stream */
+static void stream_finish(struct listen_stream *stream)
+{
+	struct listen_pool *pool = stream->thread->pool;
+	unsigned long long bytes;
+
+	do {
+		bytes = stream->stats.bytes;
+		if (stream->cfd >= 0)
+			stream_read_tcp(stream);
+		else if (!stream->use_tcp && stream->sfd >= 0)
+			stream_read_udp(stream);
+	} while (stream->stats.bytes != bytes);
+
+	if (stream->sfd >= 0)
+		stream_close_socket(stream, &stream->sfd);
+	if (stream->cfd >= 0)
+		stream_close_socket(stream, &stream->cfd);
+
+	pthread_mutex_lock(&pool->lock);
+	stream->done = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void *listen_thread(void *data)
+{
+	struct listen_thread *thread = data;
+	struct listen_pool *pool = thread->pool;
+	struct epoll_event events[MAX_EVENTS];
+	struct listen_stream *stream;
+	unsigned long long val;
+	sigset_t mask;
+	bool stop = false;
+	bool wake;
+	int nr;
+	int i;
+
+	/* Signals are for the main thread */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	do {
+		nr = epoll_wait(thread->epoll_fd, events, MAX_EVENTS, -1);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			tracecmd_plog("Failed to wait for the clients\n");
+			break;
+		}
+
+		for (wake = false, i = 0; i < nr; i++) {
+			stream = events[i].data.ptr;
+			if (stream)
+				stream_event(stream);
+			else
+				wake = true;
+		}
+		if (!wake)
+			continue;
+
+		/*
+		 * Streams are only removed here, so that the events of this
+		 * round do not point to streams that are gone.
+		 */
+		if (read(thread->wake_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+			break;
+		pthread_mutex_lock(&pool->lock);
+		stream = thread->remove;
+		thread->remove = NULL;
+		stop = pool->stop;
+		pthread_mutex_unlock(&pool->lock);
+
+		while (stream) {
+			struct listen_stream *next = stream->next;
+
+			stream_finish(stream);
+			stream = next;
+		}
+	} while (!stop);
+
+	return NULL;
+}
+
+static void wake_thread(struct listen_thread *thread)
+{
+	unsigned long long val = 1;
+
+	if (write(thread->wake_fd, &val, sizeof(val)) != sizeof(val))
+		tracecmd_plog("Failed to wake up a listen thread\n");
+}
+
+/**
+ * listen_pool_alloc - create and start a pool of threads for the streams
+ * @nr_threads: the number of threads
+ */
+struct listen_pool *listen_pool_alloc(int nr_threads)
+{
+	struct listen_thread *thread;
+	struct listen_pool *pool;
+	struct epoll_event ev;
+	int i;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	pool->threads = calloc(nr_threads, sizeof(*pool->threads));
+	if (!pool->threads)
+		goto fail;
+	pool->nr_threads = nr_threads;
+
+	for (i = 0; i < nr_threads; i++) {
+		pool->threads[i].pool = pool;
+		pool->threads[i].epoll_fd = -1;
+		pool->threads[i].wake_fd = -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+
+	for (i = 0; i < nr_threads; i++) {
+		thread = &pool->threads[i];
+		thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (thread->epoll_fd < 0)
+			goto fail;
+		thread->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (thread->wake_fd < 0)
+			goto fail;
+		if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->wake_fd, &ev) < 0)
+			goto fail;
+		if (pthread_create(&thread->thread, NULL, listen_thread, thread))
+			goto fail;
+		thread->started = true;
+	}
+
+	return pool;
+
+ fail:
+	listen_pool_free(pool);
+	return NULL;
+}
+
+/**
+ * listen_pool_add - receive the data of a CPU of a client
+ * @pool: the pool
+ * @sfd: the socket of the port the client sends the data to (bound, and
+ *   for TCP, not listening yet)
+ * @fd: the file to write the data to
+ * @page_size: the page size of the client
+ * @use_tcp: if @sfd is a TCP socket (else UDP)
+ *
+ * The pool owns @sfd and @fd from now on, until listen_pool_remove().
+ * Returns the stream, or NULL on error (then @sfd and @fd are left open).
+ */
+struct listen_stream *listen_pool_add(struct listen_pool *pool, int sfd, int fd,
+				      int page_size, bool use_tcp)
+{
+	struct listen_stream *stream;
+	struct epoll_event ev;
+
+	stream = calloc(1, sizeof(*stream));
+	if (!stream)
+		return NULL;
+
+	stream->sfd = sfd;
+	stream->cfd = -1;
+	stream->fd = fd;
+	stream->brass[0] = -1;
+	stream->brass[1] = -1;
+	stream->page_size = page_size;
+	stream->use_tcp = use_tcp;
+
+	if (use_tcp) {
+		if (listen(sfd, 1) < 0 || pipe(stream->brass) < 0)
+			goto fail;
+		stream->pipe_size = fcntl(stream->brass[0], F_GETPIPE_SZ);
+		if (stream->pipe_size <= 0)
+			stream->pipe_size = page_size;
+	} else {
+		stream->buf = malloc(page_size);
+		if (!stream->buf)
+			goto fail;
+	}
+	if (fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) | O_NONBLOCK) < 0)
+		goto fail;
+
+	pthread_mutex_lock(&pool->lock);
+	stream->thread = &pool->threads[pool->next];
+	pool->next = (pool->next + 1) % pool->nr_threads;
+	pthread_mutex_unlock(&pool->lock);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = stream;
+	if (epoll_ctl(stream->thread->epoll_fd, EPOLL_CTL_ADD, sfd, &ev) < 0)
+		goto fail;
+
+	return stream;
+
+ fail:
+	if (stream->brass[0] >= 0) {
+		close(stream->brass[0]);
+		close(stream->brass[1]);
+	}
+	free(stream->buf);
+	free(stream);
+	return NULL;
+}
+
+/**
+ * listen_pool_remove - stop receiving the data of a CPU of a client
+ * @pool: the pool
+ * @stream: the stream returned by listen_pool_add()
+ * @stats: what was received, or NULL
+ *
+ * What the client already sent is still written to the file. Its
+ * socket and the file are closed, and @stream is freed.
+ */
+void listen_pool_remove(struct listen_pool *pool, struct listen_stream *stream,
+			struct listen_stream_stats *stats)
+{
+	struct listen_thread *thread = stream->thread;
+
+	pthread_mutex_lock(&pool->lock);
+	stream->next = thread->remove;
+	thread->remove = stream;
+	pthread_mutex_unlock(&pool->lock);
+
+	wake_thread(thread);
+
+	pthread_mutex_lock(&pool->lock);
+	while (!stream->done)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (stats)
+		*stats = stream->stats;
+
+	if (stream->brass[0] >= 0) {
+		close(stream->brass[0]);
+		close(stream->brass[1]);
+	}
+	close(stream->fd);
+	free(stream->buf);
+	free(stream);
+}
+
+/**
+ * listen_pool_free - stop the threads of the pool and free it
+ * @pool: the pool, with no streams left
+ */
+void listen_pool_free(struct listen_pool *pool)
+{
+	struct listen_thread *thread;
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nr_threads; i++) {
+		thread = &pool->threads[i];
+		if (!thread->started)
+			continue;
+		wake_thread(thread);
+		pthread_join(thread->thread, NULL);
+	}
+
+	for (i = 0; i < pool->nr_threads; i++) {
+		thread = &pool->threads[i];
+		if (thread->epoll_fd >= 0)
+			close(thread->epoll_fd);
+		if (thread->wake_fd >= 0)
+			close(thread->wake_fd);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+	free(pool->threads);
+	free(pool);
+}
@@ -18,6 +18,8 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "trace-local.h"
 #include "trace-msg.h"
@@ -38,6 +40,33 @@ static int backlog = 5;
 
 static int do_daemon;
 
+/* Most clients served at a time, 0 for no limit */
+static int max_clients;
+
+/* With --threads, the data of the clients is received by these threads */
+static struct listen_pool *listen_pool;
+
+/* And the clients are served by threads, instead of processes */
+struct client_thread {
+	struct client_thread		*next;
+	pthread_t			thread;
+	int				fd;
+	struct sockaddr_storage		peer_addr;
+	socklen_t			peer_addr_len;
+};
+
+static struct client_thread *client_threads;
+static int nr_client_threads;
+static pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t client_cond = PTHREAD_COND_INITIALIZER;
+
+/* The readers of the CPU data of a client */
+struct client_readers {
+	int				cpus;
+	int				*pid_array;
+	struct listen_stream		**streams;	/* with --threads */
+};
+
 /* Used for signaling INT to finish */
 static struct tracecmd_msg_handle *stop_msg_handle;
 static bool done;
@@ -137,12 +166,38 @@ static void remove_pid_file(void)
 	unlink(buf);
 }
 
+static double time_diff(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) +
+		(end->tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+/* The throughput of a connection, from its first to its last data */
+static void log_throughput(const char *host, const char *port, const char *name,
+			   unsigned long long bytes, struct timespec *start,
+			   struct timespec *end)
+{
+	double secs = time_diff(start, end);
+
+	if (!bytes)
+		return;
+
+	tracecmd_plog("%s:%s %s: %llu bytes in %.3fs (%.1f MB/s)\n",
+		      host, port, name, bytes, secs,
+		      secs > 0 ? bytes / secs / (1024 * 1024) : 0.0);
+}
+
 static int process_udp_child(int sfd, const char *host, const char *port,
 			     int cpu, int page_size, int use_tcp)
 {
 	struct sockaddr_storage peer_addr;
+	struct timespec start, end;
+	unsigned long long bytes = 0;
 	socklen_t peer_addr_len;
 	char buf[page_size];
+	int brass[2] = { -1, -1 };
+	int pipe_size = 0;
+	char name[32];
 	char *tempfile;
 	int left;
 	int cfd;
@@ -171,11 +226,33 @@ static int process_udp_child(int sfd, const char *host, const char *port,
 			pdie("accept");
 		close(sfd);
 		sfd = cfd;
+
+		/*
+		 * The pages go from the socket to the file through a pipe,
+		 * without being copied. A datagram must be read in one go,
+		 * UDP still reads them.
+		 */
+		if (pipe(brass) == 0) {
+			pipe_size = fcntl(brass[0], F_GETPIPE_SZ);
+			if (pipe_size <= 0)
+				pipe_size = page_size;
+		}
 	}
 
 	for (;;) {
-		/* TODO, make this copyless! */
-		r = read(sfd, buf, page_size);
+		if (brass[0] >= 0) {
+			r = splice(sfd, NULL, brass[1], NULL, pipe_size,
+				   SPLICE_F_MOVE);
+			/* The socket or the file may not support it */
+			if (r < 0 && errno == EINVAL && !bytes) {
+				close(brass[0]);
+				close(brass[1]);
+				brass[0] = brass[1] = -1;
+				continue;
+			}
+		} else {
+			r = read(sfd, buf, page_size);
+		}
 		if (r < 0) {
 			if (errno == EINTR)
 				break;
@@ -183,20 +260,33 @@ static int process_udp_child(int sfd, const char *host, const char *port,
 		}
 		if (!r)
 			break;
+		if (!bytes)
+			clock_gettime(CLOCK_MONOTONIC, &start);
+		bytes += r;
+
 		/* UDP requires that we get the full size in one go */
 		if (!use_tcp && r < page_size && !once) {
 			once = 1;
 			warning("read %d bytes, expected %d", r, page_size);
 		}
 
-		left = r;
-		do {
-			w = write(fd, buf + (r - left), left);
-			if (w > 0)
-				left -= w;
-		} while (w >= 0 && left);
+		if (brass[0] >= 0) {
+			if (listen_splice_to_file(brass, fd, r) < 0)
+				pdie("writing pages from client");
+		} else {
+			left = r;
+			do {
+				w = write(fd, buf + (r - left), left);
+				if (w > 0)
+					left -= w;
+			} while (w >= 0 && left);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
 	}
 
+	snprintf(name, sizeof(name), "cpu%d", cpu);
+	log_throughput(host, port, name, bytes, &start, &end);
+
  done:
 	put_temp_file(tempfile);
 	exit(0);
@@ -222,8 +312,10 @@ static int udp_bind_a_port(int start_port, int *sfd, int use_tcp)
 	hints.ai_flags = AI_PASSIVE;
 
 	s = getaddrinfo(NULL, buf, &hints, &result);
-	if (s != 0)
-		pdie("getaddrinfo: error opening udp socket");
+	if (s != 0) {
+		tracecmd_plog("getaddrinfo: error opening udp socket\n");
+		return -1;
+	}
 
 	for (rp = result; rp != NULL; rp = rp->ai_next) {
 		*sfd = socket(rp->ai_family, rp->ai_socktype,
@@ -239,8 +331,10 @@ static int udp_bind_a_port(int start_port, int *sfd, int use_tcp)
 
 	if (rp == NULL) {
 		freeaddrinfo(result);
-		if (++num_port > MAX_PORT_SEARCH)
-			pdie("No available ports to bind");
+		if (++num_port > MAX_PORT_SEARCH) {
+			tracecmd_plog("No available ports to bind\n");
+			return -1;
+		}
 		goto again;
 	}
 
@@ -268,21 +362,57 @@ static void fork_udp_reader(int sfd, const char *node, const char *port,
 	close(sfd);
 }
 
-static int open_udp(const char *node, const char *port, int *pid,
-		    int cpu, int pagesize, int start_port, int use_tcp)
+/* Have a thread of the listen pool receive the data of @cpu */
+static int add_udp_stream(int sfd, const char *node, const char *port,
+			  struct listen_stream **stream, int cpu, int pagesize,
+			  int use_tcp)
+{
+	char *tempfile;
+	int fd;
+
+	tempfile = get_temp_file(node, port, cpu);
+	if (!tempfile)
+		return -ENOMEM;
+
+	fd = open(tempfile, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+	if (fd < 0) {
+		tracecmd_plog("Can not create %s\n", tempfile);
+		put_temp_file(tempfile);
+		return -1;
+	}
+	put_temp_file(tempfile);
+
+	*stream = listen_pool_add(listen_pool, sfd, fd, pagesize, use_tcp);
+	if (!*stream) {
+		tracecmd_plog("Failed to receive the data of cpu %d\n", cpu);
+		close(fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int open_udp(const char *node, const char *port,
+		    struct client_readers *readers, int cpu, int pagesize,
+		    int start_port, int use_tcp)
 {
 	int sfd;
 	int num_port;
 
-	/*
-	 * udp_bind_a_port() currently does not return an error, but if that
-	 * changes in the future, we have a check for it now.
-	 */
 	num_port = udp_bind_a_port(start_port, &sfd, use_tcp);
 	if (num_port < 0)
 		return num_port;
 
-	fork_udp_reader(sfd, node, port, pid, cpu, pagesize, use_tcp);
+	if (listen_pool) {
+		if (add_udp_stream(sfd, node, port, &readers->streams[cpu],
+				   cpu, pagesize, use_tcp) < 0) {
+			close(sfd);
+			return -1;
+		}
+	} else {
+		fork_udp_reader(sfd, node, port, &readers->pid_array[cpu],
+				cpu, pagesize, use_tcp);
+	}
 
 	return num_port;
 }
@@ -439,39 +569,46 @@ static int create_client_file(const char *node, const char *port)
 
 	ofd = open(buf, O_RDWR | O_CREAT | O_TRUNC, 0644);
 	if (ofd < 0)
-		pdie("Can not create file %s", buf);
+		tracecmd_plog("Can not create file %s\n", buf);
 	return ofd;
 }
 
-static void destroy_all_readers(int cpus, int *pid_array, const char *node,
-				const char *port)
+static void destroy_all_readers(struct client_readers *readers,
+				const char *node, const char *port)
 {
 	int cpu;
 
-	for (cpu = 0; cpu < cpus; cpu++) {
-		if (pid_array[cpu] > 0) {
-			kill(pid_array[cpu], SIGKILL);
-			waitpid(pid_array[cpu], NULL, 0);
+	for (cpu = 0; cpu < readers->cpus; cpu++) {
+		if (readers->streams) {
+			if (readers->streams[cpu])
+				listen_pool_remove(listen_pool,
+						   readers->streams[cpu], NULL);
 			delete_temp_file(node, port, cpu);
-			pid_array[cpu] = 0;
+		} else if (readers->pid_array[cpu] > 0) {
+			kill(readers->pid_array[cpu], SIGKILL);
+			waitpid(readers->pid_array[cpu], NULL, 0);
+			delete_temp_file(node, port, cpu);
+			readers->pid_array[cpu] = 0;
 		}
 	}
 
-	free(pid_array);
+	free(readers->pid_array);
+	free(readers->streams);
+	free(readers);
 }
 
-static int *create_all_readers(const char *node, const char *port,
-			       int pagesize, struct tracecmd_msg_handle *msg_handle)
+static struct client_readers *
+create_all_readers(const char *node, const char *port,
+		   int pagesize, struct tracecmd_msg_handle *msg_handle)
 {
 	int use_tcp = msg_handle->flags & TRACECMD_MSG_FL_USE_TCP;
+	struct client_readers *readers;
 	char buf[BUFSIZ];
 	unsigned int *port_array;
-	int *pid_array;
 	unsigned int start_port;
-	unsigned int udp_port;
+	int udp_port;
 	int cpus = msg_handle->cpu_count;
 	int cpu;
-	int pid;
 
 	if (!pagesize)
 		return NULL;
@@ -480,24 +617,32 @@ static int *create_all_readers(const char *node, const char *port,
 	if (!port_array)
 		return NULL;
 
-	pid_array = malloc(sizeof(*pid_array) * cpus);
-	if (!pid_array) {
+	readers = calloc(1, sizeof(*readers));
+	if (!readers) {
 		free(port_array);
 		return NULL;
 	}
 
-	memset(pid_array, 0, sizeof(int) * cpus);
+	if (listen_pool)
+		readers->streams = calloc(cpus, sizeof(*readers->streams));
+	else
+		readers->pid_array = calloc(cpus, sizeof(*readers->pid_array));
+	if (!readers->streams && !readers->pid_array) {
+		free(readers);
+		free(port_array);
+		return NULL;
+	}
 
 	start_port = START_PORT_SEARCH;
 
 	/* Now create a UDP port for each CPU */
 	for (cpu = 0; cpu < cpus; cpu++) {
-		udp_port = open_udp(node, port, &pid, cpu,
+		udp_port = open_udp(node, port, readers, cpu,
 				    pagesize, start_port, use_tcp);
 		if (udp_port < 0)
 			goto out_free;
 		port_array[cpu] = udp_port;
-		pid_array[cpu] = pid;
+		readers->cpus = cpu + 1;
 		/*
 		 * Due to some bugging finding ports,
 		 * force search after last port
@@ -523,11 +668,11 @@ static int *create_all_readers(const char *node, const char *port,
 	}
 
 	free(port_array);
-	return pid_array;
+	return readers;
 
  out_free:
 	free(port_array);
-	destroy_all_readers(cpus, pid_array, node, port);
+	destroy_all_readers(readers, node, port);
 	return NULL;
 }
 
@@ -567,13 +712,27 @@ out:
 	return ret;
 }
 
-static void stop_all_readers(int cpus, int *pid_array)
+static void stop_all_readers(struct client_readers *readers,
+			     const char *node, const char *port)
 {
+	struct listen_stream_stats stats;
+	char name[32];
 	int cpu;
 
-	for (cpu = 0; cpu < cpus; cpu++) {
-		if (pid_array[cpu] > 0)
-			kill(pid_array[cpu], SIGUSR1);
+	for (cpu = 0; cpu < readers->cpus; cpu++) {
+		if (!readers->streams) {
+			if (readers->pid_array[cpu] > 0)
+				kill(readers->pid_array[cpu], SIGUSR1);
+			continue;
+		}
+		if (!readers->streams[cpu])
+			continue;
+		listen_pool_remove(listen_pool, readers->streams[cpu], &stats);
+		readers->streams[cpu] = NULL;
+
+		snprintf(name, sizeof(name), "cpu%d", cpu);
+		log_throughput(node, port, name, stats.bytes,
+			       &stats.start, &stats.end);
 	}
 }
 
@@ -587,8 +746,10 @@ static int put_together_file(int cpus, int ofd, const char *node,
 
 	/* Now put together the file */
 	temp_files = malloc(sizeof(*temp_files) * cpus);
-	if (!temp_files)
+	if (!temp_files) {
+		close(ofd);
 		return -ENOMEM;
+	}
 
 	for (cpu = 0; cpu < cpus; cpu++) {
 		temp_files[cpu] = get_temp_file(node, port, cpu);
@@ -613,7 +774,10 @@ static int put_together_file(int cpus, int ofd, const char *node,
 	ret = tracecmd_write_cpu_data(handle, cpus, temp_files);
 
 out:
-	tracecmd_output_close(handle);
+	if (handle)
+		tracecmd_output_close(handle);
+	else
+		close(ofd);
 	for (cpu--; cpu >= 0; cpu--) {
 		put_temp_file(temp_files[cpu]);
 	}
@@ -624,7 +788,9 @@ out:
 static int process_client(struct tracecmd_msg_handle *msg_handle,
 			  const char *node, const char *port)
 {
-	int *pid_array;
+	struct client_readers *readers;
+	struct timespec start, end;
+	off64_t size;
 	int pagesize;
 	int cpus;
 	int ofd;
@@ -635,37 +801,52 @@ static int process_client(struct tracecmd_msg_handle *msg_handle,
 		return pagesize;
 
 	ofd = create_client_file(node, port);
+	if (ofd < 0)
+		return ofd;
 
-	pid_array = create_all_readers(node, port, pagesize, msg_handle);
-	if (!pid_array)
+	readers = create_all_readers(node, port, pagesize, msg_handle);
+	if (!readers) {
+		close(ofd);
 		return -ENOMEM;
+	}
 
-	/* on signal stop this msg */
-	stop_msg_handle = msg_handle;
+	/* on signal stop this msg (the threads are stopped by the main one) */
+	if (!listen_pool)
+		stop_msg_handle = msg_handle;
 
 	/* Now we are ready to start reading data from the client */
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	if (msg_handle->version == V3_PROTOCOL)
 		ret = tracecmd_msg_collect_data(msg_handle, ofd);
 	else
 		ret = collect_metadata_from_client(msg_handle, ofd);
+	clock_gettime(CLOCK_MONOTONIC, &end);
 	stop_msg_handle = NULL;
 
+	size = lseek64(ofd, 0, SEEK_END);
+	if (size > 0)
+		log_throughput(node, port, "metadata", size, &start, &end);
+
 	/* wait a little to let our readers finish reading */
 	sleep(1);
 
 	cpus = msg_handle->cpu_count;
 
 	/* stop our readers */
-	stop_all_readers(cpus, pid_array);
+	stop_all_readers(readers, node, port);
 
 	/* wait a little to have the readers clean up */
-	sleep(1);
+	if (!listen_pool)
+		sleep(1);
 
+	/* The file is closed with its output handle */
 	if (!ret)
 		ret = put_together_file(cpus, ofd, node, port,
 					msg_handle->version < V3_PROTOCOL);
+	else
+		close(ofd);
 
-	destroy_all_readers(cpus, pid_array, node, port);
+	destroy_all_readers(readers, node, port);
 
 	return ret;
 }
@@ -694,19 +875,18 @@ static int do_fork(int cfd)
 	return 0;
 }
 
-static int do_connection(int cfd, struct sockaddr_storage *peer_addr,
-			  socklen_t peer_addr_len)
+static int serve_client(int cfd, struct sockaddr_storage *peer_addr,
+			socklen_t peer_addr_len)
 {
 	struct tracecmd_msg_handle *msg_handle;
 	char host[NI_MAXHOST], service[NI_MAXSERV];
 	int s;
-	int ret;
-
-	ret = do_fork(cfd);
-	if (ret)
-		return ret;
 
 	msg_handle = tracecmd_msg_handle_alloc(cfd, 0);
+	if (!msg_handle) {
+		close(cfd);
+		return -1;
+	}
 
 	s = getnameinfo((struct sockaddr *)peer_addr, peer_addr_len,
 			host, NI_MAXHOST,
@@ -716,7 +896,6 @@ static int do_connection(int cfd, struct sockaddr_storage *peer_addr,
 		tracecmd_plog("Connected with %s:%s\n", host, service);
 	else {
 		tracecmd_plog("Error with getnameinfo: %s\n", gai_strerror(s));
-		close(cfd);
 		tracecmd_msg_handle_close(msg_handle);
 		return -1;
 	}
@@ -725,10 +904,24 @@ static int do_connection(int cfd, struct sockaddr_storage *peer_addr,
 
 	tracecmd_msg_handle_close(msg_handle);
 
+	return 0;
+}
+
+static int do_connection(int cfd, struct sockaddr_storage *peer_addr,
+			  socklen_t peer_addr_len)
+{
+	int ret;
+
+	ret = do_fork(cfd);
+	if (ret)
+		return ret;
+
+	ret = serve_client(cfd, peer_addr, peer_addr_len);
+
 	if (!tracecmd_get_debug())
 		exit(0);
 
-	return 0;
+	return ret;
 }
 
 static int *client_pids;
@@ -807,15 +1000,128 @@ static void clean_up(void)
 	} while (ret > 0);
 }
 
+static void *client_thread(void *data)
+{
+	struct client_thread *client = data;
+	struct client_thread **last;
+	sigset_t mask;
+
+	/* Signals are for the main thread */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	serve_client(client->fd, &client->peer_addr, client->peer_addr_len);
+
+	pthread_mutex_lock(&client_lock);
+	for (last = &client_threads; *last != client; last = &(*last)->next)
+		;
+	*last = client->next;
+	nr_client_threads--;
+	pthread_cond_broadcast(&client_cond);
+	pthread_mutex_unlock(&client_lock);
+
+	free(client);
+	return NULL;
+}
+
+/* Serve the client with a thread of this process (with --threads) */
+static void start_client_thread(int cfd, struct sockaddr_storage *peer_addr,
+				socklen_t peer_addr_len)
+{
+	struct client_thread *client;
+	pthread_attr_t attr;
+
+	client = calloc(1, sizeof(*client));
+	if (!client) {
+		warning("failed to allocate client");
+		close(cfd);
+		return;
+	}
+	client->fd = cfd;
+	client->peer_addr = *peer_addr;
+	client->peer_addr_len = peer_addr_len;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_mutex_lock(&client_lock);
+	if (pthread_create(&client->thread, &attr, client_thread, client)) {
+		pthread_mutex_unlock(&client_lock);
+		warning("failed to create client thread");
+		close(cfd);
+		free(client);
+		goto out;
+	}
+	client->next = client_threads;
+	client_threads = client;
+	nr_client_threads++;
+	pthread_mutex_unlock(&client_lock);
+ out:
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * With --max-clients, wait for a client to be done before taking a new
+ * one. The new clients wait in the backlog of the socket meanwhile.
+ */
+static void wait_for_client_slot(void)
+{
+	int status;
+	int pid;
+
+	if (!max_clients)
+		return;
+
+	if (listen_pool) {
+		struct timespec ts;
+
+		pthread_mutex_lock(&client_lock);
+		while (nr_client_threads >= max_clients && !done) {
+			/* Signals do not end the wait, look at done once in a while */
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			pthread_cond_timedwait(&client_cond, &client_lock, &ts);
+		}
+		pthread_mutex_unlock(&client_lock);
+		return;
+	}
+
+	while (saved_pids - free_pids >= max_clients && !done) {
+		pid = waitpid(-1, &status, 0);
+		if (pid > 0)
+			remove_process(pid);
+		else if (errno != EINTR)
+			break;
+	}
+}
+
+static void stop_client_threads(void)
+{
+	struct client_thread *client;
+
+	pthread_mutex_lock(&client_lock);
+	/* Only stop the clients if we received SIGINT or SIGTERM */
+	if (done) {
+		for (client = client_threads; client; client = client->next)
+			shutdown(client->fd, SHUT_RDWR);
+	}
+	while (nr_client_threads)
+		pthread_cond_wait(&client_cond, &client_lock);
+	pthread_mutex_unlock(&client_lock);
+}
+
 static void do_accept_loop(int sfd)
 {
 	struct sockaddr_storage peer_addr;
 	socklen_t peer_addr_len;
 	int cfd, pid;
 
-	peer_addr_len = sizeof(peer_addr);
-
 	do {
+		wait_for_client_slot();
+		if (done)
+			break;
+
+		peer_addr_len = sizeof(peer_addr);
 		cfd = accept(sfd, (struct sockaddr *)&peer_addr,
 			     &peer_addr_len);
 		if (cfd < 0 && errno == EINTR) {
@@ -825,6 +1131,11 @@ static void do_accept_loop(int sfd)
 		if (cfd < 0)
 			pdie("connecting");
 
+		if (listen_pool) {
+			start_client_thread(cfd, &peer_addr, peer_addr_len);
+			continue;
+		}
+
 		pid = do_connection(cfd, &peer_addr, peer_addr_len);
 		if (pid > 0)
 			add_process(pid);
@@ -902,7 +1213,13 @@ static void do_listen(char *port)
 
 	do_accept_loop(sfd);
 
-	kill_clients();
+	if (listen_pool) {
+		stop_client_threads();
+		listen_pool_free(listen_pool);
+		listen_pool = NULL;
+	} else {
+		kill_clients();
+	}
 
 	remove_pid_file();
 }
@@ -916,6 +1233,8 @@ static void start_daemon(void)
 }
 
 enum {
+	OPT_max_clients	= 253,
+	OPT_threads	= 254,
 	OPT_debug	= 255,
 };
 
@@ -923,6 +1242,7 @@ void trace_listen(int argc, char **argv)
 {
 	char *logfile = NULL;
 	char *port = NULL;
+	int nr_threads = 0;
 	int daemon = 0;
 	int c;
 
@@ -938,6 +1258,8 @@ void trace_listen(int argc, char **argv)
 			{"port", required_argument, NULL, 'p'},
 			{"help", no_argument, NULL, '?'},
 			{"debug", no_argument, NULL, OPT_debug},
+			{"threads", required_argument, NULL, OPT_threads},
+			{"max-clients", required_argument, NULL, OPT_max_clients},
 			{NULL, 0, NULL, 0}
 		};
 
@@ -967,6 +1289,16 @@ void trace_listen(int argc, char **argv)
 		case OPT_debug:
 			tracecmd_set_debug(true);
 			break;
+		case OPT_threads:
+			nr_threads = atoi(optarg);
+			if (nr_threads <= 0)
+				die("--threads needs a number of threads");
+			break;
+		case OPT_max_clients:
+			max_clients = atoi(optarg);
+			if (max_clients <= 0)
+				die("--max-clients needs a number of clients");
+			break;
 		default:
 			usage(argv);
 		}
@@ -996,6 +1328,13 @@ void trace_listen(int argc, char **argv)
 	if (daemon)
 		start_daemon();
 
+	/* After daemon(), the threads would not be in the new process */
+	if (nr_threads) {
+		listen_pool = listen_pool_alloc(nr_threads);
+		if (!listen_pool)
+			die("Failed to start %d threads", nr_threads);
+	}
+
 	signal_setup(SIGINT, finish);
 	signal_setup(SIGTERM, finish);
 
@@ -61,6 +61,9 @@ static void *zalloc(size_t size)
 	return calloc(1, size);
 }
 
+/* The function and pointer descriptors, freed at once at the end */
+static struct tracecmd_arena *arena;
+
 static struct tep_event *
 update_event(struct tep_handle *pevent,
 	     const char *sys, const char *name, int *id)
@@ -221,7 +224,7 @@ static struct func_descr *create_func(const char *func)
 	struct func_descr *funcd;
 	int key = make_key(func, strlen(func)) & HASH_MASK;
 
-	funcd = zalloc(sizeof(*funcd));
+	funcd = tracecmd_arena_get(arena, sizeof(*funcd));
 	if (!funcd)
 		die("malloc");
 
@@ -252,7 +255,7 @@ static struct ptr_descr *create_ptr(unsigned long long ptr)
 	struct ptr_descr *ptrd;
 	int key = make_key(&ptr, sizeof(ptr)) & HASH_MASK;
 
-	ptrd = zalloc(sizeof(*ptrd));
+	ptrd = tracecmd_arena_get(arena, sizeof(*ptrd));
 	if (!ptrd)
 		die("malloc");
 
@@ -279,7 +282,7 @@ static void remove_ptr(unsigned long long ptr)
 		return;
 
 	*last = ptrd->next;
-	free(ptrd);
+	tracecmd_arena_put(arena, ptrd, sizeof(*ptrd));
 }
 
 static void add_kmalloc(const char *func, unsigned long long ptr,
@@ -459,12 +462,21 @@ static void print_list(void)
 	}
 }
 
+static int mem_event(struct tracecmd_input *handle,
+		     struct tep_record *record, int cpu, void *data)
+{
+	struct tep_handle *pevent = data;
+
+	process_record(pevent, record);
+
+	return 0;
+}
+
 static void do_trace_mem(struct tracecmd_input *handle)
 {
 	struct tep_handle *pevent = tracecmd_get_tep(handle);
 	struct tep_record *record;
 	struct tep_event *event;
-	int missed_events = 0;
 	int cpus;
 	int cpu;
 	int ret;
@@ -501,15 +513,8 @@ static void do_trace_mem(struct tracecmd_input *handle)
 	update_kmem_cache_alloc_node(pevent);
 	update_kmem_cache_free(pevent);
 
-	while ((record = tracecmd_read_next_data(handle, &cpu))) {
-
-		/* record missed event */
-		if (!missed_events && record->missed_events)
-			missed_events = 1;
-
-		process_record(pevent, record);
-		tracecmd_free_record(record);
-	}
+	if (tracecmd_iterate_events(handle, -1, mem_event, pevent) < 0)
+		die("Failed to read the events");
 
 	sort_list();
 	print_list();
@@ -550,7 +555,7 @@ void trace_mem(int argc, char **argv)
 	if (!input_file)
 		input_file = DEFAULT_INPUT_FILE;
 
-	handle = tracecmd_alloc(input_file, 0);
+	handle = tracecmd_alloc(input_file, TRACECMD_FL_SEQUENTIAL_SCAN);
 	if (!handle)
 		die("can't open %s\n", input_file);
 
@@ -558,7 +563,12 @@ void trace_mem(int argc, char **argv)
 	if (ret)
 		return;
 
+	arena = tracecmd_arena_alloc();
+	if (!arena)
+		die("malloc");
+
 	do_trace_mem(handle);
 
+	tracecmd_arena_free(arena);
 	tracecmd_close(handle);
 }
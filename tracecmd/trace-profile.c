@@ -9,6 +9,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 #ifndef NO_AUDIT
 #include <libaudit.h>
 #endif
@@ -27,6 +29,12 @@
 #define TASK_STATE_TO_CHAR_STR "RSDTtXZxKWP"
 #define TASK_STATE_MAX		1024
 
+/* Not known yet, the task may have gone to sleep in an earlier slice */
+#define TASK_SLEEP_UNKNOWN	-1
+
+/* report --profile --threads: the slices of the trace each thread takes */
+#define SLICES_PER_THREAD	4
+
 #define task_from_item(item)	container_of(item, struct task_data, hash)
 #define start_from_item(item)	container_of(item, struct start_data, hash)
 #define event_from_item(item)	container_of(item, struct event_hash, hash)
@@ -98,14 +106,16 @@ struct stack_data {
 	unsigned long long	time_max;
 	unsigned long long	ts_max;
 	unsigned long long	time_avg;
+	struct tracecmd_histogram hist;
 	unsigned long		size;
 	char			caller[];
 };
 
+/* A copy of the stack, so that the pages of the trace are not held */
 struct stack_holder {
 	unsigned long		size;
 	void			*caller;
-	struct tep_record	*record;
+	unsigned long long	ts;
 };
 
 struct start_data {
@@ -116,11 +126,34 @@ struct start_data {
 	unsigned long long 	timestamp;
 	unsigned long long 	search_val;
 	unsigned long long	val;
+	unsigned long long	seq;	/* order in which the starts were added */
 	int			cpu;
 
 	struct stack_holder	stack;
 };
 
+/*
+ * In the slices of a threaded profile, what depends on the state left by
+ * the slices before it. These are replayed in order by merge_slice().
+ */
+enum slice_op_type {
+	SLICE_OP_END,		/* an end without a start in the slice */
+	SLICE_OP_WAKEUP,	/* a wakeup of a task not known to be sleeping */
+	SLICE_OP_MISSED,	/* events were lost on a CPU */
+	SLICE_OP_STACK,		/* the stack trace of a wakeup op */
+};
+
+struct slice_op {
+	struct slice_op		*next;
+	enum slice_op_type	type;
+	struct event_data	*event_data;	/* of the start */
+	unsigned long long	search_val;
+	unsigned long long	ts;
+	int			pid;
+	int			cpu;
+	struct stack_holder	stack;		/* the stack trace that followed */
+};
+
 struct event_hash {
 	struct trace_hash_item	hash;
 	struct event_data	*event_data;
@@ -135,6 +168,7 @@ struct event_hash {
 	unsigned long long	ts_min;
 	unsigned long long	time_std;
 	unsigned long long	last_time;
+	struct tracecmd_histogram hist;
 
 	struct trace_hash	stacks;
 };
@@ -149,6 +183,7 @@ struct task_data {
 	struct trace_hash_item	hash;
 	int			pid;
 	int			sleeping;
+	bool			comm_reset;	/* execed in this slice */
 
 	char			*comm;
 
@@ -159,8 +194,10 @@ struct task_data {
 	struct start_data	*last_start;
 	struct event_hash	*last_event;
 	struct tep_record	*last_stack;
+	struct slice_op		*stack_op;	/* last_event, until the merge */
 	struct handle_data	*handle;
 	struct group_data	*group;
+	unsigned long long	last_ts;	/* of its last record, for --evict */
 };
 
 struct cpu_info {
@@ -176,6 +213,7 @@ struct handle_data {
 	struct handle_data	*next;
 	struct tracecmd_input	*handle;
 	struct tep_handle	*pevent;
+	struct tracecmd_arena	*arena;	/* the tasks, events, starts, stacks */
 
 	struct trace_hash	events;
 	struct trace_hash	group_hash;
@@ -196,45 +234,175 @@ struct handle_data {
 
 	struct task_data	*global_task;
 	struct task_data	*global_percpu_tasks;
+	struct task_data	*last_task;
+	unsigned long long	last_ts;	/* of the last record */
+
+	struct event_data	*stacktrace_event;
+	struct hook_list	*hooks;
+	int			global;
 
 	int			cpus;
+
+	/* The slices of a threaded profile, see trace_profile_threads() */
+	int			slice;
+	unsigned long long	nr_starts;
+	struct slice_op		*ops;
+	struct slice_op		**ops_tail;
+	struct slice_op		*deferred;	/* the last end without a start */
 };
 
 static struct handle_data *handles;
-static struct event_data *stacktrace_event;
 static bool merge_like_comms = false;
 
+/* A live profile, see trace_profile_check_snapshot() */
+static int snapshot_secs;
+static int decay_percent;
+static unsigned long long evict_nsecs;
+static time_t next_snapshot;
+static int nr_snapshots;
+
+/* The percentiles of the times shown, see trace_profile_set_percentiles() */
+static double default_percentiles[] = { 50, 90, 99, 99.9 };
+static double *percentiles = default_percentiles;
+static int nr_percentiles = ARRAY_SIZE(default_percentiles);
+
 void trace_profile_set_merge_like_comms(void)
 {
 	merge_like_comms = true;
 }
 
+void trace_profile_set_snapshot(int secs)
+{
+	snapshot_secs = secs;
+}
+
+void trace_profile_set_decay(int percent)
+{
+	decay_percent = percent;
+}
+
+void trace_profile_set_evict(int secs)
+{
+	evict_nsecs = (unsigned long long)secs * NSEC_PER_SEC;
+}
+
+/**
+ * trace_profile_set_percentiles - set the percentiles the profile shows
+ * @list: the percentiles separated by commas (like "50,99,99.9")
+ *
+ * Returns 0 on success, or -1 if @list is not a list of percentiles
+ * above 0 and up to 100.
+ */
+int trace_profile_set_percentiles(const char *list)
+{
+	double *values = NULL;
+	double *tmp;
+	const char *p;
+	char *end;
+	int nr = 0;
+
+	for (p = list; *p; p = end + 1) {
+		tmp = realloc(values, sizeof(*values) * (nr + 1));
+		if (!tmp)
+			goto fail;
+		values = tmp;
+		values[nr] = strtod(p, &end);
+		if (end == p || values[nr] <= 0 || values[nr] > 100)
+			goto fail;
+		nr++;
+		if (*end != ',')
+			break;
+	}
+	/* An empty list leaves end unset */
+	if (!nr || *end)
+		goto fail;
+
+	if (percentiles != default_percentiles)
+		free(percentiles);
+	percentiles = values;
+	nr_percentiles = nr;
+	return 0;
+ fail:
+	free(values);
+	return -1;
+}
+
+static void print_percentiles(struct tracecmd_histogram *hist,
+			      unsigned long long max)
+{
+	unsigned long long val;
+	int i;
+
+	/* The bucket of a percentile may go past the max */
+	for (i = 0; i < nr_percentiles; i++) {
+		val = tracecmd_histogram_percentile(hist, percentiles[i]);
+		printf(" p%g:%lld", percentiles[i], val < max ? val : max);
+	}
+}
+
 static struct start_data *
 add_start(struct task_data *task,
-	  struct event_data *event_data, struct tep_record *record,
+	  struct event_data *event_data, unsigned long long ts, int cpu,
 	  unsigned long long search_val, unsigned long long val)
 {
 	struct start_data *start;
 
-	start = malloc(sizeof(*start));
+	start = tracecmd_arena_get(task->handle->arena, sizeof(*start));
 	if (!start)
 		return NULL;
-	memset(start, 0, sizeof(*start));
 	start->hash.key = trace_hash(search_val);
 	start->search_val = search_val;
 	start->val = val;
-	start->timestamp = record->ts;
+	start->timestamp = ts;
 	start->event_data = event_data;
-	start->cpu = record->cpu;
+	start->cpu = cpu;
 	start->task = task;
+	start->seq = task->handle->nr_starts++;
 	trace_hash_add(&task->start_hash, &start->hash);
 	if (event_data->migrate)
 		list_add(&start->list, &task->handle->migrate_starts);
 	else
-		list_add(&start->list, &task->handle->cpu_starts[record->cpu]);
+		list_add(&start->list, &task->handle->cpu_starts[cpu]);
 	return start;
 }
 
+static struct slice_op *
+add_slice_op(struct handle_data *h, enum slice_op_type type, int pid, int cpu,
+	     struct event_data *event_data, unsigned long long search_val,
+	     unsigned long long ts)
+{
+	struct slice_op *op;
+
+	op = tracecmd_arena_get(h->arena, sizeof(*op));
+	if (!op)
+		die("Could not allocate slice op");
+
+	op->type = type;
+	op->pid = pid;
+	op->cpu = cpu;
+	op->event_data = event_data;
+	op->search_val = search_val;
+	op->ts = ts;
+
+	*h->ops_tail = op;
+	h->ops_tail = &op->next;
+
+	return op;
+}
+
+static void save_stack(struct handle_data *h, struct stack_holder *stack,
+		       void *caller, unsigned long size, unsigned long long ts)
+{
+	stack->caller = tracecmd_arena_get(h->arena, size);
+	if (!stack->caller) {
+		warning("Could not allocate stack");
+		return;
+	}
+	memcpy(stack->caller, caller, size);
+	stack->size = size;
+	stack->ts = ts;
+}
+
 struct event_data_match {
 	struct event_data	*event_data;
 	unsigned long long	search_val;
@@ -260,6 +428,16 @@ static int match_event(struct trace_hash_item *item, void *data)
 		event->val == edata->val;
 }
 
+static unsigned long long event_hash_key(struct event_data_match *edata)
+{
+	unsigned long long key;
+
+	key = (unsigned long)edata->event_data +
+		(unsigned long)edata->search_val +
+		(unsigned long)edata->val;
+	return trace_hash(key);
+}
+
 static struct event_hash *
 find_event_hash(struct task_data *task, struct event_data_match *edata)
 {
@@ -267,18 +445,14 @@ find_event_hash(struct task_data *task, struct event_data_match *edata)
 	struct trace_hash_item *item;
 	unsigned long long key;
 
-	key = (unsigned long)edata->event_data +
-		(unsigned long)edata->search_val +
-		(unsigned long)edata->val;
-	key = trace_hash(key);
+	key = event_hash_key(edata);
 	item = trace_hash_find(&task->event_hash, key, match_event, edata);
 	if (item)
 		return event_from_item(item);
 
-	event_hash = malloc(sizeof(*event_hash));
+	event_hash = tracecmd_arena_get(task->handle->arena, sizeof(*event_hash));
 	if (!event_hash)
 		return NULL;
-	memset(event_hash, 0, sizeof(*event_hash));
 
 	event_hash->event_data = edata->event_data;
 	event_hash->search_val = edata->search_val;
@@ -342,7 +516,7 @@ static int match_stack(struct trace_hash_item *item, void *data)
 }
 
 
-static void add_event_stack(struct event_hash *event_hash,
+static void add_event_stack(struct handle_data *h, struct event_hash *event_hash,
 			    void *caller, unsigned long size,
 			    unsigned long long time, unsigned long long ts)
 {
@@ -363,12 +537,11 @@ static void add_event_stack(struct event_hash *event_hash,
 
 	item = trace_hash_find(&event_hash->stacks, key, match_stack, &match);
 	if (!item) {
-		stack = malloc(sizeof(*stack) + size);
+		stack = tracecmd_arena_get(h->arena, sizeof(*stack) + size);
 		if (!stack) {
 			warning("Could not allocate stack");
 			return;
 		}
-		memset(stack, 0, sizeof(*stack));
 		memcpy(&stack->caller, caller, size);
 		stack->size = size;
 		stack->hash.key = key;
@@ -378,6 +551,7 @@ static void add_event_stack(struct event_hash *event_hash,
 
 	stack->count++;
 	stack->time += time;
+	tracecmd_histogram_add(&stack->hist, time);
 	if (stack->count == 1 || time < stack->time_min) {
 		stack->time_min = time;
 		stack->ts_min = ts;
@@ -390,13 +564,14 @@ static void add_event_stack(struct event_hash *event_hash,
 
 static void free_start(struct start_data *start)
 {
+	struct tracecmd_arena *arena = start->task->handle->arena;
+
 	if (start->task->last_start == start)
 		start->task->last_start = NULL;
-	if (start->stack.record)
-		tracecmd_free_record(start->stack.record);
+	tracecmd_arena_put(arena, start->stack.caller, start->stack.size);
 	trace_hash_del(&start->hash);
 	list_del(&start->list);
-	free(start);
+	tracecmd_arena_put(arena, start, sizeof(*start));
 }
 
 static struct event_hash *
@@ -422,6 +597,7 @@ add_and_free_start(struct task_data *task, struct start_data *start,
 	event_hash->count++;
 	event_hash->time_total += delta;
 	event_hash->last_time = delta;
+	tracecmd_histogram_add(&event_hash->hist, delta);
 
 	if (delta > event_hash->time_max) {
 		event_hash->time_max = delta;
@@ -433,18 +609,9 @@ add_and_free_start(struct task_data *task, struct start_data *start,
 		event_hash->ts_min = ts;
 	}
 
-	if (start->stack.record) {
-		unsigned long size;
-		void *caller;
-
-		size = start->stack.size;
-		caller = start->stack.caller;
-
-		add_event_stack(event_hash, caller, size, delta,
-				start->stack.record->ts);
-		tracecmd_free_record(start->stack.record);
-		start->stack.record = NULL;
-	}
+	if (start->stack.caller)
+		add_event_stack(task->handle, event_hash, start->stack.caller,
+				start->stack.size, delta, start->stack.ts);
 
 	free_start(start);
 
@@ -455,11 +622,19 @@ static struct event_hash *
 find_and_update_start(struct task_data *task, struct event_data *event_data,
 		      unsigned long long ts, unsigned long long search_val)
 {
+	struct handle_data *h = task->handle;
 	struct start_data *start;
 
+	h->deferred = NULL;
+
 	start = find_start(task, event_data, search_val);
-	if (!start)
+	if (!start) {
+		/* In a slice, the start may be in one of the slices before */
+		if (h->slice && event_data)
+			h->deferred = add_slice_op(h, SLICE_OP_END, task->pid, -1,
+						   event_data, search_val, ts);
 		return NULL;
+	}
 	return add_and_free_start(task, start, event_data, ts);
 }
 
@@ -474,6 +649,8 @@ static int match_task(struct trace_hash_item *item, void *data)
 static void init_task(struct handle_data *h, struct task_data *task)
 {
 	task->handle = h;
+	if (h->slice)
+		task->sleeping = TASK_SLEEP_UNKNOWN;
 
 	trace_hash_init(&task->start_hash, 16);
 	trace_hash_init(&task->event_hash, 32);
@@ -485,12 +662,11 @@ add_task(struct handle_data *h, int pid)
 	unsigned long long key = trace_hash(pid);
 	struct task_data *task;
 
-	task = malloc(sizeof(*task));
+	task = tracecmd_arena_get(h->arena, sizeof(*task));
 	if (!task) {
 		warning("Could not allocate task");
 		return NULL;
 	}
-	memset(task, 0, sizeof(*task));
 
 	task->pid = pid;
 	task->hash.key = key;
@@ -506,20 +682,23 @@ find_task(struct handle_data *h, int pid)
 {
 	unsigned long long key = trace_hash(pid);
 	struct trace_hash_item *item;
-	static struct task_data *last_task;
 	void *data = (unsigned long *)&pid;
 
-	if (last_task && last_task->pid == pid)
-		return last_task;
+	if (h->last_task && h->last_task->pid == pid)
+		goto out;
 
 	item = trace_hash_find(&h->task_hash, key, match_task, data);
 
 	if (item)
-		last_task = task_from_item(item);
+		h->last_task = task_from_item(item);
 	else
-		last_task = add_task(h, pid);
+		h->last_task = add_task(h, pid);
 
-	return last_task;
+	if (!h->last_task)
+		return NULL;
+ out:
+	h->last_task->last_ts = h->last_ts;
+	return h->last_task;
 }
 
 static int match_group(struct trace_hash_item *item, void *data)
@@ -536,7 +715,7 @@ add_task_comm(struct task_data *task, struct tep_format_field *field,
 {
 	const char *comm;
 
-	task->comm = malloc(field->size + 1);
+	task->comm = tracecmd_arena_get(task->handle->arena, field->size + 1);
 	if (!task->comm) {
 		warning("Could not allocate task comm");
 		return;
@@ -597,6 +776,7 @@ static void account_task(struct task_data *task, struct event_data *event_data,
 
 	event_hash->count++;
 	task->last_event = event_hash;
+	task->stack_op = NULL;
 }
 
 static struct task_data *
@@ -634,6 +814,8 @@ handle_end_event(struct handle_data *h, struct event_data *event_data,
 	event_hash = find_and_update_start(task, event_data->start, record->ts, val);
 	task->last_start = NULL;
 	task->last_event = event_hash;
+	/* If the start is in an earlier slice, the merge adds the stack */
+	task->stack_op = event_hash ? NULL : h->deferred;
 
 	return task;
 }
@@ -652,7 +834,7 @@ handle_start_event(struct handle_data *h, struct event_data *event_data,
 
 	tep_read_number_field(event_data->end_match_field, record->data,
 				 &val);
-	start = add_start(task, event_data, record, val, val);
+	start = add_start(task, event_data, record->ts, record->cpu, val, val);
 	if (!start) {
 		warning("Failed to allocate start of task");
 		return NULL;
@@ -660,6 +842,7 @@ handle_start_event(struct handle_data *h, struct event_data *event_data,
 		
 	task->last_start = start;
 	task->last_event = NULL;
+	task->stack_op = NULL;
 
 	return task;
 }
@@ -690,6 +873,7 @@ static int handle_event_data(struct handle_data *h,
 		task->proxy = NULL;
 		task->last_start = NULL;
 		task->last_event = NULL;
+		task->stack_op = NULL;
 		account_task(task, event_data, record);
 	}
 
@@ -710,6 +894,10 @@ static void handle_missed_events(struct handle_data *h, int cpu)
 	list_for_each_entry_safe(start, n, &h->migrate_starts, list) {
 		free_start(start);
 	}
+
+	/* And the ones of the slices before this one */
+	if (h->slice)
+		add_slice_op(h, SLICE_OP_MISSED, 0, cpu, NULL, 0, 0);
 }
 
 static int match_event_data(struct trace_hash_item *item, void *data)
@@ -733,30 +921,17 @@ find_event_data(struct handle_data *h, int id)
 	return NULL;
 }
 
-static void trace_profile_record(struct tracecmd_input *handle,
-				 struct tep_record *record)
+static void profile_record(struct handle_data *h, struct tep_record *record)
 {
-	static struct handle_data *last_handle;
 	struct tep_record *stack_record;
 	struct event_data *event_data;
 	struct task_data *task;
-	struct handle_data *h;
 	struct tep_handle *pevent;
 	unsigned long long pid;
 	int cpu = record->cpu;
 	int id;
 
-	if (last_handle && last_handle->handle == handle)
-		h = last_handle;
-	else {
-		for (h = handles; h; h = h->next) {
-			if (h->handle == handle)
-				break;
-		}
-		if (!h)
-			die("Handle not found?");
-		last_handle = h;
-	}
+	h->last_ts = record->ts;
 
 	if (record->missed_events)
 		handle_missed_events(h, cpu);
@@ -791,6 +966,27 @@ static void trace_profile_record(struct tracecmd_input *handle,
 	}
 }
 
+static void trace_profile_record(struct tracecmd_input *handle,
+				 struct tep_record *record)
+{
+	static struct handle_data *last_handle;
+	struct handle_data *h;
+
+	if (last_handle && last_handle->handle == handle)
+		h = last_handle;
+	else {
+		for (h = handles; h; h = h->next) {
+			if (h->handle == handle)
+				break;
+		}
+		if (!h)
+			die("Handle not found?");
+		last_handle = h;
+	}
+
+	profile_record(h, record);
+}
+
 static struct event_data *
 add_event(struct handle_data *h, const char *system, const char *event_name,
 	  enum event_data_type type)
@@ -808,12 +1004,11 @@ add_event(struct handle_data *h, const char *system, const char *event_name,
 			die("No 'common_pid' found in event");
 	}
 
-	event_data = malloc(sizeof(*event_data));
+	event_data = tracecmd_arena_get(h->arena, sizeof(*event_data));
 	if (!event_data) {
 		warning("Could not allocate event_data");
 		return NULL;
 	}
-	memset(event_data, 0, sizeof(*event_data));
 	event_data->id = event->id;
 	event_data->event = event;
 	event_data->type = type;
@@ -1023,9 +1218,11 @@ static int handle_sched_switch_event(struct handle_data *h,
 		task->sleeping = 0;
 
 	/* task is being scheduled out. prev_state tells why */
-	start = add_start(task, event_data, record, prev_pid, prev_state);
+	start = add_start(task, event_data, record->ts, record->cpu,
+			  prev_pid, prev_state);
 	task->last_start = start;
 	task->last_event = NULL;
+	task->stack_op = NULL;
 
 	task = find_task(h, next_pid);
 	if (!task)
@@ -1062,6 +1259,7 @@ static int handle_stacktrace_event(struct handle_data *h,
 	unsigned long long size;
 	struct event_hash *event_hash;
 	struct start_data *start;
+	struct slice_op *op;
 	void *caller;
 
 	task = find_task(h, pid);
@@ -1079,6 +1277,28 @@ static int handle_stacktrace_event(struct handle_data *h,
 		task = proxy;
 	}
 
+	/*
+	 * start_match_field holds the size.
+	 * data_field holds the caller location.
+	 */
+	size = record->size - event_data->data_field->offset;
+	caller = record->data + event_data->data_field->offset;
+
+	/* The event before is settled by the merge of the slices */
+	if (!task->last_start && !task->last_event && task->stack_op) {
+		op = task->stack_op;
+		task->stack_op = NULL;
+		/*
+		 * The start of a wakeup may end on another CPU before its
+		 * stack trace shows up: replay the stack in its own turn.
+		 */
+		if (op->type == SLICE_OP_WAKEUP)
+			op = add_slice_op(h, SLICE_OP_STACK, op->pid, op->cpu,
+					  op->event_data, op->search_val, op->ts);
+		save_stack(h, &op->stack, caller, size, record->ts);
+		return 0;
+	}
+
 	if (!task->last_start && !task->last_event) {
 		/*
 		 * Save this stack in case function graph needs it.
@@ -1091,31 +1311,23 @@ static int handle_stacktrace_event(struct handle_data *h,
 		return 0;
 	}
 
-	/*
-	 * start_match_field holds the size.
-	 * data_field holds the caller location.
-	 */
-	size = record->size - event_data->data_field->offset;
-	caller = record->data + event_data->data_field->offset;
-
 	/*
 	 * If there's a "start" then don't add the stack until
 	 * it finds a matching "end".
 	 */
 	if ((start = task->last_start)) {
-		tracecmd_record_ref(record);
-		start->stack.record = record;
-		start->stack.size = size;
-		start->stack.caller = caller;
+		save_stack(h, &start->stack, caller, size, record->ts);
 		task->last_start = NULL;
 		task->last_event = NULL;
+		task->stack_op = NULL;
 		return 0;
 	}
 
 	event_hash = task->last_event;
 	task->last_event = NULL;
+	task->stack_op = NULL;
 
-	add_event_stack(event_hash, caller, size, event_hash->last_time,
+	add_event_stack(h, event_hash, caller, size, event_hash->last_time,
 			record->ts);
 	
 	return 0;
@@ -1145,13 +1357,13 @@ static int handle_fgraph_entry_event(struct handle_data *h,
 	if (task->last_stack) {
 		start = task->last_start;
 		record = task->last_stack;
-		size = record->size - stacktrace_event->data_field->offset;
-		caller = record->data + stacktrace_event->data_field->offset;
-		start->stack.record = record;
-		start->stack.size = size;
-		start->stack.caller = caller;
+		size = record->size - h->stacktrace_event->data_field->offset;
+		caller = record->data + h->stacktrace_event->data_field->offset;
+		save_stack(h, &start->stack, caller, size, record->ts);
+		tracecmd_free_record(record);
 		task->last_stack = NULL;
 		task->last_event = NULL;
+		task->stack_op = NULL;
 	}
 
 	/* Do not map stacks after this event to this event */
@@ -1172,6 +1384,7 @@ static int handle_fgraph_exit_event(struct handle_data *h,
 		return -1;
 	/* Do not match stacks with function graph exit events */
 	task->last_event = NULL;
+	task->stack_op = NULL;
 
 	return 0;
 }
@@ -1195,8 +1408,11 @@ static int handle_process_exec(struct handle_data *h,
 	if (!task)
 		return -1;
 
-	free(task->comm);
+	/* A live profile may see many execs, give the comm back */
+	if (task->comm)
+		tracecmd_arena_put(h->arena, task->comm, strlen(task->comm) + 1);
 	task->comm = NULL;
+	task->comm_reset = true;
 
 	return 0;
 }
@@ -1236,11 +1452,20 @@ static int handle_sched_wakeup_event(struct handle_data *h,
 		add_task_comm(task, h->wakeup_comm, record);
 
 	/* if the task isn't sleeping, then ignore the wake up */
-	if (!task->sleeping) {
+	if (task->sleeping <= 0) {
 		/* Ignore any following stack traces */
 		proxy->proxy = NULL;
 		proxy->last_start = NULL;
 		proxy->last_event = NULL;
+		proxy->stack_op = NULL;
+		/*
+		 * Unless it went to sleep in an earlier slice, which is
+		 * for the merge to find out. It gets the following stack.
+		 */
+		if (task->sleeping == TASK_SLEEP_UNKNOWN)
+			proxy->stack_op = add_slice_op(h, SLICE_OP_WAKEUP, pid,
+						       record->cpu, event_data,
+						       pid, record->ts);
 		return 0;
 	}
 
@@ -1257,15 +1482,18 @@ static int handle_sched_wakeup_event(struct handle_data *h,
 	find_and_update_start(task, event_data->start, record->ts, pid);
 
 	/* Set this up for timing how long the wakeup takes */
-	start = add_start(task, event_data, record, pid, pid);
+	start = add_start(task, event_data, record->ts, record->cpu, pid, pid);
 	task->last_event = NULL;
+	task->stack_op = NULL;
 	task->last_start = start;
 
 	return 0;
 }
 
-void trace_init_profile(struct tracecmd_input *handle, struct hook_list *hook,
-			int global)
+/* @quiet: the hooks were already checked, do not warn about them again */
+static struct handle_data *
+alloc_handle_data(struct tracecmd_input *handle, struct hook_list *hook,
+		  int global, bool quiet)
 {
 	struct tep_handle *pevent = tracecmd_get_tep(handle);
 	struct tep_format_field **fields;
@@ -1286,18 +1514,19 @@ void trace_init_profile(struct tracecmd_input *handle, struct hook_list *hook,
 	struct event_data *start_event;
 	struct event_data *end_event;
 	struct tep_event **events;
-	int ret;
+	char comm[32];
 	int i;
 
-	tracecmd_set_show_data_func(handle, trace_profile_record);
 	h = malloc(sizeof(*h));
 	if (!h) {
 		warning("Could not allocate handle");
-		return;
+		return NULL;
 	};
 	memset(h, 0, sizeof(*h));
-	h->next = handles;
-	handles = h;
+
+	h->arena = tracecmd_arena_alloc();
+	if (!h->arena)
+		goto free_handle;
 
 	trace_hash_init(&h->task_hash, 1024);
 	trace_hash_init(&h->events, 1024);
@@ -1305,6 +1534,9 @@ void trace_init_profile(struct tracecmd_input *handle, struct hook_list *hook,
 
 	h->handle = handle;
 	h->pevent = pevent;
+	h->hooks = hook;
+	h->global = global;
+	h->ops_tail = &h->ops;
 
 	h->cpus = tracecmd_cpus(handle);
 
@@ -1330,25 +1562,25 @@ void trace_init_profile(struct tracecmd_input *handle, struct hook_list *hook,
 
 	memset(h->cpu_data, 0, h->cpus * sizeof(h->cpu_data));
 
-	h->global_task = malloc(sizeof(struct task_data));
+	h->global_task = tracecmd_arena_get(h->arena, sizeof(struct task_data));
 	if (!h->global_task)
 		goto free_data;
 
-	memset(h->global_task, 0, sizeof(struct task_data));
 	init_task(h, h->global_task);
-	h->global_task->comm = strdup("Global Events");
+	h->global_task->comm = tracecmd_arena_strdup(h->arena, "Global Events");
 	if (!h->global_task->comm)
 		die("malloc");
 	h->global_task->pid = -1;
 
-	h->global_percpu_tasks = calloc(h->cpus, sizeof(struct task_data));
+	h->global_percpu_tasks = tracecmd_arena_get(h->arena,
+					h->cpus * sizeof(struct task_data));
 	if (!h->global_percpu_tasks)
 		die("malloc");
 	for (i = 0; i < h->cpus; i++) {
 		init_task(h, &h->global_percpu_tasks[i]);
-		ret = asprintf(&h->global_percpu_tasks[i].comm,
-			       "Global CPU[%d] Events", i);
-		if (ret < 0)
+		snprintf(comm, sizeof(comm), "Global CPU[%d] Events", i);
+		h->global_percpu_tasks[i].comm = tracecmd_arena_strdup(h->arena, comm);
+		if (!h->global_percpu_tasks[i].comm)
 			die("malloc");
 		h->global_percpu_tasks[i].pid = -1 - i;
 	}
@@ -1368,15 +1600,15 @@ void trace_init_profile(struct tracecmd_input *handle, struct hook_list *hook,
 	process_exec = add_event(h, "sched", "sched_process_exec",
 				 EVENT_TYPE_PROCESS_EXEC);
 
-	stacktrace_event = add_event(h, "ftrace", "kernel_stack", EVENT_TYPE_STACK);
-	if (stacktrace_event) {
-		stacktrace_event->handle_event = handle_stacktrace_event;
+	h->stacktrace_event = add_event(h, "ftrace", "kernel_stack", EVENT_TYPE_STACK);
+	if (h->stacktrace_event) {
+		h->stacktrace_event->handle_event = handle_stacktrace_event;
 
-		stacktrace_event->data_field = tep_find_field(stacktrace_event->event,
-							    "caller");
-		if (!stacktrace_event->data_field)
+		h->stacktrace_event->data_field = tep_find_field(h->stacktrace_event->event,
+							       "caller");
+		if (!h->stacktrace_event->data_field)
 			die("Event: %s does not have field caller",
-			    stacktrace_event->event->name);
+			    h->stacktrace_event->event->name);
 	}
 
 	if (process_exec) {
@@ -1476,11 +1708,13 @@ void trace_init_profile(struct tracecmd_input *handle, struct hook_list *hook,
 		end_event = add_event(h, hook->end_system, hook->end_event,
 				      EVENT_TYPE_USER_MATE);
 		if (!start_event) {
-			warning("Event %s not found", hook->start_event);
+			if (!quiet)
+				warning("Event %s not found", hook->start_event);
 			continue;
 		}
 		if (!end_event) {
-			warning("Event %s not found", hook->end_event);
+			if (!quiet)
+				warning("Event %s not found", hook->end_event);
 			continue;
 		}
 		mate_events(h, start_event, hook->pid, hook->start_match,
@@ -1506,16 +1740,33 @@ void trace_init_profile(struct tracecmd_input *handle, struct hook_list *hook,
 
 		free(fields);
 	}
-	return;
+	return h;
 
  free_data:
 	free(h->cpu_data);
  free_starts:
 	free(h->cpu_starts);
  free_handle:
-	handles = h->next;
+	trace_hash_free(&h->task_hash);
+	trace_hash_free(&h->events);
+	trace_hash_free(&h->group_hash);
+	tracecmd_arena_free(h->arena);
 	free(h);
 	warning("Failed handle allocations");
+	return NULL;
+}
+
+void trace_init_profile(struct tracecmd_input *handle, struct hook_list *hook,
+			int global)
+{
+	struct handle_data *h;
+
+	tracecmd_set_show_data_func(handle, trace_profile_record);
+	h = alloc_handle_data(handle, hook, global, false);
+	if (!h)
+		return;
+	h->next = handles;
+	handles = h;
 }
 
 static void output_event_stack(struct tep_handle *pevent, struct stack_data *stack)
@@ -1533,12 +1784,15 @@ static void output_event_stack(struct tep_handle *pevent, struct stack_data *sta
 	if (stack->count)
 		stack->time_avg = stack->time / stack->count;
 
-	printf("     <stack> %lld total:%lld min:%lld(ts:%lld.%06lld) max:%lld(ts:%lld.%06lld) avg=%lld\n",
+	printf("     <stack> %lld total:%lld min:%lld(ts:%lld.%06lld) max:%lld(ts:%lld.%06lld) avg=%lld",
 	       stack->count, stack->time, stack->time_min,
 	       nsecs_per_sec(stack->ts_min), mod_to_usec(stack->ts_min),
 	       stack->time_max,
 	       nsecs_per_sec(stack->ts_max), mod_to_usec(stack->ts_max),
 	       stack->time_avg);
+	if (stack->time)
+		print_percentiles(&stack->hist, stack->time_max);
+	printf("\n");
 
 	for (i = 0; i < stack->size; i += longsize) {
 		ptr = stack->caller + i;
@@ -1573,6 +1827,7 @@ struct stack_chain {
 	unsigned long long	ts_max;
 	unsigned long long	time_avg;
 	unsigned long long	count;
+	struct tracecmd_histogram hist;	/* of all the stacks of the chain */
 	int			percent;
 	int			nr_children;
 };
@@ -1686,6 +1941,7 @@ make_stack_chain(struct stack_data **stacks, int cnt, int longsize, int level,
 
 		count += stacks[i]->count;
 		time += stacks[i]->time;
+		tracecmd_histogram_merge(&chain[x].hist, &stacks[i]->hist);
 		if (stacks[i]->time_max > time_max) {
 			time_max = stacks[i]->time_max;
 			ts_max = stacks[i]->ts_max;
@@ -1825,6 +2081,8 @@ static void output_chain(struct tep_handle *pevent, struct stack_chain *chain, i
 			       nsecs_per_sec(chain[i].ts_min),
 			       mod_to_usec(chain[i].ts_min),
 			       chain[i].time_avg);
+		if (chain[i].time)
+			print_percentiles(&chain[i].hist, chain[i].time_max);
 		printf("\n");
 
 		for (child = chain[i].children, nr_children = chain[i].nr_children;
@@ -1957,6 +2215,7 @@ static void output_event(struct event_hash *event_hash)
 		       event_hash->time_min,
 		       nsecs_per_sec(event_hash->ts_min),
 		       mod_to_usec(event_hash->ts_min));
+		print_percentiles(&event_hash->hist, event_hash->time_max);
 	}
 	printf("\n");
 
@@ -1999,6 +2258,15 @@ static int compare_events(const void *a, const void *b)
 		return -1;
 	if ((*A)->time_total < (*B)->time_total)
 		return 1;
+	/* Do not depend on the order of the hash (see merge_slice()) */
+	if ((*A)->val > (*B)->val)
+		return 1;
+	if ((*A)->val < (*B)->val)
+		return -1;
+	if ((*A)->search_val > (*B)->search_val)
+		return 1;
+	if ((*A)->search_val < (*B)->search_val)
+		return -1;
 	return 0;
 }
 
@@ -2102,86 +2370,61 @@ static int compare_tasks(const void *a, const void *b)
 
 static int compare_groups(const void *a, const void *b)
 {
-	const char *A = a;
-	const char *B = b;
+	struct group_data * const *A = a;
+	struct group_data * const *B = b;
+
+	return strcmp((*A)->comm, (*B)->comm);
+}
 
-	return strcmp(A, B);
+/* Gives an event, without its stacks, back to the arena of @h */
+static void free_event_hash(struct handle_data *h, struct event_hash *event_hash)
+{
+	trace_hash_free(&event_hash->stacks);
+	tracecmd_arena_put(h->arena, event_hash, sizeof(*event_hash));
 }
 
-static void free_event_hash(struct event_hash *event_hash)
+/*
+ * The tasks, groups and what they hold are freed with the arena of
+ * their handle_data, only their hashes are freed here.
+ */
+static void free_events(struct trace_hash *hash)
 {
 	struct trace_hash_item **bucket;
 	struct trace_hash_item *item;
-	struct stack_data *stack;
+	struct event_hash *event_hash;
 
-	trace_hash_for_each_bucket(bucket, &event_hash->stacks) {
-		trace_hash_while_item(item, bucket) {
-			stack = stack_from_item(item);
-			trace_hash_del(&stack->hash);
-			free(stack);
+	trace_hash_for_each_bucket(bucket, hash) {
+		trace_hash_for_each_item(item, bucket) {
+			event_hash = event_from_item(item);
+			trace_hash_free(&event_hash->stacks);
 		}
 	}
-	trace_hash_free(&event_hash->stacks);
-	free(event_hash);
+	trace_hash_free(hash);
 }
 
-static void __free_task(struct task_data *task)
+static void free_task(struct task_data *task)
 {
 	struct trace_hash_item **bucket;
 	struct trace_hash_item *item;
 	struct start_data *start;
-	struct event_hash *event_hash;
-
-	free(task->comm);
 
 	trace_hash_for_each_bucket(bucket, &task->start_hash) {
-		trace_hash_while_item(item, bucket) {
+		trace_hash_for_each_item(item, bucket) {
 			start = start_from_item(item);
-			if (start->stack.record)
-				tracecmd_free_record(start->stack.record);
 			list_del(&start->list);
-			trace_hash_del(item);
-			free(start);
 		}
 	}
 	trace_hash_free(&task->start_hash);
 
-	trace_hash_for_each_bucket(bucket, &task->event_hash) {
-		trace_hash_while_item(item, bucket) {
-			event_hash = event_from_item(item);
-			trace_hash_del(item);
-			free_event_hash(event_hash);
-		}
-	}
-	trace_hash_free(&task->event_hash);
+	free_events(&task->event_hash);
 
 	if (task->last_stack)
 		tracecmd_free_record(task->last_stack);
 }
 
-static void free_task(struct task_data *task)
-{
-	__free_task(task);
-	free(task);
-}
-
 static void free_group(struct group_data *group)
 {
-	struct trace_hash_item **bucket;
-	struct trace_hash_item *item;
-	struct event_hash *event_hash;
-
-	free(group->comm);
-
-	trace_hash_for_each_bucket(bucket, &group->event_hash) {
-		trace_hash_while_item(item, bucket) {
-			event_hash = event_from_item(item);
-			trace_hash_del(item);
-			free_event_hash(event_hash);
-		}
-	}
-	trace_hash_free(&group->event_hash);
-	free(group);
+	free_events(&group->event_hash);
 }
 
 static void show_global_task(struct handle_data *h,
@@ -2193,11 +2436,18 @@ static void show_global_task(struct handle_data *h,
 	output_task(h, task);
 }
 
-static void output_tasks(struct handle_data *h)
+/*
+ * The tasks and groups are freed by free_handle_data(). A snapshot of a
+ * live profile (@snapshot set) only shows those that still have events,
+ * that is, the ones with events since the last snapshot, and with
+ * --decay, the ones that have some of their old events left.
+ */
+static void output_tasks(struct handle_data *h, bool snapshot)
 {
 	struct trace_hash_item **bucket;
 	struct trace_hash_item *item;
 	struct task_data **tasks;
+	struct task_data *task;
 	int nr_tasks = 0;
 	int i;
 
@@ -2216,27 +2466,28 @@ static void output_tasks(struct handle_data *h)
 	nr_tasks = 0;
 
 	trace_hash_for_each_bucket(bucket, &h->task_hash) {
-		trace_hash_while_item(item, bucket) {
-			tasks[nr_tasks++] = task_from_item(item);
-			trace_hash_del(item);
+		trace_hash_for_each_item(item, bucket) {
+			task = task_from_item(item);
+			if (snapshot && trace_hash_empty(&task->event_hash))
+				continue;
+			tasks[nr_tasks++] = task;
 		}
 	}
 
 	qsort(tasks, nr_tasks, sizeof(*tasks), compare_tasks);
 
-	for (i = 0; i < nr_tasks; i++) {
+	for (i = 0; i < nr_tasks; i++)
 		output_task(h, tasks[i]);
-		free_task(tasks[i]);
-	}
 
 	free(tasks);
 }
 
-static void output_groups(struct handle_data *h)
+static void output_groups(struct handle_data *h, bool snapshot)
 {
 	struct trace_hash_item **bucket;
 	struct trace_hash_item *item;
 	struct group_data **groups;
+	struct group_data *group;
 	int nr_groups = 0;
 	int i;
 
@@ -2258,23 +2509,23 @@ static void output_groups(struct handle_data *h)
 	nr_groups = 0;
 
 	trace_hash_for_each_bucket(bucket, &h->group_hash) {
-		trace_hash_while_item(item, bucket) {
-			groups[nr_groups++] = group_from_item(item);
-			trace_hash_del(item);
+		trace_hash_for_each_item(item, bucket) {
+			group = group_from_item(item);
+			if (snapshot && trace_hash_empty(&group->event_hash))
+				continue;
+			groups[nr_groups++] = group;
 		}
 	}
 
 	qsort(groups, nr_groups, sizeof(*groups), compare_groups);
 
-	for (i = 0; i < nr_groups; i++) {
+	for (i = 0; i < nr_groups; i++)
 		output_group(h, groups[i]);
-		free_group(groups[i]);
-	}
 
 	free(groups);
 }
 
-static void output_handle(struct handle_data *h)
+static void output_handle(struct handle_data *h, bool snapshot)
 {
 	int i;
 
@@ -2282,11 +2533,11 @@ static void output_handle(struct handle_data *h)
 	for (i = 0; i < h->cpus; i++)
 		show_global_task(h, &h->global_percpu_tasks[i]);
 
-	output_groups(h);
-	output_tasks(h);
+	output_groups(h, snapshot);
+	output_tasks(h, snapshot);
 }
 
-static void merge_event_stack(struct event_hash *event,
+static void merge_event_stack(struct handle_data *h, struct event_hash *event,
 			      struct stack_data *stack)
 {
 	struct stack_data *exist;
@@ -2304,19 +2555,24 @@ static void merge_event_stack(struct event_hash *event,
 	exist = stack_from_item(item);
 	exist->count += stack->count;
 	exist->time += stack->time;
+	tracecmd_histogram_merge(&exist->hist, &stack->hist);
 
-	if (exist->time_max < stack->time_max) {
+	/* On a tie, the first one in the trace, whatever the merge order */
+	if (exist->time_max < stack->time_max ||
+	    (exist->time_max == stack->time_max && exist->ts_max > stack->ts_max)) {
 		exist->time_max = stack->time_max;
 		exist->ts_max = stack->ts_max;
 	}
-	if (exist->time_min > stack->time_min) {
+	if (exist->time_min > stack->time_min ||
+	    (exist->time_min == stack->time_min && exist->ts_min > stack->ts_min)) {
 		exist->time_min = stack->time_min;
 		exist->ts_min = stack->ts_min;
 	}
-	free(stack);
+	tracecmd_arena_put(h->arena, stack, sizeof(*stack) + stack->size);
 }
 
-static void merge_stacks(struct event_hash *exist, struct event_hash *event)
+static void merge_stacks(struct handle_data *h, struct event_hash *exist,
+			 struct event_hash *event)
 {
 	struct stack_data *stack;
 	struct trace_hash_item *item;
@@ -2326,15 +2582,38 @@ static void merge_stacks(struct event_hash *exist, struct event_hash *event)
 		trace_hash_while_item(item, bucket) {
 			stack = stack_from_item(item);
 			trace_hash_del(&stack->hash);
-			merge_event_stack(exist, stack);
+			merge_event_stack(h, exist, stack);
 		}
 	}
 }
 
-static void merge_event_into_group(struct group_data *group,
+/* Adds @event to @exist and frees it */
+static void merge_event_hash(struct handle_data *h, struct event_hash *exist,
+			     struct event_hash *event)
+{
+	exist->count += event->count;
+	exist->time_total += event->time_total;
+	tracecmd_histogram_merge(&exist->hist, &event->hist);
+
+	/* On a tie, the first one in the trace, whatever the merge order */
+	if (exist->time_max < event->time_max ||
+	    (exist->time_max == event->time_max && exist->ts_max > event->ts_max)) {
+		exist->time_max = event->time_max;
+		exist->ts_max = event->ts_max;
+	}
+	if (exist->time_min > event->time_min ||
+	    (exist->time_min == event->time_min && exist->ts_min > event->ts_min)) {
+		exist->time_min = event->time_min;
+		exist->ts_min = event->ts_min;
+	}
+
+	merge_stacks(h, exist, event);
+	free_event_hash(h, event);
+}
+
+static void merge_event_into_group(struct handle_data *h, struct group_data *group,
 				   struct event_hash *event)
 {
-	struct event_hash *exist;
 	struct trace_hash_item *item;
 	struct event_data_match edata;
 	unsigned long long key;
@@ -2365,21 +2644,7 @@ static void merge_event_into_group(struct group_data *group,
 		return;
 	}
 
-	exist = event_from_item(item);
-	exist->count += event->count;
-	exist->time_total += event->time_total;
-
-	if (exist->time_max < event->time_max) {
-		exist->time_max = event->time_max;
-		exist->ts_max = event->ts_max;
-	}
-	if (exist->time_min > event->time_min) {
-		exist->time_min = event->time_min;
-		exist->ts_min = event->ts_min;
-	}
-
-	merge_stacks(exist, event);
-	free_event_hash(event);
+	merge_event_hash(h, event_from_item(item), event);
 }
 
 static void add_group(struct handle_data *h, struct task_data *task)
@@ -2399,14 +2664,13 @@ static void add_group(struct handle_data *h, struct task_data *task)
 	if (item) {
 		grp = group_from_item(item);
 	} else {
-		grp = malloc(sizeof(*grp));
+		grp = tracecmd_arena_get(h->arena, sizeof(*grp));
 		if (!grp) {
 			warning("Could not allocate group");
 			return;
 		}
-		memset(grp, 0, sizeof(*grp));
 
-		grp->comm = strdup(task->comm);
+		grp->comm = tracecmd_arena_strdup(h->arena, task->comm);
 		if (!grp->comm)
 			die("strdup");
 		grp->hash.key = key;
@@ -2421,7 +2685,7 @@ static void add_group(struct handle_data *h, struct task_data *task)
 
 			event_hash = event_from_item(item);
 			trace_hash_del(&event_hash->hash);
-			merge_event_into_group(grp, event_hash);
+			merge_event_into_group(h, grp, event_hash);
 		}
 	}
 }
@@ -2440,15 +2704,721 @@ static void merge_tasks(struct handle_data *h)
 	}
 }
 
-int do_trace_profile(void)
+/* The task of @h for task @pid of a slice, the global ones included */
+static struct task_data *slice_task(struct handle_data *h, int pid)
 {
-	struct handle_data *h;
+	if (pid == -1)
+		return h->global_task;
+	if (pid < -1)
+		return -1 - pid < h->cpus ? &h->global_percpu_tasks[-1 - pid] : NULL;
+	return find_task(h, pid);
+}
 
-	for (h = handles; h; h = h->next) {
+/* Does to @h what the records behind @op would have done to it */
+static void replay_slice_op(struct handle_data *h, struct slice_op *op)
+{
+	struct event_data *event_data;
+	struct event_hash *event_hash;
+	struct start_data *start;
+	struct task_data *task;
+
+	if (op->type == SLICE_OP_MISSED) {
+		handle_missed_events(h, op->cpu);
+		return;
+	}
+
+	event_data = find_event_data(h, op->event_data->id);
+	task = slice_task(h, op->pid);
+	if (!event_data || !task)
+		return;
+
+	switch (op->type) {
+	case SLICE_OP_END:
+		event_hash = find_and_update_start(task, event_data, op->ts,
+						   op->search_val);
+		if (event_hash && op->stack.caller)
+			add_event_stack(h, event_hash, op->stack.caller,
+					op->stack.size, event_hash->last_time,
+					op->stack.ts);
+		break;
+	case SLICE_OP_WAKEUP:
+		/* As handle_sched_wakeup_event() */
+		if (!task->sleeping)
+			break;
+		task->sleeping = 0;
+		find_and_update_start(task, event_data->start, op->ts, op->pid);
+		add_start(task, event_data, op->ts, op->cpu, op->pid, op->pid);
+		break;
+	case SLICE_OP_STACK:
+		/* Only if the start of the wakeup has not ended yet */
+		start = find_start(task, event_data, op->search_val);
+		if (!start || start->timestamp != op->ts || start->stack.caller)
+			break;
+		start->stack = op->stack;
+		op->stack.caller = NULL;
+		break;
+	default:
+		break;
+	}
+}
+
+static int compare_starts(const void *a, const void *b)
+{
+	struct start_data * const *A = a;
+	struct start_data * const *B = b;
+
+	if ((*A)->seq > (*B)->seq)
+		return 1;
+	if ((*A)->seq < (*B)->seq)
+		return -1;
+	return 0;
+}
+
+static void add_list_starts(struct start_data **starts, int *nr,
+			    struct list_head *list)
+{
+	struct start_data *start;
+
+	list_for_each_entry(start, list, list)
+		starts[(*nr)++] = start;
+}
+
+/*
+ * The starts left in @slice are more recent than the ones of @h.
+ * They are moved in the order they were added, as the latest start
+ * is the one that matches an end (trace_hash_add() adds to the front).
+ */
+static void merge_slice_starts(struct handle_data *h, struct handle_data *slice)
+{
+	struct event_data *event_data;
+	struct start_data **starts;
+	struct start_data *start;
+	struct task_data *task;
+	int nr_starts = 0;
+	int i;
+
+	list_for_each_entry(start, &slice->migrate_starts, list)
+		nr_starts++;
+	for (i = 0; i < slice->cpus; i++) {
+		list_for_each_entry(start, &slice->cpu_starts[i], list)
+			nr_starts++;
+	}
+	if (!nr_starts)
+		return;
+
+	starts = malloc(sizeof(*starts) * nr_starts);
+	if (!starts)
+		die("Could not allocate starts");
+
+	nr_starts = 0;
+	add_list_starts(starts, &nr_starts, &slice->migrate_starts);
+	for (i = 0; i < slice->cpus; i++)
+		add_list_starts(starts, &nr_starts, &slice->cpu_starts[i]);
+
+	qsort(starts, nr_starts, sizeof(*starts), compare_starts);
+
+	for (i = 0; i < nr_starts; i++) {
+		start = starts[i];
+		trace_hash_del(&start->hash);
+		list_del(&start->list);
+
+		event_data = find_event_data(h, start->event_data->id);
+		task = slice_task(h, start->task->pid);
+		if (!event_data || !task) {
+			tracecmd_arena_put(h->arena, start->stack.caller,
+					   start->stack.size);
+			tracecmd_arena_put(h->arena, start, sizeof(*start));
+			continue;
+		}
+
+		start->event_data = event_data;
+		start->task = task;
+		start->seq = h->nr_starts++;
+		trace_hash_add(&task->start_hash, &start->hash);
+		if (event_data->migrate)
+			list_add(&start->list, &h->migrate_starts);
+		else
+			list_add(&start->list, &h->cpu_starts[start->cpu]);
+	}
+
+	free(starts);
+}
+
+static void merge_event_into_task(struct handle_data *h, struct task_data *task,
+				  struct event_hash *event)
+{
+	struct trace_hash_item *item;
+	struct event_data_match edata;
+
+	edata.event_data = find_event_data(h, event->event_data->id);
+	if (!edata.event_data) {
+		free_event_hash(h, event);
+		return;
+	}
+	edata.search_val = event->search_val;
+	edata.val = event->val;
+
+	event->event_data = edata.event_data;
+	event->hash.key = event_hash_key(&edata);
+
+	item = trace_hash_find(&task->event_hash, event->hash.key,
+			       match_event, &edata);
+	if (!item) {
+		trace_hash_add(&task->event_hash, &event->hash);
+		return;
+	}
+
+	merge_event_hash(h, event_from_item(item), event);
+}
+
+static void merge_slice_task(struct handle_data *h, struct task_data *slice_task_data)
+{
+	struct trace_hash_item **bucket;
+	struct trace_hash_item *item;
+	struct task_data *task;
+
+	task = slice_task(h, slice_task_data->pid);
+	if (!task)
+		return;
+
+	/* The comm is the one of the first sched event since the last exec */
+	if (slice_task_data->comm_reset || !task->comm) {
+		task->comm = slice_task_data->comm;
+		slice_task_data->comm = NULL;
+	}
+
+	if (slice_task_data->sleeping != TASK_SLEEP_UNKNOWN)
+		task->sleeping = slice_task_data->sleeping;
+
+	trace_hash_for_each_bucket(bucket, &slice_task_data->event_hash) {
+		trace_hash_while_item(item, bucket) {
+			trace_hash_del(item);
+			merge_event_into_task(h, task, event_from_item(item));
+		}
+	}
+}
+
+/*
+ * Add the slice that follows what was merged into @h so far. What the
+ * slice could not know of the ones before it is replayed first, in the
+ * order it happened, then its starts and its events are moved over.
+ */
+static void merge_slice(struct handle_data *h, struct handle_data *slice)
+{
+	struct trace_hash_item **bucket;
+	struct trace_hash_item *item;
+	struct slice_op *op;
+	int i;
+
+	/* What is moved from the slice is now freed with @h */
+	tracecmd_arena_join(h->arena, slice->arena);
+
+	while ((op = slice->ops)) {
+		slice->ops = op->next;
+		replay_slice_op(h, op);
+		tracecmd_arena_put(h->arena, op->stack.caller, op->stack.size);
+		tracecmd_arena_put(h->arena, op, sizeof(*op));
+	}
+	slice->ops_tail = &slice->ops;
+
+	merge_slice_starts(h, slice);
+
+	merge_slice_task(h, slice->global_task);
+	for (i = 0; i < slice->cpus; i++)
+		merge_slice_task(h, &slice->global_percpu_tasks[i]);
+
+	trace_hash_for_each_bucket(bucket, &slice->task_hash) {
+		trace_hash_for_each_item(item, bucket)
+			merge_slice_task(h, task_from_item(item));
+	}
+}
+
+static void free_handle_data(struct handle_data *h)
+{
+	struct trace_hash_item **bucket;
+	struct trace_hash_item *item;
+	int i;
+
+	trace_hash_for_each_bucket(bucket, &h->task_hash) {
+		trace_hash_for_each_item(item, bucket)
+			free_task(task_from_item(item));
+	}
+	trace_hash_free(&h->task_hash);
+
+	free_task(h->global_task);
+	for (i = 0; i < h->cpus; i++)
+		free_task(&h->global_percpu_tasks[i]);
+
+	trace_hash_for_each_bucket(bucket, &h->group_hash) {
+		trace_hash_for_each_item(item, bucket)
+			free_group(group_from_item(item));
+	}
+	trace_hash_free(&h->group_hash);
+	trace_hash_free(&h->events);
+
+	tracecmd_arena_free(h->arena);
+	free(h->cpu_starts);
+	free(h->cpu_data);
+	free(h);
+}
+
+struct profile_slice {
+	struct handle_data	*h;
+	unsigned long long	start;
+	unsigned long long	end;
+	bool			done;
+};
+
+struct profile_threads {
+	struct handle_data	*h;	/* where the slices are merged */
+	struct profile_slice	*slices;
+	int			nr_slices;
+	int			next;
+	bool			stop;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+};
+
+struct profile_thread {
+	struct profile_threads	*pt;
+	struct tracecmd_input	*handle;
+	pthread_t		thread;
+};
+
+/* Is @record a stack trace of the event before it on its CPU? */
+static bool slice_stack(struct handle_data *h, struct tep_record *record)
+{
+	return h->stacktrace_event && !record->missed_events &&
+		tep_data_type(h->pevent, record) == h->stacktrace_event->id;
+}
+
+/*
+ * A stack trace goes with the event before it on its CPU, but the idle
+ * task runs on all CPUs at once, and its stack traces go to its last
+ * event on any CPU. So the slices are not cut where a CPU still has a
+ * stack trace to come: the cut is moved from @ts to the first time from
+ * which all the CPUs start with an event that is not a stack trace.
+ * The slices on both sides find the same one, and each record is in
+ * the slice it would be in without the stack traces.
+ */
+static unsigned long long slice_cut(struct handle_data *h, unsigned long long ts)
+{
+	struct tracecmd_input *handle = h->handle;
+	struct tep_record *record;
+	struct tep_record *next;
+	unsigned long long last = 0;
+	bool pending;
+	int cpu;
+	int i;
+
+	if (ts == -1ULL)
+		return ts;
+
+	tracecmd_set_all_cpus_to_timestamp(handle, ts);
+
+	while ((record = tracecmd_peek_next_data(handle, &cpu))) {
+		/* All of the records before it must be before the cut */
+		if (record->ts >= ts && record->ts > last) {
+			pending = false;
+			for (i = 0; i < h->cpus && !pending; i++) {
+				next = tracecmd_peek_data(handle, i);
+				pending = next && slice_stack(h, next);
+			}
+			if (!pending)
+				return record->ts;
+		}
+		record = tracecmd_read_data(handle, cpu);
+		last = record->ts;
+		tracecmd_free_record(record);
+	}
+
+	return -1ULL;
+}
+
+static void read_slice(struct handle_data *h, struct profile_slice *slice)
+{
+	struct tracecmd_input *handle = h->handle;
+	struct trace_hash_item **bucket;
+	struct trace_hash_item *item;
+	struct tep_record *record;
+	struct task_data *task;
+	unsigned long long start;
+	unsigned long long end;
+	int cpu;
+
+	start = h->slice ? slice_cut(h, slice->start) : slice->start;
+	end = slice_cut(h, slice->end);
+
+	if (start < end)
+		tracecmd_set_all_cpus_to_timestamp(handle, start);
+
+	while (start < end && (record = tracecmd_read_next_data(handle, &cpu))) {
+		if (record->ts >= end) {
+			tracecmd_free_record(record);
+			break;
+		}
+		if (record->ts >= start)
+			profile_record(h, record);
+		tracecmd_free_record(record);
+	}
+
+	/* The records belong to the handle of this thread */
+	trace_hash_for_each_bucket(bucket, &h->task_hash) {
+		trace_hash_for_each_item(item, bucket) {
+			task = task_from_item(item);
+			tracecmd_free_record(task->last_stack);
+			task->last_stack = NULL;
+		}
+	}
+}
+
+static void *profile_thread(void *data)
+{
+	struct profile_thread *thread = data;
+	struct profile_threads *pt = thread->pt;
+	struct profile_slice *slice;
+	struct handle_data *h;
+
+	pthread_mutex_lock(&pt->lock);
+	while (pt->next < pt->nr_slices && !pt->stop) {
+		slice = &pt->slices[pt->next++];
+		pthread_mutex_unlock(&pt->lock);
+
+		h = alloc_handle_data(thread->handle, pt->h->hooks,
+				      pt->h->global, true);
+		if (h) {
+			h->slice = slice - pt->slices;
+			read_slice(h, slice);
+		}
+
+		pthread_mutex_lock(&pt->lock);
+		slice->h = h;
+		slice->done = true;
+		pthread_cond_broadcast(&pt->cond);
+	}
+	pthread_mutex_unlock(&pt->lock);
+
+	return NULL;
+}
+
+/**
+ * trace_profile_threads - profile a trace with threads
+ * @handle: the handle that trace_init_profile() was called with
+ * @inputs: other handles of the same file, one per thread
+ * @nr_threads: the number of @inputs
+ *
+ * The trace is cut in slices of time, which the threads profile on
+ * their own handles, each slice in a handle_data of its own. As they
+ * are done, the slices are merged in order into the handle_data of
+ * @handle, for do_trace_profile() to show the same as if all the
+ * records went through trace_profile_record().
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int trace_profile_threads(struct tracecmd_input *handle,
+			  struct tracecmd_input **inputs, int nr_threads)
+{
+	struct profile_threads pt = { };
+	struct profile_thread *threads;
+	unsigned long long first = -1ULL;
+	unsigned long long last = 0;
+	unsigned long long span;
+	struct tep_record *record;
+	struct handle_data *h;
+	int ret = 0;
+	int cpu;
+	int i;
+
+	for (h = handles; h; h = h->next) {
+		if (h->handle == handle)
+			break;
+	}
+	if (!h || nr_threads < 1)
+		return -1;
+
+	for (cpu = 0; cpu < tracecmd_cpus(inputs[0]); cpu++) {
+		record = tracecmd_read_cpu_first(inputs[0], cpu);
+		if (!record)
+			continue;
+		if (record->ts < first)
+			first = record->ts;
+		tracecmd_free_record(record);
+
+		record = tracecmd_read_cpu_last(inputs[0], cpu);
+		if (record && record->ts > last)
+			last = record->ts;
+		tracecmd_free_record(record);
+	}
+
+	/* No records */
+	if (first > last)
+		return 0;
+
+	pt.h = h;
+	pt.nr_slices = nr_threads * SLICES_PER_THREAD;
+	pt.slices = calloc(pt.nr_slices, sizeof(*pt.slices));
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!pt.slices || !threads)
+		die("Could not allocate profile threads");
+
+	span = (last - first) / pt.nr_slices + 1;
+	for (i = 0; i < pt.nr_slices; i++) {
+		pt.slices[i].start = first + span * i;
+		pt.slices[i].end = first + span * (i + 1);
+	}
+	pt.slices[pt.nr_slices - 1].end = -1ULL;
+
+	pthread_mutex_init(&pt.lock, NULL);
+	pthread_cond_init(&pt.cond, NULL);
+
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].pt = &pt;
+		threads[i].handle = inputs[i];
+		if (pthread_create(&threads[i].thread, NULL, profile_thread,
+				   &threads[i]))
+			die("creating profile threads");
+	}
+
+	/* Merge the slices in order, while the threads do the next ones */
+	for (i = 0; i < pt.nr_slices; i++) {
+		pthread_mutex_lock(&pt.lock);
+		while (!pt.slices[i].done)
+			pthread_cond_wait(&pt.cond, &pt.lock);
+		pthread_mutex_unlock(&pt.lock);
+
+		if (!pt.slices[i].h) {
+			ret = -1;
+			break;
+		}
+		merge_slice(h, pt.slices[i].h);
+		free_handle_data(pt.slices[i].h);
+		pt.slices[i].h = NULL;
+	}
+
+	pthread_mutex_lock(&pt.lock);
+	pt.stop = true;
+	pthread_mutex_unlock(&pt.lock);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	for (i = 0; i < pt.nr_slices; i++) {
+		if (pt.slices[i].h)
+			free_handle_data(pt.slices[i].h);
+	}
+
+	pthread_mutex_destroy(&pt.lock);
+	pthread_cond_destroy(&pt.cond);
+	free(threads);
+	free(pt.slices);
+
+	return ret;
+}
+
+/* @val scaled to @keep percent of it, without overflowing */
+static unsigned long long decay_val(unsigned long long val, int keep)
+{
+	return val / 100 * keep + val % 100 * keep / 100;
+}
+
+/*
+ * Scales the counts, times and histograms of the events of @hash and
+ * of their stacks, and gives back to the arena the ones that are left with no
+ * count. The max and min of an event stay the ones seen so far.
+ */
+static void decay_events(struct handle_data *h, struct trace_hash *hash, int keep)
+{
+	struct trace_hash_item **bucket;
+	struct trace_hash_item **sbucket;
+	struct trace_hash_item *item;
+	struct trace_hash_item *sitem;
+	struct trace_hash_item *n;
+	struct trace_hash_item *sn;
+	struct event_hash *event_hash;
+	struct stack_data *stack;
+
+	trace_hash_for_each_bucket(bucket, hash) {
+		trace_hash_for_each_item_safe(item, n, bucket) {
+			event_hash = event_from_item(item);
+			event_hash->count = decay_val(event_hash->count, keep);
+			event_hash->time_total = decay_val(event_hash->time_total, keep);
+			tracecmd_histogram_scale(&event_hash->hist, keep);
+
+			trace_hash_for_each_bucket(sbucket, &event_hash->stacks) {
+				trace_hash_for_each_item_safe(sitem, sn, sbucket) {
+					stack = stack_from_item(sitem);
+					stack->count = decay_val(stack->count, keep);
+					stack->time = decay_val(stack->time, keep);
+					tracecmd_histogram_scale(&stack->hist, keep);
+					if (stack->count && event_hash->count)
+						continue;
+					trace_hash_del(sitem);
+					tracecmd_arena_put(h->arena, stack,
+							   sizeof(*stack) + stack->size);
+				}
+			}
+
+			if (event_hash->count)
+				continue;
+			trace_hash_del(item);
+			free_event_hash(h, event_hash);
+		}
+	}
+}
+
+/*
+ * What a task points to between a record and the stack trace that
+ * follows it. The events may go away with the snapshot, at worst a
+ * stack trace is not accounted.
+ */
+static void snapshot_task(struct task_data *task)
+{
+	task->proxy = NULL;
+	task->last_event = NULL;
+	task->stack_op = NULL;
+}
+
+static void decay_handle(struct handle_data *h, int keep)
+{
+	struct trace_hash_item **bucket;
+	struct trace_hash_item *item;
+	struct group_data *group;
+	struct task_data *task;
+	int i;
+
+	decay_events(h, &h->global_task->event_hash, keep);
+	for (i = 0; i < h->cpus; i++)
+		decay_events(h, &h->global_percpu_tasks[i].event_hash, keep);
+
+	trace_hash_for_each_bucket(bucket, &h->task_hash) {
+		trace_hash_for_each_item(item, bucket) {
+			task = task_from_item(item);
+			decay_events(h, &task->event_hash, keep);
+		}
+	}
+
+	trace_hash_for_each_bucket(bucket, &h->group_hash) {
+		trace_hash_for_each_item(item, bucket) {
+			group = group_from_item(item);
+			decay_events(h, &group->event_hash, keep);
+		}
+	}
+}
+
+/*
+ * Frees the starts that have not seen their end for longer than
+ * --evict, and then the tasks that have not been seen for as long and
+ * hold nothing. The time is the one of the trace.
+ */
+static void evict_handle(struct handle_data *h)
+{
+	struct trace_hash_item **bucket;
+	struct trace_hash_item *item;
+	struct trace_hash_item *n;
+	struct start_data *start;
+	struct start_data *sn;
+	struct task_data *task;
+	int i;
+
+	for (i = 0; i < h->cpus; i++) {
+		list_for_each_entry_safe(start, sn, &h->cpu_starts[i], list) {
+			if (start->timestamp + evict_nsecs < h->last_ts)
+				free_start(start);
+		}
+	}
+	list_for_each_entry_safe(start, sn, &h->migrate_starts, list) {
+		if (start->timestamp + evict_nsecs < h->last_ts)
+			free_start(start);
+	}
+
+	trace_hash_for_each_bucket(bucket, &h->task_hash) {
+		trace_hash_for_each_item_safe(item, n, bucket) {
+			task = task_from_item(item);
+			if (task->last_ts + evict_nsecs >= h->last_ts ||
+			    !trace_hash_empty(&task->start_hash) ||
+			    !trace_hash_empty(&task->event_hash))
+				continue;
+
+			trace_hash_del(item);
+			if (h->last_task == task)
+				h->last_task = NULL;
+			free_task(task);
+			if (task->comm)
+				tracecmd_arena_put(h->arena, task->comm,
+						   strlen(task->comm) + 1);
+			tracecmd_arena_put(h->arena, task, sizeof(*task));
+		}
+	}
+}
+
+static void snapshot_handle(struct handle_data *h)
+{
+	struct trace_hash_item **bucket;
+	struct trace_hash_item *item;
+	int i;
+
+	snapshot_task(h->global_task);
+	for (i = 0; i < h->cpus; i++)
+		snapshot_task(&h->global_percpu_tasks[i]);
+	trace_hash_for_each_bucket(bucket, &h->task_hash) {
+		trace_hash_for_each_item(item, bucket)
+			snapshot_task(task_from_item(item));
+	}
+
+	if (merge_like_comms)
+		merge_tasks(h);
+
+	output_handle(h, true);
+
+	/* Keeping all of it is the same as not having snapshots */
+	if (decay_percent < 100)
+		decay_handle(h, decay_percent);
+
+	if (evict_nsecs)
+		evict_handle(h);
+}
+
+/**
+ * trace_profile_check_snapshot - show the live profile if it is time to
+ *
+ * Called by the stream loop. Every --snapshot seconds, the profile since
+ * the last snapshot (with what --decay kept of the older ones) is shown,
+ * and then it is reset, or decayed by --decay, and what is idle for
+ * longer than --evict is freed. The memory of a profile that runs for
+ * long then follows what is live, not all that was seen.
+ */
+void trace_profile_check_snapshot(void)
+{
+	struct handle_data *h;
+	struct timespec now;
+
+	if (!snapshot_secs)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+	if (!next_snapshot)
+		next_snapshot = now.tv_sec + snapshot_secs;
+	if (now.tv_sec < next_snapshot)
+		return;
+	next_snapshot = now.tv_sec + snapshot_secs;
+
+	printf("\nsnapshot: %d\n", ++nr_snapshots);
+	for (h = handles; h; h = h->next)
+		snapshot_handle(h);
+	fflush(stdout);
+}
+
+int do_trace_profile(void)
+{
+	struct handle_data *h;
+
+	while ((h = handles)) {
+		handles = h->next;
 		if (merge_like_comms)
 			merge_tasks(h);
-		output_handle(h);
-		trace_hash_free(&h->task_hash);
+		output_handle(h, false);
+		free_handle_data(h);
 	}
 
 	return 0;
@@ -19,6 +19,9 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
 
 #include "trace-local.h"
 #include "trace-hash.h"
@@ -102,6 +105,20 @@ static int no_softirqs;
 static int tsdiff;
 static int tscheck;
 
+static int nr_threads;
+
+/* How the inputs are opened */
+static int open_flags = TRACECMD_FL_SEQUENTIAL_SCAN;
+static unsigned long long ts2secs;
+static int no_date;
+static int raw_ts;
+
+/* With --follow, an inotify watch of the file being recorded */
+static int follow_fd = -1;
+
+/* Let the recorder write some more before looking again */
+#define FOLLOW_DELAY_MS		200
+
 static int latency_format;
 static bool raw_format;
 static const char *format_type = TEP_PRINT_INFO;
@@ -361,6 +378,23 @@ static void add_handle(struct tracecmd_input *handle, const char *file)
 	list_add_tail(&item->list, &handle_list);
 }
 
+static void set_input_options(struct tracecmd_input *handle,
+			      struct input_files *input)
+{
+	if (no_date)
+		tracecmd_set_flag(handle, TRACECMD_FL_IGNORE_DATE);
+	if (raw_ts)
+		tracecmd_set_flag(handle, TRACECMD_FL_RAW_TS);
+
+	if (input->tsoffset)
+		tracecmd_set_ts_offset(handle, input->tsoffset);
+
+	if (input->ts2secs)
+		tracecmd_set_ts2secs(handle, input->ts2secs);
+	else if (ts2secs)
+		tracecmd_set_ts2secs(handle, ts2secs);
+}
+
 static void free_inputs(void)
 {
 	struct input_files *item;
@@ -806,14 +840,15 @@ static void finish_wakeup(void)
 	trace_hash_free(&wakeup_hash);
 }
 
-void trace_show_data(struct tracecmd_input *handle, struct tep_record *record)
+/* Format @record into @s, as trace_show_data() prints it */
+static void format_record(struct tracecmd_input *handle,
+			  struct tep_record *record, struct trace_seq *s)
 {
-	tracecmd_show_data_func func = tracecmd_get_show_data_func(handle);
 	const char *tfmt = time_format(handle, TIME_FMT_NORMAL);
 	const char *cfmt = latency_format ? "%8.8s-%-5d %3d" : "%16s-%-5d [%03d]";
 	struct tep_handle *pevent;
 	struct tep_event *event;
-	struct trace_seq s;
+	unsigned int start = s->len;
 	int cpu = record->cpu;
 	bool use_trace_clock;
 	static unsigned long long last_ts;
@@ -823,49 +858,41 @@ void trace_show_data(struct tracecmd_input *handle, struct tep_record *record)
 
 	page_size = tracecmd_page_size(handle);
 
-	test_save(record, cpu);
-
-	if (func) {
-		func(handle, record);
-		return;
-	}
-
 	pevent = tracecmd_get_tep(handle);
 	event = tep_find_event_by_record(pevent, record);
 	use_trace_clock = tracecmd_get_use_trace_clock(handle);
 
-	trace_seq_init(&s);
 	if (record->missed_events > 0)
-		trace_seq_printf(&s, "CPU:%d [%lld EVENTS DROPPED]\n",
+		trace_seq_printf(s, "CPU:%d [%lld EVENTS DROPPED]\n",
 				 cpu, record->missed_events);
 	else if (record->missed_events < 0)
-		trace_seq_printf(&s, "CPU:%d [EVENTS DROPPED]\n", cpu);
+		trace_seq_printf(s, "CPU:%d [EVENTS DROPPED]\n", cpu);
 	if (buffer_breaks || tracecmd_get_debug()) {
 		if (tracecmd_record_at_buffer_start(handle, record)) {
-			trace_seq_printf(&s, "CPU:%d [SUBBUFFER START]", cpu);
+			trace_seq_printf(s, "CPU:%d [SUBBUFFER START]", cpu);
 			if (tracecmd_get_debug())
-				trace_seq_printf(&s, " [%lld:0x%llx]",
+				trace_seq_printf(s, " [%lld:0x%llx]",
 						 tracecmd_page_ts(handle, record),
 						 record->offset & ~(page_size - 1));
-			trace_seq_putc(&s, '\n');
+			trace_seq_putc(s, '\n');
 		}
 	}
 
-	tep_print_event(pevent, &s, record, cfmt,
+	tep_print_event(pevent, s, record, cfmt,
 			TEP_PRINT_COMM,
 			TEP_PRINT_PID,
 			TEP_PRINT_CPU);
 
 	if (latency_format) {
 		if (raw_format)
-			trace_seq_printf(&s, "-0x%x",
+			trace_seq_printf(s, "-0x%x",
 					 tep_data_flags(pevent, record));
 		else
-			tep_print_event(pevent, &s, record, "%s",
+			tep_print_event(pevent, s, record, "%s",
 					TEP_PRINT_LATENCY);
 	}
 
-	tep_print_event(pevent, &s, record, tfmt, TEP_PRINT_TIME);
+	tep_print_event(pevent, s, record, tfmt, TEP_PRINT_TIME);
 
 	if (tsdiff) {
 		unsigned long long rec_ts = record->ts;
@@ -879,21 +906,21 @@ void trace_show_data(struct tracecmd_input *handle, struct tep_record *record)
 			buf[49] = 0;
 		}
 		last_ts = rec_ts;
-		trace_seq_printf(&s, " %-8s", buf);
+		trace_seq_printf(s, " %-8s", buf);
 	}
 
-	print_event_name(&s, event);
-	tep_print_event(pevent, &s, record, "%s", format_type);
+	print_event_name(s, event);
+	tep_print_event(pevent, s, record, "%s", format_type);
 
-	if (s.len && *(s.buffer + s.len - 1) == '\n')
-		s.len--;
+	if (s->len > start && *(s->buffer + s->len - 1) == '\n')
+		s->len--;
 	if (tracecmd_get_debug()) {
 		struct kbuffer *kbuf;
 		struct kbuffer_raw_info info;
 		void *page;
 		void *offset;
 
-		trace_seq_printf(&s, " [%d:0x%llx:%d]",
+		trace_seq_printf(s, " [%d:0x%llx:%d]",
 				 tracecmd_record_ts_delta(handle, record),
 				 record->offset & (page_size - 1), record->size);
 		kbuf = tracecmd_record_kbuf(handle, record);
@@ -911,31 +938,46 @@ void trace_show_data(struct tracecmd_input *handle, struct tep_record *record)
 					break;
 				switch (pi->type) {
 				case KBUFFER_TYPE_PADDING:
-					trace_seq_printf(&s, "\n PADDING: ");
+					trace_seq_printf(s, "\n PADDING: ");
 					break;
 				case KBUFFER_TYPE_TIME_EXTEND:
-					trace_seq_printf(&s, "\n TIME EXTEND: ");
+					trace_seq_printf(s, "\n TIME EXTEND: ");
 					break;
 				case KBUFFER_TYPE_TIME_STAMP:
-					trace_seq_printf(&s, "\n TIME STAMP: ");
+					trace_seq_printf(s, "\n TIME STAMP: ");
 					break;
 				}
 				if (pi->type == KBUFFER_TYPE_TIME_STAMP)
-					trace_seq_printf(&s, "timestamp:%lld length:%d",
+					trace_seq_printf(s, "timestamp:%lld length:%d",
 							 pi->delta,
 							 pi->length);
 				else
-					trace_seq_printf(&s, "delta:%lld length:%d",
+					trace_seq_printf(s, "delta:%lld length:%d",
 							 pi->delta,
 							 pi->length);
 			}
 		}
 	}
+}
+
+void trace_show_data(struct tracecmd_input *handle, struct tep_record *record)
+{
+	tracecmd_show_data_func func = tracecmd_get_show_data_func(handle);
+	struct trace_seq s;
+
+	test_save(record, record->cpu);
+
+	if (func) {
+		func(handle, record);
+		return;
+	}
 
+	trace_seq_init(&s);
+	format_record(handle, record, &s);
 	trace_seq_do_printf(&s);
 	trace_seq_destroy(&s);
 
-	process_wakeup(pevent, record);
+	process_wakeup(tracecmd_get_tep(handle), record);
 
 	printf("\n");
 }
@@ -999,55 +1041,62 @@ struct stack_info {
 	int			nr_cpus;
 };
 
+static struct stack_info *stack_infos;
+
+static void init_stacktrace(void)
+{
+	struct stack_info *info;
+	struct handle_list *h;
+	struct tep_handle *pevent;
+	struct tep_event *event;
+	static int init;
+
+	if (init)
+		return;
+	init = 1;
+
+	list_for_each_entry(h, &handle_list, list) {
+		info = malloc(sizeof(*info));
+		if (!info)
+			die("Failed to allocate handle");
+		info->handles = h;
+		info->nr_cpus = tracecmd_cpus(h->handle);
+
+		info->cpus = malloc(sizeof(*info->cpus) * info->nr_cpus);
+		if (!info->cpus)
+			die("Failed to allocate for %d cpus", info->nr_cpus);
+		memset(info->cpus, 0, sizeof(*info->cpus) * info->nr_cpus);
+
+		pevent = tracecmd_get_tep(h->handle);
+		event = tep_find_event_by_name(pevent, "ftrace",
+					       "kernel_stack");
+		if (event)
+			info->stacktrace_id = event->id;
+		else
+			info->stacktrace_id = 0;
+
+		info->next = stack_infos;
+		stack_infos = info;
+	}
+}
+
 static int
 test_stacktrace(struct handle_list *handles, struct tep_record *record,
 		int last_printed)
 {
-	static struct stack_info *infos;
 	struct stack_info *info;
 	struct stack_info_cpu *cpu_info;
-	struct handle_list *h;
 	struct tracecmd_input *handle;
 	struct tep_handle *pevent;
-	struct tep_event *event;
-	static int init;
 	int ret;
 	int id;
 
-	if (!init) {
-		init = 1;
-
-		list_for_each_entry(h, &handle_list, list) {
-			info = malloc(sizeof(*info));
-			if (!info)
-				die("Failed to allocate handle");
-			info->handles = h;
-			info->nr_cpus = tracecmd_cpus(h->handle);
-
-			info->cpus = malloc(sizeof(*info->cpus) * info->nr_cpus);
-			if (!info->cpus)
-				die("Failed to allocate for %d cpus", info->nr_cpus);
-			memset(info->cpus, 0, sizeof(*info->cpus));
-
-			pevent = tracecmd_get_tep(h->handle);
-			event = tep_find_event_by_name(pevent, "ftrace",
-						       "kernel_stack");
-			if (event)
-				info->stacktrace_id = event->id;
-			else
-				info->stacktrace_id = 0;
-
-			info->next = infos;
-			infos = info;
-		}
-
-
-	}
+	init_stacktrace();
 
 	handle = handles->handle;
 	pevent = tracecmd_get_tep(handle);
 
-	for (info = infos; info; info = info->next)
+	for (info = stack_infos; info; info = info->next)
 		if (info->handles == handles)
 			break;
 
@@ -1074,13 +1123,46 @@ test_stacktrace(struct handle_list *handles, struct tep_record *record,
 	return 0;
 }
 
+/*
+ * Returns true if @record passes the filters and is to be shown.
+ * Only looks at @record and at the state of its CPU.
+ */
+static bool keep_record(struct handle_list *handles, struct tep_handle *pevent,
+			struct tep_record *record)
+{
+	bool found = false;
+	int ret;
+
+	ret = test_filters(pevent, handles->event_filters, record, 0);
+	switch (ret) {
+	case FILTER_NOEXIST:
+		/* Stack traces may still filter this */
+		if (stacktrace_id &&
+		    test_stacktrace(handles, record, 0))
+			found = true;
+		break;
+	case FILTER_NONE:
+	case FILTER_MATCH:
+		/* Test the negative filters (-v) */
+		ret = test_filters(pevent, handles->event_filter_out,
+				   record, 1);
+		if (ret != FILTER_MATCH)
+			found = true;
+		break;
+	}
+
+	if (found && stacktrace_id)
+		test_stacktrace(handles, record, 1);
+
+	return found;
+}
+
 static struct tep_record *get_next_record(struct handle_list *handles)
 {
 	struct tep_record *record;
 	struct tep_handle *pevent;
 	int found = 0;
 	int cpu;
-	int ret;
 
 	if (handles->record)
 		return handles->record;
@@ -1115,35 +1197,12 @@ static struct tep_record *get_next_record(struct handle_list *handles)
 			record = tracecmd_read_next_data(handles->handle, &cpu);
 
 		if (record) {
-			ret = test_filters(pevent, handles->event_filters, record, 0);
-			switch (ret) {
-			case FILTER_NOEXIST:
-				/* Stack traces may still filter this */
-				if (stacktrace_id &&
-				    test_stacktrace(handles, record, 0))
-					found = 1;
-				else
-					tracecmd_free_record(record);
-				break;
-			case FILTER_NONE:
-			case FILTER_MATCH:
-				/* Test the negative filters (-v) */
-				ret = test_filters(pevent, handles->event_filter_out,
-						   record, 1);
-				if (ret != FILTER_MATCH) {
-					found = 1;
-					break;
-				}
-				/* fall through */
-			default:
+			found = keep_record(handles, pevent, record);
+			if (!found)
 				tracecmd_free_record(record);
-			}
 		}
 	} while (record && !found);
 
-	if (record && stacktrace_id)
-		test_stacktrace(handles, record, 1);
-
 	handles->record = record;
 	if (!record)
 		handles->done = 1;
@@ -1191,6 +1250,634 @@ enum output_type {
 	OUTPUT_VERSION_ONLY,
 };
 
+static void print_record_stats(struct handle_list *handles)
+{
+	struct tracecmd_record_stats stats;
+
+	tracecmd_get_record_stats(handles->handle, &stats);
+	printf("\n%s%srecords: %llu allocated, %llu reused, %llu max in use, %llu slabs\n",
+	       handles->file ? handles->file : "", handles->file ? ": " : "",
+	       stats.allocated, stats.reused, stats.max_in_use, stats.slabs);
+}
+
+/*
+ * report --threads: the CPUs are decoded and filtered by worker
+ * threads, and merged by time and formatted on the main thread. The
+ * plugin handlers keep state across records (and libtraceevent caches
+ * the last event it looked up), so the formatting stays in one thread
+ * and in order, and the output is the same as without threads.
+ */
+#define THREAD_CHUNK_RECORDS	512	/* records in a decoded chunk */
+#define THREAD_CHUNK_SCAN	(THREAD_CHUNK_RECORDS * 16)
+#define THREAD_CPU_CHUNKS	4	/* decoded chunks queued per CPU */
+
+/* Filtered records of one CPU, with copies of their data */
+struct rec_chunk {
+	struct rec_chunk	*next;
+	struct tep_record	*records;
+	char			*data;
+	size_t			data_len;
+	size_t			data_size;
+	int			nr;
+	int			pos;
+};
+
+struct cpu_stream {
+	struct rec_chunk	*head;
+	struct rec_chunk	*tail;
+	struct rec_chunk	*cur;
+	int			nr_chunks;
+	int			cpu;
+	bool			done;
+};
+
+struct report_pipe {
+	struct handle_list	*handles;
+	struct tracecmd_input	*handle;
+	struct tep_handle	*pevent;
+	struct cpu_stream	*streams;
+	int			nr_streams;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	/* libtraceevent filters have scratch buffers of their own */
+	pthread_mutex_t		filter_lock;
+	bool			lock_filters;
+	int			fgraph_id;	/* -1 if there are no function graph events */
+	bool			fgraph;		/* a function graph entry was reached */
+	bool			failed;
+	bool			stop;
+};
+
+struct pipe_worker {
+	struct report_pipe	*rp;
+	pthread_t		thread;
+	int			id;
+};
+
+static void free_chunk(struct rec_chunk *chunk)
+{
+	free(chunk->records);
+	free(chunk->data);
+	free(chunk);
+}
+
+static int chunk_add(struct rec_chunk *chunk, struct tep_record *record)
+{
+	struct tep_record *rec;
+	size_t size;
+	char *data;
+
+	if (chunk->data_len + record->size > chunk->data_size) {
+		size = chunk->data_size ? chunk->data_size : BUFSIZ;
+		while (size < chunk->data_len + record->size)
+			size *= 2;
+		data = realloc(chunk->data, size);
+		if (!data)
+			return -1;
+		chunk->data = data;
+		chunk->data_size = size;
+	}
+	memcpy(chunk->data + chunk->data_len, record->data, record->size);
+
+	rec = &chunk->records[chunk->nr++];
+	*rec = *record;
+	/* The data may still move, keep its offset until the chunk is done */
+	rec->data = (void *)(unsigned long)chunk->data_len;
+	rec->priv = NULL;
+	rec->ref_count = 1;
+	rec->locked = 0;
+	chunk->data_len += record->size;
+
+	return 0;
+}
+
+struct decode_data {
+	struct report_pipe	*rp;
+	struct rec_chunk	*chunk;
+	int			scanned;
+};
+
+static int decode_event(struct tracecmd_input *handle,
+			struct tep_record *record, int cpu, void *data)
+{
+	struct decode_data *dd = data;
+	struct report_pipe *rp = dd->rp;
+	bool keep;
+
+	if (rp->lock_filters) {
+		pthread_mutex_lock(&rp->filter_lock);
+		keep = keep_record(rp->handles, rp->pevent, record);
+		pthread_mutex_unlock(&rp->filter_lock);
+	} else {
+		keep = keep_record(rp->handles, rp->pevent, record);
+	}
+
+	if (keep && chunk_add(dd->chunk, record) < 0)
+		return -1;
+
+	if (dd->chunk->nr == THREAD_CHUNK_RECORDS ||
+	    ++dd->scanned == THREAD_CHUNK_SCAN)
+		return 1;
+
+	return 0;
+}
+
+/* Returns 1 if there is more to read on @cpu, 0 if not, -1 on error */
+static int decode_chunk(struct report_pipe *rp, int cpu,
+			struct rec_chunk **pchunk)
+{
+	struct decode_data dd = { .rp = rp };
+	struct rec_chunk *chunk;
+	int ret;
+	int i;
+
+	chunk = calloc(1, sizeof(*chunk));
+	if (!chunk)
+		return -1;
+	chunk->records = malloc(sizeof(*chunk->records) * THREAD_CHUNK_RECORDS);
+	if (!chunk->records) {
+		free_chunk(chunk);
+		return -1;
+	}
+
+	dd.chunk = chunk;
+	ret = tracecmd_iterate_events(rp->handle, cpu, decode_event, &dd);
+	if (ret < 0) {
+		free_chunk(chunk);
+		return -1;
+	}
+
+	for (i = 0; i < chunk->nr; i++)
+		chunk->records[i].data = chunk->data +
+			(unsigned long)chunk->records[i].data;
+
+	*pchunk = chunk;
+
+	return ret;
+}
+
+/* Find a CPU of worker @id that has room for another chunk */
+static struct cpu_stream *find_decode_stream(struct report_pipe *rp, int id)
+{
+	struct cpu_stream *stream;
+	int i;
+
+	if (rp->failed || rp->fgraph)
+		return NULL;
+
+	for (i = id; i < rp->nr_streams; i += nr_threads) {
+		stream = &rp->streams[i];
+		if (!stream->done && stream->nr_chunks < THREAD_CPU_CHUNKS)
+			return stream;
+	}
+
+	return NULL;
+}
+
+/*
+ * The workers decode and filter their CPUs, keeping up to
+ * THREAD_CPU_CHUNKS chunks queued ahead of the merge on each.
+ */
+static void *pipe_worker_thread(void *data)
+{
+	struct pipe_worker *w = data;
+	struct report_pipe *rp = w->rp;
+	struct cpu_stream *stream;
+	struct rec_chunk *chunk;
+	int ret;
+
+	pthread_mutex_lock(&rp->lock);
+	for (;;) {
+		stream = find_decode_stream(rp, w->id);
+		if (!stream) {
+			if (rp->stop)
+				break;
+			pthread_cond_wait(&rp->cond, &rp->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&rp->lock);
+
+		chunk = NULL;
+		ret = decode_chunk(rp, stream->cpu, &chunk);
+
+		pthread_mutex_lock(&rp->lock);
+		if (ret < 0) {
+			rp->failed = true;
+			stream->done = true;
+		} else {
+			if (chunk->nr) {
+				if (stream->tail)
+					stream->tail->next = chunk;
+				else
+					stream->head = chunk;
+				stream->tail = chunk;
+				stream->nr_chunks++;
+			} else {
+				free_chunk(chunk);
+			}
+			if (!ret)
+				stream->done = true;
+		}
+		pthread_cond_broadcast(&rp->cond);
+	}
+	pthread_mutex_unlock(&rp->lock);
+
+	return NULL;
+}
+
+static struct tep_record *stream_peek(struct report_pipe *rp,
+				      struct cpu_stream *stream)
+{
+	struct rec_chunk *chunk = stream->cur;
+
+	if (chunk && chunk->pos < chunk->nr)
+		return &chunk->records[chunk->pos];
+
+	if (chunk) {
+		stream->cur = NULL;
+		free_chunk(chunk);
+	}
+
+	pthread_mutex_lock(&rp->lock);
+	while (!stream->head && !stream->done && !rp->failed)
+		pthread_cond_wait(&rp->cond, &rp->lock);
+	chunk = stream->head;
+	if (chunk) {
+		stream->head = chunk->next;
+		if (!stream->head)
+			stream->tail = NULL;
+		stream->nr_chunks--;
+		/* The worker may be waiting for room */
+		pthread_cond_broadcast(&rp->cond);
+	}
+	pthread_mutex_unlock(&rp->lock);
+
+	stream->cur = chunk;
+	if (!chunk)
+		return NULL;
+
+	return &chunk->records[0];
+}
+
+struct stream_node {
+	unsigned long long	ts;
+	int			idx;
+};
+
+static inline bool stream_node_less(struct stream_node *a, struct stream_node *b)
+{
+	/* On equal times, the first CPU wins, as in the single threaded merge */
+	return a->ts < b->ts || (a->ts == b->ts && a->idx < b->idx);
+}
+
+static void stream_sift_down(struct stream_node *heap, int nr, int i)
+{
+	struct stream_node tmp;
+	int child;
+
+	for (;;) {
+		child = i * 2 + 1;
+		if (child >= nr)
+			break;
+		if (child + 1 < nr && stream_node_less(&heap[child + 1], &heap[child]))
+			child++;
+		if (!stream_node_less(&heap[child], &heap[i]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+/*
+ * The function graph handler looks ahead at the next records of the
+ * handle when formatting, which only works in a single thread. The
+ * merge stops at the first function graph entry, with rp->fgraph set,
+ * and leaves it and what follows to the single threaded path.
+ */
+static void merge_streams(struct report_pipe *rp)
+{
+	struct handle_list *handles = rp->handles;
+	struct stream_node *heap;
+	struct cpu_stream *stream;
+	struct tep_record *record;
+	struct trace_seq s;
+	int nr = 0;
+	int cpu;
+	int i;
+
+	heap = calloc(rp->nr_streams, sizeof(*heap));
+	if (!heap)
+		die("allocating merge heap");
+
+	for (i = 0; i < rp->nr_streams; i++) {
+		record = stream_peek(rp, &rp->streams[i]);
+		if (!record)
+			continue;
+		heap[nr].ts = record->ts;
+		heap[nr].idx = i;
+		nr++;
+	}
+	for (i = nr / 2 - 1; i >= 0; i--)
+		stream_sift_down(heap, nr, i);
+
+	while (nr) {
+		stream = &rp->streams[heap[0].idx];
+		record = &stream->cur->records[stream->cur->pos];
+		cpu = record->cpu;
+
+		if (rp->fgraph_id >= 0 &&
+		    tep_data_type(rp->pevent, record) == rp->fgraph_id) {
+			rp->fgraph = true;
+			break;
+		}
+
+		if (tscheck && handles->last_timestamp[cpu] > record->ts) {
+			errno = 0;
+			warning("WARNING: Record on cpu %d went backwards: %lld to %lld delta: -%lld\n",
+				cpu, handles->last_timestamp[cpu],
+				record->ts,
+				handles->last_timestamp[cpu] - record->ts);
+		}
+		handles->last_timestamp[cpu] = record->ts;
+
+		trace_seq_init(&s);
+		format_record(rp->handle, record, &s);
+		trace_seq_putc(&s, '\n');
+		trace_seq_do_printf(&s);
+		trace_seq_destroy(&s);
+
+		stream->cur->pos++;
+		record = stream_peek(rp, stream);
+		if (record)
+			heap[0].ts = record->ts;
+		else
+			heap[0] = heap[--nr];
+		stream_sift_down(heap, nr, 0);
+	}
+
+	free(heap);
+}
+
+/*
+ * After the merge stopped at a function graph entry, point the CPUs of
+ * the handle to the first record of each that was not shown. The CPUs
+ * that have no decoded records left are already there.
+ */
+static void rewind_streams(struct report_pipe *rp)
+{
+	struct cpu_stream *stream;
+	struct rec_chunk *chunk;
+	int i;
+
+	for (i = 0; i < rp->nr_streams; i++) {
+		stream = &rp->streams[i];
+		chunk = stream->cur;
+		if (!chunk || chunk->pos == chunk->nr)
+			chunk = stream->head;
+		if (!chunk)
+			continue;
+		if (tracecmd_set_cursor(rp->handle, stream->cpu,
+					chunk->records[chunk->pos].offset) < 0)
+			die("failed to go back to the record at %lld",
+			    chunk->records[chunk->pos].offset);
+	}
+}
+
+/* libtraceevent sets up these on first use, do it before the threads */
+static void warm_up_tep(struct tep_handle *pevent, struct tep_record *record)
+{
+	struct trace_seq s;
+
+	tep_data_type(pevent, record);
+	tep_data_pid(pevent, record);
+	tep_data_flags(pevent, record);
+	tep_data_preempt_count(pevent, record);
+	tep_data_comm_from_pid(pevent, 0);
+	tep_find_function(pevent, 0);
+
+	if (latency_format) {
+		trace_seq_init(&s);
+		tep_print_event(pevent, &s, record, "%s", TEP_PRINT_LATENCY);
+		trace_seq_destroy(&s);
+	}
+}
+
+/* Can this handle be shown by read_data_threads()? */
+static bool can_use_threads(struct handle_list *handles)
+{
+	struct filter_str *filter;
+
+	if (nr_threads < 2)
+		return false;
+
+	/* The state of these is kept across all the records */
+	if (multi_inputs || instances || profile || show_wakeup || tsdiff ||
+	    buffer_breaks || tracecmd_get_debug() ||
+	    tracecmd_get_show_data_func(handles->handle))
+		return false;
+
+	/* COMM filters read the comms that the plugins may be adding */
+	for (filter = filter_strings; filter; filter = filter->next) {
+		if (strstr(filter->filter, "COMM"))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Show the records of @handles with the CPUs decoded and filtered
+ * by nr_threads threads. Returns false if the records need
+ * to be shown by the single threaded path instead, all of them or the
+ * ones from the first function graph entry on.
+ */
+static bool read_data_threads(struct handle_list *handles)
+{
+	struct tracecmd_input *handle = handles->handle;
+	struct report_pipe rp = { .handles = handles };
+	struct pipe_worker *workers;
+	struct tep_record *record;
+	struct tep_event *event;
+	int cpus = handles->cpus;
+	int i;
+
+	if (!can_use_threads(handles))
+		return false;
+
+	rp.handle = handle;
+	rp.pevent = tracecmd_get_tep(handle);
+
+	record = tracecmd_peek_next_data(handle, NULL);
+	if (!record)
+		return false;
+	warm_up_tep(rp.pevent, record);
+	init_stacktrace();
+
+	event = tep_find_event_by_name(rp.pevent, "ftrace", "funcgraph_entry");
+	rp.fgraph_id = event ? event->id : -1;
+
+	rp.streams = calloc(cpus, sizeof(*rp.streams));
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!rp.streams || !workers)
+		die("allocating report threads");
+
+	/* Same order as the single threaded path, for equal time stamps */
+	if (filter_cpus) {
+		for (i = 0; filter_cpus[i] >= 0; i++) {
+			if (filter_cpus[i] < cpus)
+				rp.streams[rp.nr_streams++].cpu = filter_cpus[i];
+		}
+	} else {
+		for (i = 0; i < cpus; i++)
+			rp.streams[rp.nr_streams++].cpu = i;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].rp = &rp;
+		workers[i].id = i;
+	}
+
+	pthread_mutex_init(&rp.lock, NULL);
+	pthread_cond_init(&rp.cond, NULL);
+	pthread_mutex_init(&rp.filter_lock, NULL);
+	rp.lock_filters = handles->event_filters || handles->event_filter_out;
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL,
+				   pipe_worker_thread, &workers[i]))
+			die("creating report threads");
+	}
+
+	merge_streams(&rp);
+
+	pthread_mutex_lock(&rp.lock);
+	rp.stop = true;
+	pthread_cond_broadcast(&rp.cond);
+	pthread_mutex_unlock(&rp.lock);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	if (rp.failed)
+		die("failed to read the trace data");
+
+	if (rp.fgraph)
+		rewind_streams(&rp);
+
+	for (i = 0; i < rp.nr_streams; i++) {
+		if (rp.streams[i].cur)
+			free_chunk(rp.streams[i].cur);
+		while (rp.streams[i].head) {
+			struct rec_chunk *chunk = rp.streams[i].head;
+
+			rp.streams[i].head = chunk->next;
+			free_chunk(chunk);
+		}
+	}
+
+	pthread_mutex_destroy(&rp.lock);
+	pthread_cond_destroy(&rp.cond);
+	pthread_mutex_destroy(&rp.filter_lock);
+	free(workers);
+	free(rp.streams);
+
+	if (rp.fgraph)
+		return false;
+
+	handles->done = 1;
+
+	return true;
+}
+
+/*
+ * report --profile --threads: the threads profile slices of the trace,
+ * each with a handle of its own (see trace_profile_threads()). The
+ * profile sees the records after the filters, which stay single
+ * threaded.
+ */
+static bool read_profile_threads(struct handle_list *handles)
+{
+	struct tracecmd_input **inputs;
+	struct input_files *input;
+	int ret;
+	int i;
+
+	if (nr_threads < 2 || multi_inputs || instances || filter_cpus ||
+	    handles->event_filters || handles->event_filter_out)
+		return false;
+
+	input = container_of(input_files.next, struct input_files, list);
+
+	inputs = calloc(nr_threads, sizeof(*inputs));
+	if (!inputs)
+		die("allocating profile threads");
+
+	for (i = 0; i < nr_threads; i++) {
+		inputs[i] = tracecmd_alloc(input->file, open_flags);
+		if (!inputs[i])
+			die("error reading header for %s", input->file);
+		set_input_options(inputs[i], input);
+		if (tracecmd_read_headers(inputs[i], 0) < 0 ||
+		    tracecmd_init_data(inputs[i]) < 0)
+			die("failed to init data for %s", input->file);
+	}
+
+	ret = trace_profile_threads(handles->handle, inputs, nr_threads);
+
+	for (i = 0; i < nr_threads; i++)
+		tracecmd_close(inputs[i]);
+	free(inputs);
+
+	if (ret < 0)
+		die("failed to profile the trace");
+
+	handles->done = 1;
+
+	return true;
+}
+
+/*
+ * Wait for the file being recorded to change, and pick up the data that
+ * was added to it. Returns once there is more to read.
+ */
+static void follow_handles(struct list_head *handle_list)
+{
+	struct pollfd pfd = {
+		.fd = follow_fd,
+		.events = POLLIN,
+	};
+	struct handle_list *handles;
+	char buf[4096];
+	bool more = false;
+	int ret;
+
+	fflush(stdout);
+
+	while (!more) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("Failed to wait for the file to change");
+		}
+		/* The file changes a lot while recording, do not look every time */
+		usleep(FOLLOW_DELAY_MS * 1000);
+		while (read(follow_fd, buf, sizeof(buf)) > 0)
+			;
+
+		list_for_each_entry(handles, handle_list, list) {
+			ret = tracecmd_refresh(handles->handle);
+			if (ret < 0)
+				die("Can not follow the file, was it recorded with --live?");
+			if (ret > 0) {
+				handles->done = 0;
+				more = true;
+			}
+		}
+	}
+}
+
 static void read_data_info(struct list_head *handle_list, enum output_type otype,
 			   int global)
 {
@@ -1286,7 +1973,15 @@ static void read_data_info(struct list_head *handle_list, enum output_type otype
 	if (otype != OUTPUT_NORMAL)
 		return;
 
-	do {
+	if (nr_threads > 1) {
+		handles = container_of(handle_list->next, struct handle_list, list);
+		if (profile)
+			read_profile_threads(handles);
+		else
+			read_data_threads(handles);
+	}
+
+	for (;;) {
 		last_handle = NULL;
 		last_record = NULL;
 
@@ -1316,13 +2011,19 @@ static void read_data_info(struct list_head *handle_list, enum output_type otype
 			print_handle_file(last_handle);
 			trace_show_data(last_handle->handle, last_record);
 			free_handle_record(last_handle);
-		}
-	} while (last_record);
+		} else if (follow_fd >= 0) {
+			/* Wait for the recorder to add more data */
+			follow_handles(handle_list);
+		} else
+			break;
+	}
 
 	if (profile)
 		do_trace_profile();
 
 	list_for_each_entry(handles, handle_list, list) {
+		if (tracecmd_get_debug())
+			print_record_stats(handles);
 		free_filters(handles->event_filters);
 		free_filters(handles->event_filter_out);
 		free(handles->last_timestamp);
@@ -1485,6 +2186,9 @@ static void add_hook(const char *arg)
 }
 
 enum {
+	OPT_percentiles	= 233,
+	OPT_follow	= 234,
+	OPT_threads	= 235,
 	OPT_raw_ts	= 236,
 	OPT_version	= 237,
 	OPT_tscheck	= 238,
@@ -1521,9 +2225,7 @@ void trace_report (int argc, char **argv)
 	struct handle_list *handles;
 	enum output_type otype;
 	long long tsoffset = 0;
-	unsigned long long ts2secs = 0;
 	unsigned long long ts2sc;
-	int open_flags = 0;
 	int show_stat = 0;
 	int show_funcs = 0;
 	int show_endian = 0;
@@ -1534,12 +2236,11 @@ void trace_report (int argc, char **argv)
 	int show_events = 0;
 	int print_events = 0;
 	int nanosec = 0;
-	int no_date = 0;
-	int raw_ts = 0;
 	int global = 0;
 	int neg = 0;
 	int ret = 0;
 	int check_event_parsing = 0;
+	int follow = 0;
 	int c;
 
 	list_head_init(&handle_list);
@@ -1573,11 +2274,14 @@ void trace_report (int argc, char **argv)
 			{"uname", no_argument, NULL, OPT_uname},
 			{"version", no_argument, NULL, OPT_version},
 			{"by-comm", no_argument, NULL, OPT_bycomm},
+			{"percentiles", required_argument, NULL, OPT_percentiles},
 			{"ts-offset", required_argument, NULL, OPT_tsoffset},
 			{"ts2secs", required_argument, NULL, OPT_ts2secs},
 			{"ts-diff", no_argument, NULL, OPT_tsdiff},
 			{"ts-check", no_argument, NULL, OPT_tscheck},
 			{"raw-ts", no_argument, NULL, OPT_raw_ts},
+			{"threads", required_argument, NULL, OPT_threads},
+			{"follow", no_argument, NULL, OPT_follow},
 			{"help", no_argument, NULL, '?'},
 			{NULL, 0, NULL, 0}
 		};
@@ -1730,6 +2434,10 @@ void trace_report (int argc, char **argv)
 		case OPT_bycomm:
 			trace_profile_set_merge_like_comms();
 			break;
+		case OPT_percentiles:
+			if (trace_profile_set_percentiles(optarg) < 0)
+				die("Invalid percentiles: %s", optarg);
+			break;
 		case OPT_ts2secs:
 			ts2sc = atoll(optarg);
 			if (multi_inputs)
@@ -1753,6 +2461,14 @@ void trace_report (int argc, char **argv)
 		case OPT_raw_ts:
 			raw_ts = 1;
 			break;
+		case OPT_threads:
+			nr_threads = atoi(optarg);
+			if (nr_threads < 1)
+				die("--threads needs a positive number");
+			break;
+		case OPT_follow:
+			follow = 1;
+			break;
 		default:
 			usage(argv);
 		}
@@ -1774,6 +2490,17 @@ void trace_report (int argc, char **argv)
 	} else if (show_wakeup)
 		die("Wakeup tracing can only be done on a single input file");
 
+	if (follow) {
+		if (multi_inputs)
+			die("--follow only works with a single input file");
+		if (nr_threads > 1 || profile)
+			die("--follow can not be used with --threads or --profile");
+		follow_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (follow_fd < 0 ||
+		    inotify_add_watch(follow_fd, input_file, IN_MODIFY) < 0)
+			die("Failed to watch %s", input_file);
+	}
+
 	list_for_each_entry(inputs, &input_files, list) {
 		handle = read_trace_header(inputs->file, open_flags);
 		if (!handle)
@@ -1782,10 +2509,7 @@ void trace_report (int argc, char **argv)
 		/* If used with instances, top instance will have no tag */
 		add_handle(handle, multi_inputs ? inputs->file : NULL);
 
-		if (no_date)
-			tracecmd_set_flag(handle, TRACECMD_FL_IGNORE_DATE);
-		if (raw_ts)
-			tracecmd_set_flag(handle, TRACECMD_FL_RAW_TS);
+		set_input_options(handle, inputs);
 		page_size = tracecmd_page_size(handle);
 
 		if (show_page_size) {
@@ -1795,14 +2519,6 @@ void trace_report (int argc, char **argv)
 			return;
 		}
 
-		if (inputs->tsoffset)
-			tracecmd_set_ts_offset(handle, inputs->tsoffset);
-
-		if (inputs->ts2secs)
-			tracecmd_set_ts2secs(handle, inputs->ts2secs);
-		else if (ts2secs)
-			tracecmd_set_ts2secs(handle, ts2secs);
-
 		pevent = tracecmd_get_tep(handle);
 
 		if (nanosec)
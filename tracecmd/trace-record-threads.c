@@ -0,0 +1,379 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Record the per CPU buffers with a small pool of threads, instead of a
+ * process per CPU. Each thread waits with epoll on the trace_pipe_raw
+ * files of the recorders it was given.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "trace-local.h"
+
+#define MAX_EVENTS	64
+
+/* How long to wait for the kernel to wake us up, before looking anyway */
+#define DEFAULT_TIMEOUT_MS	1000
+
+struct recorder_thread {
+	struct recorder_pool		*pool;
+	pthread_t			thread;
+	struct tracecmd_recorder	**recorders;
+	struct tracecmd_recorder_stats	**stats;
+	int				nr_recorders;
+	int				epoll_fd;
+	int				cpu;	/* pinned to, or -1 */
+	pid_t				tid;
+	bool				started;
+	bool				failed;
+};
+
+struct recorder_pool {
+	struct recorder_thread		*threads;
+	int				nr_threads;
+	int				next;	/* thread for the next recorder */
+	int				stop_fd;
+	int				timeout;	/* ms */
+	pthread_mutex_t			lock;
+	pthread_cond_t			cond;
+	int				nr_started;
+};
+
+/**
+ * recorder_pool_parse_cpus - parse a list of CPUs ("0-3,8")
+ * @list: the list
+ * @set: filled with the CPUs of @list
+ *
+ * Returns the number of CPUs in @set, or -1 if @list is not valid.
+ */
+int recorder_pool_parse_cpus(const char *list, cpu_set_t *set)
+{
+	unsigned long first, last;
+	char *end;
+
+	CPU_ZERO(set);
+
+	while (*list) {
+		first = strtoul(list, &end, 10);
+		if (end == list)
+			return -1;
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtoul(list, &end, 10);
+			if (end == list || last < first)
+				return -1;
+		}
+		if (last >= CPU_SETSIZE)
+			return -1;
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -1;
+		list = end;
+	}
+
+	return CPU_COUNT(set);
+}
+
+/**
+ * recorder_pool_alloc - create a pool of recording threads
+ * @nr_threads: the number of threads
+ * @cpus: the CPUs to pin the threads to (round robin), or NULL
+ * @sleep_usecs: how often to look at the buffers if the kernel does not
+ *   wake us up, or 0 to rely on the kernel (buffer_percent)
+ */
+struct recorder_pool *recorder_pool_alloc(int nr_threads, cpu_set_t *cpus,
+					  int sleep_usecs)
+{
+	struct recorder_pool *pool;
+	int cpu = -1;
+	int i;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->stop_fd = -1;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	pool->threads = calloc(nr_threads, sizeof(*pool->threads));
+	if (!pool->threads)
+		goto fail;
+	pool->nr_threads = nr_threads;
+
+	pool->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (pool->stop_fd < 0)
+		goto fail;
+
+	if (sleep_usecs > 0)
+		pool->timeout = (sleep_usecs + 999) / 1000;
+	else
+		pool->timeout = DEFAULT_TIMEOUT_MS;
+
+	for (i = 0; i < nr_threads; i++) {
+		pool->threads[i].pool = pool;
+		pool->threads[i].epoll_fd = -1;
+		pool->threads[i].cpu = -1;
+		if (!cpus || !CPU_COUNT(cpus))
+			continue;
+		/* Next CPU of the set, wrapping around */
+		do {
+			cpu = (cpu + 1) % CPU_SETSIZE;
+		} while (!CPU_ISSET(cpu, cpus));
+		pool->threads[i].cpu = cpu;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		pool->threads[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (pool->threads[i].epoll_fd < 0)
+			goto fail;
+	}
+
+	return pool;
+
+ fail:
+	recorder_pool_free(pool);
+	return NULL;
+}
+
+/**
+ * recorder_pool_add - give a recorder to the pool
+ * @pool: the pool
+ * @recorder: a recorder created with TRACECMD_RECORD_POLL
+ * @stats: where to save the statistics of @recorder when done, or NULL
+ *
+ * The recorders are spread over the threads of the pool. The pool owns
+ * @recorder from now on. Must be called before recorder_pool_start().
+ */
+int recorder_pool_add(struct recorder_pool *pool,
+		      struct tracecmd_recorder *recorder,
+		      struct tracecmd_recorder_stats *stats)
+{
+	struct recorder_thread *thread = &pool->threads[pool->next];
+	struct tracecmd_recorder_stats **save;
+	struct tracecmd_recorder **recorders;
+	struct epoll_event ev;
+
+	recorders = realloc(thread->recorders,
+			    sizeof(*recorders) * (thread->nr_recorders + 1));
+	if (!recorders)
+		return -1;
+	thread->recorders = recorders;
+
+	save = realloc(thread->stats, sizeof(*save) * (thread->nr_recorders + 1));
+	if (!save)
+		return -1;
+	thread->stats = save;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = recorder;
+	if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD,
+		      tracecmd_recorder_get_trace_fd(recorder), &ev) < 0)
+		return -1;
+
+	save[thread->nr_recorders] = stats;
+	recorders[thread->nr_recorders++] = recorder;
+	pool->next = (pool->next + 1) % pool->nr_threads;
+
+	return 0;
+}
+
+static void *recorder_thread(void *data)
+{
+	struct recorder_thread *thread = data;
+	struct recorder_pool *pool = thread->pool;
+	struct epoll_event events[MAX_EVENTS];
+	struct timespec req = {
+		.tv_sec = 0,
+		.tv_nsec = 1000000,
+	};
+	struct tracecmd_recorder *recorder;
+	sigset_t mask;
+	bool stop = false;
+	long total;
+	long ret;
+	int nr;
+	int i;
+
+	/* Signals are for the main thread */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	if (thread->cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(thread->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			warning("Failed to pin recorder thread to CPU %d", thread->cpu);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	thread->tid = syscall(SYS_gettid);
+	thread->started = true;
+	pool->nr_started++;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	while (!stop) {
+		nr = epoll_wait(thread->epoll_fd, events, MAX_EVENTS, pool->timeout);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			thread->failed = true;
+			break;
+		}
+
+		/*
+		 * Older kernels do not wake up pollers of trace_pipe_raw,
+		 * so on a timeout, look at all the buffers.
+		 */
+		if (!nr) {
+			for (i = 0; i < thread->nr_recorders; i++) {
+				if (tracecmd_recorder_read_data(thread->recorders[i]) < 0)
+					thread->failed = true;
+			}
+			continue;
+		}
+
+		for (total = 0, i = 0; i < nr; i++) {
+			recorder = events[i].data.ptr;
+			if (!recorder) {
+				stop = true;
+				continue;
+			}
+			ret = tracecmd_recorder_read_data(recorder);
+			if (ret < 0)
+				thread->failed = true;
+			else
+				total += ret;
+		}
+
+		/*
+		 * Without a watermark, trace_pipe_raw is readable as soon
+		 * as there is an event, but splice only moves full pages.
+		 * Do not spin on it.
+		 */
+		if (!stop && !total)
+			nanosleep(&req, NULL);
+	}
+
+	for (i = 0; i < thread->nr_recorders; i++) {
+		if (tracecmd_flush_recording(thread->recorders[i]) < 0)
+			thread->failed = true;
+		if (thread->stats[i])
+			tracecmd_recorder_get_stats(thread->recorders[i],
+						    thread->stats[i]);
+	}
+
+	return NULL;
+}
+
+/**
+ * recorder_pool_start - start the threads of the pool
+ * @pool: the pool
+ *
+ * Returns once all the threads are running, so that their ids
+ * (see recorder_pool_get_tid()) are known.
+ */
+int recorder_pool_start(struct recorder_pool *pool)
+{
+	struct recorder_thread *thread;
+	struct epoll_event ev;
+	int i;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+
+	for (i = 0; i < pool->nr_threads; i++) {
+		thread = &pool->threads[i];
+		if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, pool->stop_fd, &ev) < 0)
+			return -1;
+		if (pthread_create(&thread->thread, NULL, recorder_thread, thread))
+			return -1;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->nr_started < pool->nr_threads)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+int recorder_pool_nr_threads(struct recorder_pool *pool)
+{
+	return pool->nr_threads;
+}
+
+pid_t recorder_pool_get_tid(struct recorder_pool *pool, int thread)
+{
+	return pool->threads[thread].tid;
+}
+
+/**
+ * recorder_pool_stop - stop recording and flush the buffers
+ * @pool: the pool
+ *
+ * Returns 0, or -1 if a thread had an error while recording.
+ */
+int recorder_pool_stop(struct recorder_pool *pool)
+{
+	unsigned long long val = 1;
+	int ret = 0;
+	int i;
+
+	/* The eventfd stays readable, it wakes up all the threads */
+	if (write(pool->stop_fd, &val, sizeof(val)) != sizeof(val))
+		return -1;
+
+	for (i = 0; i < pool->nr_threads; i++) {
+		if (!pool->threads[i].started)
+			continue;
+		pthread_join(pool->threads[i].thread, NULL);
+		pool->threads[i].started = false;
+		if (pool->threads[i].failed)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+void recorder_pool_free(struct recorder_pool *pool)
+{
+	struct recorder_thread *thread;
+	int i, r;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < pool->nr_threads; i++) {
+		thread = &pool->threads[i];
+		for (r = 0; r < thread->nr_recorders; r++)
+			tracecmd_free_recorder(thread->recorders[r]);
+		free(thread->recorders);
+		free(thread->stats);
+		if (thread->epoll_fd >= 0)
+			close(thread->epoll_fd);
+	}
+	if (pool->stop_fd >= 0)
+		close(pool->stop_fd);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+	free(pool->threads);
+	free(pool);
+}
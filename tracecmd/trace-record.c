@@ -18,6 +18,8 @@
 #include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/utsname.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #ifndef NO_PTRACE
 #include <sys/ptrace.h>
 #else
@@ -35,6 +37,7 @@
 #include <limits.h>
 #include <libgen.h>
 #include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <grp.h>
 #ifdef VSOCK
@@ -75,8 +78,15 @@ static int keep;
 
 static int latency;
 static int sleep_time = 1000;
+/* Without -s, the recorders wait to be woken up by the kernel */
+static bool sleep_set;
 static int recorder_threads;
 static struct pid_record_data *pids;
+
+/* Record with a pool of threads, instead of a process per CPU */
+static int nr_pool_threads;
+static cpu_set_t *pool_cpus;
+static struct recorder_pool *recorder_pool;
 static int buffers;
 
 /* Clear all function filters */
@@ -92,6 +102,31 @@ static bool fork_process;
 
 /* Max size to let a per cpu file get */
 static int max_kb;
+/* the ring of files of each CPU, with -m or --segments */
+static int ring_segments;
+static int segment_kb;
+
+/* With --prealloc, the recorders write straight into the output file */
+static unsigned long long prealloc_kb;
+static struct tracecmd_output *prealloc_handle;
+static unsigned long long *prealloc_offsets;
+static const char *prealloc_file;
+
+/* Room for the command lines and options, before the CPU data */
+#define PREALLOC_HEADER_ROOM	(16ULL << 20)
+
+/* With --live, the headers of the output file are kept up to date */
+static bool live;
+static pthread_t live_thread;
+static int live_stop_fd = -1;
+
+#define LIVE_DEFAULT_KB		4096
+#define LIVE_SYNC_MS		1000
+
+/* A live profile shown every --snapshot seconds, see trace-profile.c */
+static int profile_snapshot;
+static int profile_decay;
+static int profile_evict;
 
 static bool use_tcp;
 
@@ -109,6 +144,9 @@ static int fset;
 
 static unsigned recorder_flags;
 
+/* Compression used by the recorders writing to temp files */
+static const char *recorder_compression;
+
 /* Try a few times to get an accurate date */
 static int date2ts_tries = 50;
 
@@ -175,6 +213,7 @@ static inline int no_top_instance(void)
 static void init_instance(struct buffer_instance *instance)
 {
 	instance->event_next = &instance->events;
+	instance->buffer_percent = -1;
 }
 
 enum {
@@ -745,6 +784,9 @@ static void stop_threads(enum trace_type type)
 	if (!recorder_threads)
 		return;
 
+	if (recorder_pool && recorder_pool_stop(recorder_pool) < 0)
+		warning("error recording the ring buffers");
+
 	/* Tell all threads to finish up */
 	for (i = 0; i < recorder_threads; i++) {
 		if (pids[i].pid > 0) {
@@ -770,6 +812,9 @@ static void wait_threads()
 			pids[i].pid = -1;
 		}
 	}
+
+	recorder_pool_free(recorder_pool);
+	recorder_pool = NULL;
 }
 
 static int create_recorder(struct buffer_instance *instance, int cpu,
@@ -3296,6 +3341,37 @@ create_recorder_instance_pipe(struct buffer_instance *instance,
 	return recorder;
 }
 
+static struct tracecmd_recorder *
+create_prealloc_recorder(struct buffer_instance *instance, int cpu,
+			 unsigned flags)
+{
+	struct tracecmd_recorder *recorder;
+	const char *tracing;
+	int fd;
+
+	tracing = tracefs_tracing_dir();
+	if (!tracing)
+		die("can't get the tracing directory");
+
+	fd = open(prealloc_file, O_WRONLY | O_LARGEFILE);
+	if (fd < 0)
+		die("Failed to open %s", prealloc_file);
+	if (lseek64(fd, prealloc_offsets[cpu], SEEK_SET) == (off64_t)-1)
+		die("Failed to seek to the data of CPU %d", cpu);
+
+	recorder = tracecmd_create_buffer_recorder_fd(fd, cpu, flags, tracing);
+	if (!recorder)
+		die("can't create recorder");
+
+	/* Once the extent of the CPU is full, the recorder takes a new one */
+	if (tracecmd_recorder_set_limit(recorder, prealloc_kb * 1024) < 0 ||
+	    tracecmd_recorder_set_extents(recorder,
+					  tracecmd_get_cpu_extents(prealloc_handle)) < 0)
+		die("Failed to limit the data of CPU %d", cpu);
+
+	return recorder;
+}
+
 static struct tracecmd_recorder *
 create_recorder_instance(struct buffer_instance *instance, const char *file, int cpu,
 			 int *brass)
@@ -3325,13 +3401,18 @@ create_recorder_instance(struct buffer_instance *instance, const char *file, int
 	if (brass)
 		return create_recorder_instance_pipe(instance, cpu, brass);
 
+	if (prealloc_handle)
+		return create_prealloc_recorder(instance, cpu, recorder_flags);
+
 	if (!tracefs_instance_get_name(instance->tracefs))
-		return tracecmd_create_recorder_maxkb(file, cpu, recorder_flags, max_kb);
+		return tracecmd_create_recorder_ring(file, cpu, recorder_flags,
+						     ring_segments, segment_kb);
 
 	path = tracefs_instance_get_dir(instance->tracefs);
 
-	record = tracecmd_create_buffer_recorder_maxkb(file, cpu, recorder_flags,
-						       path, max_kb);
+	record = tracecmd_create_buffer_recorder_ring(file, cpu, recorder_flags,
+						      path, ring_segments,
+						      segment_kb);
 	tracefs_put_tracing_file(path);
 
 	return record;
@@ -3344,6 +3425,7 @@ create_recorder_instance(struct buffer_instance *instance, const char *file, int
 static int create_recorder(struct buffer_instance *instance, int cpu,
 			   enum trace_type type, int *brass)
 {
+	unsigned long sleep = sleep_time;
 	long ret;
 	char *file;
 	pid_t pid;
@@ -3399,6 +3481,12 @@ static int create_recorder(struct buffer_instance *instance, int cpu,
 		file = get_temp_file(instance, cpu);
 		recorder = create_recorder_instance(instance, file, cpu, brass);
 		put_temp_file(file);
+
+		/* Only the data going straight to the temp files is compressed */
+		if (recorder && recorder_compression && !brass && !is_guest(instance) &&
+		    tracecmd_recorder_set_compression(recorder, recorder_compression) < 0)
+			die("Failed to set up %s compression for CPU %d",
+			    recorder_compression, cpu);
 	}
 
 	if (!recorder)
@@ -3411,10 +3499,16 @@ static int create_recorder(struct buffer_instance *instance, int cpu,
 		return ret;
 	}
 
+	/* The kernel wakes up the recorder, only sleep without it */
+	if (recorder_flags & TRACECMD_RECORD_WAKEUP)
+		sleep = 0;
+
 	while (!finished) {
-		if (tracecmd_start_recording(recorder, sleep_time) < 0)
+		if (tracecmd_start_recording(recorder, sleep) < 0)
 			break;
 	}
+	if (instance->recorder_stats)
+		tracecmd_recorder_get_stats(recorder, &instance->recorder_stats[cpu]);
 	tracecmd_free_recorder(recorder);
 	recorder = NULL;
 
@@ -3861,13 +3955,134 @@ static void setup_agent(struct buffer_instance *instance,
 	instance->network_handle = network_handle;
 }
 
+/* Only the recorders that write to the local temp files go in the pool */
+static bool use_recorder_pool(struct buffer_instance *instance,
+			      enum trace_type type)
+{
+	return recorder_pool && !(type & TRACE_TYPE_STREAM) &&
+		!is_agent(instance) && !is_guest(instance) && !host;
+}
+
+static void add_pool_recorder(struct buffer_instance *instance, int cpu)
+{
+	struct tracecmd_recorder *recorder;
+	unsigned flags = (recorder_flags & ~TRACECMD_RECORD_WAKEUP) |
+		TRACECMD_RECORD_POLL;
+	char *file;
+	char *path;
+
+	if (prealloc_handle) {
+		recorder = create_prealloc_recorder(instance, cpu, flags);
+		goto add;
+	}
+
+	file = get_temp_file(instance, cpu);
+	if (!tracefs_instance_get_name(instance->tracefs)) {
+		recorder = tracecmd_create_recorder_ring(file, cpu, flags,
+							 ring_segments, segment_kb);
+	} else {
+		path = tracefs_instance_get_dir(instance->tracefs);
+		recorder = tracecmd_create_buffer_recorder_ring(file, cpu, flags,
+								path, ring_segments,
+								segment_kb);
+		tracefs_put_tracing_file(path);
+	}
+	put_temp_file(file);
+
+	if (!recorder)
+		die("can't create recorder");
+
+	if (recorder_compression &&
+	    tracecmd_recorder_set_compression(recorder, recorder_compression) < 0)
+		die("Failed to set up %s compression for CPU %d",
+		    recorder_compression, cpu);
+
+ add:
+	if (recorder_pool_add(recorder_pool, recorder,
+			      instance->recorder_stats ?
+			      &instance->recorder_stats[cpu] : NULL) < 0)
+		die("Failed to add the recorder of CPU %d to the threads", cpu);
+}
+
+static unsigned long proc_rss_kb(pid_t pid)
+{
+	unsigned long size, resident = 0;
+	char path[64];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+
+	return resident * (getpagesize() / 1024);
+}
+
+/* To compare the threads with the processes, with --debug */
+static void print_recorders_startup(struct timespec *start, int recorders)
+{
+	unsigned long rss = proc_rss_kb(getpid());
+	struct timespec end;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < recorders; i++) {
+		if (pids[i].pid > 0)
+			rss += proc_rss_kb(pids[i].pid);
+	}
+
+	printf("%d recorders started in %.3f ms with %d %s, total RSS %lu KB\n",
+	       recorders,
+	       (end.tv_sec - start->tv_sec) * 1000.0 +
+	       (end.tv_nsec - start->tv_nsec) / 1000000.0,
+	       recorder_pool ? recorder_pool_nr_threads(recorder_pool) : recorders,
+	       recorder_pool ? "threads" : "processes", rss);
+}
+
+static struct tracecmd_recorder_stats *recorder_stats_map;
+static size_t recorder_stats_size;
+
+/*
+ * The recorders run in their own processes, give them a place to leave
+ * their statistics for print_stat() and the trace.dat file.
+ */
+static void alloc_recorder_stats(int total_cpu_count)
+{
+	struct tracecmd_recorder_stats *stats;
+	struct buffer_instance *instance;
+
+	if (!total_cpu_count)
+		return;
+
+	stats = mmap(NULL, sizeof(*stats) * total_cpu_count,
+		     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED) {
+		warning("Failed to allocate the recorder statistics");
+		return;
+	}
+	recorder_stats_map = stats;
+	recorder_stats_size = sizeof(*stats) * total_cpu_count;
+
+	for_all_instances(instance) {
+		instance->recorder_stats = stats;
+		stats += instance->cpu_count;
+	}
+}
+
 void start_threads(enum trace_type type, struct common_record_context *ctx)
 {
 	struct buffer_instance *instance;
+	struct timespec start;
 	int total_cpu_count = 0;
 	int i = 0;
 	int ret;
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	for_all_instances(instance) {
 		/* Start the connection now to find out how many CPUs we need */
 		if (is_guest(instance))
@@ -3880,6 +4095,15 @@ void start_threads(enum trace_type type, struct common_record_context *ctx)
 	if (!pids)
 		die("Failed to allocate pids for %d cpus", total_cpu_count);
 
+	alloc_recorder_stats(total_cpu_count);
+
+	if (nr_pool_threads && !(type & TRACE_TYPE_STREAM)) {
+		recorder_pool = recorder_pool_alloc(nr_pool_threads, pool_cpus,
+						    sleep_set ? sleep_time : 0);
+		if (!recorder_pool)
+			die("Failed to allocate %d recorder threads", nr_pool_threads);
+	}
+
 	for_all_instances(instance) {
 		int *brass = NULL;
 		int x, pid;
@@ -3911,6 +4135,12 @@ void start_threads(enum trace_type type, struct common_record_context *ctx)
 				pids[i].brass[0] = -1;
 			pids[i].cpu = x;
 			pids[i].instance = instance;
+			if (use_recorder_pool(instance, type)) {
+				add_pool_recorder(instance, x);
+				/* Recorded, but nothing to signal or wait for */
+				pids[i++].pid = -1;
+				continue;
+			}
 			/* Make sure all output is flushed before forking */
 			fflush(stdout);
 			pid = pids[i++].pid = create_recorder(instance, x, type, brass);
@@ -3921,6 +4151,16 @@ void start_threads(enum trace_type type, struct common_record_context *ctx)
 		}
 	}
 	recorder_threads = i;
+
+	if (recorder_pool) {
+		if (recorder_pool_start(recorder_pool) < 0)
+			die("Failed to start the recorder threads");
+		for (i = 0; i < recorder_pool_nr_threads(recorder_pool); i++)
+			add_filter_pid_all(recorder_pool_get_tid(recorder_pool, i), 1);
+	}
+
+	if (tracecmd_get_debug())
+		print_recorders_startup(&start, recorder_threads);
 }
 
 static void touch_file(const char *file)
@@ -4052,6 +4292,24 @@ add_trace_id(struct tracecmd_output *handle, struct buffer_instance *instance)
 			    sizeof(long long), &instance->trace_id);
 }
 
+static void add_recorder_stats(struct tracecmd_output *handle,
+			       struct buffer_instance *instance)
+{
+	struct trace_seq s;
+	int i;
+
+	if (!instance->recorder_stats)
+		return;
+
+	for (i = 0; i < instance->cpu_count; i++) {
+		trace_seq_init(&s);
+		tracecmd_recorder_print_stats(&s, i, &instance->recorder_stats[i]);
+		tracecmd_add_option(handle, TRACECMD_OPTION_RECORDER_STATS,
+				    s.len+1, s.buffer);
+		trace_seq_destroy(&s);
+	}
+}
+
 static void
 add_buffer_stat(struct tracecmd_output *handle, struct buffer_instance *instance)
 {
@@ -4063,12 +4321,17 @@ add_buffer_stat(struct tracecmd_output *handle, struct buffer_instance *instance
 			tracefs_instance_get_name(instance->tracefs));
 	tracecmd_add_option(handle, TRACECMD_OPTION_CPUSTAT,
 			    s.len+1, s.buffer);
+	if (instance->recorder_stats)
+		tracecmd_add_option(handle, TRACECMD_OPTION_RECORDER_STATS,
+				    s.len+1, s.buffer);
 	trace_seq_destroy(&s);
 
 	for (i = 0; i < instance->cpu_count; i++)
 		tracecmd_add_option(handle, TRACECMD_OPTION_CPUSTAT,
 				    instance->s_save[i].len+1,
 				    instance->s_save[i].buffer);
+
+	add_recorder_stats(handle, instance);
 }
 
 static void add_option_hooks(struct tracecmd_output *handle)
@@ -4118,6 +4381,51 @@ static void add_version(struct tracecmd_output *handle)
 	free(str);
 }
 
+static void print_compress_stat(struct buffer_instance *instance, int cpu)
+{
+	struct tracecmd_recorder_compress_stats stats;
+	char *file;
+	int ret;
+
+	file = get_temp_file(instance, cpu);
+	ret = tracecmd_recorder_compress_stats(file, &stats);
+	put_temp_file(file);
+	if (ret < 0 || !stats.bytes_in || !stats.bytes_out)
+		return;
+
+	printf("CPU %d: %llu bytes %s compressed to %llu (ratio %.2f)",
+	       cpu, stats.bytes_in, stats.compression, stats.bytes_out,
+	       (double)stats.bytes_in / stats.bytes_out);
+	if (stats.record_ns)
+		printf(", recorded %.1f MB/s",
+		       stats.bytes_in * 1000.0 / stats.record_ns);
+	if (stats.compress_ns)
+		printf(", compressed %.1f MB/s",
+		       stats.bytes_in * 1000.0 / stats.compress_ns);
+	printf("\n");
+}
+
+static void print_recorder_stat(struct buffer_instance *instance, int cpu)
+{
+	struct tracecmd_recorder_stats *stats = &instance->recorder_stats[cpu];
+
+	if (!stats->polls && !stats->bytes)
+		return;
+
+	printf("CPU %d: recorded %llu bytes in %llu reads (avg %llu ns), "
+	       "%llu writes (avg %llu ns), asleep %.3f secs, "
+	       "%llu of %llu polls empty, max pipe backlog %llu",
+	       cpu, stats->bytes, stats->reads,
+	       stats->reads ? stats->read_ns / stats->reads : 0,
+	       stats->writes,
+	       stats->writes ? stats->write_ns / stats->writes : 0,
+	       stats->sleep_ns / 1000000000.0,
+	       stats->empty_polls, stats->polls, stats->max_backlog);
+	if (stats->dropped)
+		printf(", dropped %llu bytes", stats->dropped);
+	printf("\n");
+}
+
 static void print_stat(struct buffer_instance *instance)
 {
 	int cpu;
@@ -4129,8 +4437,13 @@ static void print_stat(struct buffer_instance *instance)
 		printf("\nBuffer: %s\n\n",
 			tracefs_instance_get_name(instance->tracefs));
 
-	for (cpu = 0; cpu < instance->cpu_count; cpu++)
+	for (cpu = 0; cpu < instance->cpu_count; cpu++) {
 		trace_seq_do_printf(&instance->s_print[cpu]);
+		if (recorder_compression)
+			print_compress_stat(instance, cpu);
+		if (instance->recorder_stats)
+			print_recorder_stat(instance, cpu);
+	}
 }
 
 static char *get_trace_clock(bool selected)
@@ -4221,6 +4534,113 @@ static void write_guest_file(struct buffer_instance *instance)
 	free(temp_files);
 }
 
+static void append_prealloc_data(struct tracecmd_output *handle)
+{
+	unsigned long long *sizes;
+	int i;
+
+	if (!top_instance.recorder_stats)
+		die("The size of the recorded data is not known");
+
+	sizes = malloc(sizeof(*sizes) * local_cpu_count);
+	if (!sizes)
+		die("Failed to allocate the sizes of %d CPUs", local_cpu_count);
+
+	for (i = 0; i < local_cpu_count; i++) {
+		sizes[i] = top_instance.recorder_stats[i].written;
+		if (top_instance.recorder_stats[i].dropped)
+			warning("CPU %d: %llu bytes did not fit in the output file",
+				i, top_instance.recorder_stats[i].dropped);
+	}
+
+	if (tracecmd_append_reserved_cpu_data(handle, local_cpu_count, sizes) < 0)
+		die("Failed to write the CPU data headers");
+
+	free(sizes);
+}
+
+/*
+ * Write the headers of the output file, and make room in it for the
+ * data of the recorders.
+ */
+static void reserve_output(struct common_record_context *ctx)
+{
+	struct buffer_instance *instance;
+
+	for_all_instances(instance) {
+		if (instance != &top_instance || is_guest(instance))
+			die("--prealloc only works with the top instance");
+	}
+
+	prealloc_handle = tracecmd_create_init_file_glob(ctx->output,
+							 listed_events);
+	if (!prealloc_handle)
+		die("Error creating output file");
+	tracecmd_set_quiet(prealloc_handle, quiet);
+
+	prealloc_offsets = calloc(local_cpu_count, sizeof(*prealloc_offsets));
+	if (!prealloc_offsets)
+		die("Failed to allocate the offsets of %d CPUs", local_cpu_count);
+
+	if (tracecmd_reserve_cpu_data(prealloc_handle, local_cpu_count,
+				      prealloc_kb * 1024, PREALLOC_HEADER_ROOM,
+				      prealloc_offsets) < 0)
+		die("Failed to make room for the data in %s", ctx->output);
+
+	/* Known up front, and needed to read the file while recording */
+	add_options(prealloc_handle, ctx);
+
+	prealloc_file = ctx->output;
+}
+
+static void *live_sync_thread(void *data)
+{
+	struct pollfd pfd = {
+		.fd = live_stop_fd,
+		.events = POLLIN,
+	};
+	sigset_t mask;
+
+	/* Signals are for the main thread */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	do {
+		if (tracecmd_sync_reserved_cpu_data(prealloc_handle) < 0) {
+			warning("Failed to update the headers of %s, it can not be read while recording",
+				prealloc_file);
+			break;
+		}
+	} while (poll(&pfd, 1, LIVE_SYNC_MS) == 0);
+
+	return NULL;
+}
+
+/* Keep the output file readable while recording (--live) */
+static void start_live_sync(void)
+{
+	live_stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (live_stop_fd < 0)
+		die("Failed to create eventfd");
+
+	if (pthread_create(&live_thread, NULL, live_sync_thread, NULL))
+		die("Failed to create the thread for --live");
+}
+
+static void stop_live_sync(void)
+{
+	unsigned long long val = 1;
+
+	if (live_stop_fd < 0)
+		return;
+
+	if (write(live_stop_fd, &val, sizeof(val)) != sizeof(val))
+		die("Failed to stop the thread for --live");
+	pthread_join(live_thread, NULL);
+	close(live_stop_fd);
+	live_stop_fd = -1;
+}
+
 static void record_data(struct common_record_context *ctx)
 {
 	struct tracecmd_option **buffer_options;
@@ -4275,12 +4695,20 @@ static void record_data(struct common_record_context *ctx)
 				touch_file(temp_files[i]);
 		}
 
-		handle = tracecmd_create_init_file_glob(ctx->output, listed_events);
-		if (!handle)
-			die("Error creating output file");
-		tracecmd_set_quiet(handle, quiet);
+		if (prealloc_handle) {
+			/* The headers were written before recording */
+			handle = prealloc_handle;
+		} else {
+			handle = tracecmd_create_init_file_glob(ctx->output,
+								listed_events);
+			if (!handle)
+				die("Error creating output file");
+			tracecmd_set_quiet(handle, quiet);
+		}
 
-		add_options(handle, ctx);
+		/* With --prealloc, they were added with the headers */
+		if (!prealloc_handle)
+			add_options(handle, ctx);
 
 		/* Only record the top instance under TRACECMD_OPTION_CPUSTAT*/
 		if (!no_top_instance() && !top_instance.msg_handle) {
@@ -4289,6 +4717,7 @@ static void record_data(struct common_record_context *ctx)
 			for (i = 0; i < local_cpu_count; i++)
 				tracecmd_add_option(handle, TRACECMD_OPTION_CPUSTAT,
 						    s[i].len+1, s[i].buffer);
+			add_recorder_stats(handle, &top_instance);
 		}
 
 		if (buffers) {
@@ -4326,10 +4755,14 @@ static void record_data(struct common_record_context *ctx)
 			add_tsc2nsec(handle, &ctx->tsc2nsec);
 			tracecmd_set_out_clock(handle, TSCNSEC_CLOCK);
 		}
-		if (tracecmd_write_cmdlines(handle))
+		/* With --prealloc, they are written with the CPU headers */
+		if (!prealloc_handle && tracecmd_write_cmdlines(handle))
 			die("Writing cmdlines");
 
-		tracecmd_append_cpu_data(handle, local_cpu_count, temp_files);
+		if (prealloc_handle)
+			append_prealloc_data(handle);
+		else
+			tracecmd_append_cpu_data(handle, local_cpu_count, temp_files);
 
 		for (i = 0; i < max_cpu_count; i++)
 			put_temp_file(temp_files[i]);
@@ -4723,6 +5156,23 @@ void set_buffer_size(void)
 		set_buffer_size_instance(instance);
 }
 
+/* How full the buffer gets before the kernel wakes up the recorders */
+static void set_buffer_percent(void)
+{
+	struct buffer_instance *instance;
+	char buf[16];
+
+	for_all_instances(instance) {
+		if (is_guest(instance) || instance->buffer_percent < 0)
+			continue;
+
+		snprintf(buf, sizeof(buf), "%d", instance->buffer_percent);
+		if (tracefs_instance_file_write(instance->tracefs,
+						"buffer_percent", buf) < 0)
+			warning("Can't set buffer_percent, not supported by this kernel?");
+	}
+}
+
 static int
 process_event_trigger(char *path, struct event_iter *iter)
 {
@@ -5238,6 +5688,7 @@ static void destroy_stats(void)
 	int cpu;
 
 	for_all_instances(instance) {
+		instance->recorder_stats = NULL;
 		if (is_guest(instance))
 			continue;
 
@@ -5246,6 +5697,11 @@ static void destroy_stats(void)
 			trace_seq_destroy(&instance->s_print[cpu]);
 		}
 	}
+
+	if (recorder_stats_map) {
+		munmap(recorder_stats_map, recorder_stats_size);
+		recorder_stats_map = NULL;
+	}
 }
 
 static void list_event(const char *event)
@@ -5501,6 +5957,18 @@ void init_top_instance(void)
 }
 
 enum {
+	OPT_percentiles		= 228,
+	OPT_evict		= 229,
+	OPT_decay		= 230,
+	OPT_snapshot		= 231,
+	OPT_live		= 232,
+	OPT_prealloc		= 233,
+	OPT_segment_size	= 234,
+	OPT_segments		= 235,
+	OPT_buffer_percent	= 236,
+	OPT_recorder_cpus	= 237,
+	OPT_recorder_threads	= 238,
+	OPT_compress		= 239,
 	OPT_tsc2nsec		= 240,
 	OPT_fork		= 241,
 	OPT_tsyncinterval	= 242,
@@ -5898,6 +6366,7 @@ static void parse_record_options(int argc,
 	char *pids;
 	char *pid;
 	char *sav;
+	char *end;
 	int name_counter = 0;
 	int negative = 0;
 	struct buffer_instance *instance, *del_list = NULL;
@@ -5935,6 +6404,18 @@ static void parse_record_options(int argc,
 			{"tsync-interval", required_argument, NULL, OPT_tsyncinterval},
 			{"fork", no_argument, NULL, OPT_fork},
 			{"tsc2nsec", no_argument, NULL, OPT_tsc2nsec},
+			{"compress", required_argument, NULL, OPT_compress},
+			{"recorder-threads", required_argument, NULL, OPT_recorder_threads},
+			{"recorder-cpus", required_argument, NULL, OPT_recorder_cpus},
+			{"buffer-percent", required_argument, NULL, OPT_buffer_percent},
+			{"segments", required_argument, NULL, OPT_segments},
+			{"segment-size", required_argument, NULL, OPT_segment_size},
+			{"prealloc", required_argument, NULL, OPT_prealloc},
+			{"live", no_argument, NULL, OPT_live},
+			{"snapshot", required_argument, NULL, OPT_snapshot},
+			{"decay", required_argument, NULL, OPT_decay},
+			{"evict", required_argument, NULL, OPT_evict},
+			{"percentiles", required_argument, NULL, OPT_percentiles},
 			{NULL, 0, NULL, 0}
 		};
 
@@ -6195,6 +6676,7 @@ static void parse_record_options(int argc,
 			if (!optarg)
 				usage(argv);
 			sleep_time = atoi(optarg);
+			sleep_set = true;
 			break;
 		case 'S':
 			cmd_check_die(ctx, CMD_set, *(argv+1), "-S");
@@ -6356,6 +6838,87 @@ static void parse_record_options(int argc,
 				die("TSC to nanosecond is not supported");
 			ctx->instance->flags |= BUFFER_FL_TSC2NSEC;
 			break;
+		case OPT_compress:
+			if (!IS_RECORD(ctx) && !IS_EXTRACT(ctx))
+				die("--compress only works with record and extract");
+			recorder_compression = optarg;
+			break;
+		case OPT_buffer_percent:
+			check_instance_die(ctx->instance, "--buffer-percent");
+			ctx->instance->buffer_percent = atoi(optarg);
+			if (ctx->instance->buffer_percent < 0 ||
+			    ctx->instance->buffer_percent > 100)
+				die("--buffer-percent must be between 0 and 100");
+			break;
+		case OPT_segments:
+			if (!IS_RECORD(ctx))
+				die("--segments only works with record");
+			ring_segments = atoi(optarg);
+			if (ring_segments < 2)
+				die("--segments needs at least 2 segments");
+			break;
+		case OPT_segment_size:
+			if (!IS_RECORD(ctx))
+				die("--segment-size only works with record");
+			segment_kb = atoi(optarg);
+			if (segment_kb <= 0)
+				die("Invalid segment size: %s", optarg);
+			break;
+		case OPT_prealloc:
+			if (!IS_RECORD(ctx))
+				die("--prealloc only works with record");
+			prealloc_kb = strtoull(optarg, NULL, 0);
+			if (!prealloc_kb)
+				die("Invalid size for --prealloc: %s", optarg);
+			break;
+		case OPT_live:
+			if (!IS_RECORD(ctx))
+				die("--live only works with record");
+			live = true;
+			break;
+		case OPT_recorder_threads:
+			if (!IS_RECORD(ctx))
+				die("--recorder-threads only works with record");
+			nr_pool_threads = strtol(optarg, &end, 10);
+			if (end == optarg || *end || nr_pool_threads <= 0)
+				die("Invalid number of recorder threads: %s", optarg);
+			break;
+		case OPT_recorder_cpus:
+			if (!IS_RECORD(ctx))
+				die("--recorder-cpus only works with record");
+			pool_cpus = malloc(sizeof(*pool_cpus));
+			if (!pool_cpus)
+				die("Failed to allocate the recorder CPUs");
+			if (recorder_pool_parse_cpus(optarg, pool_cpus) <= 0)
+				die("Invalid CPU list for --recorder-cpus: %s", optarg);
+			break;
+		case OPT_snapshot:
+			if (!IS_PROFILE(ctx) && !IS_STREAM(ctx))
+				die("--snapshot only works with profile or stream --profile");
+			profile_snapshot = atoi(optarg);
+			if (profile_snapshot <= 0)
+				die("Invalid seconds for --snapshot: %s", optarg);
+			break;
+		case OPT_decay:
+			if (!IS_PROFILE(ctx) && !IS_STREAM(ctx))
+				die("--decay only works with profile or stream --profile");
+			profile_decay = atoi(optarg);
+			if (profile_decay < 0 || profile_decay > 100)
+				die("Invalid percent for --decay: %s", optarg);
+			break;
+		case OPT_evict:
+			if (!IS_PROFILE(ctx) && !IS_STREAM(ctx))
+				die("--evict only works with profile or stream --profile");
+			profile_evict = atoi(optarg);
+			if (profile_evict <= 0)
+				die("Invalid seconds for --evict: %s", optarg);
+			break;
+		case OPT_percentiles:
+			if (!IS_PROFILE(ctx) && !IS_STREAM(ctx))
+				die("--percentiles only works with profile or stream --profile");
+			if (trace_profile_set_percentiles(optarg) < 0)
+				die("Invalid percentiles: %s", optarg);
+			break;
 		case OPT_quiet:
 		case 'q':
 			quiet = true;
@@ -6381,6 +6944,66 @@ static void parse_record_options(int argc,
 		add_func(&ctx->instance->filter_funcs,
 			 ctx->instance->filter_mod, "*");
 
+	/*
+	 * Waiting for the watermark would hold the events of stream and
+	 * profile for up to a second, they keep polling every -s interval.
+	 */
+	if (!sleep_set && !IS_STREAM(ctx) && !IS_PROFILE(ctx))
+		recorder_flags |= TRACECMD_RECORD_WAKEUP;
+
+	if (pool_cpus && !nr_pool_threads)
+		nr_pool_threads = CPU_COUNT(pool_cpus);
+
+	if (ring_segments || segment_kb) {
+		if (max_kb && segment_kb)
+			die("-m and --segment-size can not be used together");
+		if (!max_kb && !segment_kb)
+			die("--segments needs -m or --segment-size");
+		if (!ring_segments)
+			ring_segments = 2;
+		if (segment_kb)
+			max_kb = ring_segments * segment_kb;
+	}
+	if (max_kb) {
+		/* -m alone keeps two halves */
+		if (!ring_segments)
+			ring_segments = 2;
+		if (!segment_kb)
+			segment_kb = max_kb / ring_segments;
+		if (!segment_kb)
+			segment_kb = 1;
+	}
+
+	if (live && !prealloc_kb)
+		prealloc_kb = LIVE_DEFAULT_KB;
+
+	if (profile_snapshot) {
+		if (IS_STREAM(ctx) && handle_init != trace_init_profile)
+			die("--snapshot needs --profile with stream");
+		trace_profile_set_snapshot(profile_snapshot);
+		trace_profile_set_decay(profile_decay);
+		trace_profile_set_evict(profile_evict);
+	} else if (profile_decay || profile_evict)
+		die("--decay and --evict need --snapshot");
+
+	if (prealloc_kb) {
+		if (max_kb)
+			die("--prealloc can not be used with -m or --segments");
+		if (recorder_compression)
+			die("--prealloc can not be used with --compress");
+		if (host)
+			die("--prealloc can not be used with -N");
+	}
+
+	if (recorder_compression) {
+		if (max_kb)
+			die("--compress can not be used with -m or --segments");
+		if (strcmp(recorder_compression, "none") == 0)
+			recorder_compression = NULL;
+		else if (tracecmd_compress_id(recorder_compression) < 0)
+			die("Compression '%s' is not supported", recorder_compression);
+	}
+
 	if (do_children && !filter_task && !fpids_count)
 		die(" -c can only be used with -F (or -P with event-fork support)");
 
@@ -6681,6 +7304,7 @@ static void record_trace(int argc, char **argv,
 
 	set_saved_cmdlines_size(ctx);
 	set_buffer_size();
+	set_buffer_percent();
 	update_plugins(type);
 	set_options();
 
@@ -6696,8 +7320,12 @@ static void record_trace(int argc, char **argv,
 
 	if (type & (TRACE_TYPE_RECORD | TRACE_TYPE_STREAM)) {
 		signal(SIGINT, finish);
+		if (prealloc_kb && !latency && type == TRACE_TYPE_RECORD)
+			reserve_output(ctx);
 		if (!latency)
 			start_threads(type, ctx);
+		if (live && prealloc_handle)
+			start_live_sync();
 	}
 
 	if (ctx->run_command) {
@@ -6754,6 +7382,8 @@ static void record_trace(int argc, char **argv,
 	if (!latency)
 		wait_threads();
 
+	stop_live_sync();
+
 	if (IS_RECORD(ctx)) {
 		record_data(ctx);
 		delete_thread_data();
@@ -6876,6 +7506,9 @@ void trace_stream(int argc, char **argv)
 
 	parse_record_options(argc, argv, CMD_stream, &ctx);
 	record_trace_command(argc, argv, &ctx);
+	/* With --profile, the records went to the profile */
+	if (handle_init == trace_init_profile)
+		do_trace_profile();
 	exit(0);
 }
 
@@ -506,7 +506,7 @@ void trace_split (int argc, char **argv)
 	if (!input_file)
 		input_file = default_input_file;
 
-	handle = tracecmd_open(input_file, 0);
+	handle = tracecmd_open(input_file, TRACECMD_FL_SEQUENTIAL_SCAN);
 	if (!handle)
 		die("error reading %s", input_file);
 
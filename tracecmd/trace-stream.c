@@ -98,6 +98,9 @@ int trace_stream_read(struct pid_record_data *pids, int nr_pids, struct timeval
 
 	last_pid = NULL;
 
+	/* A live profile shows what it has every so often */
+	trace_profile_check_snapshot();
+
  again:
 	for (i = 0; i < nr_pids; i++) {
 		pid = &pids[i];
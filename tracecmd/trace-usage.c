@@ -41,7 +41,7 @@ static struct usage_help usage_help[] = {
 		"          -o data output file [default trace.dat]\n"
 		"          -O option to enable (or disable)\n"
 		"          -r real time priority to run the capture threads\n"
-		"          -s sleep interval between recording (in usecs) [default: 1000]\n"
+		"          -s sleep interval between recording (in usecs) [default: wait for the kernel]\n"
 		"          -S used with --profile, to enable only events in command line\n"
 		"          -N host:port to connect to (see listen)\n"
 		"          -t used with -N, forces use of tcp in live trace\n"
@@ -62,6 +62,14 @@ static struct usage_help usage_help[] = {
 		"          --no-filter include trace-cmd threads in the trace\n"
 		"          --proc-map save the traced processes address map into the trace.dat file\n"
 		"          --user execute the specified [command ...] as given user\n"
+		"          --compress compress the data as it is recorded (zlib)\n"
+		"          --recorder-threads record with n threads instead of a process per CPU\n"
+		"          --recorder-cpus list of CPUs to run the recorder threads on (0-3,8)\n"
+		"          --buffer-percent how full the buffer is before the recorders are woken up\n"
+		"          --segments keep the data of each CPU in a ring of n files (with -m or --segment-size)\n"
+		"          --segment-size size of the files of --segments in kilobytes\n"
+		"          --prealloc record straight into the output file, in extents of size kilobytes\n"
+		"          --live keep the output file readable while recording (see report --follow)\n"
 		"          --tsc2nsec Convert the current clock to nanoseconds, using tsc multiplier and shift from the Linux"
 		"               kernel's perf interface\n"
 		"          --tsync-interval set the loop interval, in ms, for timestamps synchronization with guests:"
@@ -225,6 +233,7 @@ static struct usage_help usage_help[] = {
 		"          -H Allows users to hook two events together for timings\n"
 		"             (used with --profile)\n"
 		"          --by-comm used with --profile, merge events for related comms\n"
+		"          --percentiles list used with --profile, the percentiles of the times\n"
 		"          --ts-offset will add amount to timestamp of all events of the\n"
 		"                     previous data file.\n"
 		"          --ts2secs HZ, pass in the timestamp frequency (per second)\n"
@@ -234,12 +243,15 @@ static struct usage_help usage_help[] = {
 		"          --ts-diff Show the delta timestamp between events.\n"
 		"          --ts-check Check to make sure no time stamp on any CPU goes backwards.\n"
 		"          --raw-ts Display raw timestamps, without any corrections.\n"
+		"          --threads num Decode and filter (or profile) the events with num threads.\n"
+		"          --follow Keep reading the input file as it is recorded with record --live.\n"
 	},
 	{
 		"stream",
 		"Start tracing and read the output directly",
 		" %s stream [-e event][-p plugin][-d][-O option ][-P pid]\n"
 		"          Uses same options as record but does not write to files or the network.\n"
+		"          --profile profile the records (see profile --snapshot)\n"
 	},
 	{
 		"profile",
@@ -248,6 +260,11 @@ static struct usage_help usage_help[] = {
 		"    [-H [start_system:]start_event,start_match[,pid]/[end_system:]end_event,end_match[,flags]\n\n"
 		"          Uses same options as record --profile.\n"
 		"          -H Allows users to hook two events together for timings\n"
+		"          --snapshot secs show the profile every secs seconds, then reset it\n"
+		"             (the final profile only has what was seen since the last one)\n"
+		"          --decay percent keep percent of the counts at a snapshot instead\n"
+		"          --evict secs free the tasks and starts idle for secs seconds\n"
+		"          --percentiles list the percentiles of the times (default 50,90,99,99.9)\n"
 	},
 	{
 		"hist",
@@ -278,6 +295,14 @@ static struct usage_help usage_help[] = {
 		"                  if left out, will start at beginning of file\n"
 		"          end   - decimal end time in seconds\n"
 	},
+	{
+		"convert",
+		"rewrite a trace.dat file with compressed (or uncompressed) data",
+		" %s convert [-i file] -o file [-c compression]\n"
+		"          -i input file (default trace.dat)\n"
+		"          -o output file\n"
+		"          -c compression algorithm: zlib (default) or none\n"
+	},
 	{
 		"options",
 		"list the plugin options available for trace-cmd report",
@@ -293,6 +318,8 @@ static struct usage_help usage_help[] = {
 		"          -o file name to use for clients.\n"
 		"          -d directory to store client files.\n"
 		"          -l logfile to write messages to.\n"
+		"          --threads num receive the data of all the clients with num threads\n"
+		"          --max-clients num serve at most num clients at a time\n"
 	},
 #ifdef VSOCK
 	{
@@ -16,7 +16,10 @@
 enum unit_tests {
 	RUN_NONE	= 0,
 	RUN_TRACEFS	= (1 << 0),
-	RUN_ALL		= 0xFFFF
+	RUN_TRACECMD	= (1 << 1),
+	RUN_BENCH	= (1 << 2),
+	/* The benchmarks only run when asked for */
+	RUN_ALL		= RUN_TRACEFS | RUN_TRACECMD
 };
 
 static void print_help(char **argv)
@@ -25,6 +28,8 @@ static void print_help(char **argv)
 	printf("\t-s, --silent\tPrint test summary\n");
 	printf("\t-r, --run test\tRun specific test:\n");
 	printf("\t\t  tracefs   run libtracefs tests\n");
+	printf("\t\t  tracecmd  run libtracecmd tests\n");
+	printf("\t\t  bench     run libtracecmd benchmarks\n");
 	printf("\t-h, --help\tPrint usage information\n");
 	exit(0);
 }
@@ -52,6 +57,10 @@ int main(int argc, char **argv)
 		case 'r':
 			if (strcmp(optarg, "tracefs") == 0)
 				tests |= RUN_TRACEFS;
+			else if (strcmp(optarg, "tracecmd") == 0)
+				tests |= RUN_TRACECMD;
+			else if (strcmp(optarg, "bench") == 0)
+				tests |= RUN_BENCH;
 			else
 				print_help(argv);
 			break;
@@ -75,6 +84,10 @@ int main(int argc, char **argv)
 
 	if (tests & RUN_TRACEFS)
 		test_tracefs_lib();
+	if (tests & RUN_TRACECMD)
+		test_tracecmd_lib();
+	if (tests & RUN_BENCH)
+		bench_tracecmd_lib();
 
 	CU_basic_set_mode(verbose);
 	CU_basic_run_tests();
@@ -7,5 +7,7 @@
 #define _TRACE_UTEST_H_
 
 void test_tracefs_lib(void);
+void test_tracecmd_lib(void);
+void bench_tracecmd_lib(void);
 
 #endif /* _TRACE_UTEST_H_ */
@@ -0,0 +1,1398 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Unit tests and micro benchmarks for the trace-cmd library.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+
+#include "trace-cmd-private.h"
+#include "trace-hash.h"
+#include "trace-hash-local.h"
+#include "trace-utest.h"
+
+#define TRACECMD_SUITE		"trace-cmd library"
+#define TRACECMD_BENCH_SUITE	"trace-cmd library benchmarks"
+#define TEST_DIR_TEMPLATE	"/tmp/trace-utest.XXXXXX"
+
+/* Payload of a synthetic event, big enough for the common fields */
+#define TEST_EVENT_DATA		8
+#define TEST_EVENT_SIZE		(4 + TEST_EVENT_DATA)
+
+static char test_dir[] = TEST_DIR_TEMPLATE;
+
+static double time_diff(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) +
+		(end->tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+/* Event header with the time delta, as the ring buffer writes it */
+static unsigned int event_header(unsigned int delta)
+{
+	unsigned int type_len = TEST_EVENT_DATA / 4;
+
+	if (tracecmd_host_bigendian())
+		return (type_len << 27) | (delta & ((1 << 27) - 1));
+	return type_len | (delta << 5);
+}
+
+/*
+ * Write ring buffer pages for one CPU, with @events events whose
+ * time deltas are pseudo random, so that the CPUs interleave (and
+ * sometimes have the same timestamps).
+ */
+static int write_cpu_file(const char *file, int cpu, int events)
+{
+	int page_size = getpagesize();
+	int header_size = 8 + sizeof(long);
+	unsigned long long ts = 1000 + cpu;
+	unsigned int seed = cpu;
+	unsigned int delta;
+	unsigned int header;
+	long commit;
+	char *page;
+	int len;
+	int fd;
+	int i;
+
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	page = calloc(1, page_size);
+	if (!page) {
+		close(fd);
+		return -1;
+	}
+
+	len = header_size;
+	memcpy(page, &ts, 8);
+	for (i = 0; i < events; i++) {
+		if (len + TEST_EVENT_SIZE > page_size) {
+			commit = len - header_size;
+			memcpy(page + 8, &commit, sizeof(long));
+			if (write(fd, page, page_size) != page_size)
+				goto fail;
+			memset(page, 0, page_size);
+			memcpy(page, &ts, 8);
+			len = header_size;
+		}
+		delta = len == header_size ? 0 : rand_r(&seed) % 64;
+		ts += delta;
+		header = event_header(delta);
+		memcpy(page + len, &header, 4);
+		len += TEST_EVENT_SIZE;
+	}
+	commit = len - header_size;
+	memcpy(page + 8, &commit, sizeof(long));
+	if (write(fd, page, page_size) != page_size)
+		goto fail;
+
+	free(page);
+	close(fd);
+	return 0;
+ fail:
+	free(page);
+	close(fd);
+	return -1;
+}
+
+/* @compression is the algorithm to compress the CPU data with, or NULL */
+static char *create_test_file(int cpus, int events, const char *compression)
+{
+	struct tracecmd_output *handle;
+	char **cpu_files;
+	char *file = NULL;
+	int i;
+
+	cpu_files = calloc(cpus, sizeof(*cpu_files));
+	if (!cpu_files)
+		return NULL;
+
+	for (i = 0; i < cpus; i++) {
+		if (asprintf(&cpu_files[i], "%s/cpu%d", test_dir, i) < 0)
+			goto out;
+		if (write_cpu_file(cpu_files[i], i, events) < 0)
+			goto out;
+	}
+
+	if (asprintf(&file, "%s/trace-%d%s.dat", test_dir, cpus,
+		     compression ? "-compressed" : "") < 0)
+		goto out;
+
+	if (compression) {
+		handle = tracecmd_create_init_file(file);
+		if (handle &&
+		    (tracecmd_write_cmdlines(handle) ||
+		     tracecmd_output_set_compression(handle, compression) ||
+		     tracecmd_append_cpu_data(handle, cpus, cpu_files))) {
+			tracecmd_output_close(handle);
+			handle = NULL;
+		}
+	} else {
+		handle = tracecmd_create_file(file, cpus, cpu_files);
+	}
+	if (!handle) {
+		free(file);
+		file = NULL;
+		goto out;
+	}
+	tracecmd_output_close(handle);
+
+ out:
+	for (i = 0; i < cpus; i++) {
+		if (cpu_files[i])
+			unlink(cpu_files[i]);
+		free(cpu_files[i]);
+	}
+	free(cpu_files);
+	return file;
+}
+
+/* Read all the records in time order, returns a hash of the order */
+static unsigned long long read_merged(const char *file, bool linear,
+				      double *secs, int *count)
+{
+	struct tracecmd_input *handle;
+	struct tracecmd_record_stats stats;
+	struct tep_record *record;
+	struct timespec start, end;
+	unsigned long long hash = 0;
+	int cpu;
+
+	*count = 0;
+	handle = tracecmd_open(file, TRACECMD_FL_LOAD_NO_PLUGINS);
+	if (!handle)
+		return 0;
+	if (linear)
+		tracecmd_set_flag(handle, TRACECMD_FL_LINEAR_MERGE);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((record = tracecmd_read_next_data(handle, &cpu))) {
+		hash = hash * 31 + record->ts * 257 + cpu;
+		(*count)++;
+		tracecmd_free_record(record);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*secs = time_diff(&start, &end);
+
+	/* Records are recycled, not allocated one by one */
+	tracecmd_get_record_stats(handle, &stats);
+	CU_TEST(stats.allocated == (unsigned long long)*count);
+	CU_TEST(stats.in_use == 0);
+	CU_TEST(stats.slabs < stats.allocated / 16);
+
+	tracecmd_close(handle);
+
+	return hash;
+}
+
+/* The heap merges the CPUs in the same order as the linear scan */
+static void check_merge(int cpus, int events, double *linear_secs,
+			double *heap_secs)
+{
+	unsigned long long linear_hash, heap_hash;
+	int linear_count, heap_count;
+	char *file;
+
+	file = create_test_file(cpus, events, NULL);
+	CU_TEST(file != NULL);
+	if (!file)
+		return;
+
+	linear_hash = read_merged(file, true, linear_secs, &linear_count);
+	heap_hash = read_merged(file, false, heap_secs, &heap_count);
+
+	CU_TEST(linear_count == cpus * events);
+	CU_TEST(heap_count == linear_count);
+	CU_TEST(heap_hash == linear_hash);
+
+	unlink(file);
+	free(file);
+}
+
+static void test_merge(void)
+{
+	double linear_secs, heap_secs;
+
+	check_merge(64, 200, &linear_secs, &heap_secs);
+	check_merge(256, 50, &linear_secs, &heap_secs);
+}
+
+static void bench_merge(int cpus, int events)
+{
+	double linear_secs = 0, heap_secs = 0;
+
+	check_merge(cpus, events, &linear_secs, &heap_secs);
+
+	printf("\n    %d CPUs, %d events: linear scan %.3fs, heap %.3fs ",
+	       cpus, cpus * events, linear_secs, heap_secs);
+}
+
+static void bench_merge_64(void)
+{
+	bench_merge(64, 20000);
+}
+
+static void bench_merge_256(void)
+{
+	bench_merge(256, 5000);
+}
+
+struct iterate_data {
+	unsigned long long	hash;
+	int			count;
+};
+
+static int iterate_hash(struct tracecmd_input *handle,
+			struct tep_record *record, int cpu, void *data)
+{
+	struct iterate_data *idata = data;
+
+	idata->hash = idata->hash * 31 + record->ts * 257 + cpu;
+	idata->count++;
+	return 0;
+}
+
+static void test_iterate_events(void)
+{
+	struct tracecmd_record_stats stats;
+	struct iterate_data idata = { 0 };
+	struct tracecmd_input *handle;
+	unsigned long long hash;
+	double secs;
+	int count;
+	char *file;
+
+	file = create_test_file(16, 5000, NULL);
+	CU_TEST(file != NULL);
+	if (!file)
+		return;
+
+	hash = read_merged(file, false, &secs, &count);
+
+	handle = tracecmd_open(file, TRACECMD_FL_LOAD_NO_PLUGINS);
+	CU_TEST(handle != NULL);
+	if (handle) {
+		CU_TEST(tracecmd_iterate_events(handle, -1, iterate_hash, &idata) == 0);
+		CU_TEST(idata.count == count);
+		CU_TEST(idata.hash == hash);
+
+		/* The visitor does not allocate records */
+		tracecmd_get_record_stats(handle, &stats);
+		CU_TEST(stats.allocated == 0);
+		tracecmd_close(handle);
+	}
+
+	unlink(file);
+	free(file);
+}
+
+/* Read records at random offsets, like KernelShark does on lookups */
+static unsigned long long read_random(const char *file, int nr_maps,
+				      unsigned long long *offsets, int count,
+				      double *secs)
+{
+	struct tracecmd_input *handle;
+	struct tep_record *record;
+	struct timespec start, end;
+	unsigned long long hash = 0;
+	unsigned int seed = 1;
+	int cpu;
+	int i;
+
+	handle = tracecmd_open(file, TRACECMD_FL_LOAD_NO_PLUGINS |
+			       TRACECMD_FL_RANDOM_ACCESS);
+	CU_TEST(handle != NULL);
+	if (!handle)
+		return 0;
+	tracecmd_set_page_map_cache(handle, nr_maps);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		record = tracecmd_read_at(handle, offsets[rand_r(&seed) % count], &cpu);
+		CU_TEST(record != NULL);
+		if (!record)
+			break;
+		hash = hash * 31 + record->ts * 257 + cpu;
+		tracecmd_free_record(record);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	*secs = time_diff(&start, &end);
+
+	tracecmd_close(handle);
+
+	return hash;
+}
+
+/* The offsets of all the records of @file, returns how many there are */
+static int record_offsets(const char *file, unsigned long long *offsets)
+{
+	struct tracecmd_input *handle;
+	struct tep_record *record;
+	int count = 0;
+	int cpu;
+
+	handle = tracecmd_open(file, TRACECMD_FL_LOAD_NO_PLUGINS);
+	CU_TEST(handle != NULL);
+	if (!handle)
+		return 0;
+
+	while ((record = tracecmd_read_next_data(handle, &cpu))) {
+		offsets[count++] = record->offset;
+		tracecmd_free_record(record);
+	}
+	tracecmd_close(handle);
+
+	return count;
+}
+
+/* The same records are read at random offsets, with and without the LRU */
+static void test_page_map_cache(void)
+{
+	struct tracecmd_input *nocache, *cache;
+	struct tep_record *record, *crecord;
+	unsigned long long *offsets;
+	unsigned int seed = 1;
+	int count = 0;
+	bool same = true;
+	int cpu, ccpu;
+	char *file;
+	int i;
+
+	file = create_test_file(4, 5000, NULL);
+	CU_TEST(file != NULL);
+	if (!file)
+		return;
+
+	offsets = calloc(4 * 5000, sizeof(*offsets));
+	CU_TEST(offsets != NULL);
+	if (offsets)
+		count = record_offsets(file, offsets);
+	CU_TEST(count == 4 * 5000);
+
+	nocache = tracecmd_open(file, TRACECMD_FL_LOAD_NO_PLUGINS |
+				TRACECMD_FL_RANDOM_ACCESS);
+	cache = tracecmd_open(file, TRACECMD_FL_LOAD_NO_PLUGINS |
+			      TRACECMD_FL_RANDOM_ACCESS);
+	CU_TEST(nocache != NULL && cache != NULL);
+	if (!count || !nocache || !cache)
+		goto out;
+	tracecmd_set_page_map_cache(nocache, 0);
+	tracecmd_set_page_map_cache(cache, 2);
+
+	for (i = 0; i < count && same; i++) {
+		unsigned long long offset = offsets[rand_r(&seed) % count];
+
+		record = tracecmd_read_at(nocache, offset, &cpu);
+		crecord = tracecmd_read_at(cache, offset, &ccpu);
+		same = record && crecord && record->offset == offset &&
+			crecord->offset == offset && crecord->ts == record->ts &&
+			ccpu == cpu;
+		tracecmd_free_record(record);
+		tracecmd_free_record(crecord);
+	}
+	CU_TEST(same);
+ out:
+	tracecmd_close(nocache);
+	tracecmd_close(cache);
+	free(offsets);
+	unlink(file);
+	free(file);
+}
+
+static void bench_page_map_cache(void)
+{
+	unsigned long long *offsets;
+	unsigned long long hash;
+	double nocache_secs, cache_secs;
+	int count = 0;
+	char *file;
+
+	file = create_test_file(4, 100000, NULL);
+	CU_TEST(file != NULL);
+	if (!file)
+		return;
+
+	offsets = calloc(4 * 100000, sizeof(*offsets));
+	CU_TEST(offsets != NULL);
+	if (offsets)
+		count = record_offsets(file, offsets);
+	if (!count)
+		goto out;
+
+	hash = read_random(file, 0, offsets, count, &nocache_secs);
+	CU_TEST(read_random(file, 2, offsets, count, &cache_secs) == hash);
+
+	printf("\n    %d random reads: no map cache %.3fs, 2 cached maps per CPU %.3fs ",
+	       count, nocache_secs, cache_secs);
+ out:
+	free(offsets);
+	unlink(file);
+	free(file);
+}
+
+static void test_compressed_file(void)
+{
+	struct tracecmd_input *plain, *compressed;
+	struct tep_record *record, *crecord;
+	unsigned long long hash, chash;
+	unsigned long long ts;
+	struct stat pst, cst;
+	double secs, csecs;
+	int count, ccount;
+	char *cfile;
+	char *file;
+	int cpu;
+
+	file = create_test_file(4, 100000, NULL);
+	cfile = create_test_file(4, 100000, "zlib");
+	CU_TEST(file != NULL && cfile != NULL);
+	if (!file || !cfile)
+		goto out;
+
+	hash = read_merged(file, false, &secs, &count);
+	chash = read_merged(cfile, false, &csecs, &ccount);
+	CU_TEST(ccount == count);
+	CU_TEST(chash == hash);
+
+	stat(file, &pst);
+	stat(cfile, &cst);
+	CU_TEST(cst.st_size < pst.st_size);
+
+	plain = tracecmd_open(file, TRACECMD_FL_LOAD_NO_PLUGINS);
+	compressed = tracecmd_open(cfile, TRACECMD_FL_LOAD_NO_PLUGINS);
+	CU_TEST(plain != NULL && compressed != NULL);
+	if (!plain || !compressed)
+		goto out_close;
+
+	CU_TEST(tracecmd_get_compression(plain) == NULL);
+	CU_TEST(tracecmd_get_compression(compressed) != NULL);
+
+	/* Seeking lands on the same records, at the same offsets */
+	for (ts = 1000; ts < 1000 + 100000 * 32; ts += 100000 * 32 / 50) {
+		for (cpu = 0; cpu < 4; cpu++) {
+			tracecmd_set_cpu_to_timestamp(plain, cpu, ts);
+			tracecmd_set_cpu_to_timestamp(compressed, cpu, ts);
+			record = tracecmd_read_data(plain, cpu);
+			crecord = tracecmd_read_data(compressed, cpu);
+			CU_TEST((record == NULL) == (crecord == NULL));
+			if (record && crecord) {
+				CU_TEST(record->ts == crecord->ts);
+				CU_TEST(record->offset == crecord->offset);
+				tracecmd_free_record(crecord);
+				crecord = tracecmd_read_at(compressed, record->offset, NULL);
+				CU_TEST(crecord != NULL && crecord->ts == record->ts);
+			}
+			tracecmd_free_record(record);
+			tracecmd_free_record(crecord);
+		}
+	}
+
+ out_close:
+	tracecmd_close(plain);
+	tracecmd_close(compressed);
+ out:
+	if (file)
+		unlink(file);
+	if (cfile)
+		unlink(cfile);
+	free(file);
+	free(cfile);
+}
+
+/* Pass a CPU file through a recorder that compresses it */
+static int record_compressed(const char *file, const char *compression,
+			     struct tracecmd_recorder_compress_stats *stats)
+{
+	struct tracecmd_recorder *recorder;
+	char *raw;
+	int ret = -1;
+	int fd;
+
+	if (asprintf(&raw, "%s.raw", file) < 0)
+		return -1;
+	if (rename(file, raw) < 0)
+		goto out;
+
+	fd = open(raw, O_RDONLY);
+	if (fd < 0)
+		goto out;
+	recorder = tracecmd_create_recorder_virt(file, 0, TRACECMD_RECORD_NOSPLICE, fd);
+	if (!recorder) {
+		close(fd);
+		goto out;
+	}
+	if (tracecmd_recorder_set_compression(recorder, compression) == 0 &&
+	    tracecmd_flush_recording(recorder) >= 0)
+		ret = 0;
+	tracecmd_free_recorder(recorder);
+
+	if (!ret)
+		ret = tracecmd_recorder_compress_stats(file, stats);
+ out:
+	unlink(raw);
+	free(raw);
+	return ret;
+}
+
+static void test_recorder_compression(void)
+{
+	struct tracecmd_recorder_compress_stats stats;
+	struct tracecmd_output *handle;
+	struct tracecmd_input *input;
+	unsigned long long hash, rhash;
+	int count, rcount;
+	char *cpu_files[4] = { };
+	double secs;
+	char *rfile = NULL;
+	char *file;
+	int cpu;
+
+	file = create_test_file(4, 100000, NULL);
+	CU_TEST(file != NULL);
+	if (!file)
+		return;
+
+	for (cpu = 0; cpu < 4; cpu++) {
+		if (asprintf(&cpu_files[cpu], "%s/rcpu%d", test_dir, cpu) < 0)
+			goto out;
+		CU_TEST(write_cpu_file(cpu_files[cpu], cpu, 100000) == 0);
+		CU_TEST(record_compressed(cpu_files[cpu], "zlib", &stats) == 0);
+		CU_TEST(stats.bytes_out < stats.bytes_in);
+	}
+	printf("\n    CPU 3: %llu bytes %s compressed to %llu ",
+	       stats.bytes_in, stats.compression, stats.bytes_out);
+
+	if (asprintf(&rfile, "%s/trace-recorded.dat", test_dir) < 0)
+		goto out;
+	/* The compression of the recorder is kept */
+	handle = tracecmd_create_file(rfile, 4, cpu_files);
+	CU_TEST(handle != NULL);
+	if (!handle)
+		goto out;
+	tracecmd_output_close(handle);
+
+	input = tracecmd_open(rfile, TRACECMD_FL_LOAD_NO_PLUGINS);
+	CU_TEST(input != NULL);
+	if (input) {
+		CU_TEST(tracecmd_get_compression(input) != NULL);
+		tracecmd_close(input);
+	}
+
+	hash = read_merged(file, false, &secs, &count);
+	rhash = read_merged(rfile, false, &secs, &rcount);
+	CU_TEST(rcount == count);
+	CU_TEST(rhash == hash);
+
+ out:
+	for (cpu = 0; cpu < 4; cpu++) {
+		if (cpu_files[cpu])
+			unlink(cpu_files[cpu]);
+		free(cpu_files[cpu]);
+	}
+	if (rfile)
+		unlink(rfile);
+	unlink(file);
+	free(rfile);
+	free(file);
+}
+
+/* Drop the file from the page cache, so that the reads hit the disk */
+static void drop_file_cache(const char *file)
+{
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return;
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+static long page_faults(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_majflt + usage.ru_minflt;
+}
+
+/*
+ * Read all the records of @file, opened with @flags, out of the page
+ * cache. With @name, print the time and the page faults it took.
+ */
+static unsigned long long read_cold(const char *file, int flags, const char *name)
+{
+	struct tracecmd_input *handle;
+	struct tep_record *record;
+	struct timespec start, end;
+	unsigned long long hash = 0;
+	long faults;
+	int count = 0;
+	int cpu;
+
+	drop_file_cache(file);
+
+	faults = page_faults();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	handle = tracecmd_open(file, TRACECMD_FL_LOAD_NO_PLUGINS | flags);
+	CU_TEST(handle != NULL);
+	if (!handle)
+		return 0;
+
+	while ((record = tracecmd_read_next_data(handle, &cpu))) {
+		hash = hash * 31 + record->ts * 257 + cpu;
+		count++;
+		tracecmd_free_record(record);
+	}
+	tracecmd_close(handle);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	faults = page_faults() - faults;
+
+	if (name)
+		printf("\n    %-10s %d events: %.3fs, %ld page faults ",
+		       name, count, time_diff(&start, &end), faults);
+
+	return hash;
+}
+
+/* The same records, whatever the access pattern the file is opened for */
+static void check_page_access(int cpus, int events, bool print)
+{
+	unsigned long long hash;
+	char *file;
+
+	file = create_test_file(cpus, events, NULL);
+	CU_TEST(file != NULL);
+	if (!file)
+		return;
+
+	hash = read_cold(file, 0, print ? "default" : NULL);
+	CU_TEST(read_cold(file, TRACECMD_FL_SEQUENTIAL_SCAN,
+			  print ? "sequential" : NULL) == hash);
+	CU_TEST(read_cold(file, TRACECMD_FL_RANDOM_ACCESS,
+			  print ? "random" : NULL) == hash);
+	CU_TEST(read_cold(file, TRACECMD_FL_IO_URING,
+			  print ? "io_uring" : NULL) == hash);
+
+	unlink(file);
+	free(file);
+}
+
+static void test_page_access(void)
+{
+	check_page_access(8, 2000, false);
+}
+
+static void bench_page_access(void)
+{
+	check_page_access(8, 200000, true);
+}
+
+/* Connect two TCP sockets over the loopback */
+static int loopback_pair(int *send_fd, int *recv_fd)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int sfd;
+
+	sfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sfd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    getsockname(sfd, (struct sockaddr *)&addr, &len) < 0 ||
+	    listen(sfd, 1) < 0)
+		goto fail;
+
+	*recv_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (*recv_fd < 0)
+		goto fail;
+	if (connect(*recv_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(*recv_fd);
+		goto fail;
+	}
+
+	*send_fd = accept(sfd, NULL, NULL);
+	if (*send_fd < 0) {
+		close(*recv_fd);
+		goto fail;
+	}
+
+	close(sfd);
+	return 0;
+ fail:
+	close(sfd);
+	return -1;
+}
+
+static double cpu_secs(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+		(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+/*
+ * Send @total MB with the v3 protocol (record -N), as for the trace.dat
+ * headers, to a child that writes them to @out_file. Returns the time
+ * it took, and the CPU time of the sending in @cpu.
+ */
+static double msg_data_send(int total, const char *out_file, double *cpu)
+{
+	struct tracecmd_msg_handle *msg_handle;
+	struct timespec start, end;
+	size_t size = 1024 * 1024;
+	double secs = 0;
+	int send_fd = -1;
+	int recv_fd;
+	int status;
+	int out_fd;
+	pid_t pid;
+	char *buf;
+	int i;
+
+	buf = malloc(size);
+	CU_TEST(buf != NULL);
+	if (!buf)
+		return 0;
+	memset(buf, 0x5a, size);
+
+	CU_TEST(loopback_pair(&send_fd, &recv_fd) == 0);
+	if (send_fd < 0)
+		goto out;
+
+	pid = fork();
+	CU_TEST(pid >= 0);
+	if (pid < 0) {
+		close(send_fd);
+		close(recv_fd);
+		goto out;
+	}
+	if (!pid) {
+		close(send_fd);
+		out_fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		msg_handle = tracecmd_msg_handle_alloc(recv_fd, 0);
+		if (out_fd < 0 || !msg_handle)
+			exit(1);
+		exit(tracecmd_msg_read_data(msg_handle, out_fd) ? 1 : 0);
+	}
+	close(recv_fd);
+
+	msg_handle = tracecmd_msg_handle_alloc(send_fd, 0);
+	CU_TEST(msg_handle != NULL);
+	if (!msg_handle) {
+		close(send_fd);
+		waitpid(pid, &status, 0);
+		goto out;
+	}
+
+	*cpu = cpu_secs();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < total; i++) {
+		if (tracecmd_msg_data_send(msg_handle, buf, size) < 0)
+			break;
+	}
+	CU_TEST(i == total);
+	CU_TEST(tracecmd_msg_finish_sending_data(msg_handle) == 0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	*cpu = cpu_secs() - *cpu;
+	secs = time_diff(&start, &end);
+
+	CU_TEST(waitpid(pid, &status, 0) == pid);
+	CU_TEST(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	tracecmd_msg_handle_close(msg_handle);
+ out:
+	free(buf);
+	return secs;
+}
+
+/* All the data sent is received, in order */
+static void test_msg_data_send(void)
+{
+	int total = 8;
+	struct stat st;
+	char buf[4096];
+	char *file;
+	double cpu;
+	bool same = true;
+	ssize_t r;
+	int fd;
+	int i;
+
+	if (asprintf(&file, "%s/msg-data", test_dir) < 0)
+		return;
+
+	msg_data_send(total, file, &cpu);
+
+	fd = open(file, O_RDONLY);
+	CU_TEST(fd >= 0);
+	if (fd >= 0) {
+		CU_TEST(fstat(fd, &st) == 0 && st.st_size == total * 1024 * 1024);
+		while ((r = read(fd, buf, sizeof(buf))) > 0) {
+			for (i = 0; i < r; i++)
+				same &= buf[i] == 0x5a;
+		}
+		CU_TEST(same);
+		close(fd);
+	}
+
+	unlink(file);
+	free(file);
+}
+
+static void bench_msg_data_send(void)
+{
+	int total = 512;
+	double secs, cpu;
+
+	secs = msg_data_send(total, "/dev/null", &cpu);
+	if (!secs)
+		return;
+
+	printf("\n    %d MB over loopback: %.0f MB/s, %.3fs CPU per GB sending ",
+	       total, total / secs, cpu * 1024 / total);
+}
+
+struct hash_test_item {
+	struct trace_hash_item	hash;
+	unsigned long long	id;
+};
+
+static int match_id(struct trace_hash_item *item, void *data)
+{
+	return ((struct hash_test_item *)item)->id == *(unsigned long long *)data;
+}
+
+/* Keys with duplicates, added and deleted while the table grows */
+static void test_trace_hash(void)
+{
+	struct hash_test_item items[1000];
+	struct trace_hash_item **bucket;
+	struct trace_hash_item *item;
+	struct trace_hash hash;
+	unsigned long long id;
+	int count = 0;
+	int i;
+
+	CU_TEST(trace_hash_init(&hash, 4) == 0);
+	CU_TEST(trace_hash_empty(&hash));
+
+	for (i = 0; i < 1000; i++) {
+		items[i].hash.key = i % 100;
+		items[i].id = i;
+		trace_hash_add(&hash, &items[i].hash);
+	}
+
+	/* The last one added comes first */
+	CU_TEST(trace_hash_find(&hash, 7, NULL, NULL) == &items[907].hash);
+	id = 7;
+	CU_TEST(trace_hash_find(&hash, 7, match_id, &id) == &items[7].hash);
+	id = 8;
+	CU_TEST(trace_hash_find(&hash, 7, match_id, &id) == NULL);
+	CU_TEST(trace_hash_find(&hash, 100, NULL, NULL) == NULL);
+
+	for (i = 7; i < 1000; i += 100)
+		trace_hash_del(&items[i].hash);
+	CU_TEST(trace_hash_find(&hash, 7, NULL, NULL) == NULL);
+
+	/* The emptied bucket can be used again */
+	trace_hash_add(&hash, &items[7].hash);
+	CU_TEST(trace_hash_find(&hash, 7, NULL, NULL) == &items[7].hash);
+
+	trace_hash_for_each_bucket(bucket, &hash) {
+		trace_hash_while_item(item, bucket) {
+			trace_hash_del(item);
+			count++;
+		}
+	}
+	CU_TEST(count == 991);
+	CU_TEST(trace_hash_empty(&hash));
+
+	trace_hash_free(&hash);
+}
+
+/* trace_hash as it was: a fixed number of buckets, chained */
+struct chained_hash {
+	struct trace_hash_item	**buckets;
+	int			mask;
+};
+
+static void chained_add(struct chained_hash *hash, struct trace_hash_item *item)
+{
+	struct trace_hash_item **bucket = &hash->buckets[item->key & hash->mask];
+
+	item->next = *bucket;
+	*bucket = item;
+}
+
+static struct trace_hash_item *
+chained_find(struct chained_hash *hash, unsigned long long key,
+	     trace_hash_func match, void *data)
+{
+	struct trace_hash_item *item;
+
+	for (item = hash->buckets[key & hash->mask]; item; item = item->next) {
+		if (item->key == key && match(item, data))
+			return item;
+	}
+	return NULL;
+}
+
+/* The keys of "trace-cmd report --profile": tasks by pid */
+static void task_keys(unsigned long long *keys, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		keys[i] = trace_hash(100 + i);
+}
+
+/*
+ * And stack traces, hashed as add_event_stack() does, with callers
+ * taken from a set of kernel functions.
+ */
+static void stack_keys(unsigned long long *keys, int nr)
+{
+	unsigned long long stack[24];
+	unsigned int *words;
+	int depth;
+	int i, j;
+
+	srandom(nr);
+	for (i = 0; i < nr; i++) {
+		depth = 8 + random() % 16;
+		for (j = 0; j < depth; j++)
+			stack[j] = 0xffffffff81000000ULL + (random() % 4096) * 0x1a0;
+		words = (unsigned int *)stack;
+		keys[i] = 0;
+		for (j = 0; j < depth * 2; j++)
+			keys[i] += trace_hash(words[j]);
+	}
+}
+
+static void bench_hash(const char *name, int nr, int buckets,
+		       void (*gen_keys)(unsigned long long *keys, int nr))
+{
+	struct hash_test_item *items;
+	struct chained_hash chained;
+	struct trace_hash hash;
+	struct timespec start, end;
+	unsigned long long *keys;
+	double chained_secs, open_secs;
+	int chained_found = 0;
+	int open_found = 0;
+	int rounds = 4000000 / nr;
+	int r, i, j;
+
+	keys = calloc(nr, sizeof(*keys));
+	items = calloc(nr, sizeof(*items));
+	chained.buckets = calloc(buckets, sizeof(*chained.buckets));
+	chained.mask = buckets - 1;
+	CU_TEST(keys && items && chained.buckets);
+	if (!keys || !items || !chained.buckets)
+		goto out;
+
+	gen_keys(keys, nr);
+	for (i = 0; i < nr; i++) {
+		items[i].hash.key = keys[i];
+		items[i].id = i;
+		chained_add(&chained, &items[i].hash);
+	}
+
+	/* Look them up out of order, 7919 is a prime */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < rounds; r++) {
+		for (j = 0; j < nr; j++) {
+			i = (j * 7919ULL) % nr;
+			if (chained_find(&chained, keys[i], match_id,
+					 &items[i].id) == &items[i].hash)
+				chained_found++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	chained_secs = time_diff(&start, &end);
+
+	CU_TEST(trace_hash_init(&hash, buckets) == 0);
+	for (i = 0; i < nr; i++)
+		trace_hash_add(&hash, &items[i].hash);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < rounds; r++) {
+		for (j = 0; j < nr; j++) {
+			i = (j * 7919ULL) % nr;
+			if (trace_hash_find(&hash, keys[i], match_id,
+					    &items[i].id) == &items[i].hash)
+				open_found++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	open_secs = time_diff(&start, &end);
+
+	CU_TEST(chained_found == rounds * nr);
+	CU_TEST(open_found == chained_found);
+
+	printf("\n    %d %s, %d buckets: chained %.1f, open addressing %.1f M lookups/s ",
+	       nr, name, buckets, chained_found / chained_secs / 1000000,
+	       open_found / open_secs / 1000000);
+
+	trace_hash_free(&hash);
+ out:
+	free(chained.buckets);
+	free(items);
+	free(keys);
+}
+
+static void bench_hash_lookups(void)
+{
+	bench_hash("tasks", 32768, 1024, task_keys);
+	bench_hash("stacks", 4096, 32, stack_keys);
+}
+
+/* Objects recycled by size, zeroed, and moved over by a join */
+static void test_arena(void)
+{
+	struct tracecmd_arena *arena, *from;
+	char *obj, *big, *str;
+	void *moved;
+
+	arena = tracecmd_arena_alloc();
+	from = tracecmd_arena_alloc();
+	CU_TEST(arena && from);
+	if (!arena || !from)
+		goto out;
+
+	obj = tracecmd_arena_get(arena, 24);
+	CU_TEST(obj != NULL);
+	memset(obj, 0xff, 24);
+	tracecmd_arena_put(arena, obj, 24);
+	CU_TEST(tracecmd_arena_get(arena, 20) == obj);
+	CU_TEST(obj[0] == 0 && obj[23] == 0);
+	CU_TEST(tracecmd_arena_get(arena, 20) != obj);
+
+	big = tracecmd_arena_get(arena, 1024 * 1024);
+	CU_TEST(big != NULL);
+	CU_TEST(tracecmd_arena_size(arena) > 1024 * 1024);
+
+	str = tracecmd_arena_strdup(arena, "Global Events");
+	CU_TEST(str && strcmp(str, "Global Events") == 0);
+
+	moved = tracecmd_arena_get(from, 100);
+	tracecmd_arena_join(arena, from);
+	CU_TEST(tracecmd_arena_size(from) == 0);
+	tracecmd_arena_put(arena, moved, 100);
+	CU_TEST(tracecmd_arena_get(arena, 100) == moved);
+	CU_TEST(tracecmd_arena_get(from, 100) != NULL);
+ out:
+	tracecmd_arena_free(from);
+	tracecmd_arena_free(arena);
+}
+
+/* Sizes of the profile nodes: starts, events, stacks of 1 to 8 callers */
+#define bench_obj_size(i)	(64 + ((i) % 8) * 16)
+
+static void bench_arena(int nr)
+{
+	struct tracecmd_arena *arena;
+	struct timespec start, mid, end;
+	double malloc_secs, malloc_free;
+	double arena_secs, arena_free;
+	void **objs;
+	int i;
+
+	objs = calloc(nr, sizeof(*objs));
+	CU_TEST(objs != NULL);
+	if (!objs)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr; i++) {
+		objs[i] = calloc(1, bench_obj_size(i));
+		*(int *)objs[i] = i;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &mid);
+	for (i = 0; i < nr; i++)
+		free(objs[i]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	malloc_secs = time_diff(&start, &mid);
+	malloc_free = time_diff(&mid, &end);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	arena = tracecmd_arena_alloc();
+	CU_TEST(arena != NULL);
+	for (i = 0; arena && i < nr; i++) {
+		objs[i] = tracecmd_arena_get(arena, bench_obj_size(i));
+		*(int *)objs[i] = i;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &mid);
+	tracecmd_arena_free(arena);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	arena_secs = time_diff(&start, &mid);
+	arena_free = time_diff(&mid, &end);
+
+	printf("\n    %d objects: malloc %.3fs + free %.3fs, arena %.3fs + free %.3fs ",
+	       nr, malloc_secs, malloc_free, arena_secs, arena_free);
+
+	free(objs);
+}
+
+static void bench_arena_alloc(void)
+{
+	bench_arena(4000000);
+}
+
+static const size_t arena_sizes[] = { 1, 16, 17, 100, 1000, 1023, 1024 };
+#define NR_ARENA_SIZES	(int)(sizeof(arena_sizes) / sizeof(arena_sizes[0]))
+
+static bool all_zero(const char *obj, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (obj[i])
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Objects reused (zeroed) by size class only, objects up to 1K recycled
+ * and bigger ones not, and objects of a joined arena that stay alive.
+ */
+static void test_arena_sizes(void)
+{
+	struct tracecmd_arena *arena, *from;
+	char *objs[NR_ARENA_SIZES];
+	char *obj, *big, *small;
+	size_t size;
+	int i;
+
+	arena = tracecmd_arena_alloc();
+	from = tracecmd_arena_alloc();
+	CU_TEST(arena && from);
+	if (!arena || !from)
+		goto out;
+
+	/* Given back dirty, handed out again zeroed */
+	for (i = 0; i < NR_ARENA_SIZES; i++) {
+		objs[i] = tracecmd_arena_get(arena, arena_sizes[i]);
+		CU_TEST(objs[i] != NULL);
+		if (!objs[i])
+			goto out;
+		memset(objs[i], 0xa5, arena_sizes[i]);
+	}
+	for (i = 0; i < NR_ARENA_SIZES; i++)
+		tracecmd_arena_put(arena, objs[i], arena_sizes[i]);
+	for (i = NR_ARENA_SIZES - 1; i >= 0; i--) {
+		obj = tracecmd_arena_get(arena, arena_sizes[i]);
+		CU_TEST(obj == objs[i]);
+		CU_TEST(obj && all_zero(obj, arena_sizes[i]));
+	}
+
+	/* A free object only goes to a size of its class (17 to 32) */
+	obj = tracecmd_arena_get(arena, 24);
+	tracecmd_arena_put(arena, obj, 24);
+	CU_TEST(tracecmd_arena_get(arena, 16) != obj);
+	CU_TEST(tracecmd_arena_get(arena, 33) != obj);
+	CU_TEST(tracecmd_arena_get(arena, 32) == obj);
+
+	/* Above 1K, a given back object is not reused */
+	obj = tracecmd_arena_get(arena, 1025);
+	CU_TEST(obj != NULL);
+	tracecmd_arena_put(arena, obj, 1025);
+	big = tracecmd_arena_get(arena, 1025);
+	CU_TEST(big != NULL && big != obj);
+	CU_TEST(big && all_zero(big, 1025));
+
+	/*
+	 * An object bigger than a quarter of a chunk that does not fit
+	 * gets a chunk of its own, the small ones keep using the last one.
+	 */
+	tracecmd_arena_free(arena);
+	arena = tracecmd_arena_alloc();
+	CU_TEST(arena != NULL);
+	if (!arena)
+		goto out;
+	small = tracecmd_arena_get(arena, 16);
+	obj = tracecmd_arena_get(arena, 200 * 1024);
+	CU_TEST(small && obj == small + 16);
+	size = tracecmd_arena_size(arena);
+	big = tracecmd_arena_get(arena, 100 * 1024);
+	CU_TEST(big != NULL);
+	CU_TEST(tracecmd_arena_size(arena) >= size + 100 * 1024);
+	CU_TEST(big && all_zero(big, 100 * 1024));
+	small = tracecmd_arena_get(arena, 16);
+	CU_TEST(obj && small == obj + 200 * 1024);
+
+	/* Objects of a joined arena live as long as the one it joined */
+	for (i = 0; i < NR_ARENA_SIZES; i++) {
+		objs[i] = tracecmd_arena_get(from, arena_sizes[i]);
+		CU_TEST(objs[i] != NULL);
+		if (!objs[i])
+			goto out;
+		memset(objs[i], i + 1, arena_sizes[i]);
+	}
+	tracecmd_arena_put(from, objs[0], arena_sizes[0]);
+	tracecmd_arena_join(arena, from);
+	tracecmd_arena_free(from);
+	from = NULL;
+	for (i = 1; i < NR_ARENA_SIZES; i++)
+		CU_TEST(objs[i][0] == i + 1 && objs[i][arena_sizes[i] - 1] == i + 1);
+	CU_TEST(tracecmd_arena_get(arena, arena_sizes[0]) == objs[0]);
+ out:
+	tracecmd_arena_free(from);
+	tracecmd_arena_free(arena);
+}
+
+/* Percentiles at most a bucket (12.5%) above the real ones, merged and scaled */
+static void test_histogram(void)
+{
+	static struct tracecmd_histogram hist, from;
+	unsigned long long val;
+	int i;
+
+	for (i = 1; i <= 100000; i++)
+		tracecmd_histogram_add(&hist, i);
+
+	val = tracecmd_histogram_percentile(&hist, 50);
+	CU_TEST(val >= 50000 && val <= 50000 + 50000 / 8);
+	val = tracecmd_histogram_percentile(&hist, 99.9);
+	CU_TEST(val >= 99900 && val <= 99900 + 99900 / 8);
+	CU_TEST(tracecmd_histogram_percentile(&hist, 100) >= 100000);
+	CU_TEST(tracecmd_histogram_percentile(&from, 50) == 0);
+
+	/* The small values have a bucket each */
+	tracecmd_histogram_add(&from, 3);
+	CU_TEST(tracecmd_histogram_percentile(&from, 99) == 3);
+
+	/* A slow tail, added to the fast ones */
+	for (i = 0; i < 1000; i++)
+		tracecmd_histogram_add(&from, 1ULL << 30);
+	tracecmd_histogram_merge(&hist, &from);
+	val = tracecmd_histogram_percentile(&hist, 99.9);
+	CU_TEST(val >= 1ULL << 30 && val <= (1ULL << 30) + (1ULL << 27));
+
+	tracecmd_histogram_scale(&hist, 50);
+	val = tracecmd_histogram_percentile(&hist, 50);
+	CU_TEST(val >= 50000 && val <= 50000 + 50000 / 8);
+	tracecmd_histogram_scale(&hist, 0);
+	CU_TEST(tracecmd_histogram_percentile(&hist, 50) == 0);
+}
+
+static void bench_histogram_add(void)
+{
+	static struct tracecmd_histogram hist;
+	struct timespec start, end;
+	int nr = 10000000;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr; i++)
+		tracecmd_histogram_add(&hist, (i * 2654435761U) >> 8);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	CU_TEST(tracecmd_histogram_percentile(&hist, 100) > 0);
+
+	printf("\n    %d values: %.1fns per add ",
+	       nr, time_diff(&start, &end) * 1000000000 / nr);
+}
+
+static int test_suite_destroy(void)
+{
+	rmdir(test_dir);
+	return 0;
+}
+
+static int test_suite_init(void)
+{
+	/* Each suite gets a directory of its own */
+	strcpy(test_dir, TEST_DIR_TEMPLATE);
+	if (!mkdtemp(test_dir))
+		return 1;
+	return 0;
+}
+
+void test_tracecmd_lib(void)
+{
+	CU_pSuite suite = NULL;
+
+	suite = CU_add_suite(TRACECMD_SUITE, test_suite_init, test_suite_destroy);
+	if (suite == NULL) {
+		fprintf(stderr, "Suite \"%s\" cannot be created\n", TRACECMD_SUITE);
+		return;
+	}
+	CU_add_test(suite, "merge CPUs, heap in the order of the linear scan",
+		    test_merge);
+	CU_add_test(suite, "iterate events without allocating records",
+		    test_iterate_events);
+	CU_add_test(suite, "scan, the same records with every access pattern",
+		    test_page_access);
+	CU_add_test(suite, "random reads, the same with and without the page map cache",
+		    test_page_map_cache);
+	CU_add_test(suite, "compressed CPU data, read and seek",
+		    test_compressed_file);
+	CU_add_test(suite, "compressed recording, kept in the trace.dat file",
+		    test_recorder_compression);
+	CU_add_test(suite, "network data messages, received in order",
+		    test_msg_data_send);
+	CU_add_test(suite, "trace_hash, duplicate keys and growing",
+		    test_trace_hash);
+	CU_add_test(suite, "arena, recycling and join",
+		    test_arena);
+	CU_add_test(suite, "arena, size classes, big objects and join",
+		    test_arena_sizes);
+	CU_add_test(suite, "latency histogram, percentiles, merge and scale",
+		    test_histogram);
+}
+
+/* Timings only, not run unless asked for (-r bench) */
+void bench_tracecmd_lib(void)
+{
+	CU_pSuite suite = NULL;
+
+	suite = CU_add_suite(TRACECMD_BENCH_SUITE, test_suite_init, test_suite_destroy);
+	if (suite == NULL) {
+		fprintf(stderr, "Suite \"%s\" cannot be created\n", TRACECMD_BENCH_SUITE);
+		return;
+	}
+	CU_add_test(suite, "merge 64 CPUs, linear scan vs heap",
+		    bench_merge_64);
+	CU_add_test(suite, "merge 256 CPUs, linear scan vs heap",
+		    bench_merge_256);
+	CU_add_test(suite, "cold cache scan, default vs sequential vs random vs io_uring",
+		    bench_page_access);
+	CU_add_test(suite, "random reads, with and without the page map cache",
+		    bench_page_map_cache);
+	CU_add_test(suite, "arena vs malloc, allocating and freeing the nodes",
+		    bench_arena_alloc);
+	CU_add_test(suite, "network data messages, over the loopback",
+		    bench_msg_data_send);
+	CU_add_test(suite, "trace_hash lookups, chained vs open addressing",
+		    bench_hash_lookups);
+	CU_add_test(suite, "latency histogram, cost of an add",
+		    bench_histogram_add);
+}